@@ -0,0 +1,625 @@
+/**
+ *  @file bench.c
+ *  @brief Benchmarks of VMD library
+ *  @author ihm4
+ *  @note
+ *    A synthetic VMD file is generated from a fixed seed, so results of
+ *    different revisions of the library are comparable, and each benchmark
+ *    runs in its own process for its peak RSS. Results are printed to
+ *    stdout as one JSON document. `make bench` builds and runs this.
+ *
+ *    usage: vmdlib_bench [-b bones] [-f frames] [-r repeat] [-s seed]
+ *                        [-g file]
+ *      -b  number of bones (default 100)
+ *      -f  number of keyframes of each bone (default 3000)
+ *      -r  times each benchmark is repeated (default 5)
+ *      -s  seed of the generator (default 1)
+ *      -g  only write the synthetic file to `file`
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "vmd.h"
+
+#define BENCH_IK_PER_FRAME (4) // IK on/off of each ShowIK frame
+
+// Settings of a run
+typedef struct {
+  uint32_t    bones;
+  uint32_t    frames;
+  uint32_t    repeat;
+  uint32_t    seed;
+  const char* fname;     // synthetic file
+  uint64_t    file_size;
+} BenchConfig;
+
+// Result of a benchmark
+typedef struct {
+  double      seconds; // total of all repeats
+  uint64_t    bytes;   // bytes processed by all repeats, 0 if not relevant
+  uint64_t    items;   // items processed by all repeats
+  const char* unit;    // what items are
+} BenchResult;
+
+typedef struct {
+  const char* name;
+  bool (*run)(const BenchConfig*, BenchResult*);
+} Bench;
+
+/**
+ * @brief Next number of xorshift32
+ * @param (state) [in,out] state, not 0
+ * @return random number
+ */
+static uint32_t __BenchRandom(uint32_t* state){
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+/**
+ * @brief Random number in a range
+ * @param (state) [in,out] state
+ * @param (lo) smallest number
+ * @param (hi) largest number
+ * @return random number
+ */
+static uint32_t __BenchRange(uint32_t* state, uint32_t lo, uint32_t hi){
+  return lo + __BenchRandom(state) % (hi - lo + 1);
+}
+
+/**
+ * @brief Time of monotonic clock
+ * @return seconds
+ */
+static double __BenchNow(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Generate a synthetic VMD file
+ *  Bones are keyed every 1 to 4 frames, with smooth motion and ease curves
+ *  as MMD makes them, and stored bone by bone as MMD writes them. There are
+ *  morphs for a quarter of the bones, a camera, light, self shadow and
+ *  ShowIK frames with IK on/off records.
+ * @param (bones) number of bones
+ * @param (frames) number of keyframes of each bone
+ * @param (seed) seed of random numbers
+ * @return pointer of VMDFile, or NULL
+ */
+static VMDFile* __BenchGenerate(uint32_t bones, uint32_t frames,
+                                uint32_t seed){
+  uint32_t rng = seed == 0 ? 1 : seed, morphs = bones / 4 + 1;
+  uint32_t num_cameras = frames, num_lights = frames / 10 + 1;
+  uint32_t num_shadows = frames / 50 + 1, num_iks = frames / 20 + 1;
+  uint8_t points[4][4];
+  VMDFile* vf = VMDCreateVMDFile("bench");
+  VMDBoneSingleFrame* bone;
+  VMDMorphSingleFrame* morph;
+  VMDCameraSingleFrame* camera;
+  VMDLightSingleFrame* light;
+  VMDShadowSingleFrame* shadow;
+  VMDIKSingleFrame* ik;
+  VMDInfoIK* info;
+  float s, angle, axis[3], len;
+  uint32_t frame;
+  size_t n;
+
+  if ( vf == NULL ) return NULL;
+  bone = calloc((size_t)bones * frames, sizeof(VMDBoneSingleFrame));
+  morph = calloc((size_t)morphs * frames, sizeof(VMDMorphSingleFrame));
+  camera = calloc(num_cameras, sizeof(VMDCameraSingleFrame));
+  light = calloc(num_lights, sizeof(VMDLightSingleFrame));
+  shadow = calloc(num_shadows, sizeof(VMDShadowSingleFrame));
+  ik = calloc(num_iks, sizeof(VMDIKSingleFrame));
+  info = calloc((size_t)num_iks * BENCH_IK_PER_FRAME, sizeof(VMDInfoIK));
+  vf->bone_frames.frames = bone;
+  vf->morph_frames.frames = morph;
+  vf->camera_frames.frames = camera;
+  vf->light_frames.frames = light;
+  vf->shadow_frames.frames = shadow;
+  vf->ik_frames.frames = ik;
+  vf->ik_frames.ik = info;
+  if ( bone == NULL || morph == NULL || camera == NULL || light == NULL
+       || shadow == NULL || ik == NULL || info == NULL ) {
+    VMDReleaseVMDFile(vf);
+    return NULL;
+  }
+
+  n = 0;
+  for ( uint32_t b = 0; b < bones; b++ ) {
+    frame = __BenchRange(&rng, 0, 3);
+    for ( uint32_t k = 0; k < frames; k++, n++ ) {
+      snprintf(bone[n].name, sizeof(bone[n].name), "bone%03u", b);
+      bone[n].frame = frame;
+      s = (float)frame / 30.0f;
+      bone[n].x = b % 8 == 0 ? sinf(s * (1.0f + b % 3)) * 2.0f : 0.0f;
+      bone[n].y = b % 8 == 0 ? cosf(s * 0.7f) * 0.5f : 0.0f;
+      bone[n].z = b % 8 == 0 ? s * 0.05f : 0.0f;
+      angle = sinf(s * 1.3f + (float)b) * 1.2f;
+      axis[0] = sinf(s * 0.2f + (float)b);
+      axis[1] = cosf(s * 0.2f);
+      axis[2] = 0.3f;
+      len = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+      bone[n].qx = axis[0] / len * sinf(angle * 0.5f);
+      bone[n].qy = axis[1] / len * sinf(angle * 0.5f);
+      bone[n].qz = axis[2] / len * sinf(angle * 0.5f);
+      bone[n].qw = cosf(angle * 0.5f);
+      for ( int a = 0; a < 4; a++ ) {
+        points[a][0] = (uint8_t)__BenchRange(&rng, 0, 64);   // x1
+        points[a][1] = (uint8_t)__BenchRange(&rng, 0, 64);   // y1
+        points[a][2] = (uint8_t)__BenchRange(&rng, 64, 127); // x2
+        points[a][3] = (uint8_t)__BenchRange(&rng, 64, 127); // y2
+      }
+      __VMDEncodeBoneBezier(bone[n].bezier, (const uint8_t (*)[4])points);
+      frame += __BenchRange(&rng, 1, 4);
+    }
+  }
+  vf->bone_frames.num_frames = (uint32_t)n;
+
+  n = 0;
+  for ( uint32_t m = 0; m < morphs; m++ ) {
+    frame = 0;
+    for ( uint32_t k = 0; k < frames; k++, n++ ) {
+      snprintf(morph[n].name, sizeof(morph[n].name), "face%03u", m);
+      morph[n].frame = frame;
+      morph[n].value = (float)__BenchRange(&rng, 0, 100) / 100.0f;
+      frame += __BenchRange(&rng, 1, 6);
+    }
+  }
+  vf->morph_frames.num_frames = (uint32_t)n;
+
+  frame = 0;
+  for ( uint32_t k = 0; k < num_cameras; k++ ) {
+    camera[k].frame = frame;
+    camera[k].distance = -(float)__BenchRange(&rng, 10, 60);
+    camera[k].x = (float)__BenchRange(&rng, 0, 200) / 10.0f - 10.0f;
+    camera[k].y = (float)__BenchRange(&rng, 50, 200) / 10.0f;
+    camera[k].z = (float)__BenchRange(&rng, 0, 200) / 10.0f - 10.0f;
+    camera[k].rx = (float)__BenchRange(&rng, 0, 100) / 200.0f;
+    camera[k].ry = (float)__BenchRange(&rng, 0, 628) / 100.0f;
+    camera[k].viewAngle = __BenchRange(&rng, 20, 45);
+    for ( int a = 0; a < 6; a++ ) {
+      camera[k].bezier[a * 4 + 0] = (char)__BenchRange(&rng, 0, 64);   // x1
+      camera[k].bezier[a * 4 + 1] = (char)__BenchRange(&rng, 64, 127); // x2
+      camera[k].bezier[a * 4 + 2] = (char)__BenchRange(&rng, 0, 64);   // y1
+      camera[k].bezier[a * 4 + 3] = (char)__BenchRange(&rng, 64, 127); // y2
+    }
+    frame += __BenchRange(&rng, 2, 30);
+  }
+  vf->camera_frames.num_frames = num_cameras;
+
+  for ( uint32_t k = 0; k < num_lights; k++ ) {
+    light[k].frame = k * 30;
+    light[k].r = light[k].g = light[k].b = 0.6f;
+    light[k].x = -0.5f;
+    light[k].y = -1.0f;
+    light[k].z = 0.5f;
+  }
+  vf->light_frames.num_frames = num_lights;
+
+  for ( uint32_t k = 0; k < num_shadows; k++ ) {
+    shadow[k].frame = k * 150;
+    shadow[k].type = (char)(k % 3);
+    shadow[k].distance = 0.0888f;
+  }
+  vf->shadow_frames.num_frames = num_shadows;
+
+  for ( uint32_t k = 0; k < num_iks; k++ ) {
+    ik[k].frame = k * 60;
+    ik[k].show = (char)(k % 5 != 4);
+    ik[k].ik_count = BENCH_IK_PER_FRAME;
+    ik[k].ik_offset = k * BENCH_IK_PER_FRAME;
+    for ( uint32_t i = 0; i < BENCH_IK_PER_FRAME; i++ ) {
+      VMDInfoIK* p = &info[k * BENCH_IK_PER_FRAME + i];
+      snprintf(p->name, sizeof(p->name), "ik%02u", i);
+      p->on_off = (char)(__BenchRandom(&rng) % 4 != 0);
+    }
+  }
+  vf->ik_frames.num_frames = num_iks;
+  vf->ik_frames.num_ik = num_iks * BENCH_IK_PER_FRAME;
+  return vf;
+}
+
+/**
+ * @brief Number of keyframes of all sections
+ * @param (vf) a pointer to VMDFile
+ * @return number of keyframes
+ */
+static uint64_t __BenchKeyframes(VMDFile* vf){
+  uint64_t n = 0;
+
+  for ( int type = VMDL_BONE; type <= VMDL_IK; type++ ) {
+    n += VMDGetNumFrames(vf, (VMDStructType)type);
+  }
+  return n;
+}
+
+/**
+ * @brief Benchmark of VMDLoadFromFile()
+ * @param (cfg) settings
+ * @param (r) [out] result
+ * @return bool : false if the library failed
+ */
+static bool __BenchLoad(const BenchConfig* cfg, BenchResult* r){
+  VMDFile* vf;
+  double t0;
+
+  r->unit = "keyframes";
+  for ( uint32_t i = 0; i < cfg->repeat; i++ ) {
+    t0 = __BenchNow();
+    vf = VMDLoadFromFile(cfg->fname);
+    r->seconds += __BenchNow() - t0;
+    if ( vf == NULL ) return false;
+    r->bytes += cfg->file_size;
+    r->items += __BenchKeyframes(vf);
+    VMDReleaseVMDFile(vf);
+  }
+  return true;
+}
+
+/**
+ * @brief Benchmark of VMDMapFile(), reading every bone frame
+ *  Mapping alone reads nothing, so frame numbers of all bone frames are
+ *  read to fault the pages in.
+ * @param (cfg) settings
+ * @param (r) [out] result
+ * @return bool : false if the library failed
+ */
+static bool __BenchMap(const BenchConfig* cfg, BenchResult* r){
+  volatile uint64_t sink = 0;
+  uint64_t sum;
+  VMDFile* vf;
+  double t0;
+
+  r->unit = "keyframes";
+  for ( uint32_t i = 0; i < cfg->repeat; i++ ) {
+    t0 = __BenchNow();
+    vf = VMDMapFile(cfg->fname, VMDLIB_MAP_RDONLY);
+    if ( vf == NULL ) return false;
+    sum = 0;
+    for ( uint32_t k = 0; k < vf->bone_frames.num_frames; k++ ) {
+      sum += vf->bone_frames.frames[k].frame;
+    }
+    r->seconds += __BenchNow() - t0;
+    sink += sum;
+    r->bytes += cfg->file_size;
+    r->items += __BenchKeyframes(vf);
+    VMDReleaseVMDFile(vf);
+  }
+  (void)sink;
+  return true;
+}
+
+/**
+ * @brief Benchmark of VMDSortAllFrames()
+ *  Frames are restored to the order of the file before each sort.
+ * @param (cfg) settings
+ * @param (r) [out] result
+ * @return bool : false if the library failed
+ */
+static bool __BenchSort(const BenchConfig* cfg, BenchResult* r){
+  VMDFile* vf = VMDLoadFromFile(cfg->fname);
+  VMDFile* orig = VMDLoadFromFile(cfg->fname);
+  size_t bone_size, morph_size;
+  double t0;
+
+  r->unit = "keyframes";
+  if ( vf == NULL || orig == NULL ) {
+    VMDReleaseVMDFile(vf);
+    VMDReleaseVMDFile(orig);
+    return false;
+  }
+  bone_size = sizeof(VMDBoneSingleFrame) * vf->bone_frames.num_frames;
+  morph_size = sizeof(VMDMorphSingleFrame) * vf->morph_frames.num_frames;
+  for ( uint32_t i = 0; i < cfg->repeat; i++ ) {
+    memcpy(vf->bone_frames.frames, orig->bone_frames.frames, bone_size);
+    memcpy(vf->morph_frames.frames, orig->morph_frames.frames, morph_size);
+    t0 = __BenchNow();
+    VMDSortAllFrames(vf);
+    r->seconds += __BenchNow() - t0;
+    r->bytes += bone_size + morph_size;
+    r->items += __BenchKeyframes(vf);
+  }
+  VMDReleaseVMDFile(vf);
+  VMDReleaseVMDFile(orig);
+  return true;
+}
+
+/**
+ * @brief Benchmark of VMDSampleBones(), all bones at every half frame
+ *  The track index and the curve table are built before timing.
+ * @param (cfg) settings
+ * @param (r) [out] result
+ * @return bool : false if the library failed
+ */
+static bool __BenchSample(const BenchConfig* cfg, BenchResult* r){
+  VMDFile* vf = VMDLoadFromFile(cfg->fname);
+  const VMDTrack** tracks = NULL;
+  VMDBonePoses poses;
+  float* block = NULL;
+  uint32_t num = 0, end = 0;
+  bool ok = false;
+  double t0;
+
+  r->unit = "samples";
+  if ( vf == NULL || VMDBuildTrackIndex(vf) == false
+       || VMDBuildCurveTable(vf) == false ) {
+    goto done;
+  }
+  num = vf->index->bones.num_tracks;
+  tracks = malloc(sizeof(VMDTrack*) * (num + 1));
+  block = malloc(sizeof(float) * 7 * (num + 1));
+  if ( tracks == NULL || block == NULL ) goto done;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    const VMDTrack* t = &vf->index->bones.tracks[i];
+    uint32_t f = vf->bone_frames.frames[t->frames[t->num_frames - 1]].frame;
+    tracks[i] = t;
+    if ( f > end ) end = f;
+  }
+  poses = (VMDBonePoses){ block, block + num, block + num * 2,
+                          block + num * 3, block + num * 4, block + num * 5,
+                          block + num * 6 };
+  for ( uint32_t i = 0; i < cfg->repeat; i++ ) {
+    t0 = __BenchNow();
+    for ( uint32_t k = 0; k <= end * 2; k++ ) {
+      if ( VMDSampleBones(vf, tracks, num, (float)k * 0.5f, &poses)
+           == false ) {
+        goto done;
+      }
+    }
+    r->seconds += __BenchNow() - t0;
+    r->items += (uint64_t)num * (end * 2 + 1);
+  }
+  ok = true;
+
+ done:
+  free(tracks);
+  free(block);
+  VMDReleaseVMDFile(vf);
+  return ok;
+}
+
+/**
+ * @brief Sink of VMDExport() counting bytes
+ * @param (user) a pointer to uint64_t
+ * @param (data) output
+ * @param (size) size of output
+ * @return true
+ */
+static bool __BenchCount(void* user, const void* data, size_t size){
+  (void)data;
+  *(uint64_t*)user += size;
+  return true;
+}
+
+/**
+ * @brief Benchmark of VMDExport()
+ * @param (cfg) settings
+ * @param (r) [out] result
+ * @param (format) export format
+ * @param (flags) VMDLIB_EXPORT_*
+ * @return bool : false if the library failed
+ */
+static bool __BenchExportFormat(const BenchConfig* cfg, BenchResult* r,
+                                VMDExportFormat format, uint32_t flags){
+  VMDFile* vf = VMDLoadFromFile(cfg->fname);
+  uint64_t bytes = 0;
+  const VMDSink sink = { __BenchCount, &bytes };
+  double t0;
+
+  r->unit = "keyframes";
+  if ( vf == NULL ) return false;
+  for ( uint32_t i = 0; i < cfg->repeat; i++ ) {
+    t0 = __BenchNow();
+    for ( int type = VMDL_BONE; type <= VMDL_MORPH; type++ ) {
+      if ( VMDExport(vf, (VMDStructType)type, format, flags, &sink)
+           == false ) {
+        VMDReleaseVMDFile(vf);
+        return false;
+      }
+    }
+    r->seconds += __BenchNow() - t0;
+    r->items += vf->bone_frames.num_frames + vf->morph_frames.num_frames;
+  }
+  r->bytes = bytes;
+  VMDReleaseVMDFile(vf);
+  return true;
+}
+
+/**
+ * @brief Benchmark of CSV in Shift-JIS, as VMDDumpAllBone2CSV() prints
+ * @param (cfg) settings
+ * @param (r) [out] result
+ * @return bool : false if the library failed
+ */
+static bool __BenchDump(const BenchConfig* cfg, BenchResult* r){
+  return __BenchExportFormat(cfg, r, VMDL_EXPORT_CSV, VMDLIB_EXPORT_SJIS);
+}
+
+/**
+ * @brief Benchmark of NDJSON in UTF-8 with interpolation parameters
+ * @param (cfg) settings
+ * @param (r) [out] result
+ * @return bool : false if the library failed
+ */
+static bool __BenchExport(const BenchConfig* cfg, BenchResult* r){
+  return __BenchExportFormat(cfg, r, VMDL_EXPORT_NDJSON, VMDLIB_EXPORT_BEZIER);
+}
+
+/**
+ * @brief Benchmark of VMDWriteToFile()
+ * @param (cfg) settings
+ * @param (r) [out] result
+ * @return bool : false if the library failed
+ */
+static bool __BenchWrite(const BenchConfig* cfg, BenchResult* r){
+  VMDFile* vf = VMDLoadFromFile(cfg->fname);
+  char fname[] = "/tmp/vmdlib_bench_write_XXXXXX";
+  bool ok = true;
+  double t0;
+  int fd;
+
+  r->unit = "keyframes";
+  if ( vf == NULL ) return false;
+  fd = mkstemp(fname);
+  if ( fd < 0 ) {
+    VMDReleaseVMDFile(vf);
+    return false;
+  }
+  close(fd);
+  for ( uint32_t i = 0; i < cfg->repeat && ok; i++ ) {
+    t0 = __BenchNow();
+    ok = VMDWriteToFile(vf, fname);
+    r->seconds += __BenchNow() - t0;
+    r->bytes += cfg->file_size;
+    r->items += __BenchKeyframes(vf);
+  }
+  unlink(fname);
+  VMDReleaseVMDFile(vf);
+  return ok;
+}
+
+static const Bench __BENCHES[] = {
+  { "load",   __BenchLoad },
+  { "mmap",   __BenchMap },
+  { "sort",   __BenchSort },
+  { "sample", __BenchSample },
+  { "dump",   __BenchDump },
+  { "export", __BenchExport },
+  { "write",  __BenchWrite }
+};
+#define BENCH_NUM (sizeof(__BENCHES) / sizeof(__BENCHES[0]))
+
+/**
+ * @brief Run a benchmark in a child process and print its result
+ *  The child prints a JSON object of the result, with its peak RSS.
+ * @param (bench) benchmark
+ * @param (cfg) settings
+ * @return bool : false if the benchmark failed
+ */
+static bool __BenchRun(const Bench* bench, const BenchConfig* cfg){
+  BenchResult r = { 0.0, 0, 0, "" };
+  struct rusage usage;
+  pid_t pid;
+  int status;
+  bool ok;
+
+  fflush(stdout);
+  pid = fork();
+  if ( pid < 0 ) return false;
+  if ( pid > 0 ) {
+    if ( waitpid(pid, &status, 0) < 0 ) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+
+  ok = bench->run(cfg, &r);
+  getrusage(RUSAGE_SELF, &usage);
+  printf("    {\"name\": \"%s\", \"ok\": %s, \"repeat\": %u, "
+         "\"seconds\": %.6f, ", bench->name, ok ? "true" : "false",
+         cfg->repeat, r.seconds);
+  if ( r.bytes > 0 && r.seconds > 0.0 ) {
+    printf("\"bytes\": %llu, \"mb_per_s\": %.2f, ",
+           (unsigned long long)r.bytes, (double)r.bytes / r.seconds / 1e6);
+  } else {
+    printf("\"bytes\": %llu, \"mb_per_s\": null, ",
+           (unsigned long long)r.bytes);
+  }
+  printf("\"%s\": %llu, \"%s_per_s\": %.0f, \"peak_rss_kb\": %ld}",
+         r.unit, (unsigned long long)r.items, r.unit,
+         r.seconds > 0.0 ? (double)r.items / r.seconds : 0.0,
+         usage.ru_maxrss);
+  fflush(stdout);
+  _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * @brief Parse a number of an option
+ * @param (arg) argument
+ * @param (out) [out] number
+ * @return bool : false if not a number
+ */
+static bool __BenchNumber(const char* arg, uint32_t* out){
+  char* end;
+  unsigned long v = strtoul(arg, &end, 10);
+
+  if ( *arg == '\0' || *end != '\0' || v > UINT32_MAX ) return false;
+  *out = (uint32_t)v;
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  BenchConfig cfg = { 100, 3000, 5, 1, NULL, 0 };
+  char fname[] = "/tmp/vmdlib_bench_XXXXXX";
+  const char* gen = NULL;
+  struct stat st;
+  VMDFile* vf;
+  bool ok = true;
+  int opt, fd;
+
+  while ( (opt = getopt(argc, argv, "b:f:r:s:g:")) != -1 ) {
+    switch(opt){
+      case 'b': ok = ok && __BenchNumber(optarg, &cfg.bones); break;
+      case 'f': ok = ok && __BenchNumber(optarg, &cfg.frames); break;
+      case 'r': ok = ok && __BenchNumber(optarg, &cfg.repeat); break;
+      case 's': ok = ok && __BenchNumber(optarg, &cfg.seed); break;
+      case 'g': gen = optarg; break;
+      default: ok = false; break;
+    }
+  }
+  if ( ok == false || cfg.bones == 0 || cfg.frames == 0 || cfg.repeat == 0
+       || (uint64_t)cfg.bones * cfg.frames > UINT32_MAX ) {
+    fprintf(stderr, "usage: %s [-b bones] [-f frames] [-r repeat] "
+            "[-s seed] [-g file]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  vf = __BenchGenerate(cfg.bones, cfg.frames, cfg.seed);
+  if ( vf == NULL ) {
+    fprintf(stderr, "failed to generate file\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( gen != NULL ) {
+    ok = VMDWriteToFile(vf, (char*)gen);
+    VMDReleaseVMDFile(vf);
+    if ( ok == false ) fprintf(stderr, "failed to write %s\n", gen);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  fd = mkstemp(fname);
+  if ( fd < 0 || VMDWriteToFd(vf, fd) == false || fstat(fd, &st) != 0 ) {
+    fprintf(stderr, "failed to write synthetic file\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  cfg.fname = fname;
+  cfg.file_size = (uint64_t)st.st_size;
+
+  printf("{\n  \"bones\": %u, \"frames\": %u, \"seed\": %u, "
+         "\"file_size\": %llu, \"keyframes\": %llu,\n  \"results\": [\n",
+         cfg.bones, cfg.frames, cfg.seed,
+         (unsigned long long)cfg.file_size,
+         (unsigned long long)__BenchKeyframes(vf));
+  VMDReleaseVMDFile(vf);
+  for ( size_t i = 0; i < BENCH_NUM; i++ ) {
+    if ( i > 0 ) printf(",\n");
+    if ( __BenchRun(&__BENCHES[i], &cfg) == false ) ok = false;
+  }
+  printf("\n  ]\n}\n");
+  unlink(fname);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -12,9 +12,36 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
 #include "vmd.h"
 
-int VMD_ERROR;
+VMDLIB_THREAD_LOCAL int VMD_ERROR;
+
+/**
+ * @brief Allocate memory, counted as VMDL_STAT_ALLOC
+ *  Internally called function
+ * @param (size) bytes to allocate
+ * @return memory allocated by malloc(), or NULL
+ */
+static void* __VMDMalloc(size_t size){
+  void* p = malloc(size);
+
+  if ( p != NULL ) VMDLIB_STAT_COUNT(VMDL_STAT_ALLOC, size);
+  return p;
+}
 
 /**
  * @brief Check magic number of VMD file
@@ -30,275 +57,2134 @@ int __VMDCheckHeader(void* data){
   return true;
 }
 
+// compare frame numbers without subtraction, which overflows for large ones
+#define VMDLIB_CMP_FRAME(type, a, b) \
+  ((((const type*)(a))->frame > ((const type*)(b))->frame) \
+   - (((const type*)(a))->frame < ((const type*)(b))->frame))
+
 int __VMDCompareBoneFrameNumber(const void* a, const void* b){
-  return ((VMDBoneSingleFrame*)a)->frame - ((VMDBoneSingleFrame*)b)->frame;
+  return VMDLIB_CMP_FRAME(VMDBoneSingleFrame, a, b);
+}
+
+int __VMDCompareMorphFrameNumber(const void* a, const void* b){
+  return VMDLIB_CMP_FRAME(VMDMorphSingleFrame, a, b);
+}
+
+int __VMDCompareCameraFrameNumber(const void* a, const void* b){
+  return VMDLIB_CMP_FRAME(VMDCameraSingleFrame, a, b);
+}
+
+int __VMDCompareLightFrameNumber(const void* a, const void* b){
+  return VMDLIB_CMP_FRAME(VMDLightSingleFrame, a, b);
+}
+
+int __VMDCompareShadowFrameNumber(const void* a, const void* b){
+  return VMDLIB_CMP_FRAME(VMDShadowSingleFrame, a, b);
+}
+
+int __VMDCompareIKFrameNumber(const void* a, const void* b){
+  return VMDLIB_CMP_FRAME(VMDIKSingleFrame, a, b);
+}
+
+// radix sort of 32 bit frame numbers in 3 passes of 11 bits
+#define VMDLIB_RADIX_BITS   (11)
+#define VMDLIB_RADIX_SIZE   (1 << VMDLIB_RADIX_BITS)
+#define VMDLIB_RADIX_MASK   (VMDLIB_RADIX_SIZE - 1)
+#define VMDLIB_RADIX_PASSES (3)
+
+/**
+ * @brief Stable LSD radix sort of (frame number, position) pairs
+ *  Internally called function. Each pair holds a frame number in the upper
+ *  32 bits and the position of the frame in the lower 32 bits, and pairs are
+ *  ordered by the frame number only, so frames with the same frame number
+ *  keep their order. A pass is skipped when all frame numbers share its
+ *  digit, so frame numbers below 2^11 or 2^22 need one or two passes.
+ * @param (pairs) pairs to be sorted
+ * @param (work) work area as large as `pairs`
+ * @param (num) number of pairs
+ * @param (hist) histogram of each digit counted by caller
+ * @param (diff) bits in which any frame number differs from another
+ * @return `pairs` or `work`, whichever holds the result
+ */
+static uint64_t* __VMDRadixSortPairs(uint64_t* pairs, uint64_t* work,
+                                     uint32_t num,
+                                     uint32_t (*hist)[VMDLIB_RADIX_SIZE],
+                                     uint32_t diff){
+  uint64_t* swap;
+  uint32_t sum, count, digit;
+  int shift;
+
+  for ( int pass = 0; pass < VMDLIB_RADIX_PASSES; pass++ ) {
+    shift = 32 + pass * VMDLIB_RADIX_BITS;
+    if ( ((diff >> (pass * VMDLIB_RADIX_BITS)) & VMDLIB_RADIX_MASK) == 0 ) {
+      continue;
+    }
+    // histogram to offsets
+    sum = 0;
+    for ( uint32_t i = 0; i < VMDLIB_RADIX_SIZE; i++ ) {
+      count = hist[pass][i];
+      hist[pass][i] = sum;
+      sum += count;
+    }
+    for ( uint32_t i = 0; i < num; i++ ) {
+      digit = (uint32_t)(pairs[i] >> shift) & VMDLIB_RADIX_MASK;
+      work[hist[pass][digit]++] = pairs[i];
+    }
+    swap = pairs;
+    pairs = work;
+    work = swap;
+  }
+  return pairs;
+}
+
+/**
+ * @brief Stable sort of (frame number, position) pairs
+ *  Internally called function, used to order positions of frames by their
+ *  frame numbers without moving the frames.
+ * @param (pairs) pairs with a frame number in the upper 32 bits
+ * @param (num) number of pairs
+ * @return boolean : false if memory is insufficient
+ */
+bool __VMDSortPairs(uint64_t* pairs, uint32_t num){
+  uint64_t* work;
+  uint64_t* sorted;
+  uint32_t (*hist)[VMDLIB_RADIX_SIZE];
+  uint32_t key, first, diff = 0;
+
+  if ( num < 2 ) return true;
+  work = __VMDMalloc(sizeof(uint64_t) * (size_t)num
+                     + sizeof(uint32_t) * VMDLIB_RADIX_PASSES
+                       * VMDLIB_RADIX_SIZE);
+  if ( work == NULL ) return false;
+  hist = (uint32_t (*)[VMDLIB_RADIX_SIZE])(work + num);
+  memset(hist, 0, sizeof(uint32_t) * VMDLIB_RADIX_PASSES * VMDLIB_RADIX_SIZE);
+  first = (uint32_t)(pairs[0] >> 32);
+  for ( uint32_t i = 0; i < num; i++ ) {
+    key = (uint32_t)(pairs[i] >> 32);
+    diff |= key ^ first;
+    hist[0][key & VMDLIB_RADIX_MASK]++;
+    hist[1][(key >> VMDLIB_RADIX_BITS) & VMDLIB_RADIX_MASK]++;
+    hist[2][key >> (VMDLIB_RADIX_BITS * 2)]++;
+  }
+  sorted = __VMDRadixSortPairs(pairs, work, num, hist, diff);
+  if ( sorted != pairs ) memcpy(pairs, sorted, sizeof(uint64_t) * num);
+  free(work);
+  return true;
+}
+
+/**
+ * @brief Stable sort of frames by frame numbers
+ *  Internally called function. Always inlined into the sort function of
+ *  each frame type, so that the size of a frame and the position of its
+ *  frame number are constants there. Pairs of frame number and position are
+ *  radix sorted, then frames are moved once by a permutation pass. Falls
+ *  back to qsort() (not stable) when there is not enough memory.
+ * @param (frames) frames to be sorted
+ * @param (num) number of frames
+ * @param (size) size of a frame
+ * @param (key_offset) offset of the frame number in a frame
+ * @param (cmp) compare function for the fall back
+ * @return void
+ */
+static inline __attribute__((always_inline))
+void __VMDSortFrames(char* frames, uint32_t num, size_t size,
+                     size_t key_offset, int (*cmp)(const void*, const void*)){
+  uint64_t* pairs;
+  uint64_t* sorted;
+  uint32_t (*hist)[VMDLIB_RADIX_SIZE];
+  char* tmp;
+  uint32_t key, first, prev, diff = 0;
+  bool in_order = true;
+
+  if ( frames == NULL || num < 2 ) return;
+
+  pairs = __VMDMalloc(sizeof(uint64_t) * 2 * (size_t)num
+                      + sizeof(uint32_t) * VMDLIB_RADIX_PASSES
+                        * VMDLIB_RADIX_SIZE);
+  tmp = __VMDMalloc(size * num);
+  if ( pairs == NULL || tmp == NULL ) {
+    DEBUG_PRINT("Insufficient memory, fall back to qsort()\n");
+    free(pairs);
+    free(tmp);
+    qsort(frames, num, size, cmp);
+    return;
+  }
+  hist = (uint32_t (*)[VMDLIB_RADIX_SIZE])(pairs + 2 * (size_t)num);
+  memset(hist, 0, sizeof(uint32_t) * VMDLIB_RADIX_PASSES * VMDLIB_RADIX_SIZE);
+
+  // build pairs and histograms of all digits in one pass
+  memcpy(&first, frames + key_offset, sizeof(uint32_t));
+  prev = first;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    memcpy(&key, frames + size * i + key_offset, sizeof(uint32_t));
+    in_order = in_order && prev <= key;
+    prev = key;
+    diff |= key ^ first;
+    pairs[i] = ((uint64_t)key << 32) | i;
+    hist[0][key & VMDLIB_RADIX_MASK]++;
+    hist[1][(key >> VMDLIB_RADIX_BITS) & VMDLIB_RADIX_MASK]++;
+    hist[2][key >> (VMDLIB_RADIX_BITS * 2)]++;
+  }
+
+  if ( in_order == false ) {
+    sorted = __VMDRadixSortPairs(pairs, pairs + num, num, hist, diff);
+    for ( uint32_t i = 0; i < num; i++ ) {
+      memcpy(tmp + size * i, frames + size * (uint32_t)sorted[i], size);
+    }
+    memcpy(frames, tmp, size * num);
+  }
+  free(pairs);
+  free(tmp);
+}
+
+/**
+ * @brief Stable sort of bone frames by frame numbers
+ * @param (frames) frames to be sorted
+ * @param (num) number of frames
+ * @return void
+ */
+void VMDSortBoneFrames(VMDBoneSingleFrame* frames, uint32_t num){
+  __VMDSortFrames((char*)frames, num, sizeof(VMDBoneSingleFrame),
+                  offsetof(VMDBoneSingleFrame, frame),
+                  __VMDCompareBoneFrameNumber);
+}
+
+/**
+ * @brief Stable sort of morph frames by frame numbers
+ * @param (frames) frames to be sorted
+ * @param (num) number of frames
+ * @return void
+ */
+void VMDSortMorphFrames(VMDMorphSingleFrame* frames, uint32_t num){
+  __VMDSortFrames((char*)frames, num, sizeof(VMDMorphSingleFrame),
+                  offsetof(VMDMorphSingleFrame, frame),
+                  __VMDCompareMorphFrameNumber);
+}
+
+/**
+ * @brief Stable sort of camera frames by frame numbers
+ * @param (frames) frames to be sorted
+ * @param (num) number of frames
+ * @return void
+ */
+void VMDSortCameraFrames(VMDCameraSingleFrame* frames, uint32_t num){
+  __VMDSortFrames((char*)frames, num, sizeof(VMDCameraSingleFrame),
+                  offsetof(VMDCameraSingleFrame, frame),
+                  __VMDCompareCameraFrameNumber);
+}
+
+/**
+ * @brief Stable sort of light frames by frame numbers
+ * @param (frames) frames to be sorted
+ * @param (num) number of frames
+ * @return void
+ */
+void VMDSortLightFrames(VMDLightSingleFrame* frames, uint32_t num){
+  __VMDSortFrames((char*)frames, num, sizeof(VMDLightSingleFrame),
+                  offsetof(VMDLightSingleFrame, frame),
+                  __VMDCompareLightFrameNumber);
+}
+
+/**
+ * @brief Stable sort of self shadow frames by frame numbers
+ * @param (frames) frames to be sorted
+ * @param (num) number of frames
+ * @return void
+ */
+void VMDSortShadowFrames(VMDShadowSingleFrame* frames, uint32_t num){
+  __VMDSortFrames((char*)frames, num, sizeof(VMDShadowSingleFrame),
+                  offsetof(VMDShadowSingleFrame, frame),
+                  __VMDCompareShadowFrameNumber);
+}
+
+/**
+ * @brief Stable sort of ShowIK frames by frame numbers
+ *  IK on/off entries stay in the pool, sorted frames keep referring to them.
+ * @param (frames) frames to be sorted
+ * @param (num) number of frames
+ * @return void
+ */
+void VMDSortIKFrames(VMDIKSingleFrame* frames, uint32_t num){
+  __VMDSortFrames((char*)frames, num, sizeof(VMDIKSingleFrame),
+                  offsetof(VMDIKSingleFrame, frame),
+                  __VMDCompareIKFrameNumber);
+}
+
+/**
+ * @brief Sort for VMD Frames
+ *  VMD data is constructed by several types of frames e.g. bone, camera, and
+ *  so on. These frames are typically not sorted. This function sorts any
+ *  type of frames in VMD data by selecting the frame type with one of the
+ *  aurguments called `type`. Kept for compatibility, the sort function of
+ *  each type (e.g. VMDSortBoneFrames()) is called inside.
+ * @param (data) same as data for qsort()
+ * @param (num) same as num for qsort()
+ * @param (size) same as size for qsort(), must match `type`
+ * @param (type) specify the type of data choosen from `VMDStructType`
+ * @return void
+ */
+void VMDqsort(void* data, size_t num, size_t size, VMDStructType type){
+  if ( data == NULL ) {
+    DEBUG_PRINT("NULL was passed to %s, type was %d\n", __func__, type);
+    return;
+  }
+  if ( num > UINT32_MAX ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return;
+  }
+
+  // select which sort function to use
+  switch(type){
+    case VMDL_BONE:
+      if ( size != sizeof(VMDBoneSingleFrame) ) break;
+      VMDSortBoneFrames(data, (uint32_t)num); return;
+    case VMDL_MORPH:
+      if ( size != sizeof(VMDMorphSingleFrame) ) break;
+      VMDSortMorphFrames(data, (uint32_t)num); return;
+    case VMDL_CAMERA:
+      if ( size != sizeof(VMDCameraSingleFrame) ) break;
+      VMDSortCameraFrames(data, (uint32_t)num); return;
+    case VMDL_LIGHT:
+      if ( size != sizeof(VMDLightSingleFrame) ) break;
+      VMDSortLightFrames(data, (uint32_t)num); return;
+    case VMDL_SHADOW:
+      if ( size != sizeof(VMDShadowSingleFrame) ) break;
+      VMDSortShadowFrames(data, (uint32_t)num); return;
+    case VMDL_IK:
+      if ( size != sizeof(VMDIKSingleFrame) ) break;
+      VMDSortIKFrames(data, (uint32_t)num); return;
+  }
+  DEBUG_PRINT("%s : invalid type %d or size %zu\n", __func__, type, size);
+  VMD_ERROR = VMDLIB_E_IV;
+  return;
+}
+
+// Size of a single frame in file for each VMDStructType
+// (ShowIK records are variable length, this is the smallest one)
+static const size_t __VMD_FRAME_SIZE[] = {
+  sizeof(VMDBoneSingleFrame),
+  sizeof(VMDMorphSingleFrame),
+  sizeof(VMDCameraSingleFrame),
+  sizeof(VMDLightSingleFrame),
+  sizeof(VMDShadowSingleFrame),
+  VMDLIB_IK_HEAD_SIZE
+};
+#define VMDLIB_NUM_SECTIONS (sizeof(__VMD_FRAME_SIZE)/sizeof(__VMD_FRAME_SIZE[0]))
+
+// Location of sections in a VMD file
+typedef struct {
+  uint32_t num_frames[VMDLIB_NUM_SECTIONS]; // indexed by VMDStructType
+  size_t   offset[VMDLIB_NUM_SECTIONS];     // offset of the first frame
+  size_t   size;                            // size of the whole data
+} VMDLayout;
+
+// Sections of a file loaded with VMDLIB_LOAD_LAZY which are not read yet
+struct VMDLazyLoad {
+  char*     fname;   // file to read the sections from
+  VMDLayout layout;  // location of the sections in the file
+  uint32_t  pending; // VMDLIB_SECTION() of sections not read yet
+};
+
+// Reads `len` bytes at `pos` of memory or file for __VMDScanLayout()
+typedef bool (*VMDReadAtFunc)(void* src, size_t pos, void* dst, size_t len);
+
+/**
+ * @brief Upper bound of IK on/off entries in ShowIK section
+ *  Internally called function. Used to size the pool of IK on/off entries
+ *  before parsing, since the section has no total of the entries.
+ * @param (bytes) bytes available for the records of the section
+ * @param (num) number of ShowIK records
+ * @return number of entries which the section can contain at most
+ */
+uint32_t __VMDIKPoolBound(size_t bytes, uint32_t num){
+  size_t bound;
+  if ( bytes / VMDLIB_IK_HEAD_SIZE < num ) return 0;
+  bound = (bytes - (size_t)num * VMDLIB_IK_HEAD_SIZE) / sizeof(VMDInfoIK);
+  return bound > UINT32_MAX ? UINT32_MAX : (uint32_t)bound;
+}
+
+/**
+ * @brief Parse variable length ShowIK records in a single linear pass
+ *  Internally called function. Heads of the records go to `ik->frames` and
+ *  all IK on/off entries are packed into `ik->ik` in order, so no memory is
+ *  allocated per record. Both arrays must be allocated by caller, to hold
+ *  `ik->num_frames` records and `pool_cap` entries respectively.
+ * @param (data) head of the first record
+ * @param (size) bytes available from `data`
+ * @param (ik) [in,out] section with num_frames, frames and ik set up
+ * @param (pool_cap) number of entries `ik->ik` can hold
+ * @param (consumed) [out] bytes of the records
+ * @return boolean : false if records exceed `size` or `pool_cap`
+ */
+bool __VMDParseIK(const char* data, size_t size, VMDIKFrames* ik,
+                  uint32_t pool_cap, size_t* consumed){
+  size_t pos = 0;
+  uint32_t used = 0;
+  uint32_t count;
+  VMDLIB_STAT_START(start);
+
+  for ( uint32_t i = 0; i < ik->num_frames; i++ ) {
+    if ( size - pos < VMDLIB_IK_HEAD_SIZE ) return false;
+    // frame, show and ik_count are packed same as the file
+    memcpy(&ik->frames[i], data + pos, VMDLIB_IK_HEAD_SIZE);
+    pos += VMDLIB_IK_HEAD_SIZE;
+    count = ik->frames[i].ik_count;
+    if ( count > pool_cap - used || (size - pos) / sizeof(VMDInfoIK) < count ) {
+      DEBUG_PRINT("ShowIK record %u exceeds the section\n", i);
+      return false;
+    }
+    ik->frames[i].ik_offset = used;
+    memcpy(&ik->ik[used], data + pos, sizeof(VMDInfoIK) * count);
+    used += count;
+    pos += sizeof(VMDInfoIK) * count;
+  }
+  ik->num_ik = used;
+  *consumed = pos;
+  VMDLIB_STAT_STOP(VMDL_STAT_COPY + VMDL_IK, start, pos);
+  return true;
+}
+
+/**
+ * @brief Read ShowIK records from file in a single linear pass
+ *  Internally called function. Same as __VMDParseIK() but records are read
+ *  one by one through the buffer of stdio, so the section is never held in
+ *  memory as a whole.
+ * @param (fp) file handler positioned at the first record
+ * @param (size) bytes available in the file from the first record
+ * @param (ik) [in,out] section with num_frames, frames and ik set up
+ * @param (pool_cap) number of entries `ik->ik` can hold
+ * @return boolean : false with VMD_ERROR set on failure
+ */
+static bool __VMDReadIK(FILE* fp, size_t size, VMDIKFrames* ik,
+                        uint32_t pool_cap){
+  uint32_t count;
+  VMDLIB_STAT_START(start);
+
+  ik->num_ik = 0;
+  for ( uint32_t i = 0; i < ik->num_frames; i++ ) {
+    if ( size < VMDLIB_IK_HEAD_SIZE
+         || fread(&ik->frames[i], VMDLIB_IK_HEAD_SIZE, 1, fp) != 1 ) {
+      VMD_ERROR = VMDLIB_E_FT;
+      return false;
+    }
+    size -= VMDLIB_IK_HEAD_SIZE;
+    count = ik->frames[i].ik_count;
+    if ( count > pool_cap - ik->num_ik || size / sizeof(VMDInfoIK) < count ) {
+      DEBUG_PRINT("ShowIK record %u exceeds the section\n", i);
+      VMD_ERROR = VMDLIB_E_FT;
+      return false;
+    }
+    ik->frames[i].ik_offset = ik->num_ik;
+    if ( count != 0
+         && fread(&ik->ik[ik->num_ik], sizeof(VMDInfoIK), count, fp) != count ) {
+      VMD_ERROR = VMDLIB_E_FH;
+      return false;
+    }
+    ik->num_ik += count;
+    size -= sizeof(VMDInfoIK) * count;
+  }
+  // read through stdio and copied at once, counted as both
+  VMDLIB_STAT_STOP(VMDL_STAT_READ, start,
+                   VMDLIB_IK_HEAD_SIZE * (size_t)ik->num_frames
+                   + sizeof(VMDInfoIK) * ik->num_ik);
+  VMDLIB_STAT_STOP(VMDL_STAT_COPY + VMDL_IK, start,
+                   VMDLIB_IK_HEAD_SIZE * (size_t)ik->num_frames
+                   + sizeof(VMDInfoIK) * ik->num_ik);
+  return true;
+}
+
+/**
+ * @brief Initialize memory management and derived data fields of VMDFile
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (storage) how sections of `vf` are stored
+ * @return void
+ */
+void __VMDInitStorage(VMDFile* vf, VMDStorageType storage){
+  vf->index = NULL;
+  vf->curves = NULL;
+  vf->names = NULL;
+  vf->lazy = NULL;
+  vf->owns_names = false;
+  vf->storage = storage;
+  vf->map_flags = 0;
+  vf->map_addr = NULL;
+  vf->map_size = 0;
+  vf->dirty = 0;
+  vf->resized = 0;
+  memset(vf->edited, 0, sizeof(vf->edited));
+  memset(&vf->source, 0, sizeof(VMDFileId));
+}
+
+/**
+ * @brief Get identity of a file on disk
+ *  Internally called function. Taken before a file is read, so that the
+ *  file changing while it is read shows as a different identity later.
+ * @param (fname) file name
+ * @param (id) [out] identity, all 0 on failure
+ * @return boolean : false if the file cannot be found
+ */
+static bool __VMDGetFileId(const char* fname, VMDFileId* id){
+#ifdef _WIN32
+  struct _stat64 st;
+
+  memset(id, 0, sizeof(VMDFileId));
+  if ( _stat64(fname, &st) != 0 ) return false;
+  id->dev = (uint64_t)st.st_dev;
+  id->ino = (uint64_t)st.st_ino;
+  id->mtime = (int64_t)st.st_mtime * 1000000000;
+#else
+  struct stat st;
+
+  memset(id, 0, sizeof(VMDFileId));
+  if ( stat(fname, &st) != 0 ) return false;
+  id->dev = (uint64_t)st.st_dev;
+  id->ino = (uint64_t)st.st_ino;
+#ifdef __APPLE__
+  id->mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000
+    + st.st_mtimespec.tv_nsec;
+#else
+  id->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+  id->size = (uint64_t)st.st_size;
+  return true;
+}
+
+/**
+ * @brief Set number of frames and frames of a section
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (type) which section to set
+ * @param (num) number of frames
+ * @param (frames) head of the frames
+ * @return void
+ */
+static void __VMDSetSection(VMDFile* vf, VMDStructType type, uint32_t num,
+                            void* frames){
+  switch(type){
+    case VMDL_BONE:
+      vf->bone_frames.num_frames = num;
+      vf->bone_frames.frames = frames; break;
+    case VMDL_MORPH:
+      vf->morph_frames.num_frames = num;
+      vf->morph_frames.frames = frames; break;
+    case VMDL_CAMERA:
+      vf->camera_frames.num_frames = num;
+      vf->camera_frames.frames = frames; break;
+    case VMDL_LIGHT:
+      vf->light_frames.num_frames = num;
+      vf->light_frames.frames = frames; break;
+    case VMDL_SHADOW:
+      vf->shadow_frames.num_frames = num;
+      vf->shadow_frames.frames = frames; break;
+    case VMDL_IK:
+      vf->ik_frames.num_frames = num;
+      vf->ik_frames.frames = frames; break;
+  }
+}
+
+/**
+ * @brief Get frames of a section
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (type) which section to get
+ * @return head of the frames
+ */
+static void* __VMDGetSection(VMDFile* vf, VMDStructType type){
+  switch(type){
+    case VMDL_BONE:   return vf->bone_frames.frames;
+    case VMDL_MORPH:  return vf->morph_frames.frames;
+    case VMDL_CAMERA: return vf->camera_frames.frames;
+    case VMDL_LIGHT:  return vf->light_frames.frames;
+    case VMDL_SHADOW: return vf->shadow_frames.frames;
+    case VMDL_IK:     return vf->ik_frames.frames;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Get number of frames of a section
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (type) which section to get
+ * @return number of frames
+ */
+static uint32_t __VMDGetNumFrames(VMDFile* vf, VMDStructType type){
+  switch(type){
+    case VMDL_BONE:   return vf->bone_frames.num_frames;
+    case VMDL_MORPH:  return vf->morph_frames.num_frames;
+    case VMDL_CAMERA: return vf->camera_frames.num_frames;
+    case VMDL_LIGHT:  return vf->light_frames.num_frames;
+    case VMDL_SHADOW: return vf->shadow_frames.num_frames;
+    case VMDL_IK:     return vf->ik_frames.num_frames;
+  }
+  return 0;
+}
+
+static bool __VMDReadAtMemory(void* src, size_t pos, void* dst, size_t len){
+  memcpy(dst, (const char*)src + pos, len);
+  return true;
+}
+
+static bool __VMDReadAtFile(void* src, size_t pos, void* dst, size_t len){
+  bool ok;
+  VMDLIB_STAT_START(start);
+
+  ok = fseek((FILE*)src, (long)pos, SEEK_SET) == 0
+       && fread(dst, len, 1, (FILE*)src) == 1;
+  VMDLIB_STAT_STOP(VMDL_STAT_READ, start, ok ? len : 0);
+  return ok;
+}
+
+/**
+ * @brief Check header and locate every section from the count prefixes
+ *  Internally called function. Only the header and the count prefixes are
+ *  read. The size of each section is validated against the data once, with
+ *  a division instead of a multiplication so that a broken count cannot
+ *  overflow, therefore frames can be copied in bulk afterwards without
+ *  further checks. Sections missing at the end of the data (files saved by
+ *  MMD v6.19 end after light section, v7.39 after self shadow section) are
+ *  treated as empty. ShowIK records are variable length, only their minimum
+ *  size is validated here.
+ * @param (read) function to read `src`
+ * @param (src) memory or FILE*
+ * @param (size) size of the whole data
+ * @param (header) [out] header of the data
+ * @param (layout) [out] location of the sections
+ * @return boolean : false with VMD_ERROR set if data is not valid VMD
+ */
+static bool __VMDScanLayout(VMDReadAtFunc read, void* src, size_t size,
+                            VMDHeader* header, VMDLayout* layout){
+  size_t pos = sizeof(VMDHeader);
+  uint32_t num;
+  VMDLIB_STAT_START(start);
+
+  if ( size < sizeof(VMDHeader) ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+  if ( read(src, 0, header, sizeof(VMDHeader)) == false ) {
+    VMD_ERROR = VMDLIB_E_FH;
+    return false;
+  }
+  if ( __VMDCheckHeader(header) == false ) {
+    DEBUG_PRINT("The file is not VMD file!\n");
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+
+  layout->size = size;
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    layout->num_frames[i] = 0;
+    layout->offset[i] = size;
+    if ( size - pos < sizeof(uint32_t) ) {
+      // a legacy file may end only where a whole section is missing
+      if ( pos != size || i <= VMDL_LIGHT ) {
+        DEBUG_PRINT("The file ends in section %zu\n", i);
+        VMD_ERROR = VMDLIB_E_FT;
+        return false;
+      }
+      continue;
+    }
+    if ( read(src, pos, &num, sizeof(num)) == false ) {
+      VMD_ERROR = VMDLIB_E_FH;
+      return false;
+    }
+    pos += sizeof(uint32_t);
+    if ( (size - pos) / __VMD_FRAME_SIZE[i] < num ) {
+      DEBUG_PRINT("Section %zu exceeds the file, %u frames\n", i, num);
+      VMD_ERROR = VMDLIB_E_FT;
+      return false;
+    }
+    layout->num_frames[i] = num;
+    layout->offset[i] = pos;
+    pos += __VMD_FRAME_SIZE[i] * num;
+  }
+  VMDLIB_STAT_STOP(VMDL_STAT_HEADER, start, size);
+  return true;
+}
+
+/**
+ * @brief Leave sections out of layout
+ *  Internally called function. Skipped sections look empty to the loaders,
+ *  so they are neither allocated nor read.
+ * @param (layout) [in,out] location of the sections
+ * @param (skip) VMDLIB_SECTION() of sections to be skipped
+ * @return void
+ */
+static void __VMDMaskLayout(VMDLayout* layout, uint32_t skip){
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    if ( (skip & VMDLIB_SECTION(i)) == 0 ) continue;
+    layout->num_frames[i] = 0;
+    layout->offset[i] = layout->size;
+  }
+}
+
+/**
+ * @brief Open file and get its size
+ *  Internally called function
+ * @param (fname) file name to be opened
+ * @param (size) [out] size of the file
+ * @return file handler, or NULL with VMD_ERROR set
+ */
+static FILE* __VMDOpenFile(const char* fname, size_t* size){
+  FILE* fp;
+  long fsize;
+
+  fp = fopen(fname, "rb");
+  if ( fp == NULL ) {
+    DEBUG_PRINT("File open error.\n");
+    VMD_ERROR = VMDLIB_E_FH;
+    return NULL;
+  }
+  if ( fseek(fp, 0, SEEK_END) != 0 || (fsize = ftell(fp)) < 0 ) {
+    VMD_ERROR = VMDLIB_E_FH;
+    fclose(fp);
+    return NULL;
+  }
+  *size = (size_t)fsize;
+  return fp;
+}
+
+/**
+ * @brief Allocate empty VMDFile whose sections are sized by layout
+ *  Internally called function. Each section is allocated separately
+ *  (VMDL_STORAGE_HEAP) and the pool of IK on/off entries is sized by
+ *  __VMDIKPoolBound().
+ * @param (header) header to be set
+ * @param (layout) location of the sections
+ * @param (ik_bound) [out] capacity of the pool of IK on/off entries
+ * @return pointer of VMDFile, or NULL with VMD_ERROR set
+ */
+static VMDFile* __VMDAllocFromLayout(const VMDHeader* header,
+                                     const VMDLayout* layout,
+                                     uint32_t* ik_bound){
+  VMDFile* vf;
+  void* frames;
+  uint32_t num;
+
+  vf = __VMDMalloc(sizeof(VMDFile));
+  if ( vf == NULL ){
+    DEBUG_PRINT("Insufficient memory.\n");
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  __VMDInitStorage(vf, VMDL_STORAGE_HEAP);
+  vf->header = *header;
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    __VMDSetSection(vf, (VMDStructType)i, 0, NULL);
+  }
+  vf->ik_frames.num_ik = 0;
+  vf->ik_frames.ik = NULL;
+  *ik_bound = 0;
+
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    num = layout->num_frames[i];
+    if ( num == 0 ) continue;
+    frames = __VMDMalloc((i == VMDL_IK ? sizeof(VMDIKSingleFrame)
+                                       : __VMD_FRAME_SIZE[i]) * num);
+    if ( frames == NULL ) {
+      DEBUG_PRINT("Insufficient memory.\n");
+      VMD_ERROR = VMDLIB_E_ME;
+      VMDReleaseVMDFile(vf);
+      return NULL;
+    }
+    __VMDSetSection(vf, (VMDStructType)i, num, frames);
+  }
+
+  if ( layout->num_frames[VMDL_IK] != 0 ) {
+    *ik_bound = __VMDIKPoolBound(layout->size - layout->offset[VMDL_IK],
+                                 layout->num_frames[VMDL_IK]);
+    vf->ik_frames.ik = __VMDMalloc(sizeof(VMDInfoIK)
+                                   * (*ik_bound == 0 ? 1 : *ik_bound));
+    if ( vf->ik_frames.ik == NULL ) {
+      DEBUG_PRINT("Insufficient memory.\n");
+      VMD_ERROR = VMDLIB_E_ME;
+      VMDReleaseVMDFile(vf);
+      return NULL;
+    }
+  }
+  return vf;
+}
+
+/**
+ * @brief Shrink the pool of IK on/off entries to the parsed size
+ *  Internally called function
+ * @param (ik) section parsed with a pool sized by __VMDIKPoolBound()
+ * @param (bound) capacity of the pool
+ * @return void
+ */
+static void __VMDShrinkIKPool(VMDIKFrames* ik, uint32_t bound){
+  VMDInfoIK* shrunk;
+  // the bound is loose when something follows the section
+  if ( ik->num_ik != 0 && ik->num_ik < bound ) {
+    shrunk = realloc(ik->ik, sizeof(VMDInfoIK) * ik->num_ik);
+    if ( shrunk != NULL ) ik->ik = shrunk;
+  }
+}
+
+/**
+ * @note You must release returned pointer by VMDReleaseVMDFile()
+ *       after you used it
+ * @brief Create VMD structure without frames
+ *  Sections are allocated by malloc(), so frames can be added by VMDImport().
+ * @param (model_name) Shift-JIS model name, up to 20 bytes, or NULL
+ * @return pointer of VMDFile, or NULL with VMD_ERROR set
+ */
+VMDFile* VMDCreateVMDFile(const char* model_name){
+  VMDFile* vf = __VMDMalloc(sizeof(VMDFile));
+
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  __VMDInitStorage(vf, VMDL_STORAGE_HEAP);
+  memset(&vf->header, 0, sizeof(VMDHeader));
+  memcpy(vf->header.header, VMDLIB_MAGIC, sizeof(vf->header.header));
+  if ( model_name != NULL ) {
+    memcpy(vf->header.model_name, model_name,
+           __VMDNameLength(model_name, sizeof(vf->header.model_name)));
+  }
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    __VMDSetSection(vf, (VMDStructType)i, 0, NULL);
+  }
+  vf->ik_frames.num_ik = 0;
+  vf->ik_frames.ik = NULL;
+  return vf;
+}
+
+/**
+ * @note You must release returned pointer by VMDReleaseVMDFile()
+ *       after you used it
+ * @brief Load VMD data on memory and create VMD structure
+ *  Sizes of all sections are validated before anything is copied, so
+ *  broken or malicious data never makes this function read past `size`.
+ * @param (data) VMD data
+ * @param (size) size of the data
+ * @return pointer of VMDFile created inside this function
+ * @sa VMDLoadFromFile
+ */
+VMDFile* VMDLoadFromMemory(const void* data, size_t size){
+  VMDHeader header;
+  VMDLayout layout;
+  VMDFile* vf = NULL;
+  uint32_t ik_bound;
+  size_t ik_size;
+
+  if ( data == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  if ( __VMDScanLayout(__VMDReadAtMemory, (void*)data, size, &header,
+                       &layout) == false ) {
+    return NULL;
+  }
+  vf = __VMDAllocFromLayout(&header, &layout, &ik_bound);
+  if ( vf == NULL ) return NULL;
+
+  // validated by __VMDScanLayout(), just copy
+  for ( size_t i = 0; i < VMDL_IK; i++ ) {
+    if ( layout.num_frames[i] == 0 ) continue;
+    VMDLIB_STAT_START(start);
+    memcpy(__VMDGetSection(vf, (VMDStructType)i),
+           (const char*)data + layout.offset[i],
+           __VMD_FRAME_SIZE[i] * layout.num_frames[i]);
+    VMDLIB_STAT_STOP(VMDL_STAT_COPY + i, start,
+                     __VMD_FRAME_SIZE[i] * layout.num_frames[i]);
+  }
+
+  // ShowIK records are variable length
+  if ( __VMDParseIK((const char*)data + layout.offset[VMDL_IK],
+                    size - layout.offset[VMDL_IK], &vf->ik_frames,
+                    ik_bound, &ik_size) == false ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    VMDReleaseVMDFile(vf);
+    return NULL;
+  }
+  __VMDShrinkIKPool(&vf->ik_frames, ik_bound);
+  return vf;
+}
+
+/**
+ * @brief Remember sections to be read later
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile whose sections in `layout` are empty
+ * @param (fname) file name the sections are read from
+ * @param (layout) location of the sections, skipped ones are masked out
+ * @return bool : false with VMD_ERROR set if memory is insufficient
+ */
+static bool __VMDAttachLazy(VMDFile* vf, const char* fname,
+                            const VMDLayout* layout){
+  VMDLazyLoad* lazy;
+  uint32_t pending = 0;
+  size_t len;
+
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    if ( layout->num_frames[i] != 0 ) pending |= VMDLIB_SECTION(i);
+  }
+  if ( pending == 0 ) return true;
+  len = strlen(fname) + 1;
+  lazy = __VMDMalloc(sizeof(VMDLazyLoad) + len);
+  if ( lazy == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  lazy->fname = (char*)(lazy + 1);
+  memcpy(lazy->fname, fname, len);
+  lazy->layout = *layout;
+  lazy->pending = pending;
+  vf->lazy = lazy;
+  return true;
+}
+
+/**
+ * @brief Load VMD file into sections allocated separately
+ *  Internally called function, see VMDLoadFromFile()
+ * @param (fname) VMD file name to be read
+ * @param (skip) VMDLIB_SECTION() of sections left empty
+ * @param (lazy) read sections on first use instead (VMDLIB_LOAD_LAZY)
+ * @return pointer of VMDFile, or NULL with VMD_ERROR set
+ */
+static VMDFile* __VMDLoadFile(const char* fname, uint32_t skip, bool lazy){
+  FILE *fp = NULL;
+  size_t fsize;
+  VMDHeader header;
+  VMDLayout layout;
+  VMDLayout pending;
+  VMDFile* vf = NULL;
+  uint32_t ik_bound;
+  size_t size;
+  VMDFileId id;
+
+  // open file and check
+  __VMDGetFileId(fname, &id);
+  fp = __VMDOpenFile(fname, &fsize);
+  if ( fp == NULL ) return NULL;
+  if ( __VMDScanLayout(__VMDReadAtFile, fp, fsize, &header, &layout)
+       == false ) {
+    fclose(fp);
+    return NULL;
+  }
+  __VMDMaskLayout(&layout, skip);
+  if ( lazy ) {
+    // only the header and the counts are read now
+    pending = layout;
+    __VMDMaskLayout(&layout, VMDLIB_SECTION_ALL);
+  }
+  vf = __VMDAllocFromLayout(&header, &layout, &ik_bound);
+  if ( vf == NULL ) {
+    fclose(fp);
+    return NULL;
+  }
+
+  for ( size_t i = 0; i < VMDL_IK; i++ ) {
+    size = __VMD_FRAME_SIZE[i] * layout.num_frames[i];
+    if ( size == 0 ) continue;
+    VMDLIB_STAT_START(start);
+    if ( __VMDReadAtFile(fp, layout.offset[i],
+                         __VMDGetSection(vf, (VMDStructType)i),
+                         size) == false ) {
+      DEBUG_PRINT("File read error\n");
+      VMD_ERROR = VMDLIB_E_FH;
+      fclose(fp);
+      VMDReleaseVMDFile(vf);
+      return NULL;
+    }
+    VMDLIB_STAT_STOP(VMDL_STAT_COPY + i, start, size);
+  }
+
+  // ShowIK records are variable length
+  if ( vf->ik_frames.num_frames != 0 ) {
+    if ( fseek(fp, (long)layout.offset[VMDL_IK], SEEK_SET) != 0 ) {
+      VMD_ERROR = VMDLIB_E_FH;
+      fclose(fp);
+      VMDReleaseVMDFile(vf);
+      return NULL;
+    }
+    if ( __VMDReadIK(fp, fsize - layout.offset[VMDL_IK], &vf->ik_frames,
+                     ik_bound) == false ) {
+      fclose(fp);
+      VMDReleaseVMDFile(vf);
+      return NULL;
+    }
+    __VMDShrinkIKPool(&vf->ik_frames, ik_bound);
+  }
+  fclose(fp);
+  if ( lazy && __VMDAttachLazy(vf, fname, &pending) == false ) {
+    VMDReleaseVMDFile(vf);
+    return NULL;
+  }
+  vf->source = id;
+  return vf;
+}
+
+/**
+ * @note You must release returned pointer by VMDReleaseVMDFile()
+ *       after you used it
+ * @brief Load VMD file and create VMD structure
+ *  The count prefixes are read first and validated against the size of the
+ *  file, then each section is read directly into its own memory.
+ * @param (fname) VMD file name to be read
+ * @return pointer of VMDFile created inside this function
+ */
+VMDFile* VMDLoadFromFile(const char* fname){
+  return __VMDLoadFile(fname, 0, false);
+}
+
+/**
+ * @brief Read sections of a lazily loaded file
+ *  Sections of a file loaded with VMDLIB_LOAD_LAZY are empty until they are
+ *  read by this function. Functions of the library which use frames call
+ *  it for the sections they need, so it is needed only before accessing
+ *  frames of VMDFile directly. Does nothing for sections already read and
+ *  for files not loaded lazily.
+ * @param (vf) a pointer to VMDFile
+ * @param (sections) VMDLIB_SECTION() of sections to be read
+ * @return bool : false with VMD_ERROR set on failure, VMDLIB_E_FT if the
+ *         file has changed since it was loaded
+ */
+bool VMDLoadSections(VMDFile* vf, uint32_t sections){
+  VMDLazyLoad* lazy;
+  const VMDLayout* layout;
+  VMDIKFrames ik;
+  FILE* fp;
+  size_t fsize, size;
+  uint32_t todo, num, ik_bound;
+  void* frames;
+
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  lazy = vf->lazy;
+  if ( lazy == NULL || (lazy->pending & sections) == 0 ) return true;
+  todo = lazy->pending & sections;
+  layout = &lazy->layout;
+
+  fp = __VMDOpenFile(lazy->fname, &fsize);
+  if ( fp == NULL ) return false;
+  if ( fsize != layout->size ) {
+    DEBUG_PRINT("%s has changed since it was loaded\n", lazy->fname);
+    VMD_ERROR = VMDLIB_E_FT;
+    fclose(fp);
+    return false;
+  }
+
+  for ( size_t i = 0; i < VMDL_IK; i++ ) {
+    if ( (todo & VMDLIB_SECTION(i)) == 0 ) continue;
+    num = layout->num_frames[i];
+    size = __VMD_FRAME_SIZE[i] * num;
+    frames = __VMDMalloc(size);
+    if ( frames == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      fclose(fp);
+      return false;
+    }
+    VMDLIB_STAT_START(start);
+    if ( __VMDReadAtFile(fp, layout->offset[i], frames, size) == false ) {
+      VMD_ERROR = VMDLIB_E_FH;
+      free(frames);
+      fclose(fp);
+      return false;
+    }
+    VMDLIB_STAT_STOP(VMDL_STAT_COPY + i, start, size);
+    __VMDSetSection(vf, (VMDStructType)i, num, frames);
+    lazy->pending &= ~VMDLIB_SECTION(i);
+  }
+
+  if ( todo & VMDLIB_SECTION(VMDL_IK) ) {
+    ik.num_frames = layout->num_frames[VMDL_IK];
+    ik_bound = __VMDIKPoolBound(fsize - layout->offset[VMDL_IK], ik.num_frames);
+    ik.frames = __VMDMalloc(sizeof(VMDIKSingleFrame) * ik.num_frames);
+    ik.ik = __VMDMalloc(sizeof(VMDInfoIK) * (ik_bound == 0 ? 1 : ik_bound));
+    if ( ik.frames == NULL || ik.ik == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+    } else if ( fseek(fp, (long)layout->offset[VMDL_IK], SEEK_SET) != 0 ) {
+      VMD_ERROR = VMDLIB_E_FH;
+    } else if ( __VMDReadIK(fp, fsize - layout->offset[VMDL_IK], &ik,
+                            ik_bound) ) {
+      __VMDShrinkIKPool(&ik, ik_bound);
+      vf->ik_frames = ik;
+      lazy->pending &= ~VMDLIB_SECTION(VMDL_IK);
+    }
+    if ( lazy->pending & VMDLIB_SECTION(VMDL_IK) ) {
+      free(ik.frames);
+      free(ik.ik);
+      fclose(fp);
+      return false;
+    }
+  }
+  fclose(fp);
+
+  if ( lazy->pending == 0 ) {
+    free(lazy);
+    vf->lazy = NULL;
+  }
+  return true;
+}
+
+/**
+ * @brief Get number of frames of a section
+ *  Counts of sections not read yet (VMDLIB_LOAD_LAZY) are known as well.
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section
+ * @return number of frames
+ */
+uint32_t VMDGetNumFrames(VMDFile* vf, VMDStructType type){
+  if ( vf == NULL || type > VMDL_IK ) return 0;
+  if ( vf->lazy != NULL && (vf->lazy->pending & VMDLIB_SECTION(type)) ) {
+    return vf->lazy->layout.num_frames[type];
+  }
+  return __VMDGetNumFrames(vf, type);
+}
+
+/**
+ * @brief Read only header and counts of sections of VMD file
+ *  The file is read without buffering, so only a few dozens of bytes are
+ *  read however large the file is.
+ * @param (fname) VMD file name to be read
+ * @param (st) [out] header and counts
+ * @return VMDStatus : VMDLIB_OK, or VMDLIB_E_* on failure
+ */
+VMDStatus VMDStatFile(const char* fname, VMDFileStat* st){
+  VMDLayout layout;
+  FILE* fp;
+  long fsize;
+
+  if ( fname == NULL || st == NULL ) return VMD_ERROR = VMDLIB_E_IV;
+  fp = fopen(fname, "rb");
+  if ( fp == NULL ) return VMD_ERROR = VMDLIB_E_FH;
+  setvbuf(fp, NULL, _IONBF, 0);
+  if ( fseek(fp, 0, SEEK_END) != 0 || (fsize = ftell(fp)) < 0 ) {
+    fclose(fp);
+    return VMD_ERROR = VMDLIB_E_FH;
+  }
+  if ( __VMDScanLayout(__VMDReadAtFile, fp, (size_t)fsize, &st->header,
+                       &layout) == false ) {
+    fclose(fp);
+    return VMD_ERROR;
+  }
+  fclose(fp);
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    st->num_frames[i] = layout.num_frames[i];
+  }
+  st->size = (uint64_t)fsize;
+  return VMDLIB_OK;
+}
+
+/**
+ * @brief Unmap file mapped by __VMDMapWholeFile()
+ *  Internally called function
+ * @param (addr) head of the mapping
+ * @param (size) size of the mapping
+ * @return void
+ */
+void __VMDUnmap(void* addr, size_t size){
+#ifdef _WIN32
+  (void)size;
+  UnmapViewOfFile(addr);
+#else
+  munmap(addr, size);
+#endif
+}
+
+/**
+ * @brief Map whole file into memory
+ *  Internally called function
+ * @param (fname) file name to be mapped
+ * @param (cow) map pages as writable copy-on-write instead of read-only
+ * @param (size) [out] size of the mapping
+ * @return head of the mapping, or NULL with VMD_ERROR set
+ */
+void* __VMDMapWholeFile(const char* fname, bool cow, size_t* size){
+  void* addr = NULL;
+#ifdef _WIN32
+  HANDLE fh, mh;
+  LARGE_INTEGER fsize;
+
+  fh = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                   FILE_ATTRIBUTE_NORMAL, NULL);
+  if ( fh == INVALID_HANDLE_VALUE ) {
+    DEBUG_PRINT("File open error.\n");
+    VMD_ERROR = VMDLIB_E_FH;
+    return NULL;
+  }
+  if ( GetFileSizeEx(fh, &fsize) == 0 || (uint64_t)fsize.QuadPart > SIZE_MAX ) {
+    CloseHandle(fh);
+    VMD_ERROR = VMDLIB_E_FH;
+    return NULL;
+  }
+  *size = (size_t)fsize.QuadPart;
+  if ( *size < sizeof(VMDHeader) ) {
+    CloseHandle(fh);
+    VMD_ERROR = VMDLIB_E_FT;
+    return NULL;
+  }
+  mh = CreateFileMappingA(fh, NULL, cow ? PAGE_WRITECOPY : PAGE_READONLY,
+                          0, 0, NULL);
+  if ( mh != NULL ) {
+    addr = MapViewOfFile(mh, cow ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mh);
+  }
+  CloseHandle(fh);
+  if ( addr == NULL ) {
+    DEBUG_PRINT("File map error.\n");
+    VMD_ERROR = VMDLIB_E_FH;
+    return NULL;
+  }
+#else
+  int fd;
+  struct stat st;
+
+  fd = open(fname, O_RDONLY);
+  if ( fd < 0 ) {
+    DEBUG_PRINT("File open error.\n");
+    VMD_ERROR = VMDLIB_E_FH;
+    return NULL;
+  }
+  if ( fstat(fd, &st) != 0 || (uint64_t)st.st_size > SIZE_MAX ) {
+    close(fd);
+    VMD_ERROR = VMDLIB_E_FH;
+    return NULL;
+  }
+  *size = (size_t)st.st_size;
+  if ( *size < sizeof(VMDHeader) ) {
+    close(fd);
+    VMD_ERROR = VMDLIB_E_FT;
+    return NULL;
+  }
+  // a private mapping never writes back to the file, so writable pages of
+  // copy-on-write mode are just copied when they are modified
+  addr = mmap(NULL, *size, cow ? PROT_READ | PROT_WRITE : PROT_READ,
+              MAP_PRIVATE, fd, 0);
+  close(fd);
+  if ( addr == MAP_FAILED ) {
+    DEBUG_PRINT("File map error.\n");
+    VMD_ERROR = VMDLIB_E_FH;
+    return NULL;
+  }
+#endif
+  return addr;
+}
+
+/**
+ * @brief Map VMD file, leaving out sections
+ *  Internally called function, see VMDMapFile()
+ * @param (fname) VMD file name to be mapped
+ * @param (flags) VMDLIB_MAP_*
+ * @param (skip) VMDLIB_SECTION() of sections left empty
+ * @return pointer of VMDFile, or NULL with VMD_ERROR set
+ */
+static VMDFile* __VMDMapFile(const char* fname, int flags, uint32_t skip){
+  char* base = NULL;
+  size_t size = 0;
+  VMDLayout layout;
+  VMDFile* vf = NULL;
+  VMDIKFrames* ik = NULL;
+  uint32_t ik_bound;
+  size_t ik_size;
+  VMDFileId id;
+
+  __VMDGetFileId(fname, &id);
+  base = __VMDMapWholeFile(fname, (flags & VMDLIB_MAP_COW) != 0, &size);
+  if ( base == NULL ) {
+    return NULL;
+  }
+
+  vf = __VMDMalloc(sizeof(VMDFile));
+  if ( vf == NULL ){
+    DEBUG_PRINT("Insufficient memory.\n");
+    VMD_ERROR = VMDLIB_E_ME;
+    __VMDUnmap(base, size);
+    return NULL;
+  }
+  __VMDInitStorage(vf, VMDL_STORAGE_MMAP);
+  vf->map_flags = flags;
+  vf->map_addr = base;
+  vf->map_size = size;
+  ik = &vf->ik_frames;
+  ik->num_frames = 0;
+  ik->frames = NULL;
+  ik->num_ik = 0;
+  ik->ik = NULL;
+
+  if ( __VMDScanLayout(__VMDReadAtMemory, base, size, &vf->header, &layout)
+       == false ) {
+    VMDReleaseVMDFile(vf);
+    return NULL;
+  }
+  __VMDMaskLayout(&layout, skip);
+  for ( size_t i = 0; i < VMDL_IK; i++ ) {
+    __VMDSetSection(vf, (VMDStructType)i, layout.num_frames[i],
+                    layout.num_frames[i] == 0 ? NULL : base + layout.offset[i]);
+  }
+
+  // ShowIK records are variable length, so they are parsed into memory
+  ik->num_frames = layout.num_frames[VMDL_IK];
+  if ( ik->num_frames != 0 ) {
+    ik_bound = __VMDIKPoolBound(size - layout.offset[VMDL_IK], ik->num_frames);
+    ik->frames = __VMDMalloc(sizeof(VMDIKSingleFrame) * ik->num_frames);
+    ik->ik = __VMDMalloc(sizeof(VMDInfoIK) * (ik_bound == 0 ? 1 : ik_bound));
+    if ( ik->frames == NULL || ik->ik == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      VMDReleaseVMDFile(vf);
+      return NULL;
+    }
+    if ( __VMDParseIK(base + layout.offset[VMDL_IK],
+                      size - layout.offset[VMDL_IK], ik, ik_bound,
+                      &ik_size) == false ) {
+      VMD_ERROR = VMDLIB_E_FT;
+      VMDReleaseVMDFile(vf);
+      return NULL;
+    }
+    __VMDShrinkIKPool(ik, ik_bound);
+  }
+  vf->source = id;
+  return vf;
+}
+
+/**
+ * @note You must release returned pointer by VMDReleaseVMDFile()
+ *       after you used it
+ * @brief Map VMD file into memory and create VMD structure without copy
+ *  Since frame structures are packed in the same layout as the file, frames
+ *  of each section point straight into the mapping instead of being copied.
+ *  The mapping is read-only by default. With VMDLIB_MAP_COW, frames can be
+ *  modified (e.g. by VMDSortAllFrames()) and modified pages are copied
+ *  privately, so the file itself is never changed.
+ * @param (fname) VMD file name to be mapped
+ * @param (flags) VMDLIB_MAP_RDONLY or VMDLIB_MAP_COW
+ * @return pointer of VMDFile created inside this function
+ * @sa VMDLoadFromFile
+ */
+VMDFile* VMDMapFile(const char* fname, int flags){
+  return __VMDMapFile(fname, flags, 0);
+}
+
+// Alignment of memory handed out from VMDArena
+#define VMDLIB_ARENA_ALIGN ((size_t)16)
+// Minimum size of a buffer allocated by VMDArena itself
+#define VMDLIB_ARENA_MIN_BLOCK ((size_t)64 * 1024)
+
+// Header of an overflow block of VMDArena, data follows this header
+struct VMDArenaBlock {
+  VMDArenaBlock* next;
+  size_t         pad; // keeps data behind this header aligned
+};
+
+static size_t __VMDAlignUp(size_t size){
+  return (size + VMDLIB_ARENA_ALIGN - 1) & ~(VMDLIB_ARENA_ALIGN - 1);
+}
+
+/**
+ * @brief Initialize arena
+ * @param (arena) arena to be initialized
+ * @param (buf) caller supplied buffer, or NULL to let the arena allocate one
+ * @param (size) size of `buf`, or size to be preallocated when `buf` is NULL
+ * @return void
+ * @note A caller supplied buffer is never freed by the arena
+ */
+void VMDArenaInit(VMDArena* arena, void* buf, size_t size){
+  arena->base = buf;
+  arena->capacity = size;
+  arena->used = 0;
+  arena->owned = false;
+  arena->overflow = NULL;
+  arena->overflow_size = 0;
+  if ( buf == NULL ) {
+    arena->owned = true;
+    arena->capacity = 0;
+    if ( size != 0 ) {
+      arena->base = __VMDMalloc(size);
+      arena->capacity = arena->base == NULL ? 0 : size;
+    }
+  }
 }
 
-int __VMDCompareMorphFrameNumber(const void* a, const void* b){
-  return ((VMDMorphSingleFrame*)a)->frame - ((VMDMorphSingleFrame*)b)->frame;
-}
+/**
+ * @brief Allocate memory from arena
+ *  Returned memory is aligned by 16 bytes and is valid until the arena is
+ *  reset or released.
+ * @param (arena) arena to allocate from
+ * @param (size) bytes to be allocated
+ * @return pointer to allocated memory, or NULL with VMD_ERROR set
+ */
+void* VMDArenaAlloc(VMDArena* arena, size_t size){
+  size_t head;
+  VMDArenaBlock* block;
 
-int __VMDCompareCameraFrameNumber(const void* a, const void* b){
-  return ((VMDCameraSingleFrame*)a)->frame - ((VMDCameraSingleFrame*)b)->frame;
-}
+  if ( arena == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
 
-int __VMDCompareLightFrameNumber(const void* a, const void* b){
-  return ((VMDLightSingleFrame*)a)->frame - ((VMDLightSingleFrame*)b)->frame;
-}
+  // the first allocation of an empty arena decides the size of main buffer
+  if ( arena->owned && arena->base == NULL ) {
+    size_t capacity = size < VMDLIB_ARENA_MIN_BLOCK ? VMDLIB_ARENA_MIN_BLOCK
+                                                    : __VMDAlignUp(size);
+    arena->base = __VMDMalloc(capacity);
+    if ( arena->base == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      return NULL;
+    }
+    arena->capacity = capacity;
+  }
 
-int __VMDCompareShadowFrameNumber(const void* a, const void* b){
-  return ((VMDShadowSingleFrame*)a)->frame - ((VMDShadowSingleFrame*)b)->frame;
-}
+  // align relative to the real address since caller's buffer may be unaligned
+  if ( arena->base != NULL ) {
+    head = __VMDAlignUp((uintptr_t)arena->base + arena->used)
+           - (uintptr_t)arena->base;
+    if ( head <= arena->capacity && arena->capacity - head >= size ) {
+      arena->used = head + size;
+      return arena->base + head;
+    }
+  }
 
-int __VMDCompareIKFrameNumber(const void* a, const void* b){
-  return ((VMDIKSingleFrame*)a)->frame - ((VMDIKSingleFrame*)b)->frame;
+  // main buffer is full, fall back to a dedicated block
+  if ( size > SIZE_MAX - sizeof(VMDArenaBlock) ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  block = __VMDMalloc(sizeof(VMDArenaBlock) + size);
+  if ( block == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  block->next = arena->overflow;
+  arena->overflow = block;
+  arena->overflow_size += size;
+  return (void*)(block + 1);
 }
 
 /**
- * @brief qsort() for VMD Frames
- *  VMD data is constructed by several types of frames e.g. bone, camera, and
- *  so on. These frames are typically not sorted. This function do qsort() for
- *  any type of frames in VMD data by selecting the frame type with one of the
- *  aurguments called `type`.
- * @param (data) same as data for qsort()
- * @param (num) same as num for qsort()
- * @param (size) same as size for qsor()
- * @param (type) specify the type of data choosen from `VMDStructType`
+ * @brief Make all memory of arena reusable
+ *  Everything allocated from the arena, including VMDFile loaded by
+ *  VMDLoadFromFileArena(), becomes invalid. If the arena owns its main
+ *  buffer and some requests overflowed, the main buffer is enlarged so that
+ *  the same workload fits in it next time.
+ * @param (arena) arena to be reset
  * @return void
  */
-void VMDqsort(void* data, size_t num, size_t size, VMDStructType type){
-  void* funcp = NULL;
-  if ( data == NULL ) {
-    DEBUG_PRINT("NULL was passed to %s, type was %d\n", __func__, type);
-    return;
-  }
+void VMDArenaReset(VMDArena* arena){
+  VMDArenaBlock* block;
+  size_t wanted;
 
-  // select which compare function to use
-  switch(type){
-    case VMDL_BONE:
-      funcp = __VMDCompareBoneFrameNumber; break;
-    case VMDL_MORPH:
-      funcp = __VMDCompareMorphFrameNumber; break;
-    case VMDL_CAMERA:
-      funcp = __VMDCompareCameraFrameNumber; break;
-    case VMDL_LIGHT:
-      funcp = __VMDCompareLightFrameNumber; break;
-    case VMDL_SHADOW:
-      funcp = __VMDCompareShadowFrameNumber; break;
-    case VMDL_IK:
-      funcp = __VMDCompareIKFrameNumber; break;
-    default:
-      fprintf( stderr, "%s : invalid type %d\n", __func__, type);
+  if ( arena == NULL ) return;
+  while ( arena->overflow != NULL ) {
+    block = arena->overflow;
+    arena->overflow = block->next;
+    free(block);
   }
-  qsort(data, num, size, funcp);
-  return;
+  if ( arena->owned && arena->overflow_size != 0 ) {
+    wanted = __VMDAlignUp(arena->used) + arena->overflow_size
+             + VMDLIB_ARENA_ALIGN * 8;
+    free(arena->base);
+    arena->base = __VMDMalloc(wanted);
+    arena->capacity = arena->base == NULL ? 0 : wanted;
+  }
+  arena->used = 0;
+  arena->overflow_size = 0;
 }
 
 /**
- * @note You must release returned pointer by VMDReleaseVMDFile()
- *       after you used it
- * @brief Load VMD file and create VMD structure
+ * @brief Release all memory held by arena
+ * @param (arena) arena to be released
+ * @return void
+ */
+void VMDArenaRelease(VMDArena* arena){
+  if ( arena == NULL ) return;
+  VMDArenaReset(arena);
+  if ( arena->owned ) free(arena->base);
+  arena->base = NULL;
+  arena->capacity = 0;
+}
+
+/**
+ * @brief Load VMD file into a single memory block, leaving out sections
+ *  Internally called function, see VMDLoadFromFileArena()
  * @param (fname) VMD file name to be read
- * @return pointer of VMDFile created inside this function
+ * @param (arena) arena to allocate from, or NULL
+ * @param (skip) VMDLIB_SECTION() of sections left empty
+ * @return pointer of VMDFile, or NULL with VMD_ERROR set
  */
-VMDFile* VMDLoadFromFile(const char* fname){
+static VMDFile* __VMDLoadFileArena(const char* fname, VMDArena* arena,
+                                   uint32_t skip){
   FILE *fp = NULL;
-  uint32_t offset = 0;
-  uint32_t cpy_size = 0;
-  char *content = NULL;
-  VMDFile* vf = NULL;
   size_t fsize;
+  VMDHeader header;
+  VMDLayout layout;
+  size_t total, pos, size;
+  char* block = NULL;
+  VMDFile* vf = NULL;
+  VMDIKFrames* ik = NULL;
+  uint32_t ik_bound;
+  VMDFileId id;
 
   // open file and check
-  fp = fopen(fname, "rb");
-  if ( fp == NULL ) {
-    DEBUG_PRINT("File open error.\n");
-    VMD_ERROR = VMDLIB_E_FH;
+  __VMDGetFileId(fname, &id);
+  fp = __VMDOpenFile(fname, &fsize);
+  if ( fp == NULL ) return NULL;
+
+  // pre-pass to size every section
+  if ( __VMDScanLayout(__VMDReadAtFile, fp, fsize, &header, &layout)
+       == false ) {
+    fclose(fp);
     return NULL;
   }
+  __VMDMaskLayout(&layout, skip);
+  total = __VMDAlignUp(sizeof(VMDFile));
+  for ( size_t i = 0; i < VMDL_IK; i++ ) {
+    total += __VMDAlignUp(__VMD_FRAME_SIZE[i] * layout.num_frames[i]);
+  }
+  ik_bound = __VMDIKPoolBound(fsize - layout.offset[VMDL_IK],
+                              layout.num_frames[VMDL_IK]);
+  total += __VMDAlignUp(sizeof(VMDIKSingleFrame) * layout.num_frames[VMDL_IK]);
+  total += __VMDAlignUp(sizeof(VMDInfoIK) * ik_bound);
 
-  // check length of file
-  fseek(fp, 0, SEEK_END);
-  fsize = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-  DEBUG_PRINT("Size of file : %lo\n", fsize);
-
-  // load entire file, then close
-  // After reading whole file data then copy each structure, this is
-  // inefficient especially for memory usage. But read out each structure data
-  // cause fread() warning (unused return value)
-  content = malloc(fsize + 1);
-  if ( content == NULL ){
+  block = arena == NULL ? __VMDMalloc(total) : VMDArenaAlloc(arena, total);
+  if ( block == NULL ) {
     DEBUG_PRINT("Insufficient memory.\n");
     VMD_ERROR = VMDLIB_E_ME;
     fclose(fp);
     return NULL;
   }
+  vf = (VMDFile*)block;
+  __VMDInitStorage(vf, arena == NULL ? VMDL_STORAGE_BLOCK : VMDL_STORAGE_ARENA);
+  vf->header = header;
 
-  if (fread(content, fsize, 1, fp) == 0 ) {
-    DEBUG_PRINT("File read error\n");
-    fclose(fp);
-    VMD_ERROR = VMDLIB_E_FH;
-    fp = NULL;
-    return NULL;
+  // read sections straight into their place
+  pos = __VMDAlignUp(sizeof(VMDFile));
+  for ( size_t i = 0; i < VMDL_IK; i++ ) {
+    size = __VMD_FRAME_SIZE[i] * layout.num_frames[i];
+    if ( size == 0 ) {
+      __VMDSetSection(vf, (VMDStructType)i, 0, NULL);
+      continue;
+    }
+    VMDLIB_STAT_START(start);
+    if ( __VMDReadAtFile(fp, layout.offset[i], block + pos, size) == false ) {
+      DEBUG_PRINT("File read error\n");
+      VMD_ERROR = VMDLIB_E_FH;
+      goto error;
+    }
+    VMDLIB_STAT_STOP(VMDL_STAT_COPY + i, start, size);
+    __VMDSetSection(vf, (VMDStructType)i, layout.num_frames[i], block + pos);
+    pos += __VMDAlignUp(size);
+  }
+
+  // IK on/off entries go to the pool following the record heads
+  ik = &vf->ik_frames;
+  ik->num_frames = layout.num_frames[VMDL_IK];
+  ik->frames = NULL;
+  ik->num_ik = 0;
+  ik->ik = NULL;
+  if ( ik->num_frames != 0 ) {
+    ik->frames = (VMDIKSingleFrame*)(block + pos);
+    pos += __VMDAlignUp(sizeof(VMDIKSingleFrame) * ik->num_frames);
+    ik->ik = (VMDInfoIK*)(block + pos);
+    if ( fseek(fp, (long)layout.offset[VMDL_IK], SEEK_SET) != 0 ) {
+      VMD_ERROR = VMDLIB_E_FH;
+      goto error;
+    }
+    if ( __VMDReadIK(fp, fsize - layout.offset[VMDL_IK], ik, ik_bound)
+         == false ) {
+      goto error;
+    }
   }
   fclose(fp);
-  fp = NULL;
+  vf->source = id;
+  return vf;
 
-  // check file type
-  if ( __VMDCheckHeader(content) == false ){
-    printf("The file is not VMD file!\n");
-    VMD_ERROR = VMDLIB_E_FT;
-    free(content);
-    return NULL;
+error:
+  fclose(fp);
+  if ( arena == NULL ) free(block);
+  return NULL;
+}
+
+/**
+ * @note Release returned pointer by VMDReleaseVMDFile() or, when `arena` is
+ *       given, by VMDArenaReset()/VMDArenaRelease() of the arena
+ * @brief Load VMD file into a single memory block
+ *  Counts of all sections are read in a pre-pass, then the header and all
+ *  sections are read directly into one contiguous block. The block is
+ *  allocated by malloc() when `arena` is NULL, otherwise from `arena`.
+ * @param (fname) VMD file name to be read
+ * @param (arena) arena to allocate from, or NULL
+ * @return pointer of VMDFile created inside this function
+ * @sa VMDLoadFromFile
+ */
+VMDFile* VMDLoadFromFileArena(const char* fname, VMDArena* arena){
+  return __VMDLoadFileArena(fname, arena, 0);
+}
+
+/**
+ * @brief Check that every ShowIK record refers inside the pool
+ *  Internally called function
+ * @param (ik) ShowIK section
+ * @return boolean
+ */
+static bool __VMDCheckIK(const VMDIKFrames* ik){
+  for ( uint32_t i = 0; i < ik->num_frames; i++ ) {
+    if ( ik->frames[i].ik_offset > ik->num_ik
+         || ik->frames[i].ik_count > ik->num_ik - ik->frames[i].ik_offset ) {
+      return false;
+    }
   }
+  return true;
+}
 
-  // Allocate memory and set data. I don't know proper way to do this(same
-  // procedure for differenct type, something like generic functions in C ++),
-  // so codes below are copy-pasted...  I hope someone greate improve this.
-  vf = malloc(sizeof(VMDFile));
-  cpy_size = sizeof(VMDHeader);
-  memcpy((void*)(&vf->header), (const void*)content, cpy_size);
-  offset += cpy_size;
-
-  vf->bone_frames.num_frames = ((VMDBoneFrames*)(content+offset))->num_frames;
-  offset += sizeof(uint32_t);
-  if(vf->bone_frames.num_frames != 0){
-    cpy_size = sizeof(VMDBoneSingleFrame)*vf->bone_frames.num_frames;
-    vf->bone_frames.frames = malloc(cpy_size);
-    memcpy((void*)vf->bone_frames.frames, (const void*)(content+offset), cpy_size);
-    offset += cpy_size;
-  } else {
-    vf->bone_frames.frames = NULL;
+/**
+ * @brief Serialize ShowIK records in the file layout
+ *  Internally called function. Each record head is followed by its IK
+ *  on/off entries.
+ * @param (ik) ShowIK section checked by __VMDCheckIK()
+ * @param (dst) buffer large enough for the records
+ * @return bytes written to `dst`
+ */
+static size_t __VMDSerializeIK(const VMDIKFrames* ik, char* dst){
+  size_t pos = 0;
+  size_t size;
+  for ( uint32_t i = 0; i < ik->num_frames; i++ ) {
+    memcpy(dst + pos, &ik->frames[i], VMDLIB_IK_HEAD_SIZE);
+    pos += VMDLIB_IK_HEAD_SIZE;
+    size = sizeof(VMDInfoIK) * ik->frames[i].ik_count;
+    if ( size != 0 ) memcpy(dst + pos, &ik->ik[ik->frames[i].ik_offset], size);
+    pos += size;
   }
+  return pos;
+}
 
-  vf->morph_frames.num_frames = ((VMDMorphFrames*)(content+offset))->num_frames;
-  offset += sizeof(uint32_t);
-  if(vf->morph_frames.num_frames != 0){
-    cpy_size = sizeof(VMDMorphSingleFrame)*vf->morph_frames.num_frames;
-    vf->morph_frames.frames = malloc(cpy_size);
-    memcpy((void*)vf->morph_frames.frames, (const void*)(content+offset), cpy_size);
-    offset += cpy_size;
-  } else {
-    vf->morph_frames.frames = NULL;
+/**
+ * @brief Bytes of ShowIK section in file, without the count prefix
+ *  Internally called function
+ * @param (ik) ShowIK section
+ * @return size of the records
+ */
+static size_t __VMDIKSize(const VMDIKFrames* ik){
+  size_t size = (size_t)ik->num_frames * VMDLIB_IK_HEAD_SIZE;
+  for ( uint32_t i = 0; i < ik->num_frames; i++ ) {
+    size += sizeof(VMDInfoIK) * ik->frames[i].ik_count;
   }
+  return size;
+}
 
-  vf->camera_frames.num_frames = ((VMDCameraFrames*)(content+offset))->num_frames;
-  offset += sizeof(uint32_t);
-  if(vf->camera_frames.num_frames != 0){
-    cpy_size = sizeof(VMDCameraSingleFrame)*vf->camera_frames.num_frames;
-    vf->camera_frames.frames = malloc(cpy_size);
-    memcpy((void*)vf->camera_frames.frames, (const void*)(content+offset), cpy_size);
-    offset += cpy_size;
-  } else {
-    vf->camera_frames.frames = NULL;
+/**
+ * @brief Calculate exact size of VMD data written by VMDWriteToMemory()
+ * @param (vf) pointer to VMDFile
+ * @return size of the data, or 0 with VMD_ERROR set for an invalid call
+ */
+size_t VMDGetWriteSize(VMDFile* vf){
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return 0;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION_ALL) == false ) return 0;
+  if ( __VMDCheckIK(&vf->ik_frames) == false ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return 0;
   }
+  return sizeof(VMDHeader) + sizeof(uint32_t) * VMDLIB_NUM_SECTIONS
+    + sizeof(VMDBoneSingleFrame) * (size_t)vf->bone_frames.num_frames
+    + sizeof(VMDMorphSingleFrame) * (size_t)vf->morph_frames.num_frames
+    + sizeof(VMDCameraSingleFrame) * (size_t)vf->camera_frames.num_frames
+    + sizeof(VMDLightSingleFrame) * (size_t)vf->light_frames.num_frames
+    + sizeof(VMDShadowSingleFrame) * (size_t)vf->shadow_frames.num_frames
+    + __VMDIKSize(&vf->ik_frames);
+}
 
-  vf->light_frames.num_frames = ((VMDLightFrames*)(content+offset))->num_frames;
-  offset += sizeof(uint32_t);
-  if(vf->light_frames.num_frames != 0){
-    cpy_size = sizeof(VMDLightSingleFrame)*vf->light_frames.num_frames;
-    vf->light_frames.frames = malloc(cpy_size);
-    memcpy((void*)vf->light_frames.frames, (const void*)(content+offset), cpy_size);
-    offset += cpy_size;
-  } else {
-    vf->light_frames.frames = NULL;
+/**
+ * @brief Serialize data into caller's buffer
+ * @param (vf) pointer to VMDFile
+ * @param (buf) buffer to be written
+ * @param (size) size of `buf`, at least VMDGetWriteSize()
+ * @return bytes written, or 0 with VMD_ERROR set
+ */
+size_t VMDWriteToMemory(VMDFile* vf, void* buf, size_t size){
+  char* dst = buf;
+  size_t total, pos = 0;
+  uint32_t num;
+
+  total = VMDGetWriteSize(vf);
+  if ( total == 0 ) return 0;
+  if ( buf == NULL || size < total ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return 0;
   }
 
-  vf->shadow_frames.num_frames = ((VMDShadowFrames*)(content+offset))->num_frames;
-  offset += sizeof(uint32_t);
-  if(vf->shadow_frames.num_frames != 0){
-    cpy_size = sizeof(VMDShadowSingleFrame)*vf->shadow_frames.num_frames;
-    vf->shadow_frames.frames = malloc(cpy_size);
-    memcpy((void*)vf->shadow_frames.frames, (const void*)(content+offset), cpy_size);
-    offset += cpy_size;
-  } else {
-    vf->shadow_frames.frames = NULL;
+  VMDLIB_STAT_START(start);
+  memcpy(dst, &vf->header, sizeof(VMDHeader));
+  pos += sizeof(VMDHeader);
+  for ( size_t i = 0; i < VMDL_IK; i++ ) {
+    num = __VMDGetNumFrames(vf, (VMDStructType)i);
+    memcpy(dst + pos, &num, sizeof(num));
+    pos += sizeof(num);
+    if ( num != 0 ) {
+      memcpy(dst + pos, __VMDGetSection(vf, (VMDStructType)i),
+             __VMD_FRAME_SIZE[i] * num);
+      pos += __VMD_FRAME_SIZE[i] * num;
+    }
+  }
+  num = vf->ik_frames.num_frames;
+  memcpy(dst + pos, &num, sizeof(num));
+  pos += sizeof(num);
+  pos += __VMDSerializeIK(&vf->ik_frames, dst + pos);
+  VMDLIB_STAT_STOP(VMDL_STAT_WRITE, start, pos);
+  return pos;
+}
+
+#ifndef _WIN32
+/**
+ * @brief Write iovecs entirely, continuing after partial writes
+ *  Internally called function
+ * @param (fd) file descriptor
+ * @param (iov) [in,out] iovecs, consumed while writing
+ * @param (cnt) number of iovecs
+ * @return boolean : false with VMD_ERROR set on failure or short write
+ */
+static bool __VMDWritevAll(int fd, struct iovec* iov, int cnt){
+  ssize_t done;
+  while ( cnt > 0 ) {
+    done = writev(fd, iov, cnt);
+    if ( done < 0 && errno == EINTR ) continue;
+    if ( done <= 0 ) {
+      DEBUG_PRINT("File write error.\n");
+      VMD_ERROR = VMDLIB_E_WR;
+      return false;
+    }
+    while ( cnt > 0 && (size_t)done >= iov->iov_len ) {
+      done -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if ( cnt > 0 ) {
+      iov->iov_base = (char*)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return true;
+}
+#endif
+
+/**
+ * @brief Write data into file descriptor
+ *  Header, counts and sections are gathered into a single writev() call
+ *  (a few more only if the kernel writes partially, e.g. to sockets), so the
+ *  frames are never copied. ShowIK records are serialized into one buffer
+ *  beforehand since they are not contiguous in memory.
+ * @param (vf) pointer to VMDFile
+ * @param (fd) file descriptor opened for writing, such as a socket or pipe
+ * @return bool : false with VMD_ERROR set, VMDLIB_E_WR on short write
+ */
+bool VMDWriteToFd(VMDFile* vf, int fd){
+  size_t total;
+  char* ik_buf = NULL;
+  bool ok;
+
+  total = VMDGetWriteSize(vf);
+  if ( total == 0 ) return false;
+#ifdef _WIN32
+  // no writev() on Windows, serialize everything and write it at once
+  {
+    char* buf = __VMDMalloc(total);
+    size_t pos = 0;
+    int done;
+    if ( buf == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      return false;
+    }
+    VMDWriteToMemory(vf, buf, total);
+    ok = true;
+    VMDLIB_STAT_START(start);
+    while ( pos < total ) {
+      done = _write(fd, buf + pos,
+                    total - pos > INT_MAX ? INT_MAX : (unsigned)(total - pos));
+      if ( done <= 0 ) {
+        VMD_ERROR = VMDLIB_E_WR;
+        ok = false;
+        break;
+      }
+      pos += (size_t)done;
+    }
+    VMDLIB_STAT_STOP(VMDL_STAT_WRITE, start, pos);
+    free(buf);
+    (void)ik_buf;
+    return ok;
+  }
+#else
+  {
+    struct iovec iov[VMDLIB_NUM_SECTIONS * 2 + 1];
+    uint32_t counts[VMDLIB_NUM_SECTIONS];
+    size_t ik_size;
+    int cnt = 0;
+    VMDLIB_STAT_START(start);
+
+    ik_size = __VMDIKSize(&vf->ik_frames);
+    if ( ik_size != 0 ) {
+      ik_buf = __VMDMalloc(ik_size);
+      if ( ik_buf == NULL ) {
+        VMD_ERROR = VMDLIB_E_ME;
+        return false;
+      }
+      __VMDSerializeIK(&vf->ik_frames, ik_buf);
+    }
+
+    iov[cnt].iov_base = &vf->header;
+    iov[cnt++].iov_len = sizeof(VMDHeader);
+    for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+      counts[i] = __VMDGetNumFrames(vf, (VMDStructType)i);
+      iov[cnt].iov_base = &counts[i];
+      iov[cnt++].iov_len = sizeof(uint32_t);
+      if ( i == VMDL_IK ) {
+        iov[cnt].iov_base = ik_buf;
+        iov[cnt++].iov_len = ik_size;
+      } else {
+        iov[cnt].iov_base = __VMDGetSection(vf, (VMDStructType)i);
+        iov[cnt++].iov_len = __VMD_FRAME_SIZE[i] * counts[i];
+      }
+    }
+    ok = __VMDWritevAll(fd, iov, cnt);
+    VMDLIB_STAT_STOP(VMDL_STAT_WRITE, start, ok ? total : 0);
+    free(ik_buf);
+    return ok;
   }
+#endif
+}
+
+/**
+ * @note Release returned pointer as described for the loader selected by
+ *       `opt`, VMDReleaseVMDFile() by default
+ * @brief Load VMD file with options
+ *  Selects VMDMapFile(), VMDLoadFromFileArena() or VMDLoadFromFile() by
+ *  `opt`, then builds data derived from frames requested by `opt`.
+ *  Sections in `opt->skip_sections` are left empty without being read.
+ *  With VMDLIB_LOAD_LAZY (and neither mapping nor arena), only the header
+ *  and the counts are read, see VMDLoadSections().
+ * @param (fname) VMD file name to be read
+ * @param (opt) options, or NULL for the same as VMDLoadFromFile()
+ * @return pointer of VMDFile created inside this function
+ */
+VMDFile* VMDLoadFromFileWithOptions(const char* fname,
+                                    const VMDLoadOptions* opt){
+  VMDFile* vf;
 
-  vf->ik_frames.num_frames = ((VMDIKFrames*)(content+offset))->num_frames;
-  offset += sizeof(uint32_t);
-  if(vf->ik_frames.num_frames != 0){
-    cpy_size = sizeof(VMDIKSingleFrame)*vf->ik_frames.num_frames;
-    vf->ik_frames.frames = malloc(cpy_size);
-    memcpy((void*)vf->ik_frames.frames, (const void*)(content+offset), cpy_size);
-    offset += cpy_size;
+  if ( opt == NULL ) return VMDLoadFromFile(fname);
+  if ( opt->flags & VMDLIB_LOAD_MMAP ) {
+    vf = __VMDMapFile(fname, (opt->flags & VMDLIB_LOAD_COW) ? VMDLIB_MAP_COW
+                                                            : VMDLIB_MAP_RDONLY,
+                      opt->skip_sections);
+  } else if ( opt->arena != NULL ) {
+    vf = __VMDLoadFileArena(fname, opt->arena, opt->skip_sections);
   } else {
-    vf->ik_frames.frames = NULL;
+    vf = __VMDLoadFile(fname, opt->skip_sections,
+                       (opt->flags & VMDLIB_LOAD_LAZY) != 0);
   }
+  if ( vf == NULL ) return NULL;
 
-  free(content);
+  if ( (opt->flags & VMDLIB_LOAD_INDEX) && VMDBuildTrackIndex(vf) == false ) {
+    VMDReleaseVMDFile(vf);
+    return NULL;
+  }
+  if ( (opt->flags & VMDLIB_LOAD_CURVES) && VMDBuildCurveTable(vf) == false ) {
+    VMDReleaseVMDFile(vf);
+    return NULL;
+  }
   return vf;
 }
 
+/**
+ * @brief Load VMD file with options, returning status
+ *  Same as VMDLoadFromFileWithOptions(), but the error code of this call
+ *  is returned instead of being left in VMD_ERROR only, so that callers
+ *  on any thread can check it without looking at shared state.
+ * @param (fname) VMD file name to be read
+ * @param (out) [out] pointer of VMDFile, NULL on failure
+ * @param (opt) options, or NULL for the same as VMDLoadFromFile()
+ * @return VMDStatus : VMDLIB_OK, or VMDLIB_E_* on failure
+ */
+VMDStatus VMDLoadFromFileEx(const char* fname, VMDFile** out,
+                            const VMDLoadOptions* opt){
+  VMDStatus status;
+
+  if ( out == NULL ) return VMD_ERROR = VMDLIB_E_IV;
+  VMD_ERROR = VMDLIB_E_INIT;
+  *out = VMDLoadFromFileWithOptions(fname, opt);
+  if ( *out != NULL ) return VMDLIB_OK;
+  status = VMD_ERROR != VMDLIB_E_INIT ? VMD_ERROR : VMDLIB_E_FH;
+  VMD_ERROR = status;
+  return status;
+}
+
+/**
+ * @brief Describe an error code
+ * @param (status) VMDLIB_E_* or VMDLIB_OK
+ * @return static string, never NULL
+ */
+const char* VMDErrorString(VMDStatus status){
+  switch ( status ) {
+    case VMDLIB_E_INIT: return "no error";
+    case VMDLIB_E_FH: return "failed to open or read file";
+    case VMDLIB_E_FT: return "not a valid VMD file";
+    case VMDLIB_E_ME: return "memory allocation error";
+    case VMDLIB_E_WR: return "failed to write";
+    case VMDLIB_E_IV: return "invalid call";
+    default: return "unknown error";
+  }
+}
+
 /**
  * @brief Write data into specified file
  * @param (vf) pointer to VMDFile
  * @param (fname) a name of a file to be written
- * @return bool : succeed or not
+ * @return bool : succeed or not, VMD_ERROR is VMDLIB_E_WR on short write
+ * @sa VMDWriteToFd
  */
 bool VMDWriteToFile(VMDFile *vf, char* fname){
-  FILE *fp;
+  int fd;
+  bool ok;
 
-  if ( vf == NULL ) {
+  if ( vf == NULL || fname == NULL ) {
     VMD_ERROR = VMDLIB_E_IV;
     return false;
   }
 
   // file check
-  fp = fopen(fname, "wb");
-  if ( fp == NULL ) {
+#ifdef _WIN32
+  fd = _open(fname, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+             _S_IREAD | _S_IWRITE);
+#else
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+  if ( fd < 0 ) {
     DEBUG_PRINT("File open error.\n");
     VMD_ERROR = VMDLIB_E_FH;
     return false;
   }
 
-  fwrite(&(vf->header), sizeof(VMDHeader), 1, fp);
-  fwrite(&(vf->bone_frames.num_frames),
-         sizeof(vf->bone_frames.num_frames), 1, fp);
-  if ( vf->bone_frames.frames != NULL ) {
-    fwrite(vf->bone_frames.frames,
-           sizeof(vf->bone_frames.frames[0]), vf->bone_frames.num_frames, fp);
+  ok = VMDWriteToFd(vf, fd);
+#ifdef _WIN32
+  if ( _close(fd) != 0 && ok ) {
+#else
+  if ( close(fd) != 0 && ok ) {
+#endif
+    VMD_ERROR = VMDLIB_E_WR;
+    ok = false;
   }
+  return ok;
+}
+
+/**
+ * @brief Write bytes at a position of a file
+ *  Internally called function
+ * @param (fd) file descriptor opened for writing
+ * @param (pos) position in the file
+ * @param (data) bytes to be written
+ * @param (len) number of bytes
+ * @return boolean : false with VMD_ERROR set on failure or short write
+ */
+static bool __VMDWriteAt(int fd, size_t pos, const void* data, size_t len){
+  const char* p = data;
+#ifdef _WIN32
+  int done;
 
-  fwrite(&(vf->morph_frames.num_frames),
-         sizeof(vf->morph_frames.num_frames), 1, fp);
-  if ( vf->morph_frames.frames != NULL ) {
-    fwrite(vf->morph_frames.frames,
-           sizeof(vf->morph_frames.frames[0]), vf->morph_frames.num_frames, fp);
+  if ( _lseeki64(fd, (__int64)pos, SEEK_SET) < 0 ) {
+    VMD_ERROR = VMDLIB_E_WR;
+    return false;
+  }
+#else
+  ssize_t done;
+#endif
+  while ( len > 0 ) {
+#ifdef _WIN32
+    done = _write(fd, p, len > INT_MAX ? INT_MAX : (unsigned)len);
+#else
+    done = pwrite(fd, p, len, (off_t)pos);
+    if ( done < 0 && errno == EINTR ) continue;
+#endif
+    if ( done <= 0 ) {
+      DEBUG_PRINT("File write error.\n");
+      VMD_ERROR = VMDLIB_E_WR;
+      return false;
+    }
+    p += done;
+    pos += (size_t)done;
+    len -= (size_t)done;
   }
+  return true;
+}
+
+/**
+ * @brief Write sections from one onward at a position of a file
+ *  Internally called function
+ * @param (vf) pointer to VMDFile, all sections loaded
+ * @param (fd) file descriptor opened for writing
+ * @param (first) first section to be written
+ * @param (pos) position of the count of `first` in the file
+ * @return boolean : false with VMD_ERROR set on failure
+ */
+static bool __VMDWriteSectionsAt(VMDFile* vf, int fd, size_t first,
+                                 size_t pos){
+  uint32_t num;
+  size_t size;
+  char* ik_buf;
+  bool ok;
 
-  fwrite(&(vf->camera_frames.num_frames),
-         sizeof(vf->camera_frames.num_frames), 1, fp);
-  if ( vf->camera_frames.frames != NULL ) {
-    fwrite(vf->camera_frames.frames,
-           sizeof(vf->camera_frames.frames[0]), vf->camera_frames.num_frames, fp);
+  for ( size_t i = first; i < VMDL_IK; i++ ) {
+    num = __VMDGetNumFrames(vf, (VMDStructType)i);
+    size = __VMD_FRAME_SIZE[i] * num;
+    if ( __VMDWriteAt(fd, pos, &num, sizeof(uint32_t)) == false
+         || __VMDWriteAt(fd, pos + sizeof(uint32_t),
+                         __VMDGetSection(vf, (VMDStructType)i),
+                         size) == false ) {
+      return false;
+    }
+    pos += sizeof(uint32_t) + size;
+  }
+  num = vf->ik_frames.num_frames;
+  size = __VMDIKSize(&vf->ik_frames);
+  ik_buf = __VMDMalloc(size + 1);
+  if ( ik_buf == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
   }
+  __VMDSerializeIK(&vf->ik_frames, ik_buf);
+  ok = __VMDWriteAt(fd, pos, &num, sizeof(uint32_t))
+    && __VMDWriteAt(fd, pos + sizeof(uint32_t), ik_buf, size);
+  free(ik_buf);
+  return ok;
+}
+
+/**
+ * @brief Save edits of VMDFile into the file it was loaded from
+ *  Writes only what edits (VMDInsertFrame(), VMDUpdateFrame(), sorts, ...)
+ *  have changed since the file was loaded or last saved. Frames edited in
+ *  place are patched at their positions in the file, and if the number of
+ *  frames of a section has changed, the file is rewritten from that
+ *  section onward and truncated. The header is always written.
+ *
+ *  Only the file `vf` was loaded from or last saved to is written in part,
+ *  found by its device, inode, size and modification time taken at load or
+ *  save. The whole motion is written by VMDWriteToFile() instead if `fname`
+ *  is another file, the file has been written by someone else meanwhile,
+ *  or `vf` has not come from a file (VMDCreateVMDFile(), VMDMerge(), ...).
+ *
+ *  Edits are known only as recorded by the functions of the library, so
+ *  frames written directly into `frames[]` must be recorded by
+ *  VMDMarkEdited(), or saved by VMDWriteToFile(), or they are lost.
+ *
+ *  A file mapped by VMDMapFile() can be saved into the mapped file as long
+ *  as no section has been resized, the mapping itself is never written.
+ * @param (vf) pointer to VMDFile
+ * @param (fname) a name of the file to be written, usually the file `vf`
+ *        was loaded from
+ * @return bool : succeed or not, VMD_ERROR is VMDLIB_E_WR on short write
+ */
+bool VMDSaveFile(VMDFile* vf, const char* fname){
+  VMDFileStat st;
+  VMDFileId id;
+  size_t offset[VMDLIB_NUM_SECTIONS];
+  size_t total, pos, first, size, written;
+  uint32_t num;
+  VMDDirtyRange r;
+  int fd;
+  bool ok;
 
-  fwrite(&(vf->light_frames.num_frames),
-         sizeof(vf->light_frames.num_frames), 1, fp);
-  if ( vf->light_frames.frames != NULL ) {
-    fwrite(vf->light_frames.frames,
-           sizeof(vf->light_frames.frames[0]), vf->light_frames.num_frames, fp);
+  if ( vf == NULL || fname == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
   }
+  total = VMDGetWriteSize(vf);
+  if ( total == 0 ) return false;
 
-  fwrite(&(vf->shadow_frames.num_frames),
-         sizeof(vf->shadow_frames.num_frames), 1, fp);
-  if ( vf->shadow_frames.frames != NULL ) {
-    fwrite(vf->shadow_frames.frames,
-           sizeof(vf->shadow_frames.frames[0]), vf->shadow_frames.num_frames, fp);
+  // layout of the motion as a file, and the first section resized
+  pos = sizeof(VMDHeader);
+  first = VMDLIB_NUM_SECTIONS;
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    offset[i] = pos;
+    if ( (vf->resized & VMDLIB_SECTION(i)) && first == VMDLIB_NUM_SECTIONS ) {
+      first = i;
+    }
+    if ( i < VMDL_IK ) {
+      pos += sizeof(uint32_t)
+        + __VMD_FRAME_SIZE[i] * __VMDGetNumFrames(vf, (VMDStructType)i);
+    }
+  }
+  if ( first < VMDLIB_NUM_SECTIONS && vf->storage == VMDL_STORAGE_MMAP ) {
+    DEBUG_PRINT("Resized sections of a mapped file cannot be saved\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
   }
 
-  fwrite(&(vf->ik_frames.num_frames),
-         sizeof(vf->ik_frames.num_frames), 1, fp);
-  if ( vf->ik_frames.frames != NULL ) {
-    fwrite(vf->ik_frames.frames,
-           sizeof(vf->ik_frames.frames[0]), vf->ik_frames.num_frames, fp);
+  // the file must be the one loaded, and sections before `first` must be
+  // where the file has them
+  ok = vf->source.size != 0 && __VMDGetFileId(fname, &id)
+    && memcmp(&id, &vf->source, sizeof(VMDFileId)) == 0
+    && VMDStatFile(fname, &st) == VMDLIB_OK;
+  for ( size_t i = 0; ok && i < first; i++ ) {
+    ok = st.num_frames[i] == __VMDGetNumFrames(vf, (VMDStructType)i);
+  }
+  if ( ok ) {
+    ok = first == VMDLIB_NUM_SECTIONS ? st.size == total
+                                      : st.size >= offset[first];
+  }
+  if ( ok == false ) {
+    if ( VMDWriteToFile(vf, (char*)fname) == false ) return false;
+    goto saved;
   }
 
-  fclose(fp);
-  fp = NULL;
+#ifdef _WIN32
+  fd = _open(fname, _O_WRONLY | _O_BINARY);
+#else
+  fd = open(fname, O_WRONLY);
+#endif
+  if ( fd < 0 ) {
+    DEBUG_PRINT("File open error.\n");
+    VMD_ERROR = VMDLIB_E_FH;
+    return false;
+  }
+  VMDLIB_STAT_START(start);
+  ok = __VMDWriteAt(fd, 0, &vf->header, sizeof(VMDHeader));
+  written = sizeof(VMDHeader);
+  for ( size_t i = 0; ok && i < first; i++ ) {
+    r = vf->edited[i];
+    if ( (vf->dirty & VMDLIB_SECTION(i)) == 0 || r.last == 0 ) continue;
+    num = __VMDGetNumFrames(vf, (VMDStructType)i);
+    if ( r.last > num ) r.last = num;
+    if ( r.first >= r.last ) continue;
+    size = __VMD_FRAME_SIZE[i];
+    ok = __VMDWriteAt(fd, offset[i] + sizeof(uint32_t) + size * r.first,
+                      (char*)__VMDGetSection(vf, (VMDStructType)i)
+                      + size * r.first, size * (r.last - r.first));
+    written += size * (r.last - r.first);
+  }
+  if ( ok && first < VMDLIB_NUM_SECTIONS ) {
+    ok = __VMDWriteSectionsAt(vf, fd, first, offset[first]);
+    written += total - offset[first];
+#ifdef _WIN32
+    if ( ok && _chsize_s(fd, (__int64)total) != 0 ) {
+#else
+    if ( ok && ftruncate(fd, (off_t)total) != 0 ) {
+#endif
+      VMD_ERROR = VMDLIB_E_WR;
+      ok = false;
+    }
+  }
+  VMDLIB_STAT_STOP(VMDL_STAT_WRITE, start, ok ? written : 0);
+#ifdef _WIN32
+  if ( _close(fd) != 0 && ok ) {
+#else
+  if ( close(fd) != 0 && ok ) {
+#endif
+    VMD_ERROR = VMDLIB_E_WR;
+    ok = false;
+  }
+  if ( ok == false ) return false;
 
+saved:
+  vf->dirty = 0;
+  vf->resized = 0;
+  memset(vf->edited, 0, sizeof(vf->edited));
+  __VMDGetFileId(fname, &id);
+  vf->source = id;
   return true;
 }
 
@@ -313,12 +2199,38 @@ void VMDReleaseVMDFile(VMDFile *vf){
     return;
   }
 
+  // data derived from frames
+  VMDReleaseTrackIndex(vf);
+  VMDReleaseCurveTable(vf);
+  if ( vf->owns_names ) VMDReleaseNameTable(vf->names);
+  vf->names = NULL;
+  free(vf->lazy);
+  vf->lazy = NULL;
+
+  switch ( vf->storage ) {
+    case VMDL_STORAGE_MMAP:
+      __VMDUnmap(vf->map_addr, vf->map_size);
+      if (vf->ik_frames.frames != NULL) free(vf->ik_frames.frames);
+      if (vf->ik_frames.ik != NULL) free(vf->ik_frames.ik);
+      free(vf);
+      return;
+    case VMDL_STORAGE_BLOCK:
+      free(vf);
+      return;
+    case VMDL_STORAGE_ARENA:
+      // memory is given back by VMDArenaReset() or VMDArenaRelease()
+      return;
+    default:
+      break;
+  }
+
   if (vf->bone_frames.frames != NULL) free(vf->bone_frames.frames);
   if (vf->morph_frames.frames != NULL) free(vf->morph_frames.frames);
   if (vf->camera_frames.frames != NULL) free(vf->camera_frames.frames);
   if (vf->light_frames.frames != NULL) free(vf->light_frames.frames);
   if (vf->shadow_frames.frames != NULL) free(vf->shadow_frames.frames);
   if (vf->ik_frames.frames != NULL) free(vf->ik_frames.frames);
+  if (vf->ik_frames.ik != NULL) free(vf->ik_frames.ik);
   free(vf);
   return;
 }
@@ -327,24 +2239,317 @@ void VMDReleaseVMDFile(VMDFile *vf){
  * @brief sort all frames of VMDFile
  * @param (vf) a pointer to VMDFile structure
  * @return void
- * @sa VMDqsort
+ * @sa VMDSortBoneFrames
  */
 void VMDSortAllFrames(VMDFile* vf){
-  VMDqsort(vf->bone_frames.frames, vf->bone_frames.num_frames,
-           sizeof(VMDBoneSingleFrame), VMDL_BONE);
-  VMDqsort(vf->morph_frames.frames, vf->morph_frames.num_frames,
-           sizeof(VMDMorphSingleFrame), VMDL_MORPH);
-  VMDqsort(vf->camera_frames.frames, vf->camera_frames.num_frames,
-           sizeof(VMDCameraSingleFrame), VMDL_CAMERA);
-  VMDqsort(vf->light_frames.frames, vf->light_frames.num_frames,
-           sizeof(VMDCameraSingleFrame), VMDL_LIGHT);
-  VMDqsort(vf->shadow_frames.frames, vf->shadow_frames.num_frames,
-           sizeof(VMDCameraSingleFrame), VMDL_SHADOW);
-  VMDqsort(vf->ik_frames.frames, vf->ik_frames.num_frames,
-           sizeof(VMDCameraSingleFrame), VMDL_IK);
+  if ( vf->storage == VMDL_STORAGE_MMAP
+       && (vf->map_flags & VMDLIB_MAP_COW) == 0 ) {
+    DEBUG_PRINT("Frames mapped read-only cannot be sorted\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION_ALL) == false ) return;
+  VMDLIB_STAT_START(start);
+  VMDSortBoneFrames(vf->bone_frames.frames, vf->bone_frames.num_frames);
+  VMDSortMorphFrames(vf->morph_frames.frames, vf->morph_frames.num_frames);
+  VMDSortCameraFrames(vf->camera_frames.frames, vf->camera_frames.num_frames);
+  VMDSortLightFrames(vf->light_frames.frames, vf->light_frames.num_frames);
+  VMDSortShadowFrames(vf->shadow_frames.frames, vf->shadow_frames.num_frames);
+  VMDSortIKFrames(vf->ik_frames.frames, vf->ik_frames.num_frames);
+  // bytes are those of the motion as a file
+  VMDLIB_STAT_STOP(VMDL_STAT_SORT, start, VMDGetWriteSize(vf));
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    __VMDMarkRewritten(vf, (VMDStructType)i,
+                       __VMDGetNumFrames(vf, (VMDStructType)i));
+  }
+
+  // positions of frames have changed
+  if ( vf->index != NULL ) VMDBuildTrackIndex(vf);
+  if ( vf->curves != NULL ) VMDBuildCurveTable(vf);
   return;
 }
 
+// Smallest number of frames of a chunk of the parallel sort
+#define VMDLIB_SORT_CHUNK_MIN (4096)
+// Largest number of chunks of the parallel sort
+#define VMDLIB_SORT_MAX_CHUNKS (64)
+
+// Frames of a section to be sorted
+typedef struct {
+  VMDStructType type;
+  char*         frames;
+  uint32_t      num;
+  size_t        size;       // size of a frame in memory
+  size_t        key_offset; // offset of the frame number
+} VMDSortSection;
+
+// Steps of the parallel sort, each runs once for every chunk
+typedef enum {
+  VMDL_SORT_PAIRS,   // build pairs, check order and differing bits
+  VMDL_SORT_COUNT,   // histogram of the digit of the current pass
+  VMDL_SORT_SCATTER, // move pairs to their place of the current pass
+  VMDL_SORT_GATHER,  // copy frames in sorted order
+  VMDL_SORT_COPY     // copy sorted frames back
+} VMDSortStep;
+
+// State of the parallel sort of a section
+typedef struct {
+  VMDSortSection s;
+  VMDSortStep    step;
+  uint32_t       num_chunks;
+  uint64_t*      src;    // pairs read by the current pass
+  uint64_t*      dst;    // pairs written by the current pass
+  char*          tmp;    // frames in sorted order
+  uint32_t*      hist;   // histogram or offsets, RADIX_SIZE for each chunk
+  uint32_t*      diff;   // differing bits found by each chunk
+  bool*          order;  // each chunk is in order
+  int            shift;  // shift of the digit of the current pass
+} VMDParallelSort;
+
+/**
+ * @brief Range of a chunk of the parallel sort
+ *  Internally called function
+ * @param (ps) state of the sort
+ * @param (chunk) index of the chunk
+ * @param (begin) [out] first frame of the chunk
+ * @param (end) [out] end of the chunk
+ * @return void
+ */
+static void __VMDSortChunkRange(const VMDParallelSort* ps, uint32_t chunk,
+                                uint32_t* begin, uint32_t* end){
+  *begin = (uint32_t)((uint64_t)ps->s.num * chunk / ps->num_chunks);
+  *end = (uint32_t)((uint64_t)ps->s.num * (chunk + 1) / ps->num_chunks);
+}
+
+/**
+ * @brief Run the current step of the parallel sort for a chunk
+ *  Internally called function, a task of VMDExecutor.
+ * @param (arg) state of the sort
+ * @param (chunk) index of the chunk
+ * @return void
+ */
+static void __VMDSortChunk(void* arg, uint32_t chunk){
+  VMDParallelSort* ps = arg;
+  const VMDSortSection* s = &ps->s;
+  uint32_t* hist = ps->hist + (size_t)chunk * VMDLIB_RADIX_SIZE;
+  uint32_t begin, end, key, prev, first, diff = 0, digit;
+  bool order = true;
+
+  __VMDSortChunkRange(ps, chunk, &begin, &end);
+  switch ( ps->step ) {
+    case VMDL_SORT_PAIRS:
+      memcpy(&first, s->frames + s->key_offset, sizeof(uint32_t));
+      memcpy(&prev, s->frames + s->size * (begin > 0 ? begin - 1 : 0)
+             + s->key_offset, sizeof(uint32_t));
+      for ( uint32_t i = begin; i < end; i++ ) {
+        memcpy(&key, s->frames + s->size * i + s->key_offset,
+               sizeof(uint32_t));
+        order = order && prev <= key;
+        prev = key;
+        diff |= key ^ first;
+        ps->src[i] = ((uint64_t)key << 32) | i;
+      }
+      ps->diff[chunk] = diff;
+      ps->order[chunk] = order;
+      break;
+    case VMDL_SORT_COUNT:
+      memset(hist, 0, sizeof(uint32_t) * VMDLIB_RADIX_SIZE);
+      for ( uint32_t i = begin; i < end; i++ ) {
+        hist[(uint32_t)(ps->src[i] >> ps->shift) & VMDLIB_RADIX_MASK]++;
+      }
+      break;
+    case VMDL_SORT_SCATTER:
+      for ( uint32_t i = begin; i < end; i++ ) {
+        digit = (uint32_t)(ps->src[i] >> ps->shift) & VMDLIB_RADIX_MASK;
+        ps->dst[hist[digit]++] = ps->src[i];
+      }
+      break;
+    case VMDL_SORT_GATHER:
+      for ( uint32_t i = begin; i < end; i++ ) {
+        memcpy(ps->tmp + s->size * i,
+               s->frames + s->size * (uint32_t)ps->src[i], s->size);
+      }
+      break;
+    case VMDL_SORT_COPY:
+      memcpy(s->frames + s->size * begin, ps->tmp + s->size * begin,
+             s->size * (end - begin));
+      break;
+  }
+}
+
+/**
+ * @brief Run a step of the parallel sort for every chunk
+ *  Internally called function
+ * @param (ps) state of the sort
+ * @param (exec) executor
+ * @param (step) step to be run
+ * @return void
+ */
+static void __VMDSortStep(VMDParallelSort* ps, const VMDExecutor* exec,
+                          VMDSortStep step){
+  ps->step = step;
+  exec->parallel_for(exec->ctx, ps->num_chunks, __VMDSortChunk, ps);
+}
+
+/**
+ * @brief Stable sort of a large section on executor
+ *  Internally called function. The same LSD radix sort as __VMDSortFrames(),
+ *  with the frames split into chunks: each chunk counts its digits, the
+ *  counts are turned into the place of each chunk in every bucket, then
+ *  chunks scatter their pairs independently, which keeps the sort stable.
+ * @param (s) frames to be sorted
+ * @param (exec) executor
+ * @return bool : false if memory is insufficient
+ */
+static bool __VMDParallelSortFrames(const VMDSortSection* s,
+                                    const VMDExecutor* exec){
+  VMDParallelSort ps;
+  uint64_t* pairs;
+  uint64_t* swap;
+  uint32_t diff = 0, sum, count;
+  bool order = true;
+  size_t chunks;
+
+  chunks = exec->concurrency > 1 ? exec->concurrency : 1;
+  if ( chunks > VMDLIB_SORT_MAX_CHUNKS ) chunks = VMDLIB_SORT_MAX_CHUNKS;
+  if ( chunks > s->num / VMDLIB_SORT_CHUNK_MIN ) {
+    chunks = s->num / VMDLIB_SORT_CHUNK_MIN;
+  }
+  if ( chunks < 1 ) chunks = 1;
+
+  memset(&ps, 0, sizeof(VMDParallelSort));
+  ps.s = *s;
+  ps.num_chunks = (uint32_t)chunks;
+  pairs = __VMDMalloc(sizeof(uint64_t) * 2 * (size_t)s->num
+                      + (sizeof(uint32_t) * (VMDLIB_RADIX_SIZE + 1)
+                         + sizeof(bool)) * chunks);
+  ps.tmp = __VMDMalloc(s->size * s->num);
+  if ( pairs == NULL || ps.tmp == NULL ) {
+    free(pairs);
+    free(ps.tmp);
+    return false;
+  }
+  ps.src = pairs;
+  ps.dst = pairs + s->num;
+  ps.hist = (uint32_t*)(pairs + 2 * (size_t)s->num);
+  ps.diff = ps.hist + VMDLIB_RADIX_SIZE * chunks;
+  ps.order = (bool*)(ps.diff + chunks);
+
+  __VMDSortStep(&ps, exec, VMDL_SORT_PAIRS);
+  for ( size_t c = 0; c < chunks; c++ ) {
+    diff |= ps.diff[c];
+    order = order && ps.order[c];
+  }
+
+  if ( order == false ) {
+    for ( int pass = 0; pass < VMDLIB_RADIX_PASSES; pass++ ) {
+      if ( ((diff >> (pass * VMDLIB_RADIX_BITS)) & VMDLIB_RADIX_MASK) == 0 ) {
+        continue;
+      }
+      ps.shift = 32 + pass * VMDLIB_RADIX_BITS;
+      __VMDSortStep(&ps, exec, VMDL_SORT_COUNT);
+      // counts to offsets, bucket by bucket and chunk by chunk in a bucket
+      sum = 0;
+      for ( uint32_t d = 0; d < VMDLIB_RADIX_SIZE; d++ ) {
+        for ( size_t c = 0; c < chunks; c++ ) {
+          count = ps.hist[c * VMDLIB_RADIX_SIZE + d];
+          ps.hist[c * VMDLIB_RADIX_SIZE + d] = sum;
+          sum += count;
+        }
+      }
+      __VMDSortStep(&ps, exec, VMDL_SORT_SCATTER);
+      swap = ps.src;
+      ps.src = ps.dst;
+      ps.dst = swap;
+    }
+    __VMDSortStep(&ps, exec, VMDL_SORT_GATHER);
+    __VMDSortStep(&ps, exec, VMDL_SORT_COPY);
+  }
+  free(pairs);
+  free(ps.tmp);
+  return true;
+}
+
+/**
+ * @brief Sort a small section, a task of VMDExecutor
+ *  Internally called function
+ * @param (arg) sections
+ * @param (index) index of the section
+ * @return void
+ */
+static void __VMDSortSectionTask(void* arg, uint32_t index){
+  const VMDSortSection* s = (const VMDSortSection*)arg + index;
+  VMDqsort(s->frames, s->num, s->size, s->type);
+}
+
+/**
+ * @brief sort all frames of VMDFile on executor
+ *  Same result as VMDSortAllFrames(). Sections with at least
+ *  VMDLIB_PARALLEL_SORT_MIN frames are sorted one after another, each by a
+ *  parallel sort on `exec`, then the other sections are sorted at the same
+ *  time by a single parallel loop. Loops are never nested, so `exec` can
+ *  be a pool whose tasks should not wait for other tasks.
+ * @param (vf) a pointer to VMDFile structure
+ * @param (exec) executor, or NULL to sort on the calling thread
+ * @return void
+ * @sa VMDThreadExecutor
+ */
+void VMDSortAllFramesParallel(VMDFile* vf, const VMDExecutor* exec){
+  VMDSortSection small[VMDLIB_NUM_SECTIONS];
+  VMDSortSection s;
+  uint32_t num_small = 0;
+
+  if ( exec == NULL || exec->parallel_for == NULL ) {
+    VMDSortAllFrames(vf);
+    return;
+  }
+  if ( vf->storage == VMDL_STORAGE_MMAP
+       && (vf->map_flags & VMDLIB_MAP_COW) == 0 ) {
+    DEBUG_PRINT("Frames mapped read-only cannot be sorted\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION_ALL) == false ) return;
+  VMDLIB_STAT_START(start);
+
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    s.type = (VMDStructType)i;
+    s.frames = __VMDGetSection(vf, s.type);
+    s.num = __VMDGetNumFrames(vf, s.type);
+    switch ( s.type ) {
+#define VMDLIB_SORT_SECTION(type_name) \
+        s.size = sizeof(type_name); \
+        s.key_offset = offsetof(type_name, frame); \
+        break
+      case VMDL_BONE: VMDLIB_SORT_SECTION(VMDBoneSingleFrame);
+      case VMDL_MORPH: VMDLIB_SORT_SECTION(VMDMorphSingleFrame);
+      case VMDL_CAMERA: VMDLIB_SORT_SECTION(VMDCameraSingleFrame);
+      case VMDL_LIGHT: VMDLIB_SORT_SECTION(VMDLightSingleFrame);
+      case VMDL_SHADOW: VMDLIB_SORT_SECTION(VMDShadowSingleFrame);
+      case VMDL_IK: VMDLIB_SORT_SECTION(VMDIKSingleFrame);
+#undef VMDLIB_SORT_SECTION
+    }
+    if ( s.frames == NULL || s.num < 2 ) continue;
+    // a large section is sorted on its own if memory allows
+    if ( s.num < VMDLIB_PARALLEL_SORT_MIN
+         || __VMDParallelSortFrames(&s, exec) == false ) {
+      small[num_small++] = s;
+    }
+  }
+  if ( num_small > 0 ) {
+    exec->parallel_for(exec->ctx, num_small, __VMDSortSectionTask, small);
+  }
+  VMDLIB_STAT_STOP(VMDL_STAT_SORT, start, VMDGetWriteSize(vf));
+  for ( size_t i = 0; i < VMDLIB_NUM_SECTIONS; i++ ) {
+    __VMDMarkRewritten(vf, (VMDStructType)i,
+                       __VMDGetNumFrames(vf, (VMDStructType)i));
+  }
+
+  // positions of frames have changed
+  if ( vf->index != NULL ) VMDBuildTrackIndex(vf);
+  if ( vf->curves != NULL ) VMDBuildCurveTable(vf);
+}
+
 /**
  * @brief display summary data for CLI
  * @param (vf) a pointer to VMDFile
@@ -352,46 +2557,30 @@ void VMDSortAllFrames(VMDFile* vf){
  */
 void VMDDisplayData(VMDFile* vf){
   printf("[Model    Name]: %s\n", vf->header.model_name);
-  printf("[Bone   Frames]: %d\n", vf->bone_frames.num_frames);
-  printf("[Morph  Frames]: %d\n", vf->morph_frames.num_frames);
-  printf("[Camera Frames]: %d\n", vf->camera_frames.num_frames);
-  printf("[Light  Frames]: %d\n", vf->light_frames.num_frames);
-  printf("[Shadow Frames]: %d\n", vf->shadow_frames.num_frames);
-  printf("[IK     Frames]: %d\n", vf->ik_frames.num_frames);
+  printf("[Bone   Frames]: %u\n", VMDGetNumFrames(vf, VMDL_BONE));
+  printf("[Morph  Frames]: %u\n", VMDGetNumFrames(vf, VMDL_MORPH));
+  printf("[Camera Frames]: %u\n", VMDGetNumFrames(vf, VMDL_CAMERA));
+  printf("[Light  Frames]: %u\n", VMDGetNumFrames(vf, VMDL_LIGHT));
+  printf("[Shadow Frames]: %u\n", VMDGetNumFrames(vf, VMDL_SHADOW));
+  printf("[IK     Frames]: %u\n", VMDGetNumFrames(vf, VMDL_IK));
 }
 
 /**
  * @brief print out bone frames in CSV format
+ *  Names are printed in Shift-JIS, see VMDExport() for other forms.
  * @param (vf) a pointer to VMDFile
  * @return void
  */
 void VMDDumpAllBone2CSV(VMDFile* vf){
-  printf("name,frame,x,y,z,qx,qy,qz,qw\n");
-  for ( int i = 0; i < vf->bone_frames.num_frames; i++ ) {
-    printf("%s,%d,%f,%f,%f,%f,%f,%f,%f\n",
-           vf->bone_frames.frames[i].name,
-           vf->bone_frames.frames[i].frame,
-           vf->bone_frames.frames[i].x,
-           vf->bone_frames.frames[i].y,
-           vf->bone_frames.frames[i].z,
-           vf->bone_frames.frames[i].qx,
-           vf->bone_frames.frames[i].qy,
-           vf->bone_frames.frames[i].qz,
-           vf->bone_frames.frames[i].qw);
-  }
+  VMDExportToFile(vf, VMDL_BONE, VMDL_EXPORT_CSV, VMDLIB_EXPORT_SJIS, stdout);
 }
 
 /**
  * @brief print out morph frames in CSV format
+ *  Names are printed in Shift-JIS, see VMDExport() for other forms.
  * @param (vf) a pointer to VMDFile
  * @return void
  */
 void VMDDumpAllMorph2CSV(VMDFile* vf){
-  printf("name,frame,value");
-  for ( int i = 0; i < vf->morph_frames.num_frames; i++ ) {
-    printf("%s,%d,%f",
-           vf->morph_frames.frames[i].name,
-           vf->morph_frames.frames[i].frame,
-           vf->morph_frames.frames[i].value);
-  }
+  VMDExportToFile(vf, VMDL_MORPH, VMDL_EXPORT_CSV, VMDLIB_EXPORT_SJIS, stdout);
 }
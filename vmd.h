@@ -7,16 +7,35 @@
 #ifndef _H_VMDLIB_VMD_
 #define _H_VMDLIB_VMD_
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
-// Error definitions and the global variable to store error code
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Error definitions and the variable to store error code
+// VMD_ERROR is thread-local, each thread sees errors of its own calls.
 #define VMDLIB_E_INIT (0x0000)
 #define VMDLIB_E_FH   (0x0001)    /* failed to achieve file handler */
 #define VMDLIB_E_FT   (0x0002)    /* invalid file type */
 #define VMDLIB_E_ME   (0x0003)    /* memory allocation error */
+#define VMDLIB_E_WR   (0x0004)    /* failed to write (incl. short write) */
 #define VMDLIB_E_IV   (0xffff)    /* invalid call */
-extern int VMD_ERROR;
+#if defined(_MSC_VER)
+#define VMDLIB_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define VMDLIB_THREAD_LOCAL __thread
+#else
+#define VMDLIB_THREAD_LOCAL _Thread_local
+#endif
+extern VMDLIB_THREAD_LOCAL int VMD_ERROR;
+
+// Error code returned by functions of status API (e.g. VMDLoadFromFileEx())
+typedef int VMDStatus;
+#define VMDLIB_OK VMDLIB_E_INIT
 
 // Magic number of VMD type file
 #define VMDLIB_MAGIC ("Vocaloid Motion Data 0002\0\0\0\0")
@@ -167,14 +186,20 @@ typedef struct
 } __attribute__((packed)) VMDInfoIK;
 
 //モデル表示・IK on/offキーフレーム要素データ((9+21*IK数)Bytes/要素)
+// ファイル上では各要素の先頭9byteの直後にIK on/off情報がik_count個続く.
+// メモリ上ではIK on/off情報を全要素分VMDIKFrames.ikにまとめて格納し,
+// 各要素はその中の位置をik_offsetで指す.
 typedef struct
 {
   uint32_t frame; // フレーム番号
   char show; // モデル表示, 0:OFF, 1:ON
   uint32_t ik_count; // 記録するIKの数
-  VMDInfoIK ik; // IK on/off情報配列
+  uint32_t ik_offset; // VMDIKFrames.ik内の先頭のIK on/off情報の位置
 } __attribute__((packed)) VMDIKSingleFrame;
 
+// Size of the head of ShowIK record in file (frame, show and ik_count)
+#define VMDLIB_IK_HEAD_SIZE (9)
+
 typedef struct {
   uint32_t           num_frames;
   VMDBoneSingleFrame *frames;
@@ -201,10 +226,141 @@ typedef struct {
 } __attribute__((packed)) VMDShadowFrames;
 
 typedef struct {
-  uint32_t             num_frames;
+  uint32_t         num_frames;
   VMDIKSingleFrame *frames;
+  uint32_t         num_ik; // IK on/off情報の総数
+  VMDInfoIK        *ik;    // 全要素のIK on/off情報
 } __attribute__((packed)) VMDIKFrames;
 
+// Size of name field of bone and morph frames, and of IK
+#define VMDLIB_NAME_SIZE (15)
+#define VMDLIB_IK_NAME_SIZE (20)
+
+// Interned names (vmd_names.c), each distinct name has an id
+typedef struct VMDNameTable VMDNameTable;
+#define VMDLIB_NO_NAME (0xffffffffu) /* id of no name */
+
+// Keyframes of a single bone or morph (VMDFindBoneTrack())
+typedef struct {
+  char      name[VMDLIB_NAME_SIZE + 1]; // Shift-JIS name terminated by NUL
+  uint32_t  hash;       // hash of the name
+  uint32_t  name_id;    // id in the name table of the file
+  uint32_t  num_frames; // number of keyframes of the bone or morph
+  uint32_t* frames;     // positions in bone_frames or morph_frames,
+                        // sorted by frame number
+} VMDTrack;
+
+// Tracks of all bones or morphs
+typedef struct {
+  uint32_t  num_tracks;
+  VMDTrack* tracks;
+  uint32_t  num_ids;  // number of elements of `track_of`
+  uint32_t* track_of; // track number + 1 for each name id, 0 for no track
+  uint32_t* name_ids; // name id of each frame
+  uint32_t* indices;  // storage of VMDTrack.frames of all tracks
+} VMDTrackTable;
+
+// Track index of VMDFile (VMDBuildTrackIndex())
+typedef struct {
+  VMDTrackTable bones;
+  VMDTrackTable morphs;
+  uint32_t*     ik_name_ids; // name id of each VMDInfoIK in ik_frames.ik
+  bool          mapped;      // arrays but `tracks` point into a cache file
+} VMDTrackIndex;
+
+// Columns of bone frames (VMDCreateBoneColumns()), row i is frame i
+#define VMDLIB_COLUMN_ALIGN (64)
+typedef struct {
+  uint32_t  num_frames;
+  uint32_t  num_names;
+  char      (*names)[VMDLIB_NAME_SIZE + 1]; // names of the name table
+  uint32_t* name_id;  // id in the name table, position in `names`
+  uint32_t* frame;
+  float*    x;
+  float*    y;
+  float*    z;
+  float*    qx;
+  float*    qy;
+  float*    qz;
+  float*    qw;
+  char      (*bezier)[64];
+  void*     block;    // storage of all columns
+} VMDBoneColumns;
+
+// Columns of morph frames (VMDCreateMorphColumns()), row i is frame i
+typedef struct {
+  uint32_t  num_frames;
+  uint32_t  num_names;
+  char      (*names)[VMDLIB_NAME_SIZE + 1]; // names of the name table
+  uint32_t* name_id;  // id in the name table, position in `names`
+  uint32_t* frame;
+  float*    value;
+  void*     block;    // storage of all columns
+} VMDMorphColumns;
+
+// Interpolation curve decoded by VMDBuildCurveTable()
+#define VMDLIB_CURVE_SEGMENTS (64)
+typedef struct {
+  float    y[VMDLIB_CURVE_SEGMENTS + 1]; // weight at x = i / SEGMENTS
+  uint64_t exact; // bit i: segment i is too steep for the table, solve it
+  uint8_t  p[4];  // x1, y1, x2, y2
+} VMDCurve;
+
+// Curves of all keyframes (VMDBuildCurveTable()), each distinct curve is
+// stored once
+typedef struct {
+  uint32_t  num_curves;    // curve 0 is linear and never looked up
+  VMDCurve* curves;
+  uint32_t* bone_curves;   // 4 ids per bone frame, X, Y, Z, rotation
+  uint32_t* camera_curves; // 6 ids per camera frame, X, Y, Z, R, L, V
+  bool      mapped;        // arrays point into a cache file
+} VMDCurveTable;
+
+// Where section frames of VMDFile are stored
+typedef enum {
+  VMDL_STORAGE_HEAP,  // each section is allocated by malloc()
+  VMDL_STORAGE_MMAP,  // sections point into a file mapping (VMDMapFile(),
+                      // VMDOpenCache())
+  VMDL_STORAGE_BLOCK, // VMDFile and sections share a single malloc() block
+  VMDL_STORAGE_ARENA  // VMDFile and sections live in a caller's VMDArena
+} VMDStorageType;
+
+// Sections of a lazily loaded file not read yet, see VMDLoadSections()
+typedef struct VMDLazyLoad VMDLazyLoad;
+
+// Memory arena to load VMDFile into (VMDLoadFromFileArena())
+// One arena can be reused for many files by VMDArenaReset(), so that a
+// worker does not allocate memory for each file once the arena is warmed up.
+typedef struct VMDArenaBlock VMDArenaBlock;
+typedef struct {
+  char*          base;          // main buffer
+  size_t         capacity;      // size of the main buffer
+  size_t         used;          // bytes already handed out from main buffer
+  bool           owned;         // main buffer is allocated by the library
+  VMDArenaBlock* overflow;      // blocks for requests main buffer can't hold
+  size_t         overflow_size; // total bytes requested from overflow blocks
+} VMDArena;
+
+// Flags for VMDMapFile()
+#define VMDLIB_MAP_RDONLY (0x0000)  /* frames are read-only (default) */
+#define VMDLIB_MAP_COW    (0x0001)  /* frames are writable, copy-on-write */
+
+// Frames of a section edited since load or last save, see VMDSaveFile()
+// Frames `first` to `last` - 1 were changed, none if `last` is 0.
+typedef struct {
+  uint32_t first;
+  uint32_t last;
+} VMDDirtyRange;
+
+// Identity of a file on disk, see VMDSaveFile()
+// All 0 if VMDFile has not been loaded from or saved to a file.
+typedef struct {
+  uint64_t dev;   // device of the file
+  uint64_t ino;   // inode (file index) of the file
+  uint64_t size;  // size of the file
+  int64_t  mtime; // last modification, in nanoseconds
+} VMDFileId;
+
 // Whole data
 typedef struct {
   VMDHeader       header;
@@ -214,8 +370,72 @@ typedef struct {
   VMDLightFrames  light_frames;
   VMDShadowFrames shadow_frames;
   VMDIKFrames     ik_frames;
+  VMDTrackIndex*  index;     // built by VMDBuildTrackIndex() or NULL
+  VMDCurveTable*  curves;    // built by VMDBuildCurveTable() or NULL
+  VMDNameTable*   names;     // see VMDGetNameTable() or NULL
+  VMDLazyLoad*    lazy;      // sections not read yet (VMDLIB_LOAD_LAZY) or NULL
+  // memory management, do not touch from outside of the library
+  VMDStorageType  storage;
+  int             map_flags; // VMDLIB_MAP_* given to VMDMapFile()
+  void*           map_addr;  // head of the mapping
+  size_t          map_size;  // size of the mapping
+  bool            owns_names; // `names` is released with the file
+  // edits not saved yet, see VMDSaveFile(); frames written directly into
+  // `frames[]` are not recorded here until VMDMarkEdited() is called
+  uint32_t        dirty;     // VMDLIB_SECTION() of edited sections
+  uint32_t        resized;   // VMDLIB_SECTION() of sections resized by edits
+  VMDDirtyRange   edited[6]; // frames edited, indexed by VMDStructType
+  VMDFileId       source;    // file loaded from or last saved to
 } __attribute__((packed)) VMDFile;
 
+// Flags for VMDLoadOptions
+#define VMDLIB_LOAD_MMAP  (0x0001) /* map file by VMDMapFile() */
+#define VMDLIB_LOAD_COW   (0x0002) /* map copy-on-write with VMDLIB_LOAD_MMAP */
+#define VMDLIB_LOAD_INDEX (0x0004) /* build track index while loading */
+#define VMDLIB_LOAD_CURVES (0x0008) /* decode curves while loading */
+#define VMDLIB_LOAD_LAZY  (0x0010) /* read sections on first use */
+
+// Options for VMDLoadFromFileWithOptions()
+typedef struct {
+  uint32_t  flags; // VMDLIB_LOAD_*
+  VMDArena* arena; // load into this arena, or NULL
+  uint32_t  skip_sections; // VMDLIB_SECTION() of sections left empty
+} VMDLoadOptions;
+
+// Task of a parallel loop, called once for each `index` below the count
+typedef void (*VMDTaskFunc)(void* arg, uint32_t index);
+
+// Runs parallel loops of the library on caller's threads or thread pool
+// `parallel_for` calls `task(arg, i)` for every i < num on any threads and
+// returns when all of them have finished. Tasks of a loop never wait for
+// each other, so a pool may also run them one by one.
+typedef struct {
+  void (*parallel_for)(void* ctx, uint32_t num, VMDTaskFunc task, void* arg);
+  void*    ctx;         // passed to `parallel_for`
+  uint32_t concurrency; // threads expected to run tasks at a time
+} VMDExecutor;
+
+// Sections with at least this many frames are sorted by a parallel sort
+#define VMDLIB_PARALLEL_SORT_MIN (1u << 16)
+
+// Called by VMDLoadBatch() from worker threads as each file completes
+// `vf` is NULL and `status` is VMDLIB_E_* when the file failed to load.
+typedef void (*VMDBatchCallback)(void* user, size_t index, const char* path,
+                                 VMDFile* vf, VMDStatus status);
+
+// Flags for VMDBatchOptions
+#define VMDLIB_BATCH_PREFETCH (0x0001) /* read upcoming files ahead */
+
+// Options for VMDLoadBatch()
+typedef struct {
+  uint32_t         flags;      // VMDLIB_BATCH_*
+  uint32_t         load_flags; // VMDLIB_LOAD_* for each file
+  size_t           arena_size; // initial arena of each worker, 0 for malloc()
+  VMDBatchCallback callback;
+  void*            user;       // passed to `callback`
+  uint32_t         skip_sections; // VMDLIB_SECTION() left empty in each file
+} VMDBatchOptions;
+
 typedef enum {
   VMDL_BONE,
   VMDL_MORPH,
@@ -225,6 +445,207 @@ typedef enum {
   VMDL_IK
 } VMDStructType;
 
+// Bit of a section in masks of sections, `type` is VMDStructType
+#define VMDLIB_SECTION(type) (1u << (type))
+#define VMDLIB_SECTION_ALL   (0x003f)
+
+// Operations counted by the instrumentation (VMDGetStats())
+typedef enum {
+  VMDL_STAT_READ,   // reading files
+  VMDL_STAT_HEADER, // checking headers and sizes of sections
+  VMDL_STAT_COPY,   // copying a section, VMDL_STAT_COPY + VMDStructType
+  VMDL_STAT_SORT = VMDL_STAT_COPY + VMDL_IK + 1, // sorting all frames
+  VMDL_STAT_WRITE,  // writing files and memory
+  VMDL_STAT_ALLOC,  // allocations, counted without time
+  VMDL_STAT_NUM
+} VMDStatOp;
+
+// Counter of an operation
+typedef struct {
+  uint64_t calls;
+  uint64_t nsec;  // time spent in the operation
+  uint64_t bytes; // bytes processed (or allocated) by the operation
+} VMDStatCounter;
+
+// Counters of operations of all threads, see VMDGetStats()
+typedef struct {
+  bool           enabled;            // built with VMDLIB_STATS
+  VMDStatCounter ops[VMDL_STAT_NUM]; // indexed by VMDStatOp
+} VMDStats;
+
+// Instrumentation of hot paths, compiled in only with -DVMDLIB_STATS
+// VMDLIB_STAT_START(t) starts timer `t`, and VMDLIB_STAT_STOP() adds the
+// time since then to the counter of `op` with `bytes`.
+#ifdef VMDLIB_STATS
+#define VMDLIB_STAT_START(t) uint64_t t = __VMDStatNow()
+#define VMDLIB_STAT_STOP(op, t, bytes) __VMDStatAdd((op), (t), (bytes))
+#define VMDLIB_STAT_COUNT(op, bytes) __VMDStatCount((op), (bytes))
+#else
+#define VMDLIB_STAT_START(t) do { } while ( 0 )
+#define VMDLIB_STAT_STOP(op, t, bytes) do { } while ( 0 )
+#define VMDLIB_STAT_COUNT(op, bytes) do { } while ( 0 )
+#endif
+
+// Result of VMDStatFile()
+typedef struct {
+  VMDHeader header;
+  uint32_t  num_frames[VMDL_IK + 1]; // indexed by VMDStructType
+  uint64_t  size;                    // size of the file
+} VMDFileStat;
+
+// Output of exporters (VMDExport()), called with consecutive chunks of the
+// output, returns false to stop the export
+typedef struct {
+  bool (*write)(void* user, const void* data, size_t size);
+  void* user; // passed to `write`
+} VMDSink;
+
+typedef enum {
+  VMDL_EXPORT_CSV,    // header line and a line per row
+  VMDL_EXPORT_NDJSON, // a JSON object per line
+  VMDL_EXPORT_COLUMNS // binary columns, see vmd_export.c
+} VMDExportFormat;
+
+// Flags for VMDExport()
+#define VMDLIB_EXPORT_BEZIER    (0x0001) /* add interpolation parameters */
+#define VMDLIB_EXPORT_SJIS      (0x0002) /* names in Shift-JIS, not UTF-8 */
+#define VMDLIB_EXPORT_NO_HEADER (0x0004) /* no header line of CSV */
+
+// Types of binary columns of VMDL_EXPORT_COLUMNS
+#define VMDLIB_COLUMN_U32   (1) /* uint32_t */
+#define VMDLIB_COLUMN_F32   (2) /* float */
+#define VMDLIB_COLUMN_I8    (3) /* signed char */
+#define VMDLIB_COLUMN_BYTES (4) /* raw bytes, interpolation parameters */
+#define VMDLIB_COLUMN_NAME  (5) /* uint32_t string id, VMDLIB_NO_NAME */
+
+// Callbacks of streaming parser (VMDStreamCreate()), any of them can be NULL
+// Frames are delivered in batches and are valid only during the call.
+typedef struct {
+  void (*header)(void* user, const VMDHeader* header);
+  // called with the count prefix of each section before its frames
+  void (*section)(void* user, VMDStructType type, uint32_t num_frames);
+  void (*bone)(void* user, const VMDBoneSingleFrame* frames, uint32_t num);
+  void (*morph)(void* user, const VMDMorphSingleFrame* frames, uint32_t num);
+  void (*camera)(void* user, const VMDCameraSingleFrame* frames, uint32_t num);
+  void (*light)(void* user, const VMDLightSingleFrame* frames, uint32_t num);
+  void (*shadow)(void* user, const VMDShadowSingleFrame* frames, uint32_t num);
+  // ShowIK records are variable length, called once per record
+  void (*ik)(void* user, uint32_t frame, char show,
+             const VMDInfoIK* ik, uint32_t ik_count);
+  void* user; // passed to every callback
+} VMDStreamCallbacks;
+
+// Streaming parser, see vmd_stream.c
+typedef struct VMDStream VMDStream;
+
+// Results of VMDSample*(), values interpolated at a time
+typedef struct {
+  float x, y, z;          // position
+  float qx, qy, qz, qw;   // rotation quaternion
+} VMDBonePose;
+
+// Output of VMDSampleBones(), one array per component (structure of arrays)
+typedef struct {
+  float* x;
+  float* y;
+  float* z;
+  float* qx;
+  float* qy;
+  float* qz;
+  float* qw;
+} VMDBonePoses;
+
+typedef struct {
+  float distance;         // distance between the target and the camera
+  float x, y, z;          // position of the target
+  float rx, ry, rz;       // rotation(rad)
+  float view_angle;       // view angle(deg)
+  char  parth;            // perspective, 0:ON, 1:OFF
+} VMDCameraPose;
+
+typedef struct {
+  float r, g, b;          // color
+  float x, y, z;          // position
+} VMDLightPose;
+
+// Frames per second of MMD, frame numbers of VMD count frames at this rate
+#define VMDLIB_FRAME_RATE (30)
+
+// Poses of a motion sampled at a fixed rate (VMDBakeMotion())
+// Sample i is at i / fps seconds. Bone b of sample i is the element
+// i * bone_stride + b of each array of `bones`, and morph m of sample i is
+// morphs[i * morph_stride + m]. Bones and morphs are in the order of the
+// tracks of the track index, and each sample starts on a cache line.
+typedef struct {
+  float          fps;          // samples per second
+  uint32_t       num_samples;  // samples up to the last keyframe
+  uint32_t       num_bones;    // bone tracks
+  uint32_t       num_morphs;   // morph tracks
+  uint32_t       bone_stride;  // elements of a sample in arrays of `bones`
+  uint32_t       morph_stride; // elements of a sample in `morphs`
+  char           (*bone_names)[VMDLIB_NAME_SIZE + 1];  // name of each bone
+  char           (*morph_names)[VMDLIB_NAME_SIZE + 1]; // name of each morph
+  VMDBonePoses   bones;        // positions and rotations of bones
+  float*         morphs;       // weights of morphs
+  VMDCameraPose* cameras;      // camera of each sample, NULL without camera
+  VMDLightPose*  lights;       // light of each sample, NULL without light
+  size_t         size;         // bytes of `block`
+  void*          block;        // storage of all arrays
+} VMDBakedMotion;
+
+// A sample of VMDBakedMotion (VMDGetBakedPose()), pointing into it
+// Element b of arrays of `bones` is bone b, morphs[m] is morph m.
+typedef struct {
+  VMDBonePoses         bones;
+  const float*         morphs;
+  const VMDCameraPose* camera; // NULL without camera frames
+  const VMDLightPose*  light;  // NULL without light frames
+} VMDBakedPose;
+
+// Baked motions sharing a memory budget (VMDCreateBakeCache())
+typedef struct VMDBakeCache VMDBakeCache;
+
+// Options of VMDReduceKeyframes()
+typedef struct {
+  float              position; // largest error of bone positions
+  float              rotation; // largest error of bone rotations(rad)
+  float              morph;    // largest error of morph weights
+  const VMDExecutor* exec;     // runs tracks in parallel, or NULL
+} VMDReduceOptions;
+
+// What VMDMerge() does with keys of the same bone (or morph) and frame
+typedef enum {
+  VMDL_MERGE_KEEP_ALL, // keep all of them, in the order of files
+  VMDL_MERGE_FIRST,    // keep the key of the earliest file
+  VMDL_MERGE_LAST      // keep the key of the latest file
+} VMDMergePolicy;
+
+// Frames of a section in a range of frame numbers (VMDGetSectionRange())
+typedef struct {
+  const void* frames;     // first frame of the range in the section, or NULL
+  uint32_t    begin;      // position of `frames` in the section
+  uint32_t    num_frames; // number of frames of the range
+} VMDRange;
+
+// Flags for VMDExtractClip()
+#define VMDLIB_CLIP_KEEP_FRAMES (0x0001) // keep frame numbers of the original
+
+// Flags for VMDCompress()
+#define VMDLIB_COMPRESS_EXACT (0x0001) // keep rotations exact, not quantized
+#define VMDLIB_COMPRESS_LZ4   (0x0002) // LZ4 on top, built with -DVMDLIB_LZ4
+#define VMDLIB_COMPRESS_ZSTD  (0x0004) // zstd on top, built with -DVMDLIB_ZSTD
+
+// Flags for VMDHash()
+#define VMDLIB_HASH_NORMALIZE (0x0001) // any order of frames hashes the same
+#define VMDLIB_HASH_NO_HEADER (0x0002) // model name is not in `file`
+
+// Hashes of VMD data (VMDHash()), equal data has equal hashes
+typedef struct {
+  uint64_t file;                   // whole data
+  uint64_t header;                 // header
+  uint64_t sections[VMDL_IK + 1];  // each section, indexed by VMDStructType
+} VMDDigest;
+
 // function definitions
 int __VMDCheckHeader(void*);
 int __VMDCompareBoneFrameNumber(const void*, const void*);
@@ -233,13 +654,159 @@ int __VMDCompareCameraFrameNumber(const void*, const void*);
 int __VMDCompareLightFrameNumber(const void*, const void*);
 int __VMDCompareShadowFrameNumber(const void*, const void*);
 int __VMDCompareIKFrameNumber(const void*, const void*);
+uint32_t __VMDIKPoolBound(size_t, uint32_t);
+bool __VMDParseIK(const char*, size_t, VMDIKFrames*, uint32_t, size_t*);
 void VMDqsort(void*, size_t, size_t, VMDStructType);
+bool __VMDSortPairs(uint64_t*, uint32_t);
+void __VMDInitStorage(VMDFile*, VMDStorageType);
+void* __VMDMapWholeFile(const char*, bool, size_t*);
+void __VMDUnmap(void*, size_t);
+void VMDSortBoneFrames(VMDBoneSingleFrame*, uint32_t);
+void VMDSortMorphFrames(VMDMorphSingleFrame*, uint32_t);
+void VMDSortCameraFrames(VMDCameraSingleFrame*, uint32_t);
+void VMDSortLightFrames(VMDLightSingleFrame*, uint32_t);
+void VMDSortShadowFrames(VMDShadowSingleFrame*, uint32_t);
+void VMDSortIKFrames(VMDIKSingleFrame*, uint32_t);
 VMDFile* VMDLoadFromFile(const char*);
+VMDFile* VMDCreateVMDFile(const char*);
+VMDFile* VMDLoadFromMemory(const void*, size_t);
+VMDFile* VMDMapFile(const char*, int);
+void VMDArenaInit(VMDArena*, void*, size_t);
+void* VMDArenaAlloc(VMDArena*, size_t);
+void VMDArenaReset(VMDArena*);
+void VMDArenaRelease(VMDArena*);
+VMDFile* VMDLoadFromFileArena(const char*, VMDArena*);
+VMDFile* VMDLoadFromFileWithOptions(const char*, const VMDLoadOptions*);
+VMDStatus VMDLoadFromFileEx(const char*, VMDFile**, const VMDLoadOptions*);
+const char* VMDErrorString(VMDStatus);
+VMDStatus VMDStatFile(const char*, VMDFileStat*);
+bool VMDLoadSections(VMDFile*, uint32_t);
+uint32_t VMDGetNumFrames(VMDFile*, VMDStructType);
+bool VMDLoadBatch(const char* const*, size_t, uint32_t, const VMDBatchOptions*);
+bool VMDBuildTrackIndex(VMDFile*);
+void VMDReleaseTrackIndex(VMDFile*);
+const VMDTrack* VMDFindBoneTrack(VMDFile*, const char*);
+const VMDTrack* VMDFindMorphTrack(VMDFile*, const char*);
+uint32_t __VMDHashName(const char*, size_t);
+size_t __VMDNameLength(const char*, size_t);
+void __VMDNameFromUTF8(void**, const char*, size_t, char*, size_t);
+void __VMDCloseConverter(void*);
+VMDNameTable* VMDCreateNameTable(void);
+void VMDReleaseNameTable(VMDNameTable*);
+uint32_t VMDInternName(VMDNameTable*, const char*, size_t);
+uint32_t VMDFindName(const VMDNameTable*, const char*);
+uint32_t VMDFindNameUTF8(const VMDNameTable*, const char*);
+uint32_t VMDGetNumNames(const VMDNameTable*);
+const char* VMDGetNameSJIS(const VMDNameTable*, uint32_t);
+const char* VMDGetNameUTF8(const VMDNameTable*, uint32_t);
+uint32_t VMDGetNameHash(const VMDNameTable*, uint32_t);
+VMDNameTable* VMDGetNameTable(VMDFile*);
+bool VMDUseNameTable(VMDFile*, VMDNameTable*);
+VMDNameTable* __VMDMapNameTable(const void*, uint32_t, size_t,
+                                const uint32_t*, uint32_t);
+const void* __VMDNameTableArrays(const VMDNameTable*, size_t*,
+                                 const uint32_t**, uint32_t*);
+VMDBoneColumns* __VMDAllocBoneColumns(uint32_t, uint32_t);
+VMDBoneColumns* VMDCreateBoneColumns(VMDFile*);
+VMDMorphColumns* VMDCreateMorphColumns(VMDFile*);
+bool VMDBoneColumnsToFrames(const VMDBoneColumns*, VMDBoneSingleFrame*);
+bool VMDMorphColumnsToFrames(const VMDMorphColumns*, VMDMorphSingleFrame*);
+bool VMDStoreBoneColumns(VMDFile*, const VMDBoneColumns*);
+bool VMDStoreMorphColumns(VMDFile*, const VMDMorphColumns*);
+void VMDReleaseBoneColumns(VMDBoneColumns*);
+void VMDReleaseMorphColumns(VMDMorphColumns*);
 bool VMDWriteToFile(VMDFile*, char* );
+bool VMDWriteToFd(VMDFile*, int);
+size_t VMDGetWriteSize(VMDFile*);
+size_t VMDWriteToMemory(VMDFile*, void*, size_t);
 void VMDReleaseVMDFile(VMDFile*);
 void VMDSortAllFrames(VMDFile*);
+void VMDSortAllFramesParallel(VMDFile*, const VMDExecutor*);
+VMDExecutor VMDThreadExecutor(uint32_t);
 void VMDDisplayData(VMDFile*);
 void VMDDumpAllBone2CSV(VMDFile*);
 void VMDDumpAllMorph2CSV(VMDFile*);
+bool VMDExport(VMDFile*, VMDStructType, VMDExportFormat, uint32_t,
+               const VMDSink*);
+bool VMDExportToFile(VMDFile*, VMDStructType, VMDExportFormat, uint32_t,
+                     FILE*);
+bool VMDExportToFd(VMDFile*, VMDStructType, VMDExportFormat, uint32_t, int);
+bool VMDImport(VMDFile*, VMDStructType, VMDExportFormat, uint32_t,
+               const char*, size_t);
+bool VMDImportFromFile(VMDFile*, VMDStructType, VMDExportFormat, uint32_t,
+                       const char*);
+VMDStream* VMDStreamCreate(const VMDStreamCallbacks*);
+bool VMDStreamFeed(VMDStream*, const void*, size_t);
+bool VMDStreamFinish(VMDStream*);
+void VMDStreamRelease(VMDStream*);
+float __VMDEvalBezier(float, int, int, int, int);
+int __VMDControlPoint(char);
+float __VMDBoneWeight(const char*, int, float);
+void __VMDEncodeBoneBezier(char*, const uint8_t (*)[4]);
+float __VMDCameraWeight(const char*, int, float);
+void __VMDSlerp(const float*, const float*, float, float*);
+void __VMDLerpBone(const VMDBoneSingleFrame*, const VMDBoneSingleFrame*,
+                   float, VMDBonePose*);
+void __VMDLerpCamera(const VMDCameraSingleFrame*, const VMDCameraSingleFrame*,
+                     float, VMDCameraPose*);
+bool VMDBuildCurveTable(VMDFile*);
+void VMDReleaseCurveTable(VMDFile*);
+float __VMDCurveWeight(const VMDCurveTable*, uint32_t, float);
+void __VMDBoneKeys(VMDFile*, const VMDTrack*, float,
+                   const VMDBoneSingleFrame**, const VMDBoneSingleFrame**,
+                   float*);
+bool VMDSampleBone(VMDFile*, const VMDTrack*, float, VMDBonePose*);
+bool VMDSampleBones(VMDFile*, const VMDTrack* const*, uint32_t, float,
+                    const VMDBonePoses*);
+bool VMDSampleMorph(VMDFile*, const VMDTrack*, float, float*);
+bool VMDSampleCamera(VMDFile*, float, VMDCameraPose*);
+bool VMDSampleLight(VMDFile*, float, VMDLightPose*);
+bool VMDReduceKeyframes(VMDFile*, const VMDReduceOptions*);
+uint64_t __VMDXXHash64(const void*, size_t, uint64_t);
+bool VMDExportCache(VMDFile*, const char*);
+VMDFile* VMDOpenCache(const char*, int);
+bool VMDIsCacheCurrent(const char*, const char*);
+VMDFile* VMDMerge(VMDFile* const*, uint32_t, const uint32_t*, VMDMergePolicy);
+bool VMDGetSectionRange(VMDFile*, VMDStructType, uint32_t, uint32_t,
+                        VMDRange*);
+bool VMDGetTrackRange(VMDFile*, VMDStructType, const VMDTrack*, uint32_t,
+                      uint32_t, VMDTrack*);
+VMDFile* VMDExtractClip(VMDFile*, uint32_t, uint32_t, uint32_t);
+uint64_t __VMDStatNow(void);
+void __VMDStatAdd(VMDStatOp, uint64_t, uint64_t);
+void __VMDStatCount(VMDStatOp, uint64_t);
+void VMDGetStats(VMDStats*);
+void VMDResetStats(void);
+bool VMDCompress(VMDFile*, uint32_t, const VMDSink*);
+bool VMDCompressToFile(VMDFile*, uint32_t, const char*);
+VMDFile* VMDDecompress(const void*, size_t);
+VMDFile* VMDLoadCompressed(const char*);
+VMDBoneColumns* VMDDecompressBoneColumns(const void*, size_t);
+void __VMDMarkEdited(VMDFile*, VMDStructType, uint32_t, uint32_t);
+void __VMDMarkRewritten(VMDFile*, VMDStructType, uint32_t);
+bool VMDMarkEdited(VMDFile*, VMDStructType, uint32_t, uint32_t);
+bool VMDInsertFrame(VMDFile*, VMDStructType, const void*, uint32_t*);
+bool VMDDeleteFrame(VMDFile*, VMDStructType, uint32_t);
+bool VMDUpdateFrame(VMDFile*, VMDStructType, uint32_t, const void*,
+                    uint32_t*);
+bool VMDSaveFile(VMDFile*, const char*);
+void* __VMDAllocColumns(size_t);
+void __VMDFreeColumns(void*);
+VMDBakedMotion* VMDBakeMotion(VMDFile*, float, const VMDExecutor*);
+void VMDReleaseBakedMotion(VMDBakedMotion*);
+bool VMDGetBakedPose(const VMDBakedMotion*, uint32_t, VMDBakedPose*);
+VMDBakeCache* VMDCreateBakeCache(size_t);
+void VMDReleaseBakeCache(VMDBakeCache*);
+const VMDBakedMotion* VMDCacheBakedMotion(VMDBakeCache*, VMDFile*, float,
+                                          const VMDExecutor*);
+void VMDUnpinBakedMotion(VMDBakeCache*, const VMDBakedMotion*);
+void VMDEvictBakedMotions(VMDBakeCache*, const VMDFile*);
+size_t VMDGetBakeCacheSize(const VMDBakeCache*);
+bool VMDHash(VMDFile*, uint32_t, VMDDigest*);
+bool VMDHashFile(const char*, uint32_t, VMDDigest*);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* _H_VMDLIB_VMD_ */
@@ -0,0 +1,394 @@
+/**
+ *  @file vmd.hpp
+ *  @brief C++ interface of VMD library
+ *  @author ihm4
+ *  @note
+ *    Header-only, needs C++20 (std::span) and links with the C library.
+ *    vmd::File owns a VMDFile as vmd::File is moved, never copied, and
+ *    releases it by VMDReleaseVMDFile(). Sections are seen as
+ *    vmd::Section<T> of the frame structs of vmd.h, so sorting, searching
+ *    and sampling are instantiated for each frame type with comparators
+ *    and strides known at compile time, instead of void* and sizes.
+ *
+ *    Errors are reported as the C library does: a false or empty result
+ *    with VMD_ERROR set (see vmd::error()), no exceptions are thrown.
+ */
+
+#ifndef _HPP_VMDLIB_VMD_
+#define _HPP_VMDLIB_VMD_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include "vmd.h"
+
+namespace vmd {
+
+/**
+ * @brief Error code of the last failed call of this thread
+ * @return VMD_ERROR
+ */
+inline int error(){
+  return VMD_ERROR;
+}
+
+/**
+ * @brief Properties of each frame type
+ *  `type` is the section, `Pose` the result of sampling keyframes of the
+ *  type (void for types that are not sampled) and `lerp()` interpolates
+ *  between two keyframes.
+ */
+template <class T> struct FrameTraits;
+
+template <> struct FrameTraits<VMDBoneSingleFrame> {
+  static constexpr VMDStructType type = VMDL_BONE;
+  using Pose = VMDBonePose;
+  static std::span<VMDBoneSingleFrame> section(VMDFile* vf){
+    return {vf->bone_frames.frames, vf->bone_frames.num_frames};
+  }
+  // curves of `b` are solved directly
+  static void lerp(const VMDBoneSingleFrame& a, const VMDBoneSingleFrame& b,
+                   float x, Pose& pose){
+    __VMDLerpBone(&a, &b, x, &pose);
+  }
+};
+
+template <> struct FrameTraits<VMDMorphSingleFrame> {
+  static constexpr VMDStructType type = VMDL_MORPH;
+  using Pose = float;
+  static std::span<VMDMorphSingleFrame> section(VMDFile* vf){
+    return {vf->morph_frames.frames, vf->morph_frames.num_frames};
+  }
+  static void lerp(const VMDMorphSingleFrame& a, const VMDMorphSingleFrame& b,
+                   float x, Pose& pose){
+    pose = a.value + (b.value - a.value) * x;
+  }
+};
+
+template <> struct FrameTraits<VMDCameraSingleFrame> {
+  static constexpr VMDStructType type = VMDL_CAMERA;
+  using Pose = VMDCameraPose;
+  static std::span<VMDCameraSingleFrame> section(VMDFile* vf){
+    return {vf->camera_frames.frames, vf->camera_frames.num_frames};
+  }
+  // keyframes on adjacent frames are a cut, see __VMDLerpCamera()
+  static void lerp(const VMDCameraSingleFrame& a,
+                   const VMDCameraSingleFrame& b, float x, Pose& pose){
+    __VMDLerpCamera(&a, &b, x, &pose);
+  }
+};
+
+template <> struct FrameTraits<VMDLightSingleFrame> {
+  static constexpr VMDStructType type = VMDL_LIGHT;
+  using Pose = VMDLightPose;
+  static std::span<VMDLightSingleFrame> section(VMDFile* vf){
+    return {vf->light_frames.frames, vf->light_frames.num_frames};
+  }
+  static void lerp(const VMDLightSingleFrame& a, const VMDLightSingleFrame& b,
+                   float x, Pose& pose){
+    pose.r = a.r + (b.r - a.r) * x;
+    pose.g = a.g + (b.g - a.g) * x;
+    pose.b = a.b + (b.b - a.b) * x;
+    pose.x = a.x + (b.x - a.x) * x;
+    pose.y = a.y + (b.y - a.y) * x;
+    pose.z = a.z + (b.z - a.z) * x;
+  }
+};
+
+template <> struct FrameTraits<VMDShadowSingleFrame> {
+  static constexpr VMDStructType type = VMDL_SHADOW;
+  using Pose = void;
+  static std::span<VMDShadowSingleFrame> section(VMDFile* vf){
+    return {vf->shadow_frames.frames, vf->shadow_frames.num_frames};
+  }
+};
+
+template <> struct FrameTraits<VMDIKSingleFrame> {
+  static constexpr VMDStructType type = VMDL_IK;
+  using Pose = void;
+  static std::span<VMDIKSingleFrame> section(VMDFile* vf){
+    return {vf->ik_frames.frames, vf->ik_frames.num_frames};
+  }
+};
+
+// Frame types of vmd.h
+template <class T>
+concept Frame = requires { FrameTraits<std::remove_const_t<T>>::type; };
+
+// Frame types interpolated by vmd::sample()
+template <class T>
+concept SampledFrame = Frame<T>
+  && !std::is_void_v<typename FrameTraits<std::remove_const_t<T>>::Pose>;
+
+/**
+ * @brief Frames of a section, or a part of it, in place
+ *  A view, frames belong to the VMDFile they were taken from.
+ */
+template <Frame T>
+class Section {
+ public:
+  using value_type = T;
+
+  constexpr Section() = default;
+  constexpr explicit Section(std::span<T> frames) : frames_(frames) {}
+
+  constexpr std::span<T> frames() const { return frames_; }
+  constexpr T* begin() const { return frames_.data(); }
+  constexpr T* end() const { return frames_.data() + frames_.size(); }
+  constexpr T* data() const { return frames_.data(); }
+  constexpr uint32_t size() const { return (uint32_t)frames_.size(); }
+  constexpr bool empty() const { return frames_.empty(); }
+  constexpr T& operator[](uint32_t i) const { return frames_[i]; }
+
+  // frames can always be read through a view of const frames
+  constexpr operator Section<const T>() const
+    requires (!std::is_const_v<T>) {
+    return Section<const T>(std::span<const T>(frames_));
+  }
+
+ private:
+  std::span<T> frames_;
+};
+
+/**
+ * @brief Position of the first frame at or after a frame number
+ * @note Frames must be sorted, see vmd::sort()
+ * @param (frames) frames
+ * @param (frame) frame number
+ * @return position, frames.size() if every frame is before `frame`
+ */
+template <Frame T>
+inline uint32_t lowerBound(Section<T> frames, uint32_t frame){
+  return (uint32_t)(std::partition_point(frames.begin(), frames.end(),
+                                         [frame](const T& f){
+                                           return f.frame < frame;
+                                         }) - frames.begin());
+}
+
+/**
+ * @brief Frames with frame numbers from `first` to `last`
+ *  Same frames as VMDGetSectionRange().
+ * @note Frames must be sorted, see vmd::sort()
+ * @param (frames) frames
+ * @param (first) first frame number
+ * @param (last) last frame number, inclusive
+ * @return part of `frames`, empty if no frame is in the range
+ */
+template <Frame T>
+inline Section<T> range(Section<T> frames, uint32_t first, uint32_t last){
+  uint32_t begin, end;
+
+  if ( first > last ) return Section<T>();
+  begin = lowerBound(frames, first);
+  end = last == UINT32_MAX ? frames.size() : lowerBound(frames, last + 1);
+  return Section<T>(frames.frames().subspan(begin, end - begin));
+}
+
+/**
+ * @brief Stable sort of frames by frame numbers
+ *  Same order as VMDSortAllFrames(), frames already in order are left
+ *  untouched.
+ * @param (frames) frames to be sorted
+ * @return bool : true if frames have been reordered
+ */
+template <Frame T>
+  requires (!std::is_const_v<T>)
+inline bool sort(Section<T> frames){
+  auto before = [](const T& a, const T& b){ return a.frame < b.frame; };
+
+  if ( std::is_sorted(frames.begin(), frames.end(), before) ) return false;
+  std::stable_sort(frames.begin(), frames.end(), before);
+  return true;
+}
+
+/**
+ * @brief Sample keyframes of a track at a time
+ *  Keys are the keyframes of one bone or one morph gathered in order, or a
+ *  camera or light section as a whole. Before the first key and after the
+ *  last one the track holds that key.
+ * @note Keys must be sorted, see vmd::sort()
+ * @param (keys) keyframes of the track
+ * @param (t) time in frames, can be fractional
+ * @param (pose) [out] interpolated pose
+ * @return bool : false with VMD_ERROR set if there is no key
+ */
+template <SampledFrame T>
+inline bool sample(Section<T> keys, float t,
+                   typename FrameTraits<std::remove_const_t<T>>::Pose& pose){
+  using Traits = FrameTraits<std::remove_const_t<T>>;
+  uint32_t k;
+  float x;
+
+  if ( keys.empty() ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  // last key at or before `t`, or the first key
+  k = (uint32_t)(std::partition_point(keys.begin(), keys.end(),
+                                      [t](const T& f){
+                                        return (float)f.frame <= t;
+                                      }) - keys.begin());
+  k = k == 0 ? 0 : k - 1;
+  const T& a = keys[k];
+  if ( k + 1 == keys.size() || t <= (float)a.frame ) {
+    Traits::lerp(a, a, 0.0f, pose);
+    return true;
+  }
+  const T& b = keys[k + 1];
+  x = b.frame <= a.frame ? 1.0f
+                         : (t - (float)a.frame) / (float)(b.frame - a.frame);
+  Traits::lerp(a, b, x > 1.0f ? 1.0f : x, pose);
+  return true;
+}
+
+/**
+ * @brief VMDFile owned by a scope
+ *  Move-only. Loaders return vmd::File by value, which moves the pointer
+ *  and never the frames. An empty vmd::File (VMDFile failed to load or was
+ *  moved away) converts to false.
+ */
+class File {
+ public:
+  File() = default;
+  // takes ownership of `vf`, which must be released by VMDReleaseVMDFile()
+  explicit File(VMDFile* vf) : vf_(vf) {}
+  File(const File&) = delete;
+  File& operator=(const File&) = delete;
+  File(File&& other) noexcept : vf_(std::exchange(other.vf_, nullptr)) {}
+  File& operator=(File&& other) noexcept {
+    if ( this != &other ) reset(std::exchange(other.vf_, nullptr));
+    return *this;
+  }
+  ~File() { reset(); }
+
+  // see VMDLoadFromFile()
+  static File load(const char* fname){
+    return File(VMDLoadFromFile(fname));
+  }
+  // see VMDLoadFromFileWithOptions(), files in an arena must not outlive it
+  static File load(const char* fname, const VMDLoadOptions& opt){
+    return File(VMDLoadFromFileWithOptions(fname, &opt));
+  }
+  // see VMDLoadFromMemory()
+  static File load(std::span<const std::byte> data){
+    return File(VMDLoadFromMemory(data.data(), data.size()));
+  }
+  // see VMDMapFile()
+  static File map(const char* fname, int flags = 0){
+    return File(VMDMapFile(fname, flags));
+  }
+  // see VMDOpenCache()
+  static File openCache(const char* fname, int flags = 0){
+    return File(VMDOpenCache(fname, flags));
+  }
+  // see VMDCreateVMDFile()
+  static File create(const char* model_name){
+    return File(VMDCreateVMDFile(model_name));
+  }
+
+  VMDFile* get() const { return vf_; }
+  VMDFile* operator->() const { return vf_; }
+  explicit operator bool() const { return vf_ != nullptr; }
+
+  // gives up ownership, the caller releases the returned pointer
+  VMDFile* release() { return std::exchange(vf_, nullptr); }
+
+  // releases the owned VMDFile and takes `vf` instead
+  void reset(VMDFile* vf = nullptr){
+    if ( vf_ != nullptr ) VMDReleaseVMDFile(vf_);
+    vf_ = vf;
+  }
+
+  /**
+   * @brief Frames of a section
+   *  Sections not read yet (VMDLIB_LOAD_LAZY) are read first.
+   * @return frames, empty on failure with VMD_ERROR set
+   */
+  template <Frame T>
+  Section<T> section(){
+    using Traits = FrameTraits<std::remove_const_t<T>>;
+
+    if ( vf_ == nullptr ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return Section<T>();
+    }
+    if ( VMDLoadSections(vf_, VMDLIB_SECTION(Traits::type)) == false ) {
+      return Section<T>();
+    }
+    return Section<T>(Traits::section(vf_));
+  }
+
+  /**
+   * @brief Stable sort of a section by frame numbers
+   *  Track index and curve table built before are rebuilt, and the
+   *  section is recorded for VMDSaveFile(), as VMDSortAllFrames() does.
+   * @return bool : false with VMD_ERROR set, e.g. for read-only mapping
+   */
+  template <Frame T>
+    requires (!std::is_const_v<T>)
+  bool sort(){
+    Section<T> frames;
+
+    if ( vf_ != nullptr && vf_->storage == VMDL_STORAGE_MMAP
+         && (vf_->map_flags & VMDLIB_MAP_COW) == 0 ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return false;
+    }
+    frames = section<T>();
+    if ( frames.empty() ) return vf_ != nullptr;
+    if ( vmd::sort(frames) == false ) return true;
+    VMDMarkEdited(vf_, FrameTraits<T>::type, 0, (uint32_t)frames.size());
+    if ( vf_->index != nullptr && VMDBuildTrackIndex(vf_) == false ) {
+      return false;
+    }
+    if ( vf_->curves != nullptr && VMDBuildCurveTable(vf_) == false ) {
+      return false;
+    }
+    return true;
+  }
+
+  // see VMDSortAllFrames()
+  void sortAll(){ VMDSortAllFrames(vf_); }
+
+  // see VMDFindBoneTrack() and VMDFindMorphTrack()
+  const VMDTrack* findBone(const char* name){
+    return VMDFindBoneTrack(vf_, name);
+  }
+  const VMDTrack* findMorph(const char* name){
+    return VMDFindMorphTrack(vf_, name);
+  }
+
+  // see VMDSampleBone(), VMDSampleMorph(), VMDSampleCamera() and
+  // VMDSampleLight(), which use the curve table of the file if built
+  bool sample(const VMDTrack* bone, float t, VMDBonePose& pose){
+    return VMDSampleBone(vf_, bone, t, &pose);
+  }
+  bool sample(const VMDTrack* morph, float t, float& weight){
+    return VMDSampleMorph(vf_, morph, t, &weight);
+  }
+  bool sample(float t, VMDCameraPose& pose){
+    return VMDSampleCamera(vf_, t, &pose);
+  }
+  bool sample(float t, VMDLightPose& pose){
+    return VMDSampleLight(vf_, t, &pose);
+  }
+
+  // see VMDGetWriteSize(), VMDWriteToMemory() and VMDWriteToFile()
+  size_t writeSize() const { return VMDGetWriteSize(vf_); }
+  size_t write(std::span<std::byte> buf) const {
+    return VMDWriteToMemory(vf_, buf.data(), buf.size());
+  }
+  bool write(const char* fname) const {
+    return VMDWriteToFile(vf_, const_cast<char*>(fname));
+  }
+
+ private:
+  VMDFile* vf_ = nullptr;
+};
+
+} // namespace vmd
+
+#endif /* _HPP_VMDLIB_VMD_ */
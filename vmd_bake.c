@@ -0,0 +1,560 @@
+/**
+ *  @file vmd_bake.c
+ *  @brief Poses of VMD file baked at a fixed rate
+ *  @author ihm4
+ *  @note
+ *    Playing a motion samples every bone and morph at each tick, solving
+ *    curves of keyframes each time. Baking samples them once at every tick
+ *    of a fixed rate (such as 30 or 60 fps) into arrays, so that playback
+ *    only takes the poses of a sample by its index (VMDGetBakedPose()).
+ *
+ *    Poses of a sample are rows of structure of arrays: each component of
+ *    all bones of a sample is contiguous, and the rows of consecutive
+ *    samples follow each other, so playback streams through memory. Rows
+ *    are padded to whole cache lines, and tracks are baked in parallel in
+ *    groups of a cache line, so threads never write to a line together.
+ *    Bones are sampled by VMDSampleBone(), with exact slerp.
+ *
+ *    A bake cache keeps baked motions within a memory budget, and drops the
+ *    least recently used ones not being played to stay in it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <math.h>
+#include "vmd.h"
+
+// Bones or morphs baked by a task, as many as floats of a cache line
+#define VMDLIB_BAKE_TRACKS (VMDLIB_COLUMN_ALIGN / sizeof(float))
+
+// Entry of a bake cache, `baked` first so that it is found from `baked`
+typedef struct VMDBakeEntry {
+  VMDBakedMotion       baked;
+  const VMDFile*       vf;     // file baked
+  uint32_t             pins;   // VMDCacheBakedMotion() not unpinned yet
+  bool                 stale;  // evicted while pinned, freed when unpinned
+  struct VMDBakeEntry* prev;   // more recently used
+  struct VMDBakeEntry* next;   // less recently used
+} VMDBakeEntry;
+
+struct VMDBakeCache {
+  size_t        budget; // bytes of baked motions to be kept
+  size_t        used;   // bytes of baked motions in the cache
+  VMDBakeEntry* head;   // most recently used
+  VMDBakeEntry* tail;   // least recently used
+};
+
+// State of a bake shared by its tasks
+typedef struct {
+  VMDFile*        vf;
+  VMDBakedMotion* baked;
+  uint32_t        bone_tasks;  // tasks of groups of bones
+  uint32_t        morph_tasks; // tasks of groups of morphs
+} VMDBake;
+
+/**
+ * @brief Round number of tracks up to whole groups of a task
+ *  Internally called function
+ * @param (num) number of tracks
+ * @return elements of a row
+ */
+static uint32_t __VMDBakeStride(uint32_t num){
+  return (uint32_t)((num + VMDLIB_BAKE_TRACKS - 1) & ~(VMDLIB_BAKE_TRACKS - 1));
+}
+
+/**
+ * @brief Round size of an array up to whole cache lines
+ *  Internally called function
+ * @param (bytes) size of the array
+ * @return size in the block
+ */
+static size_t __VMDBakeAlign(size_t bytes){
+  return (bytes + VMDLIB_COLUMN_ALIGN - 1)
+         & ~(size_t)(VMDLIB_COLUMN_ALIGN - 1);
+}
+
+/**
+ * @brief Time of a sample
+ *  Internally called function
+ * @param (baked) baked motion
+ * @param (s) sample
+ * @return time in frames
+ */
+static float __VMDBakeTime(const VMDBakedMotion* baked, uint32_t s){
+  return (float)((double)s * VMDLIB_FRAME_RATE / baked->fps);
+}
+
+/**
+ * @brief Bake a group of bones
+ *  Internally called function. Lanes past the last bone are the rest pose.
+ * @param (bk) state of the bake
+ * @param (first) first bone of the group
+ * @return void
+ */
+static void __VMDBakeBones(const VMDBake* bk, uint32_t first){
+  const VMDBakedMotion* baked = bk->baked;
+  const VMDTrack* tracks = bk->vf->index->bones.tracks;
+  const VMDBonePoses* out = &baked->bones;
+  VMDBonePose pose;
+  size_t at;
+
+  for ( uint32_t b = first; b < first + VMDLIB_BAKE_TRACKS; b++ ) {
+    for ( uint32_t s = 0; s < baked->num_samples; s++ ) {
+      if ( b < baked->num_bones ) {
+        VMDSampleBone(bk->vf, &tracks[b], __VMDBakeTime(baked, s), &pose);
+      } else {
+        memset(&pose, 0, sizeof(VMDBonePose));
+        pose.qw = 1.0f;
+      }
+      at = (size_t)s * baked->bone_stride + b;
+      out->x[at] = pose.x;
+      out->y[at] = pose.y;
+      out->z[at] = pose.z;
+      out->qx[at] = pose.qx;
+      out->qy[at] = pose.qy;
+      out->qz[at] = pose.qz;
+      out->qw[at] = pose.qw;
+    }
+  }
+}
+
+/**
+ * @brief Bake a group of morphs
+ *  Internally called function. Lanes past the last morph are 0.
+ * @param (bk) state of the bake
+ * @param (first) first morph of the group
+ * @return void
+ */
+static void __VMDBakeMorphs(const VMDBake* bk, uint32_t first){
+  const VMDBakedMotion* baked = bk->baked;
+  const VMDTrack* tracks = bk->vf->index->morphs.tracks;
+  float weight;
+
+  for ( uint32_t m = first; m < first + VMDLIB_BAKE_TRACKS; m++ ) {
+    for ( uint32_t s = 0; s < baked->num_samples; s++ ) {
+      weight = 0.0f;
+      if ( m < baked->num_morphs ) {
+        VMDSampleMorph(bk->vf, &tracks[m], __VMDBakeTime(baked, s), &weight);
+      }
+      baked->morphs[(size_t)s * baked->morph_stride + m] = weight;
+    }
+  }
+}
+
+/**
+ * @brief Task of a bake
+ *  Internally called function, run for every group of bones and morphs
+ *  and once more for the camera and the light
+ * @param (arg) state of the bake
+ * @param (index) task
+ * @return void
+ */
+static void __VMDBakeTask(void* arg, uint32_t index){
+  const VMDBake* bk = arg;
+  const VMDBakedMotion* baked = bk->baked;
+  float t;
+
+  if ( index < bk->bone_tasks ) {
+    __VMDBakeBones(bk, index * VMDLIB_BAKE_TRACKS);
+    return;
+  }
+  index -= bk->bone_tasks;
+  if ( index < bk->morph_tasks ) {
+    __VMDBakeMorphs(bk, index * VMDLIB_BAKE_TRACKS);
+    return;
+  }
+  for ( uint32_t s = 0; s < baked->num_samples; s++ ) {
+    t = __VMDBakeTime(baked, s);
+    if ( baked->cameras != NULL ) {
+      VMDSampleCamera(bk->vf, t, &baked->cameras[s]);
+    }
+    if ( baked->lights != NULL ) VMDSampleLight(bk->vf, t, &baked->lights[s]);
+  }
+}
+
+/**
+ * @brief Last frame number of a section
+ *  Internally called function
+ * @param (frames) frames of the section
+ * @param (num) number of frames
+ * @param (size) size of a frame
+ * @param (key) offset of the frame number in a frame
+ * @param (last) [in,out] last frame number so far
+ * @return void
+ */
+static void __VMDBakeLastFrame(const void* frames, uint32_t num, size_t size,
+                               size_t key, uint32_t* last){
+  uint32_t f;
+
+  for ( uint32_t i = 0; i < num; i++ ) {
+    memcpy(&f, (const char*)frames + size * i + key, sizeof(uint32_t));
+    if ( f > *last ) *last = f;
+  }
+}
+
+/**
+ * @brief Bake a motion into a baked motion given
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (fps) samples per second
+ * @param (exec) runs tasks in parallel, or NULL
+ * @param (baked) [out] baked motion
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDBake(VMDFile* vf, float fps, const VMDExecutor* exec,
+                      VMDBakedMotion* baked){
+  VMDBake bk;
+  uint32_t last = 0, tasks;
+  uint64_t num;
+  size_t row, names, cameras, lights;
+  char* cursor;
+
+  if ( vf == NULL || !(fps > 0.0f) || isinf(fps) ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  // samplers must not build anything from the tasks
+  if ( VMDLoadSections(vf, VMDLIB_SECTION_ALL) == false ) return false;
+  if ( vf->index == NULL && VMDBuildTrackIndex(vf) == false ) return false;
+  if ( vf->curves == NULL && VMDBuildCurveTable(vf) == false ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+
+  __VMDBakeLastFrame(vf->bone_frames.frames, vf->bone_frames.num_frames,
+                     sizeof(VMDBoneSingleFrame),
+                     offsetof(VMDBoneSingleFrame, frame), &last);
+  __VMDBakeLastFrame(vf->morph_frames.frames, vf->morph_frames.num_frames,
+                     sizeof(VMDMorphSingleFrame),
+                     offsetof(VMDMorphSingleFrame, frame), &last);
+  __VMDBakeLastFrame(vf->camera_frames.frames, vf->camera_frames.num_frames,
+                     sizeof(VMDCameraSingleFrame),
+                     offsetof(VMDCameraSingleFrame, frame), &last);
+  __VMDBakeLastFrame(vf->light_frames.frames, vf->light_frames.num_frames,
+                     sizeof(VMDLightSingleFrame),
+                     offsetof(VMDLightSingleFrame, frame), &last);
+  num = (uint64_t)floor((double)last * fps / VMDLIB_FRAME_RATE) + 1;
+  if ( num > UINT32_MAX ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+
+  memset(baked, 0, sizeof(VMDBakedMotion));
+  baked->fps = fps;
+  baked->num_samples = (uint32_t)num;
+  baked->num_bones = vf->index->bones.num_tracks;
+  baked->num_morphs = vf->index->morphs.num_tracks;
+  baked->bone_stride = __VMDBakeStride(baked->num_bones);
+  baked->morph_stride = __VMDBakeStride(baked->num_morphs);
+  names = __VMDBakeAlign((size_t)(VMDLIB_NAME_SIZE + 1) * baked->num_bones)
+          + __VMDBakeAlign((size_t)(VMDLIB_NAME_SIZE + 1) * baked->num_morphs);
+  row = sizeof(float) * num;
+  cameras = vf->camera_frames.num_frames == 0 ? 0
+            : __VMDBakeAlign(sizeof(VMDCameraPose) * num);
+  lights = vf->light_frames.num_frames == 0 ? 0
+           : __VMDBakeAlign(sizeof(VMDLightPose) * num);
+  baked->size = names + row * baked->bone_stride * 7
+                + row * baked->morph_stride + cameras + lights;
+  baked->block = __VMDAllocColumns(baked->size);
+  if ( baked->block == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+
+  // arrays of rows are whole cache lines, so every array stays aligned
+  cursor = baked->block;
+  baked->bone_names = (void*)cursor;
+  cursor += __VMDBakeAlign((size_t)(VMDLIB_NAME_SIZE + 1) * baked->num_bones);
+  baked->morph_names = (void*)cursor;
+  cursor += __VMDBakeAlign((size_t)(VMDLIB_NAME_SIZE + 1) * baked->num_morphs);
+#define VMDLIB_TAKE(member, stride) \
+  member = (float*)cursor; \
+  cursor += row * (stride)
+  VMDLIB_TAKE(baked->bones.x, baked->bone_stride);
+  VMDLIB_TAKE(baked->bones.y, baked->bone_stride);
+  VMDLIB_TAKE(baked->bones.z, baked->bone_stride);
+  VMDLIB_TAKE(baked->bones.qx, baked->bone_stride);
+  VMDLIB_TAKE(baked->bones.qy, baked->bone_stride);
+  VMDLIB_TAKE(baked->bones.qz, baked->bone_stride);
+  VMDLIB_TAKE(baked->bones.qw, baked->bone_stride);
+  VMDLIB_TAKE(baked->morphs, baked->morph_stride);
+#undef VMDLIB_TAKE
+  if ( cameras != 0 ) baked->cameras = (VMDCameraPose*)cursor;
+  cursor += cameras;
+  if ( lights != 0 ) baked->lights = (VMDLightPose*)cursor;
+
+  for ( uint32_t i = 0; i < baked->num_bones; i++ ) {
+    memcpy(baked->bone_names[i], vf->index->bones.tracks[i].name,
+           VMDLIB_NAME_SIZE + 1);
+  }
+  for ( uint32_t i = 0; i < baked->num_morphs; i++ ) {
+    memcpy(baked->morph_names[i], vf->index->morphs.tracks[i].name,
+           VMDLIB_NAME_SIZE + 1);
+  }
+
+  bk.vf = vf;
+  bk.baked = baked;
+  bk.bone_tasks = baked->bone_stride / VMDLIB_BAKE_TRACKS;
+  bk.morph_tasks = baked->morph_stride / VMDLIB_BAKE_TRACKS;
+  tasks = bk.bone_tasks + bk.morph_tasks + 1;
+  if ( exec != NULL && exec->parallel_for != NULL ) {
+    exec->parallel_for(exec->ctx, tasks, __VMDBakeTask, &bk);
+  } else {
+    for ( uint32_t i = 0; i < tasks; i++ ) __VMDBakeTask(&bk, i);
+  }
+  return true;
+}
+
+/**
+ * @note Don't forget to release returned pointer by VMDReleaseBakedMotion()
+ * @brief Bake poses of bones, morphs, camera and light at a fixed rate
+ *  Samples from time 0 up to the last keyframe. The track index is built
+ *  if not yet, and the baked motion does not refer to `vf` afterwards.
+ *  Camera and light frames must be sorted, see VMDSortAllFrames().
+ * @param (vf) a pointer to VMDFile
+ * @param (fps) samples per second, such as 30 or 60
+ * @param (exec) runs groups of tracks in parallel, or NULL
+ * @return baked motion, or NULL with VMD_ERROR set
+ */
+VMDBakedMotion* VMDBakeMotion(VMDFile* vf, float fps, const VMDExecutor* exec){
+  VMDBakedMotion* baked = malloc(sizeof(VMDBakedMotion));
+
+  if ( baked == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  if ( __VMDBake(vf, fps, exec, baked) == false ) {
+    free(baked);
+    return NULL;
+  }
+  return baked;
+}
+
+/**
+ * @brief Release baked motion made by VMDBakeMotion()
+ * @param (baked) baked motion, or NULL
+ * @return void
+ */
+void VMDReleaseBakedMotion(VMDBakedMotion* baked){
+  if ( baked == NULL ) return;
+  __VMDFreeColumns(baked->block);
+  free(baked);
+}
+
+/**
+ * @brief Get poses of a sample of baked motion
+ *  Takes no time whichever sample it is, the poses are pointers into
+ *  `baked`. The sample at `t` seconds is `t * baked->fps`, samples past the
+ *  last one are the last one (the motion holds its last pose).
+ * @param (baked) baked motion
+ * @param (sample) sample
+ * @param (pose) [out] poses of the sample
+ * @return bool : false for an invalid call
+ */
+bool VMDGetBakedPose(const VMDBakedMotion* baked, uint32_t sample,
+                     VMDBakedPose* pose){
+  size_t at;
+
+  if ( baked == NULL || pose == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( sample >= baked->num_samples ) sample = baked->num_samples - 1;
+  at = (size_t)sample * baked->bone_stride;
+  pose->bones.x = baked->bones.x + at;
+  pose->bones.y = baked->bones.y + at;
+  pose->bones.z = baked->bones.z + at;
+  pose->bones.qx = baked->bones.qx + at;
+  pose->bones.qy = baked->bones.qy + at;
+  pose->bones.qz = baked->bones.qz + at;
+  pose->bones.qw = baked->bones.qw + at;
+  pose->morphs = baked->morphs + (size_t)sample * baked->morph_stride;
+  pose->camera = baked->cameras == NULL ? NULL : &baked->cameras[sample];
+  pose->light = baked->lights == NULL ? NULL : &baked->lights[sample];
+  return true;
+}
+
+/**
+ * @note Don't forget to release returned pointer by VMDReleaseBakeCache()
+ * @brief Create cache of baked motions
+ *  A cache is used from one thread at a time.
+ * @param (budget) bytes of baked motions the cache keeps
+ * @return cache, or NULL if memory is insufficient
+ */
+VMDBakeCache* VMDCreateBakeCache(size_t budget){
+  VMDBakeCache* cache = calloc(1, sizeof(VMDBakeCache));
+
+  if ( cache == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  cache->budget = budget;
+  return cache;
+}
+
+/**
+ * @brief Remove entry from the list of a bake cache and free it
+ *  Internally called function
+ * @param (cache) bake cache
+ * @param (e) entry
+ * @return void
+ */
+static void __VMDBakeCacheFree(VMDBakeCache* cache, VMDBakeEntry* e){
+  if ( e->prev != NULL ) e->prev->next = e->next; else cache->head = e->next;
+  if ( e->next != NULL ) e->next->prev = e->prev; else cache->tail = e->prev;
+  cache->used -= e->baked.size;
+  __VMDFreeColumns(e->baked.block);
+  free(e);
+}
+
+/**
+ * @brief Drop least recently used motions not pinned to meet the budget
+ *  Internally called function
+ * @param (cache) bake cache
+ * @return void
+ */
+static void __VMDBakeCacheTrim(VMDBakeCache* cache){
+  VMDBakeEntry* e = cache->tail;
+  VMDBakeEntry* prev;
+
+  while ( e != NULL && cache->used > cache->budget ) {
+    prev = e->prev;
+    if ( e->pins == 0 ) __VMDBakeCacheFree(cache, e);
+    e = prev;
+  }
+}
+
+/**
+ * @brief Release cache of baked motions with all motions in it
+ *  Motions still pinned are released too.
+ * @param (cache) bake cache, or NULL
+ * @return void
+ */
+void VMDReleaseBakeCache(VMDBakeCache* cache){
+  if ( cache == NULL ) return;
+  while ( cache->head != NULL ) __VMDBakeCacheFree(cache, cache->head);
+  free(cache);
+}
+
+/**
+ * @brief Get a motion baked at a rate from a bake cache
+ *  The motion is baked by VMDBakeMotion() unless the cache has it, and
+ *  stays valid until it is unpinned by VMDUnpinBakedMotion(), once for
+ *  each call. Motions not pinned are dropped least recently used first
+ *  when the cache is over its budget. Motions being pinned are never
+ *  dropped, so the cache can hold more than the budget while they are.
+ *
+ *  Motions are looked up by `vf` itself. Evict motions of a file by
+ *  VMDEvictBakedMotions() before the file is edited or released.
+ * @param (cache) bake cache
+ * @param (vf) a pointer to VMDFile
+ * @param (fps) samples per second
+ * @param (exec) runs tracks in parallel when a motion is baked, or NULL
+ * @return baked motion, or NULL with VMD_ERROR set
+ */
+const VMDBakedMotion* VMDCacheBakedMotion(VMDBakeCache* cache, VMDFile* vf,
+                                          float fps, const VMDExecutor* exec){
+  VMDBakeEntry* e;
+
+  if ( cache == NULL || vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  for ( e = cache->head; e != NULL; e = e->next ) {
+    if ( e->vf == vf && e->baked.fps == fps && e->stale == false ) break;
+  }
+  if ( e != NULL ) {
+    // most recently used first
+    if ( e->prev != NULL ) {
+      e->prev->next = e->next;
+      if ( e->next != NULL ) {
+        e->next->prev = e->prev;
+      } else {
+        cache->tail = e->prev;
+      }
+      e->prev = NULL;
+      e->next = cache->head;
+      cache->head->prev = e;
+      cache->head = e;
+    }
+    e->pins++;
+    return &e->baked;
+  }
+
+  e = calloc(1, sizeof(VMDBakeEntry));
+  if ( e == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  if ( __VMDBake(vf, fps, exec, &e->baked) == false ) {
+    free(e);
+    return NULL;
+  }
+  e->vf = vf;
+  e->pins = 1;
+  e->next = cache->head;
+  if ( cache->head != NULL ) cache->head->prev = e; else cache->tail = e;
+  cache->head = e;
+  cache->used += e->baked.size;
+  __VMDBakeCacheTrim(cache);
+  return &e->baked;
+}
+
+/**
+ * @brief Unpin a motion got by VMDCacheBakedMotion()
+ *  The motion may be dropped afterwards and must not be used any more.
+ * @param (cache) bake cache
+ * @param (baked) baked motion of the cache
+ * @return void
+ */
+void VMDUnpinBakedMotion(VMDBakeCache* cache, const VMDBakedMotion* baked){
+  VMDBakeEntry* e = (VMDBakeEntry*)baked;
+
+  if ( cache == NULL || e == NULL || e->pins == 0 ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return;
+  }
+  e->pins--;
+  if ( e->pins == 0 && e->stale ) {
+    __VMDBakeCacheFree(cache, e);
+    return;
+  }
+  __VMDBakeCacheTrim(cache);
+}
+
+/**
+ * @brief Drop motions of a file from a bake cache
+ *  Motions being pinned are dropped when they are unpinned, and are no
+ *  longer found by VMDCacheBakedMotion() meanwhile.
+ * @param (cache) bake cache
+ * @param (vf) file whose motions are dropped, or NULL for all files
+ * @return void
+ */
+void VMDEvictBakedMotions(VMDBakeCache* cache, const VMDFile* vf){
+  VMDBakeEntry* e;
+  VMDBakeEntry* next;
+
+  if ( cache == NULL ) return;
+  for ( e = cache->head; e != NULL; e = next ) {
+    next = e->next;
+    if ( vf != NULL && e->vf != vf ) continue;
+    if ( e->pins == 0 ) {
+      __VMDBakeCacheFree(cache, e);
+    } else {
+      e->stale = true;
+    }
+  }
+}
+
+/**
+ * @brief Bytes of baked motions held by a bake cache
+ * @param (cache) bake cache
+ * @return bytes, including motions being pinned
+ */
+size_t VMDGetBakeCacheSize(const VMDBakeCache* cache){
+  return cache == NULL ? 0 : cache->used;
+}
@@ -0,0 +1,391 @@
+/**
+ *  @file vmd_batch.c
+ *  @brief Batch sampling of bones of VMD file
+ *  @author ihm4
+ *  @note
+ *    Bones are sampled in chunks. Keyframes and curve weights of each bone
+ *    are gathered into a structure of arrays first, then positions and
+ *    rotations of the chunk are blended by SIMD instructions, 8 bones at
+ *    once with AVX2, or 4 with SSE2 and NEON. The instruction set is chosen
+ *    at run time on x86. Define VMDLIB_NO_SIMD to use the scalar code only.
+ *
+ *    Rotations are interpolated by nlerp with the correction of the
+ *    interpolation parameter described in "Approximating slerp" by
+ *    Arseny Kapoulkine, which stays within about 1e-3 of slerp. Use
+ *    VMDSampleBone() where exact slerp is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "vmd.h"
+
+#if !defined(VMDLIB_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#define VMDLIB_SIMD_X86
+#include <immintrin.h>
+#elif !defined(VMDLIB_NO_SIMD) && defined(__ARM_NEON)
+#define VMDLIB_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// Number of bones gathered at once
+#define VMDLIB_BATCH_SIZE (64)
+
+// Keyframes of a chunk of bones, a: previous keyframe, b: next keyframe
+typedef struct {
+  float ax[VMDLIB_BATCH_SIZE], ay[VMDLIB_BATCH_SIZE], az[VMDLIB_BATCH_SIZE];
+  float bx[VMDLIB_BATCH_SIZE], by[VMDLIB_BATCH_SIZE], bz[VMDLIB_BATCH_SIZE];
+  float qa[4][VMDLIB_BATCH_SIZE];
+  float qb[4][VMDLIB_BATCH_SIZE];
+  float w[4][VMDLIB_BATCH_SIZE]; // weights of X, Y, Z and rotation
+} __attribute__((aligned(32))) VMDBoneBatch;
+
+// Blends bones [begin, end) of a chunk into out[base + i]
+typedef void (*VMDBlendFunc)(const VMDBoneBatch*, uint32_t, uint32_t,
+                             const VMDBonePoses*, uint32_t);
+
+/**
+ * @brief Blend bones of a chunk without SIMD
+ *  Internally called function. Also used for the bones left over by the
+ *  SIMD versions.
+ * @param (bb) chunk of bones
+ * @param (begin) first bone in chunk
+ * @param (end) last bone in chunk + 1
+ * @param (out) [out] poses
+ * @param (base) position of the chunk in `out`
+ * @return void
+ */
+static void __VMDBlendBonesScalar(const VMDBoneBatch* bb, uint32_t begin,
+                                  uint32_t end, const VMDBonePoses* out,
+                                  uint32_t base){
+  float d, sign, t, k, ot, q[4], len;
+
+  for ( uint32_t i = begin; i < end; i++ ) {
+    out->x[base + i] = bb->ax[i] + (bb->bx[i] - bb->ax[i]) * bb->w[0][i];
+    out->y[base + i] = bb->ay[i] + (bb->by[i] - bb->ay[i]) * bb->w[1][i];
+    out->z[base + i] = bb->az[i] + (bb->bz[i] - bb->az[i]) * bb->w[2][i];
+
+    d = bb->qa[0][i] * bb->qb[0][i] + bb->qa[1][i] * bb->qb[1][i]
+        + bb->qa[2][i] * bb->qb[2][i] + bb->qa[3][i] * bb->qb[3][i];
+    sign = d < 0.0f ? -1.0f : 1.0f;
+    d = fabsf(d);
+    t = bb->w[3][i];
+    k = (1.0904f + d * (-3.2452f + d * (3.55645f - d * 1.43519f)))
+        * (t - 0.5f) * (t - 0.5f)
+        + (0.848013f + d * (-1.06021f + d * 0.215638f));
+    ot = t + t * (t - 0.5f) * (t - 1.0f) * k;
+    len = 0.0f;
+    for ( int c = 0; c < 4; c++ ) {
+      q[c] = bb->qa[c][i] * (1.0f - ot) + bb->qb[c][i] * ot * sign;
+      len += q[c] * q[c];
+    }
+    len = len > 0.0f ? 1.0f / sqrtf(len) : 0.0f;
+    out->qx[base + i] = q[0] * len;
+    out->qy[base + i] = q[1] * len;
+    out->qz[base + i] = q[2] * len;
+    out->qw[base + i] = q[3] * len;
+  }
+}
+
+#ifdef VMDLIB_SIMD_X86
+/**
+ * @brief Blend bones of a chunk with SSE2
+ *  Internally called function, see __VMDBlendBonesScalar()
+ */
+static void __VMDBlendBonesSSE2(const VMDBoneBatch* bb, uint32_t begin,
+                                uint32_t end, const VMDBonePoses* out,
+                                uint32_t base){
+  const __m128 signmask = _mm_set1_ps(-0.0f);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 tiny = _mm_set1_ps(1e-30f);
+  __m128 a, b, w, d, sign, t, th, ka, kb, ot, q[4], len;
+  uint32_t i = begin;
+
+  for ( ; i + 4 <= end; i += 4 ) {
+#define VMDLIB_LERP(dst, pa, pb, pw)                                         \
+    a = _mm_load_ps(&(pa)[i]);                                               \
+    b = _mm_load_ps(&(pb)[i]);                                               \
+    w = _mm_load_ps(&(pw)[i]);                                               \
+    _mm_storeu_ps(&(dst)[base + i], _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), w)))
+    VMDLIB_LERP(out->x, bb->ax, bb->bx, bb->w[0]);
+    VMDLIB_LERP(out->y, bb->ay, bb->by, bb->w[1]);
+    VMDLIB_LERP(out->z, bb->az, bb->bz, bb->w[2]);
+#undef VMDLIB_LERP
+
+    d = _mm_setzero_ps();
+    for ( int c = 0; c < 4; c++ ) {
+      d = _mm_add_ps(d, _mm_mul_ps(_mm_load_ps(&bb->qa[c][i]),
+                                   _mm_load_ps(&bb->qb[c][i])));
+    }
+    sign = _mm_and_ps(d, signmask);
+    d = _mm_xor_ps(d, sign);
+    t = _mm_load_ps(&bb->w[3][i]);
+    th = _mm_sub_ps(t, half);
+    ka = _mm_add_ps(_mm_set1_ps(3.55645f), _mm_mul_ps(d, _mm_set1_ps(-1.43519f)));
+    ka = _mm_add_ps(_mm_set1_ps(-3.2452f), _mm_mul_ps(d, ka));
+    ka = _mm_add_ps(_mm_set1_ps(1.0904f), _mm_mul_ps(d, ka));
+    kb = _mm_add_ps(_mm_set1_ps(-1.06021f), _mm_mul_ps(d, _mm_set1_ps(0.215638f)));
+    kb = _mm_add_ps(_mm_set1_ps(0.848013f), _mm_mul_ps(d, kb));
+    ka = _mm_add_ps(_mm_mul_ps(ka, _mm_mul_ps(th, th)), kb);
+    ot = _mm_mul_ps(_mm_mul_ps(t, th), _mm_sub_ps(t, one));
+    ot = _mm_add_ps(t, _mm_mul_ps(ot, ka));
+
+    len = _mm_setzero_ps();
+    for ( int c = 0; c < 4; c++ ) {
+      a = _mm_load_ps(&bb->qa[c][i]);
+      b = _mm_xor_ps(_mm_load_ps(&bb->qb[c][i]), sign);
+      q[c] = _mm_add_ps(_mm_mul_ps(a, _mm_sub_ps(one, ot)), _mm_mul_ps(b, ot));
+      len = _mm_add_ps(len, _mm_mul_ps(q[c], q[c]));
+    }
+    len = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(len, tiny)));
+    _mm_storeu_ps(&out->qx[base + i], _mm_mul_ps(q[0], len));
+    _mm_storeu_ps(&out->qy[base + i], _mm_mul_ps(q[1], len));
+    _mm_storeu_ps(&out->qz[base + i], _mm_mul_ps(q[2], len));
+    _mm_storeu_ps(&out->qw[base + i], _mm_mul_ps(q[3], len));
+  }
+  __VMDBlendBonesScalar(bb, i, end, out, base);
+}
+
+/**
+ * @brief Blend bones of a chunk with AVX2
+ *  Internally called function, see __VMDBlendBonesScalar()
+ */
+__attribute__((target("avx2,fma")))
+static void __VMDBlendBonesAVX2(const VMDBoneBatch* bb, uint32_t begin,
+                                uint32_t end, const VMDBonePoses* out,
+                                uint32_t base){
+  const __m256 signmask = _mm256_set1_ps(-0.0f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 tiny = _mm256_set1_ps(1e-30f);
+  __m256 a, b, w, d, sign, t, th, ka, kb, ot, q[4], len;
+  uint32_t i = begin;
+
+  for ( ; i + 8 <= end; i += 8 ) {
+#define VMDLIB_LERP(dst, pa, pb, pw)                                         \
+    a = _mm256_load_ps(&(pa)[i]);                                            \
+    b = _mm256_load_ps(&(pb)[i]);                                            \
+    w = _mm256_load_ps(&(pw)[i]);                                            \
+    _mm256_storeu_ps(&(dst)[base + i], _mm256_fmadd_ps(_mm256_sub_ps(b, a), w, a))
+    VMDLIB_LERP(out->x, bb->ax, bb->bx, bb->w[0]);
+    VMDLIB_LERP(out->y, bb->ay, bb->by, bb->w[1]);
+    VMDLIB_LERP(out->z, bb->az, bb->bz, bb->w[2]);
+#undef VMDLIB_LERP
+
+    d = _mm256_setzero_ps();
+    for ( int c = 0; c < 4; c++ ) {
+      d = _mm256_fmadd_ps(_mm256_load_ps(&bb->qa[c][i]),
+                          _mm256_load_ps(&bb->qb[c][i]), d);
+    }
+    sign = _mm256_and_ps(d, signmask);
+    d = _mm256_xor_ps(d, sign);
+    t = _mm256_load_ps(&bb->w[3][i]);
+    th = _mm256_sub_ps(t, half);
+    ka = _mm256_fmadd_ps(d, _mm256_set1_ps(-1.43519f), _mm256_set1_ps(3.55645f));
+    ka = _mm256_fmadd_ps(d, ka, _mm256_set1_ps(-3.2452f));
+    ka = _mm256_fmadd_ps(d, ka, _mm256_set1_ps(1.0904f));
+    kb = _mm256_fmadd_ps(d, _mm256_set1_ps(0.215638f), _mm256_set1_ps(-1.06021f));
+    kb = _mm256_fmadd_ps(d, kb, _mm256_set1_ps(0.848013f));
+    ka = _mm256_fmadd_ps(ka, _mm256_mul_ps(th, th), kb);
+    ot = _mm256_mul_ps(_mm256_mul_ps(t, th), _mm256_sub_ps(t, one));
+    ot = _mm256_fmadd_ps(ot, ka, t);
+
+    len = _mm256_setzero_ps();
+    for ( int c = 0; c < 4; c++ ) {
+      a = _mm256_load_ps(&bb->qa[c][i]);
+      b = _mm256_xor_ps(_mm256_load_ps(&bb->qb[c][i]), sign);
+      q[c] = _mm256_fmadd_ps(b, ot, _mm256_mul_ps(a, _mm256_sub_ps(one, ot)));
+      len = _mm256_fmadd_ps(q[c], q[c], len);
+    }
+    len = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_max_ps(len, tiny)));
+    _mm256_storeu_ps(&out->qx[base + i], _mm256_mul_ps(q[0], len));
+    _mm256_storeu_ps(&out->qy[base + i], _mm256_mul_ps(q[1], len));
+    _mm256_storeu_ps(&out->qz[base + i], _mm256_mul_ps(q[2], len));
+    _mm256_storeu_ps(&out->qw[base + i], _mm256_mul_ps(q[3], len));
+  }
+  __VMDBlendBonesSSE2(bb, i, end, out, base);
+}
+#endif /* VMDLIB_SIMD_X86 */
+
+#ifdef VMDLIB_SIMD_NEON
+/**
+ * @brief Blend bones of a chunk with NEON
+ *  Internally called function, see __VMDBlendBonesScalar()
+ */
+static void __VMDBlendBonesNEON(const VMDBoneBatch* bb, uint32_t begin,
+                                uint32_t end, const VMDBonePoses* out,
+                                uint32_t base){
+  const float32x4_t one = vdupq_n_f32(1.0f);
+  const float32x4_t half = vdupq_n_f32(0.5f);
+  const float32x4_t tiny = vdupq_n_f32(1e-30f);
+  float32x4_t a, b, w, d, t, th, ka, kb, ot, q[4], len;
+  uint32x4_t sign;
+  uint32_t i = begin;
+
+  for ( ; i + 4 <= end; i += 4 ) {
+#define VMDLIB_LERP(dst, pa, pb, pw)                                         \
+    a = vld1q_f32(&(pa)[i]);                                                 \
+    b = vld1q_f32(&(pb)[i]);                                                 \
+    w = vld1q_f32(&(pw)[i]);                                                 \
+    vst1q_f32(&(dst)[base + i], vmlaq_f32(a, vsubq_f32(b, a), w))
+    VMDLIB_LERP(out->x, bb->ax, bb->bx, bb->w[0]);
+    VMDLIB_LERP(out->y, bb->ay, bb->by, bb->w[1]);
+    VMDLIB_LERP(out->z, bb->az, bb->bz, bb->w[2]);
+#undef VMDLIB_LERP
+
+    d = vdupq_n_f32(0.0f);
+    for ( int c = 0; c < 4; c++ ) {
+      d = vmlaq_f32(d, vld1q_f32(&bb->qa[c][i]), vld1q_f32(&bb->qb[c][i]));
+    }
+    sign = vandq_u32(vreinterpretq_u32_f32(d), vdupq_n_u32(0x80000000u));
+    d = vabsq_f32(d);
+    t = vld1q_f32(&bb->w[3][i]);
+    th = vsubq_f32(t, half);
+    ka = vmlaq_f32(vdupq_n_f32(3.55645f), d, vdupq_n_f32(-1.43519f));
+    ka = vmlaq_f32(vdupq_n_f32(-3.2452f), d, ka);
+    ka = vmlaq_f32(vdupq_n_f32(1.0904f), d, ka);
+    kb = vmlaq_f32(vdupq_n_f32(-1.06021f), d, vdupq_n_f32(0.215638f));
+    kb = vmlaq_f32(vdupq_n_f32(0.848013f), d, kb);
+    ka = vmlaq_f32(kb, ka, vmulq_f32(th, th));
+    ot = vmulq_f32(vmulq_f32(t, th), vsubq_f32(t, one));
+    ot = vmlaq_f32(t, ot, ka);
+
+    len = vdupq_n_f32(0.0f);
+    for ( int c = 0; c < 4; c++ ) {
+      a = vld1q_f32(&bb->qa[c][i]);
+      b = vreinterpretq_f32_u32(veorq_u32(
+            vreinterpretq_u32_f32(vld1q_f32(&bb->qb[c][i])), sign));
+      q[c] = vmlaq_f32(vmulq_f32(a, vsubq_f32(one, ot)), b, ot);
+      len = vmlaq_f32(len, q[c], q[c]);
+    }
+    len = vmaxq_f32(len, tiny);
+    w = vrsqrteq_f32(len);
+    // two Newton steps make the estimate accurate to float precision
+    w = vmulq_f32(w, vrsqrtsq_f32(vmulq_f32(len, w), w));
+    len = vmulq_f32(w, vrsqrtsq_f32(vmulq_f32(len, w), w));
+    vst1q_f32(&out->qx[base + i], vmulq_f32(q[0], len));
+    vst1q_f32(&out->qy[base + i], vmulq_f32(q[1], len));
+    vst1q_f32(&out->qz[base + i], vmulq_f32(q[2], len));
+    vst1q_f32(&out->qw[base + i], vmulq_f32(q[3], len));
+  }
+  __VMDBlendBonesScalar(bb, i, end, out, base);
+}
+#endif /* VMDLIB_SIMD_NEON */
+
+/**
+ * @brief Choose blend function for this CPU
+ *  Internally called function
+ * @return blend function
+ */
+static VMDBlendFunc __VMDSelectBlend(void){
+#if defined(VMDLIB_SIMD_X86)
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ) {
+    return __VMDBlendBonesAVX2;
+  }
+  return __VMDBlendBonesSSE2;
+#elif defined(VMDLIB_SIMD_NEON)
+  return __VMDBlendBonesNEON;
+#else
+  return __VMDBlendBonesScalar;
+#endif
+}
+
+/**
+ * @brief Blend function for this CPU, chosen on first use
+ *  Internally called function. Threads sampling at once may each choose
+ *  it, but they all store the same function atomically.
+ * @return blend function
+ */
+static VMDBlendFunc __VMDGetBlend(void){
+  static VMDBlendFunc blend = NULL;
+  VMDBlendFunc f = __atomic_load_n(&blend, __ATOMIC_ACQUIRE);
+
+  if ( f == NULL ) {
+    f = __VMDSelectBlend();
+    __atomic_store_n(&blend, f, __ATOMIC_RELEASE);
+  }
+  return f;
+}
+
+/**
+ * @brief Gather keyframes of a bone into a chunk
+ *  Internally called function. Bones without track are in the rest pose.
+ * @param (vf) a pointer to VMDFile
+ * @param (track) track of the bone or NULL
+ * @param (t) time in frames
+ * @param (bb) [out] chunk of bones
+ * @param (i) position in the chunk
+ * @return void
+ */
+static void __VMDGatherBone(VMDFile* vf, const VMDTrack* track, float t,
+                            VMDBoneBatch* bb, uint32_t i){
+  const VMDBoneSingleFrame* a;
+  const VMDBoneSingleFrame* b;
+  float w[4];
+
+  if ( track == NULL || track->num_frames == 0 ) {
+    bb->ax[i] = bb->ay[i] = bb->az[i] = 0.0f;
+    bb->bx[i] = bb->by[i] = bb->bz[i] = 0.0f;
+    for ( int c = 0; c < 4; c++ ) {
+      bb->qa[c][i] = bb->qb[c][i] = c == 3 ? 1.0f : 0.0f;
+      bb->w[c][i] = 0.0f;
+    }
+    return;
+  }
+  __VMDBoneKeys(vf, track, t, &a, &b, w);
+  bb->ax[i] = a->x;
+  bb->ay[i] = a->y;
+  bb->az[i] = a->z;
+  bb->bx[i] = b->x;
+  bb->by[i] = b->y;
+  bb->bz[i] = b->z;
+  bb->qa[0][i] = a->qx;
+  bb->qa[1][i] = a->qy;
+  bb->qa[2][i] = a->qz;
+  bb->qa[3][i] = a->qw;
+  bb->qb[0][i] = b->qx;
+  bb->qb[1][i] = b->qy;
+  bb->qb[2][i] = b->qz;
+  bb->qb[3][i] = b->qw;
+  for ( int c = 0; c < 4; c++ ) bb->w[c][i] = w[c];
+}
+
+/**
+ * @brief Sample poses of many bones at a time
+ *  Poses of `tracks[i]` are written to the i-th elements of the arrays of
+ *  `out`. NULL tracks (bones without keyframes) give the rest pose.
+ * @param (vf) a pointer to VMDFile
+ * @param (tracks) tracks of bones, see VMDFindBoneTrack()
+ * @param (num) number of tracks
+ * @param (t) time in frames, can be fractional
+ * @param (out) [out] arrays of at least `num` elements for each component
+ * @return bool : false for an invalid call
+ */
+bool VMDSampleBones(VMDFile* vf, const VMDTrack* const* tracks, uint32_t num,
+                    float t, const VMDBonePoses* out){
+  VMDBlendFunc blend;
+  VMDBoneBatch bb;
+  uint32_t n;
+
+  if ( vf == NULL || (num > 0 && (tracks == NULL || out == NULL)) ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  blend = __VMDGetBlend();
+  // build curve table before the loop rather than in the first bone
+  if ( vf->curves == NULL ) VMDBuildCurveTable(vf);
+
+  for ( uint32_t base = 0; base < num; base += n ) {
+    n = num - base < VMDLIB_BATCH_SIZE ? num - base : VMDLIB_BATCH_SIZE;
+    for ( uint32_t i = 0; i < n; i++ ) {
+      __VMDGatherBone(vf, tracks[base + i], t, &bb, i);
+    }
+    blend(&bb, 0, n, out, base);
+  }
+  return true;
+}
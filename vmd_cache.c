@@ -0,0 +1,885 @@
+/**
+ *  @file vmd_cache.c
+ *  @brief Cache file of VMD data ready for sampling ("VMDC")
+ *  @author ihm4
+ *  @note
+ *    A cache holds the frames of every section together with the data
+ *    derived from them on load: the name table with UTF-8 names, the track
+ *    index and the decoded curves. Opening a cache maps the file and points
+ *    VMDFile into it, only the track list and ShowIK frames are copied, so
+ *    sampling starts without parsing anything.
+ *
+ *    Bone and morph frames are stored grouped by track, each track in frame
+ *    order, so a track is one contiguous run of frames. Other sections are
+ *    sorted by frame number. A cache is specific to the byte order and the
+ *    structure layout of the build which wrote it, and opening a foreign
+ *    one fails with VMDLIB_E_FT. Every id and position in a cache is
+ *    checked on open against what it refers to, so a damaged cache also
+ *    fails with VMDLIB_E_FT instead of being read out of bounds.
+ *
+ *    The file is laid out as below, every chunk starts at a multiple of
+ *    VMDLIB_CACHE_ALIGN.
+ *
+ *      char     magic[4];       // "VMDC"
+ *      uint32_t version;        // 1
+ *      uint32_t byte_order;     // 0x01020304 in the byte order of writer
+ *      uint32_t num_chunks;     // VMDC_NUM_CHUNKS
+ *      uint64_t source_hash;    // __VMDXXHash64() of the VMD form
+ *      uint64_t file_size;
+ *      struct {                 // num_chunks descriptors, 24 bytes each
+ *        uint64_t offset;       // from the head of the file
+ *        uint64_t size;         // count * elem_size
+ *        uint32_t count;        // number of elements
+ *        uint32_t elem_size;    // size of an element
+ *      } chunks[num_chunks];    // indexed by VMDCacheChunkType
+ *      // padding, then the chunks
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmd.h"
+
+#define VMDLIB_CACHE_MAGIC   ("VMDC")
+#define VMDLIB_CACHE_VERSION (1)
+#define VMDLIB_CACHE_ALIGN   (64)
+#define VMDLIB_CACHE_BYTE_ORDER (0x01020304u)
+
+// Chunks of cache file
+typedef enum {
+  VMDC_HEADER,
+  VMDC_BONE,
+  VMDC_MORPH,
+  VMDC_CAMERA,
+  VMDC_LIGHT,
+  VMDC_SHADOW,
+  VMDC_IK,
+  VMDC_IK_POOL,          // VMDIKFrames.ik
+  VMDC_NAMES,            // names of the name table
+  VMDC_NAME_HASH,        // hash slots of the name table
+  VMDC_BONE_TRACKS,      // VMDCacheTrack of each bone track
+  VMDC_BONE_TRACK_OF,    // VMDTrackTable.track_of of bones
+  VMDC_BONE_NAME_IDS,    // VMDTrackTable.name_ids of bones
+  VMDC_BONE_INDICES,     // VMDTrackTable.indices of bones
+  VMDC_MORPH_TRACKS,
+  VMDC_MORPH_TRACK_OF,
+  VMDC_MORPH_NAME_IDS,
+  VMDC_MORPH_INDICES,
+  VMDC_IK_NAME_IDS,      // VMDTrackIndex.ik_name_ids
+  VMDC_CURVES,           // VMDCurveTable.curves
+  VMDC_BONE_CURVES,      // VMDCurveTable.bone_curves
+  VMDC_CAMERA_CURVES,    // VMDCurveTable.camera_curves
+  VMDC_NUM_CHUNKS
+} VMDCacheChunkType;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+  uint32_t count;
+  uint32_t elem_size;
+} VMDCacheChunk;
+
+typedef struct {
+  char          magic[4];
+  uint32_t      version;
+  uint32_t      byte_order;
+  uint32_t      num_chunks;
+  uint64_t      source_hash;
+  uint64_t      file_size;
+  VMDCacheChunk chunks[VMDC_NUM_CHUNKS];
+} VMDCacheHeader;
+
+// Track of bones or morphs in cache file
+typedef struct {
+  uint32_t name_id;
+  uint32_t num_frames;
+  uint32_t first;      // position of the first frame of the track
+} VMDCacheTrack;
+
+// Data of chunks being written
+typedef struct {
+  const void* data[VMDC_NUM_CHUNKS];
+  void*       owned[VMDC_NUM_CHUNKS]; // allocated for the cache, or NULL
+  uint32_t    count[VMDC_NUM_CHUNKS];
+} VMDCacheWriter;
+
+// Size of an element of each chunk
+static const uint32_t __VMD_CACHE_ELEM_SIZE[VMDC_NUM_CHUNKS] = {
+  sizeof(VMDHeader),
+  sizeof(VMDBoneSingleFrame),
+  sizeof(VMDMorphSingleFrame),
+  sizeof(VMDCameraSingleFrame),
+  sizeof(VMDLightSingleFrame),
+  sizeof(VMDShadowSingleFrame),
+  sizeof(VMDIKSingleFrame),
+  sizeof(VMDInfoIK),
+  0, // size of a name is private to vmd_names.c
+  sizeof(uint32_t),
+  sizeof(VMDCacheTrack),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(VMDCacheTrack),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(VMDCurve),
+  sizeof(uint32_t),
+  sizeof(uint32_t)
+};
+
+#define VMDLIB_XXH_PRIME1 (0x9e3779b185ebca87ull)
+#define VMDLIB_XXH_PRIME2 (0xc2b2ae3d27d4eb4full)
+#define VMDLIB_XXH_PRIME3 (0x165667b19e3779f9ull)
+#define VMDLIB_XXH_PRIME4 (0x85ebca77c2b2ae63ull)
+#define VMDLIB_XXH_PRIME5 (0x27d4eb2f165667c5ull)
+#define VMDLIB_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/**
+ * @brief Little endian 64 bit integer
+ *  Internally called function
+ * @param (p) 8 bytes
+ * @return value
+ */
+static uint64_t __VMDRead64(const unsigned char* p){
+  uint64_t v = 0;
+  for ( int i = 7; i >= 0; i-- ) v = (v << 8) | p[i];
+  return v;
+}
+
+/**
+ * @brief Round of xxHash64
+ *  Internally called function
+ * @param (acc) accumulator
+ * @param (input) 8 bytes of input
+ * @return new accumulator
+ */
+static uint64_t __VMDXXHRound(uint64_t acc, uint64_t input){
+  acc += input * VMDLIB_XXH_PRIME2;
+  acc = VMDLIB_ROTL64(acc, 31);
+  return acc * VMDLIB_XXH_PRIME1;
+}
+
+/**
+ * @brief Merge an accumulator of xxHash64
+ *  Internally called function
+ * @param (h) hash
+ * @param (acc) accumulator
+ * @return new hash
+ */
+static uint64_t __VMDXXHMerge(uint64_t h, uint64_t acc){
+  h ^= __VMDXXHRound(0, acc);
+  return h * VMDLIB_XXH_PRIME1 + VMDLIB_XXH_PRIME4;
+}
+
+/**
+ * @brief xxHash64 of bytes
+ *  Internally called function. Same value as XXH64() of the xxHash library
+ *  on any byte order.
+ * @param (data) bytes
+ * @param (size) number of bytes
+ * @param (seed) seed
+ * @return hash
+ */
+uint64_t __VMDXXHash64(const void* data, size_t size, uint64_t seed){
+  const unsigned char* p = data;
+  const unsigned char* end = p + size;
+  uint64_t h, v[4];
+
+  if ( size >= 32 ) {
+    v[0] = seed + VMDLIB_XXH_PRIME1 + VMDLIB_XXH_PRIME2;
+    v[1] = seed + VMDLIB_XXH_PRIME2;
+    v[2] = seed;
+    v[3] = seed - VMDLIB_XXH_PRIME1;
+    for ( ; end - p >= 32; p += 32 ) {
+      v[0] = __VMDXXHRound(v[0], __VMDRead64(p));
+      v[1] = __VMDXXHRound(v[1], __VMDRead64(p + 8));
+      v[2] = __VMDXXHRound(v[2], __VMDRead64(p + 16));
+      v[3] = __VMDXXHRound(v[3], __VMDRead64(p + 24));
+    }
+    h = VMDLIB_ROTL64(v[0], 1) + VMDLIB_ROTL64(v[1], 7)
+        + VMDLIB_ROTL64(v[2], 12) + VMDLIB_ROTL64(v[3], 18);
+    for ( int i = 0; i < 4; i++ ) h = __VMDXXHMerge(h, v[i]);
+  } else {
+    h = seed + VMDLIB_XXH_PRIME5;
+  }
+  h += (uint64_t)size;
+
+  for ( ; end - p >= 8; p += 8 ) {
+    h ^= __VMDXXHRound(0, __VMDRead64(p));
+    h = VMDLIB_ROTL64(h, 27) * VMDLIB_XXH_PRIME1 + VMDLIB_XXH_PRIME4;
+  }
+  if ( end - p >= 4 ) {
+    h ^= (uint64_t)(p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+                    | (uint32_t)p[3] << 24) * VMDLIB_XXH_PRIME1;
+    h = VMDLIB_ROTL64(h, 23) * VMDLIB_XXH_PRIME2 + VMDLIB_XXH_PRIME3;
+    p += 4;
+  }
+  for ( ; p < end; p++ ) {
+    h ^= *p * VMDLIB_XXH_PRIME5;
+    h = VMDLIB_ROTL64(h, 11) * VMDLIB_XXH_PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= VMDLIB_XXH_PRIME2;
+  h ^= h >> 29;
+  h *= VMDLIB_XXH_PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+/**
+ * @brief Hash of the VMD form of VMDFile
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (hash) [out] __VMDXXHash64() of the bytes VMDWriteToMemory() writes
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDSourceHash(VMDFile* vf, uint64_t* hash){
+  size_t size = VMDGetWriteSize(vf);
+  char* buf = malloc(size);
+
+  if ( buf == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  if ( VMDWriteToMemory(vf, buf, size) != size ) {
+    free(buf);
+    return false;
+  }
+  *hash = __VMDXXHash64(buf, size, 0);
+  free(buf);
+  return true;
+}
+
+/**
+ * @brief Allocate data of a chunk
+ *  Internally called function
+ * @param (w) chunks being written
+ * @param (type) chunk
+ * @param (count) number of elements
+ * @param (elem_size) size of an element
+ * @return allocated data, or NULL if memory is insufficient
+ */
+static void* __VMDCacheAlloc(VMDCacheWriter* w, VMDCacheChunkType type,
+                             uint32_t count, size_t elem_size){
+  void* p = malloc(elem_size * count + 1);
+
+  w->owned[type] = p;
+  w->data[type] = p;
+  w->count[type] = count;
+  return p;
+}
+
+/**
+ * @brief Copy frames into a chunk in the given order
+ *  Internally called function
+ * @param (w) chunks being written
+ * @param (type) chunk
+ * @param (frames) head of the frames
+ * @param (order) positions of frames in the order of the chunk
+ * @param (num) number of frames
+ * @return bool : false if memory is insufficient
+ */
+static bool __VMDCacheGather(VMDCacheWriter* w, VMDCacheChunkType type,
+                             const char* frames, const uint32_t* order,
+                             uint32_t num){
+  size_t size = __VMD_CACHE_ELEM_SIZE[type];
+  char* out = __VMDCacheAlloc(w, type, num, size);
+
+  if ( out == NULL ) return false;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    memcpy(out + size * i, frames + size * order[i], size);
+  }
+  return true;
+}
+
+/**
+ * @brief Positions of frames sorted by frame number
+ *  Internally called function. Frames with the same number keep their
+ *  order.
+ * @param (frames) head of the frames, each starts with its frame number
+ * @param (num) number of frames
+ * @param (size) size of a frame
+ * @return positions, released by caller, or NULL if memory is insufficient
+ */
+static uint32_t* __VMDCacheFrameOrder(const char* frames, uint32_t num,
+                                      size_t size){
+  uint64_t* pairs = malloc(sizeof(uint64_t) * num + 1);
+  uint32_t* order = malloc(sizeof(uint32_t) * num + 1);
+  uint32_t key;
+
+  if ( pairs == NULL || order == NULL ) goto error;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    memcpy(&key, frames + size * i, sizeof(uint32_t));
+    pairs[i] = (uint64_t)key << 32 | i;
+  }
+  if ( __VMDSortPairs(pairs, num) == false ) goto error;
+  for ( uint32_t i = 0; i < num; i++ ) order[i] = (uint32_t)pairs[i];
+  free(pairs);
+  return order;
+
+ error:
+  free(pairs);
+  free(order);
+  return NULL;
+}
+
+/**
+ * @brief Prepare chunks of a section sorted by frame number
+ *  Internally called function
+ * @param (w) chunks being written
+ * @param (type) chunk of the frames
+ * @param (frames) head of the frames
+ * @param (num) number of frames
+ * @param (order) [out] positions of frames in the chunk, released by caller
+ * @return bool : false if memory is insufficient
+ */
+static bool __VMDCacheSortedSection(VMDCacheWriter* w, VMDCacheChunkType type,
+                                    const void* frames, uint32_t num,
+                                    uint32_t** order){
+  *order = __VMDCacheFrameOrder(frames, num, __VMD_CACHE_ELEM_SIZE[type]);
+  if ( *order == NULL ) return false;
+  return __VMDCacheGather(w, type, frames, *order, num);
+}
+
+/**
+ * @brief Prepare chunks of bone or morph tracks
+ *  Internally called function. Frames are grouped by track.
+ * @param (w) chunks being written
+ * @param (type) chunk of the frames, followed by chunks of the tracks
+ * @param (table) track table
+ * @param (frames) head of the frames
+ * @param (num) number of frames
+ * @param (order) [out] positions of frames in the chunk, released by caller
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDCacheTracks(VMDCacheWriter* w, VMDCacheChunkType type,
+                             const VMDTrackTable* table, const void* frames,
+                             uint32_t num, uint32_t** order){
+  VMDCacheChunkType tracks = type == VMDC_BONE ? VMDC_BONE_TRACKS
+                                               : VMDC_MORPH_TRACKS;
+  VMDCacheTrack* out;
+  uint32_t* name_ids;
+  uint32_t* indices;
+  uint32_t n = 0;
+
+  *order = malloc(sizeof(uint32_t) * num + 1);
+  out = __VMDCacheAlloc(w, tracks, table->num_tracks, sizeof(VMDCacheTrack));
+  name_ids = __VMDCacheAlloc(w, tracks + 2, num, sizeof(uint32_t));
+  indices = __VMDCacheAlloc(w, tracks + 3, num, sizeof(uint32_t));
+  if ( *order == NULL || out == NULL || name_ids == NULL || indices == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  for ( uint32_t i = 0; i < table->num_tracks; i++ ) {
+    const VMDTrack* track = &table->tracks[i];
+    out[i].name_id = track->name_id;
+    out[i].num_frames = track->num_frames;
+    out[i].first = n;
+    for ( uint32_t k = 0; k < track->num_frames; k++, n++ ) {
+      (*order)[n] = track->frames[k];
+      name_ids[n] = track->name_id;
+      indices[n] = n;
+    }
+  }
+  if ( n != num ) {
+    DEBUG_PRINT("Track index does not cover all frames\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  w->data[tracks + 1] = table->track_of;
+  w->count[tracks + 1] = table->num_ids;
+  if ( __VMDCacheGather(w, type, frames, *order, num) == false ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Prepare chunk of curve ids in the order of frames in the cache
+ *  Internally called function
+ * @param (w) chunks being written
+ * @param (type) chunk
+ * @param (ids) curve ids of the frames
+ * @param (per_frame) number of ids of a frame
+ * @param (order) positions of frames in the cache
+ * @param (num) number of frames
+ * @return bool : false if memory is insufficient
+ */
+static bool __VMDCacheCurveIds(VMDCacheWriter* w, VMDCacheChunkType type,
+                               const uint32_t* ids, uint32_t per_frame,
+                               const uint32_t* order, uint32_t num){
+  uint32_t* out = __VMDCacheAlloc(w, type, num * per_frame, sizeof(uint32_t));
+
+  if ( out == NULL ) return false;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    memcpy(out + per_frame * i, ids + per_frame * order[i],
+           sizeof(uint32_t) * per_frame);
+  }
+  return true;
+}
+
+/**
+ * @brief Write prepared chunks into a file
+ *  Internally called function
+ * @param (w) chunks prepared
+ * @param (hash) hash of the VMD form
+ * @param (name_size) size of a name of the name table
+ * @param (fp) file
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDCacheWrite(const VMDCacheWriter* w, uint64_t hash,
+                            size_t name_size, FILE* fp){
+  static const char zeros[VMDLIB_CACHE_ALIGN] = { 0 };
+  VMDCacheHeader header;
+  uint64_t pos, pad;
+
+  memset(&header, 0, sizeof(VMDCacheHeader));
+  memcpy(header.magic, VMDLIB_CACHE_MAGIC, 4);
+  header.version = VMDLIB_CACHE_VERSION;
+  header.byte_order = VMDLIB_CACHE_BYTE_ORDER;
+  header.num_chunks = VMDC_NUM_CHUNKS;
+  header.source_hash = hash;
+  pos = sizeof(VMDCacheHeader);
+  for ( int i = 0; i < VMDC_NUM_CHUNKS; i++ ) {
+    VMDCacheChunk* c = &header.chunks[i];
+    c->elem_size = i == VMDC_NAMES ? (uint32_t)name_size
+                                   : __VMD_CACHE_ELEM_SIZE[i];
+    c->count = w->count[i];
+    c->size = (uint64_t)c->count * c->elem_size;
+    pos = (pos + VMDLIB_CACHE_ALIGN - 1) & ~(uint64_t)(VMDLIB_CACHE_ALIGN - 1);
+    c->offset = pos;
+    pos += c->size;
+  }
+  header.file_size = pos;
+
+  if ( fwrite(&header, sizeof(VMDCacheHeader), 1, fp) != 1 ) goto error;
+  pos = sizeof(VMDCacheHeader);
+  for ( int i = 0; i < VMDC_NUM_CHUNKS; i++ ) {
+    pad = header.chunks[i].offset - pos;
+    if ( pad > 0 && fwrite(zeros, (size_t)pad, 1, fp) != 1 ) goto error;
+    if ( header.chunks[i].size > 0
+         && fwrite(w->data[i], (size_t)header.chunks[i].size, 1, fp) != 1 ) {
+      goto error;
+    }
+    pos = header.chunks[i].offset + header.chunks[i].size;
+  }
+  return true;
+
+ error:
+  DEBUG_PRINT("File write error.\n");
+  VMD_ERROR = VMDLIB_E_WR;
+  return false;
+}
+
+/**
+ * @brief Export VMDFile as cache file
+ *  The track index and the curve table are built for the export if `vf`
+ *  does not have them, and released afterwards. `vf` itself is not
+ *  reordered. The cache is written to "<fname>.tmp" first and renamed to
+ *  `fname`, so processes having the old cache mapped keep reading it.
+ * @param (vf) a pointer to VMDFile
+ * @param (fname) cache file name to be written
+ * @return bool : false with VMD_ERROR set on failure
+ * @sa VMDOpenCache
+ */
+bool VMDExportCache(VMDFile* vf, const char* fname){
+  VMDCacheWriter w;
+  uint32_t* order[VMDC_IK + 1] = { NULL };
+  bool had_index, had_curves, ok = false;
+  const uint32_t* hash_slots;
+  uint32_t hash_size;
+  size_t name_size;
+  uint64_t hash;
+  char* tmp = NULL;
+  FILE* fp = NULL;
+
+  if ( vf == NULL || fname == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  memset(&w, 0, sizeof(VMDCacheWriter));
+  if ( VMDLoadSections(vf, VMDLIB_SECTION_ALL) == false ) return false;
+  had_index = vf->index != NULL;
+  had_curves = vf->curves != NULL;
+  if ( had_index == false && VMDBuildTrackIndex(vf) == false ) return false;
+  if ( had_curves == false && VMDBuildCurveTable(vf) == false ) goto done;
+  if ( __VMDSourceHash(vf, &hash) == false ) goto done;
+
+  w.data[VMDC_HEADER] = &vf->header;
+  w.count[VMDC_HEADER] = 1;
+  if ( __VMDCacheTracks(&w, VMDC_BONE, &vf->index->bones,
+                        vf->bone_frames.frames, vf->bone_frames.num_frames,
+                        &order[VMDC_BONE]) == false
+       || __VMDCacheTracks(&w, VMDC_MORPH, &vf->index->morphs,
+                           vf->morph_frames.frames,
+                           vf->morph_frames.num_frames,
+                           &order[VMDC_MORPH]) == false ) {
+    goto done;
+  }
+  if ( __VMDCacheSortedSection(&w, VMDC_CAMERA, vf->camera_frames.frames,
+                               vf->camera_frames.num_frames,
+                               &order[VMDC_CAMERA]) == false
+       || __VMDCacheSortedSection(&w, VMDC_LIGHT, vf->light_frames.frames,
+                                  vf->light_frames.num_frames,
+                                  &order[VMDC_LIGHT]) == false
+       || __VMDCacheSortedSection(&w, VMDC_SHADOW, vf->shadow_frames.frames,
+                                  vf->shadow_frames.num_frames,
+                                  &order[VMDC_SHADOW]) == false
+       || __VMDCacheSortedSection(&w, VMDC_IK, vf->ik_frames.frames,
+                                  vf->ik_frames.num_frames,
+                                  &order[VMDC_IK]) == false
+       || __VMDCacheCurveIds(&w, VMDC_BONE_CURVES, vf->curves->bone_curves, 4,
+                             order[VMDC_BONE],
+                             vf->bone_frames.num_frames) == false
+       || __VMDCacheCurveIds(&w, VMDC_CAMERA_CURVES,
+                             vf->curves->camera_curves, 6, order[VMDC_CAMERA],
+                             vf->camera_frames.num_frames) == false ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    goto done;
+  }
+  // IK entries stay in place, ShowIK frames refer to them by offset
+  w.data[VMDC_IK_POOL] = vf->ik_frames.ik;
+  w.count[VMDC_IK_POOL] = vf->ik_frames.num_ik;
+  w.data[VMDC_IK_NAME_IDS] = vf->index->ik_name_ids;
+  w.count[VMDC_IK_NAME_IDS] = vf->ik_frames.num_ik;
+  w.data[VMDC_NAMES] = __VMDNameTableArrays(vf->names, &name_size,
+                                            &hash_slots, &hash_size);
+  w.count[VMDC_NAMES] = VMDGetNumNames(vf->names);
+  w.data[VMDC_NAME_HASH] = hash_slots;
+  w.count[VMDC_NAME_HASH] = hash_size;
+  w.data[VMDC_CURVES] = vf->curves->curves;
+  w.count[VMDC_CURVES] = vf->curves->num_curves;
+
+  tmp = malloc(strlen(fname) + 5);
+  if ( tmp == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    goto done;
+  }
+  sprintf(tmp, "%s.tmp", fname);
+  fp = fopen(tmp, "wb");
+  if ( fp == NULL ) {
+    DEBUG_PRINT("File open error.\n");
+    VMD_ERROR = VMDLIB_E_FH;
+    goto done;
+  }
+  ok = __VMDCacheWrite(&w, hash, name_size, fp);
+  if ( fclose(fp) != 0 && ok ) {
+    VMD_ERROR = VMDLIB_E_WR;
+    ok = false;
+  }
+#ifdef _WIN32
+  // rename() of Windows does not replace an existing file
+  if ( ok ) remove(fname);
+#endif
+  if ( ok && rename(tmp, fname) != 0 ) {
+    VMD_ERROR = VMDLIB_E_WR;
+    ok = false;
+  }
+  if ( ok == false ) remove(tmp);
+
+ done:
+  for ( int i = 0; i < VMDC_NUM_CHUNKS; i++ ) free(w.owned[i]);
+  for ( int i = 0; i <= VMDC_IK; i++ ) free(order[i]);
+  free(tmp);
+  if ( had_curves == false ) VMDReleaseCurveTable(vf);
+  if ( had_index == false ) VMDReleaseTrackIndex(vf);
+  return ok;
+}
+
+/**
+ * @brief Check header of cache file
+ *  Internally called function
+ * @param (header) header
+ * @param (size) size of the file, 0 not to check the chunks
+ * @return bool : false if the file is not a cache of this build
+ */
+static bool __VMDCheckCacheHeader(const VMDCacheHeader* header, size_t size){
+  const VMDCacheChunk* c;
+
+  if ( memcmp(header->magic, VMDLIB_CACHE_MAGIC, 4) != 0
+       || header->version != VMDLIB_CACHE_VERSION
+       || header->byte_order != VMDLIB_CACHE_BYTE_ORDER
+       || header->num_chunks != VMDC_NUM_CHUNKS ) {
+    return false;
+  }
+  if ( size == 0 ) return true;
+  if ( header->file_size != size ) return false;
+  for ( int i = 0; i < VMDC_NUM_CHUNKS; i++ ) {
+    c = &header->chunks[i];
+    if ( i != VMDC_NAMES && c->elem_size != __VMD_CACHE_ELEM_SIZE[i] ) {
+      return false;
+    }
+    if ( c->offset % VMDLIB_CACHE_ALIGN != 0 || c->offset > size
+         || c->size > size - c->offset
+         || c->size != (uint64_t)c->count * c->elem_size ) {
+      return false;
+    }
+  }
+  return header->chunks[VMDC_HEADER].count == 1;
+}
+
+/**
+ * @brief Check ids of a chunk against the number of what they refer to
+ *  Internally called function
+ * @param (ids) ids
+ * @param (num) number of ids
+ * @param (bound) ids must be less than this
+ * @return bool : false if an id is out of range
+ */
+static bool __VMDCheckCacheIds(const uint32_t* ids, uint32_t num,
+                               uint64_t bound){
+  for ( uint32_t i = 0; i < num; i++ ) {
+    if ( ids[i] >= bound ) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Track table pointing into cache file
+ *  Internally called function
+ * @param (table) [out] track table
+ * @param (header) header of the cache
+ * @param (base) head of the mapping
+ * @param (type) chunk of the frames, followed by chunks of the tracks
+ * @param (names) name table of the file
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDMapTrackTable(VMDTrackTable* table,
+                               const VMDCacheHeader* header, char* base,
+                               VMDCacheChunkType type,
+                               const VMDNameTable* names){
+  VMDCacheChunkType tracks = type == VMDC_BONE ? VMDC_BONE_TRACKS
+                                               : VMDC_MORPH_TRACKS;
+  const VMDCacheChunk* c = header->chunks;
+  const VMDCacheTrack* in = (const VMDCacheTrack*)(base + c[tracks].offset);
+  uint32_t num = c[type].count;
+
+  if ( c[tracks + 1].count > VMDGetNumNames(names)
+       || c[tracks + 2].count != num || c[tracks + 3].count != num ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+  table->num_tracks = c[tracks].count;
+  table->num_ids = c[tracks + 1].count;
+  table->track_of = (uint32_t*)(base + c[tracks + 1].offset);
+  table->name_ids = (uint32_t*)(base + c[tracks + 2].offset);
+  table->indices = (uint32_t*)(base + c[tracks + 3].offset);
+  if ( __VMDCheckCacheIds(table->track_of, table->num_ids,
+                          (uint64_t)table->num_tracks + 1) == false
+       || __VMDCheckCacheIds(table->name_ids, num,
+                             VMDGetNumNames(names)) == false
+       || __VMDCheckCacheIds(table->indices, num, num) == false ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+  table->tracks = malloc(sizeof(VMDTrack) * table->num_tracks + 1);
+  if ( table->tracks == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  for ( uint32_t i = 0; i < table->num_tracks; i++ ) {
+    VMDTrack* track = &table->tracks[i];
+    if ( in[i].name_id >= VMDGetNumNames(names) || in[i].first > num
+         || in[i].num_frames > num - in[i].first
+         || strlen(VMDGetNameSJIS(names, in[i].name_id))
+            > VMDLIB_NAME_SIZE ) {
+      VMD_ERROR = VMDLIB_E_FT;
+      return false;
+    }
+    memset(track->name, 0, sizeof(track->name));
+    strncpy(track->name, VMDGetNameSJIS(names, in[i].name_id),
+            VMDLIB_NAME_SIZE);
+    track->hash = VMDGetNameHash(names, in[i].name_id);
+    track->name_id = in[i].name_id;
+    track->num_frames = in[i].num_frames;
+    track->frames = table->indices + in[i].first;
+  }
+  return true;
+}
+
+/**
+ * @note Release returned pointer by VMDReleaseVMDFile()
+ * @brief Open cache file written by VMDExportCache()
+ *  The file is mapped like VMDMapFile(), and frames, the name table, the
+ *  track index and the curve table point into the mapping. They stay
+ *  valid until the file is released, including the name table returned by
+ *  VMDGetNameTable(). With VMDLIB_MAP_COW frames can be modified, derived
+ *  data is then rebuilt on the heap as for any other file.
+ * @param (fname) cache file name to be opened
+ * @param (flags) VMDLIB_MAP_RDONLY or VMDLIB_MAP_COW
+ * @return pointer of VMDFile, or NULL with VMD_ERROR set
+ * @sa VMDExportCache
+ */
+VMDFile* VMDOpenCache(const char* fname, int flags){
+  const VMDCacheHeader* header;
+  const VMDCacheChunk* c;
+  const VMDIKSingleFrame* ik;
+  VMDFile* vf;
+  size_t size;
+  char* base;
+
+  if ( fname == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  base = __VMDMapWholeFile(fname, (flags & VMDLIB_MAP_COW) != 0, &size);
+  if ( base == NULL ) return NULL;
+  header = (const VMDCacheHeader*)base;
+  c = header->chunks;
+  if ( size < sizeof(VMDCacheHeader)
+       || __VMDCheckCacheHeader(header, size) == false ) {
+    DEBUG_PRINT("Not a cache file of this build.\n");
+    VMD_ERROR = VMDLIB_E_FT;
+    __VMDUnmap(base, size);
+    return NULL;
+  }
+  vf = calloc(1, sizeof(VMDFile));
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    __VMDUnmap(base, size);
+    return NULL;
+  }
+  __VMDInitStorage(vf, VMDL_STORAGE_MMAP);
+  vf->map_flags = flags;
+  vf->map_addr = base;
+  vf->map_size = size;
+
+  memcpy(&vf->header, base + c[VMDC_HEADER].offset, sizeof(VMDHeader));
+#define VMDLIB_MAP_SECTION(field, type, chunk) \
+  do { \
+    vf->field.num_frames = c[chunk].count; \
+    vf->field.frames = c[chunk].count == 0 ? NULL \
+                       : (type*)(base + c[chunk].offset); \
+  } while ( 0 )
+  VMDLIB_MAP_SECTION(bone_frames, VMDBoneSingleFrame, VMDC_BONE);
+  VMDLIB_MAP_SECTION(morph_frames, VMDMorphSingleFrame, VMDC_MORPH);
+  VMDLIB_MAP_SECTION(camera_frames, VMDCameraSingleFrame, VMDC_CAMERA);
+  VMDLIB_MAP_SECTION(light_frames, VMDLightSingleFrame, VMDC_LIGHT);
+  VMDLIB_MAP_SECTION(shadow_frames, VMDShadowSingleFrame, VMDC_SHADOW);
+#undef VMDLIB_MAP_SECTION
+
+  // ShowIK frames are released with mapped files, so they are copied
+  ik = (const VMDIKSingleFrame*)(base + c[VMDC_IK].offset);
+  for ( uint32_t i = 0; i < c[VMDC_IK].count; i++ ) {
+    if ( ik[i].ik_offset > c[VMDC_IK_POOL].count
+         || ik[i].ik_count > c[VMDC_IK_POOL].count - ik[i].ik_offset ) {
+      VMD_ERROR = VMDLIB_E_FT;
+      goto error;
+    }
+  }
+  vf->ik_frames.num_frames = c[VMDC_IK].count;
+  vf->ik_frames.num_ik = c[VMDC_IK_POOL].count;
+  vf->ik_frames.frames = malloc(c[VMDC_IK].size + 1);
+  vf->ik_frames.ik = malloc(c[VMDC_IK_POOL].size + 1);
+  if ( vf->ik_frames.frames == NULL || vf->ik_frames.ik == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    goto error;
+  }
+  memcpy(vf->ik_frames.frames, ik, c[VMDC_IK].size);
+  memcpy(vf->ik_frames.ik, base + c[VMDC_IK_POOL].offset,
+         c[VMDC_IK_POOL].size);
+
+  vf->names = __VMDMapNameTable(base + c[VMDC_NAMES].offset,
+                                c[VMDC_NAMES].count, c[VMDC_NAMES].elem_size,
+                                (const uint32_t*)(base
+                                                  + c[VMDC_NAME_HASH].offset),
+                                c[VMDC_NAME_HASH].count);
+  if ( vf->names == NULL ) goto error;
+  vf->owns_names = true;
+
+  vf->index = calloc(1, sizeof(VMDTrackIndex));
+  if ( vf->index == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    goto error;
+  }
+  vf->index->mapped = true;
+  vf->index->ik_name_ids = (uint32_t*)(base + c[VMDC_IK_NAME_IDS].offset);
+  if ( c[VMDC_IK_NAME_IDS].count != c[VMDC_IK_POOL].count
+       || __VMDCheckCacheIds(vf->index->ik_name_ids,
+                             c[VMDC_IK_NAME_IDS].count,
+                             VMDGetNumNames(vf->names)) == false ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    goto error;
+  }
+  if ( __VMDMapTrackTable(&vf->index->bones, header, base, VMDC_BONE,
+                          vf->names) == false
+       || __VMDMapTrackTable(&vf->index->morphs, header, base, VMDC_MORPH,
+                             vf->names) == false ) {
+    goto error;
+  }
+
+  if ( c[VMDC_BONE_CURVES].count != (uint64_t)c[VMDC_BONE].count * 4
+       || c[VMDC_CAMERA_CURVES].count != (uint64_t)c[VMDC_CAMERA].count * 6
+       || __VMDCheckCacheIds((const uint32_t*)(base
+                                               + c[VMDC_BONE_CURVES].offset),
+                             c[VMDC_BONE_CURVES].count,
+                             c[VMDC_CURVES].count) == false
+       || __VMDCheckCacheIds((const uint32_t*)(base
+                                               + c[VMDC_CAMERA_CURVES].offset),
+                             c[VMDC_CAMERA_CURVES].count,
+                             c[VMDC_CURVES].count) == false ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    goto error;
+  }
+  vf->curves = calloc(1, sizeof(VMDCurveTable));
+  if ( vf->curves == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    goto error;
+  }
+  vf->curves->mapped = true;
+  vf->curves->num_curves = c[VMDC_CURVES].count;
+  vf->curves->curves = (VMDCurve*)(base + c[VMDC_CURVES].offset);
+  vf->curves->bone_curves = (uint32_t*)(base + c[VMDC_BONE_CURVES].offset);
+  vf->curves->camera_curves = (uint32_t*)(base
+                                          + c[VMDC_CAMERA_CURVES].offset);
+  return vf;
+
+ error:
+  VMDReleaseVMDFile(vf);
+  return NULL;
+}
+
+/**
+ * @brief Check whether cache file was made from a VMD file
+ *  Compares the hash of the source recorded in the cache with the hash of
+ *  the VMD file, so a cache can be reused until its source changes. The
+ *  hash is taken of the VMD form VMDExportCache() was given, which is the
+ *  file itself when it was exported right after loading.
+ * @param (fname) cache file name
+ * @param (source) VMD file name
+ * @return bool : true if the cache is of this build and of `source`, false
+ *                otherwise, with VMD_ERROR set if a file cannot be read
+ */
+bool VMDIsCacheCurrent(const char* fname, const char* source){
+  VMDCacheHeader header;
+  size_t size;
+  char* base;
+  FILE* fp;
+  bool ok;
+
+  if ( fname == NULL || source == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  fp = fopen(fname, "rb");
+  if ( fp == NULL ) {
+    VMD_ERROR = VMDLIB_E_FH;
+    return false;
+  }
+  ok = fread(&header, sizeof(VMDCacheHeader), 1, fp) == 1
+       && __VMDCheckCacheHeader(&header, 0);
+  fclose(fp);
+  if ( ok == false ) return false;
+
+  base = __VMDMapWholeFile(source, false, &size);
+  if ( base == NULL ) return false;
+  ok = __VMDXXHash64(base, size, 0) == header.source_hash;
+  __VMDUnmap(base, size);
+  return ok;
+}
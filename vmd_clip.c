@@ -0,0 +1,951 @@
+/**
+ *  @file vmd_clip.c
+ *  @brief Range queries and clips of VMD file
+ *  @author ihm4
+ *  @note
+ *    Frames in a range of frame numbers are found by binary search, per
+ *    track for bones and morphs (whose tracks are always in frame order)
+ *    and per section for the others (which must be sorted, see
+ *    VMDSortAllFrames()). Ranges are views into the frames of the file.
+ *
+ *    A clip copies the frames of a range into a new file. Where the range
+ *    starts or ends between two keyframes, a keyframe is made there from
+ *    the pose sampled at that time, and the curve of the keyframe after it
+ *    is cut to the part inside the clip, so the clip moves as the original
+ *    does. Cut curves are exact up to the rounding of control points to
+ *    the 0 to 127 of MMD. A part of a curve that no curve of MMD follows
+ *    within VMDLIB_CLIP_TOLERANCE is baked into keyframes at every frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <math.h>
+#include "vmd.h"
+
+// Keyframes of a track or section around a range
+typedef struct {
+  uint32_t lo;          // first keyframe at or after `first`
+  uint32_t hi;          // first keyframe after `last`
+  bool     make_first;  // a keyframe is made at `first`
+  bool     make_last;   // a keyframe is made at `last`
+  float    u_first;     // progress of `first` between lo - 1 and lo
+  float    u_last;      // progress of `last` between hi - 1 and hi
+} VMDClipKeys;
+
+// Frames of a track or section, positions are identity if NULL
+typedef struct {
+  const char*     frames;
+  size_t          size;      // size of a frame
+  size_t          key;       // offset of the frame number in a frame
+  const uint32_t* positions; // positions of keyframes in frame order
+  uint32_t        num;       // number of keyframes
+} VMDClipTrack;
+
+// Largest error of weights of a cut curve, before the part is baked into
+// keyframes at every frame instead
+#define VMDLIB_CLIP_TOLERANCE (1.0f / 127.0f)
+// Number of points where cut curves are measured
+#define VMDLIB_CLIP_SAMPLES   32
+
+/**
+ * @brief Frame number of a keyframe
+ *  Internally called function
+ * @param (t) track
+ * @param (k) keyframe
+ * @return frame number
+ */
+static uint32_t __VMDClipFrame(const VMDClipTrack* t, uint32_t k){
+  uint32_t pos = t->positions == NULL ? k : t->positions[k];
+  uint32_t frame;
+
+  memcpy(&frame, t->frames + t->size * pos + t->key, sizeof(uint32_t));
+  return frame;
+}
+
+/**
+ * @brief First keyframe after a frame number
+ *  Internally called function
+ * @param (t) track
+ * @param (frame) frame number
+ * @param (inclusive) find the first keyframe at or after `frame` instead
+ * @return keyframe, or number of keyframes if there is none
+ */
+static uint32_t __VMDClipBound(const VMDClipTrack* t, uint32_t frame,
+                               bool inclusive){
+  uint32_t lo = 0, hi = t->num, mid, f;
+
+  while ( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    f = __VMDClipFrame(t, mid);
+    if ( inclusive ? f < frame : f <= frame ) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * @brief Progress of a frame number between two keyframes
+ *  Internally called function
+ * @param (t) track
+ * @param (k) keyframe after `frame`, not the first
+ * @param (frame) frame number
+ * @return progress, 0 to 1
+ */
+static float __VMDClipProgress(const VMDClipTrack* t, uint32_t k,
+                               uint32_t frame){
+  uint32_t f0 = __VMDClipFrame(t, k - 1), f1 = __VMDClipFrame(t, k);
+
+  if ( f1 <= f0 ) return 1.0f;
+  return (float)((double)(frame - f0) / (double)(f1 - f0));
+}
+
+/**
+ * @brief Find keyframes of a range and where keyframes are made
+ *  Internally called function. A keyframe is made at `first` unless there
+ *  is one, or the track starts inside the range (then the clip holds the
+ *  first keyframe as the original does). A keyframe is made at `last` if
+ *  the track moves on after the range.
+ * @param (t) track
+ * @param (first) first frame of the range
+ * @param (last) last frame of the range
+ * @param (interpolated) values change between keyframes, otherwise they
+ *        change at keyframes and keyframes are made only to hold values
+ * @param (ck) [out] keyframes
+ * @return void
+ */
+static void __VMDClipFindKeys(const VMDClipTrack* t, uint32_t first,
+                              uint32_t last, bool interpolated,
+                              VMDClipKeys* ck){
+  ck->lo = __VMDClipBound(t, first, true);
+  ck->hi = __VMDClipBound(t, last, false);
+  ck->u_first = 0.0f;
+  ck->u_last = 0.0f;
+  ck->make_first = (ck->lo == t->num || __VMDClipFrame(t, ck->lo) != first)
+                   && (ck->lo > 0 || (interpolated && ck->lo == ck->hi));
+  if ( ck->make_first && ck->lo > 0 && ck->lo < t->num ) {
+    ck->u_first = __VMDClipProgress(t, ck->lo, first);
+  }
+  ck->make_last = interpolated && ck->hi > 0 && ck->hi < t->num
+                  && __VMDClipFrame(t, ck->hi - 1) != last
+                  && (first != last || ck->make_first == false);
+  if ( ck->make_last ) ck->u_last = __VMDClipProgress(t, ck->hi, last);
+}
+
+/**
+ * @brief Largest error of a curve of MMD from weights at sample points
+ *  Internally called function
+ * @param (target) weights at (i + 0.5) / VMDLIB_CLIP_SAMPLES
+ * @param (p) x1, y1, x2, y2 of the curve
+ * @return largest error of weights
+ */
+static float __VMDCurveError(const float* target, const int* p){
+  float err = 0.0f, d;
+
+  for ( int i = 0; i < VMDLIB_CLIP_SAMPLES; i++ ) {
+    d = __VMDEvalBezier((i + 0.5f) / VMDLIB_CLIP_SAMPLES, p[0], p[1], p[2],
+                        p[3]) - target[i];
+    if ( fabsf(d) > err ) err = fabsf(d);
+  }
+  return err;
+}
+
+/**
+ * @brief Fit a curve of MMD to weights at sample points
+ *  Internally called function. Control points are moved one at a time, by
+ *  smaller and smaller steps, while the largest error gets smaller.
+ * @param (target) weights at (i + 0.5) / VMDLIB_CLIP_SAMPLES
+ * @param (out) [in,out] x1, y1, x2, y2, where the search starts
+ * @return largest error of weights of the curve found
+ */
+static float __VMDFitCurve(const float* target, uint8_t* out){
+  int p[4], v;
+  float best, err;
+  bool moved;
+
+  for ( int k = 0; k < 4; k++ ) p[k] = out[k];
+  best = __VMDCurveError(target, p);
+  for ( int step = 32; step > 0; step /= 2 ) {
+    do {
+      moved = false;
+      for ( int k = 0; k < 8; k++ ) {
+        v = p[k / 2];
+        p[k / 2] += k % 2 == 0 ? -step : step;
+        if ( p[k / 2] >= 0 && p[k / 2] <= 127
+             && (err = __VMDCurveError(target, p)) < best ) {
+          best = err;
+          moved = true;
+        } else {
+          p[k / 2] = v;
+        }
+      }
+    } while ( moved );
+  }
+  for ( int k = 0; k < 4; k++ ) out[k] = (uint8_t)p[k];
+  return best;
+}
+
+/**
+ * @brief Cut a curve of MMD to a part of it
+ *  Internally called function. The curve is split by de Casteljau's
+ *  algorithm at the parameters of `u0` and `u1`, and the part between
+ *  them is scaled to (0, 0) - (1, 1). A part may not fit in the box of
+ *  control points of MMD, then the nearest curve in the box is searched.
+ * @param (x1) control point
+ * @param (y1) control point
+ * @param (x2) control point
+ * @param (y2) control point
+ * @param (u0) progress where the part starts
+ * @param (u1) progress where the part ends, larger than `u0`
+ * @param (out) [out] x1, y1, x2, y2 of the part
+ * @return largest error of weights of the part
+ */
+static float __VMDCutCurve(int x1, int y1, int x2, int y2, float u0,
+                           float u1, uint8_t* out){
+  double p[4][2] = { { 0.0, 0.0 }, { x1 / 127.0, y1 / 127.0 },
+                     { x2 / 127.0, y2 / 127.0 }, { 1.0, 1.0 } };
+  double t[2], u[2] = { u0, u1 }, lo, hi, mid, x, s, a[2], b[2], c[2], d[2],
+         e[2], f[2], dx, dy, v;
+  float target[VMDLIB_CLIP_SAMPLES], w0, w1, err;
+  int q[4];
+
+  out[0] = out[1] = 20;
+  out[2] = out[3] = 107;
+  w0 = __VMDEvalBezier(u0, x1, y1, x2, y2);
+  w1 = __VMDEvalBezier(u1, x1, y1, x2, y2);
+  if ( w1 - w0 <= 1e-6f ) return 0.0f; // the value does not change
+  for ( int i = 0; i < VMDLIB_CLIP_SAMPLES; i++ ) {
+    x = u0 + (u1 - u0) * ((i + 0.5) / VMDLIB_CLIP_SAMPLES);
+    target[i] = (__VMDEvalBezier((float)x, x1, y1, x2, y2) - w0) / (w1 - w0);
+  }
+
+  // parameters of the curve at the progress (x is monotonic in t)
+  for ( int i = 0; i < 2; i++ ) {
+    lo = 0.0;
+    hi = 1.0;
+    for ( int k = 0; k < 40; k++ ) {
+      mid = (lo + hi) * 0.5;
+      x = 3.0 * (1.0 - mid) * (1.0 - mid) * mid * p[1][0]
+          + 3.0 * (1.0 - mid) * mid * mid * p[2][0] + mid * mid * mid;
+      if ( x < u[i] ) lo = mid; else hi = mid;
+    }
+    t[i] = (lo + hi) * 0.5;
+  }
+
+  // left part [0, t1], then right part of it from t0 / t1
+  for ( int pass = 0; pass < 2 && t[1] > 0.0; pass++ ) {
+    s = pass == 0 ? t[1] : t[0] / t[1];
+    for ( int k = 0; k < 2; k++ ) {
+      a[k] = p[0][k] + (p[1][k] - p[0][k]) * s;
+      b[k] = p[1][k] + (p[2][k] - p[1][k]) * s;
+      c[k] = p[2][k] + (p[3][k] - p[2][k]) * s;
+      d[k] = a[k] + (b[k] - a[k]) * s;
+      e[k] = b[k] + (c[k] - b[k]) * s;
+      f[k] = d[k] + (e[k] - d[k]) * s;
+      if ( pass == 0 ) {
+        p[1][k] = a[k];
+        p[2][k] = d[k];
+        p[3][k] = f[k];
+      } else {
+        p[0][k] = f[k];
+        p[1][k] = e[k];
+        p[2][k] = c[k];
+      }
+    }
+  }
+  dx = p[3][0] - p[0][0];
+  dy = p[3][1] - p[0][1];
+  if ( dx > 1e-9 && dy > 1e-9 ) {
+    for ( int i = 0; i < 2; i++ ) {
+      for ( int k = 0; k < 2; k++ ) {
+        v = (p[1 + i][k] - p[0][k]) / (k == 0 ? dx : dy);
+        v = floor(v * 127.0 + 0.5);
+        out[i * 2 + k] = (uint8_t)(v < 0.0 ? 0 : v > 127.0 ? 127 : v);
+      }
+    }
+  }
+  for ( int k = 0; k < 4; k++ ) q[k] = out[k];
+  err = __VMDCurveError(target, q);
+  if ( err > VMDLIB_CLIP_TOLERANCE ) err = __VMDFitCurve(target, out);
+  return err;
+}
+
+/**
+ * @brief Cut curves of bone frame
+ *  Internally called function
+ * @param (bezier) [in,out] interpolation parameters
+ * @param (u0) progress where the part starts
+ * @param (u1) progress where the part ends
+ * @return largest error of weights of the parts
+ */
+static float __VMDCutBoneCurves(char* bezier, float u0, float u1){
+  uint8_t points[4][4];
+  float err = 0.0f;
+
+  for ( int axis = 0; axis < 4; axis++ ) {
+    err = fmaxf(err, __VMDCutCurve(__VMDControlPoint(bezier[axis]),
+                                   __VMDControlPoint(bezier[4 + axis]),
+                                   __VMDControlPoint(bezier[8 + axis]),
+                                   __VMDControlPoint(bezier[12 + axis]),
+                                   u0, u1, points[axis]));
+  }
+  __VMDEncodeBoneBezier(bezier, (const uint8_t (*)[4])points);
+  return err;
+}
+
+/**
+ * @brief Cut curves of camera frame
+ *  Internally called function
+ * @param (bezier) [in,out] interpolation parameters
+ * @param (u0) progress where the part starts
+ * @param (u1) progress where the part ends
+ * @return largest error of weights of the parts
+ */
+static float __VMDCutCameraCurves(char* bezier, float u0, float u1){
+  uint8_t points[4];
+  float err = 0.0f;
+  char* p;
+
+  for ( int axis = 0; axis < 6; axis++ ) {
+    p = bezier + axis * 4; // x1, x2, y1, y2
+    err = fmaxf(err, __VMDCutCurve(__VMDControlPoint(p[0]),
+                                   __VMDControlPoint(p[2]),
+                                   __VMDControlPoint(p[1]),
+                                   __VMDControlPoint(p[3]), u0, u1, points));
+    p[0] = (char)points[0];
+    p[1] = (char)points[2];
+    p[2] = (char)points[1];
+    p[3] = (char)points[3];
+  }
+  return err;
+}
+
+/**
+ * @brief Make bone frame from the pose at a frame
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile with track index
+ * @param (track) track
+ * @param (frame) frame number
+ * @param (out) [out] bone frame with linear curves
+ * @return void
+ */
+static void __VMDMakeBoneKey(VMDFile* vf, const VMDTrack* track,
+                             uint32_t frame, VMDBoneSingleFrame* out){
+  static const uint8_t linear[4][4] = {
+    { 20, 20, 107, 107 }, { 20, 20, 107, 107 },
+    { 20, 20, 107, 107 }, { 20, 20, 107, 107 }
+  };
+  VMDBonePose pose = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+
+  VMDSampleBone(vf, track, (float)frame, &pose);
+  memset(out, 0, sizeof(VMDBoneSingleFrame));
+  memcpy(out->name, vf->bone_frames.frames[track->frames[0]].name,
+         sizeof(out->name));
+  out->frame = frame;
+  out->x = pose.x;
+  out->y = pose.y;
+  out->z = pose.z;
+  out->qx = pose.qx;
+  out->qy = pose.qy;
+  out->qz = pose.qz;
+  out->qw = pose.qw;
+  __VMDEncodeBoneBezier(out->bezier, linear);
+}
+
+/**
+ * @brief Clip a bone track where a part of a curve is in the clip
+ *  Internally called function. The curves of `end` are cut to the part
+ *  from `start`, or if a cut curve can not follow the original one, the
+ *  part is baked into keyframes at every frame.
+ * @param (vf) a pointer to VMDFile with track index
+ * @param (track) track
+ * @param (start) frame where the part starts
+ * @param (end) keyframe where the part ends, with curves of the whole
+ * @param (u0) progress of `start` in the whole
+ * @param (u1) progress of `end` in the whole
+ * @param (shift) subtracted from frame numbers
+ * @param (out) [out] frames after `start` to `end`, or NULL to count them
+ * @return number of frames of the part
+ */
+static uint32_t __VMDClipBonePart(VMDFile* vf, const VMDTrack* track,
+                                  uint32_t start,
+                                  const VMDBoneSingleFrame* end, float u0,
+                                  float u1, uint32_t shift,
+                                  VMDBoneSingleFrame* out){
+  VMDBoneSingleFrame key = *end;
+  uint32_t num = 0;
+
+  if ( __VMDCutBoneCurves(key.bezier, u0, u1) > VMDLIB_CLIP_TOLERANCE ) {
+    for ( uint32_t f = start + 1; f < key.frame; f++, num++ ) {
+      if ( out == NULL ) continue;
+      __VMDMakeBoneKey(vf, track, f, &out[num]);
+      out[num].frame -= shift;
+    }
+    __VMDMakeBoneKey(vf, track, key.frame, &key);
+  }
+  if ( out != NULL ) {
+    out[num] = key;
+    out[num].frame -= shift;
+  }
+  return num + 1;
+}
+
+/**
+ * @brief Clip a bone track
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile with track index
+ * @param (track) track
+ * @param (first) first frame of the clip
+ * @param (last) last frame of the clip
+ * @param (shift) subtracted from frame numbers
+ * @param (out) [out] frames of the clip, or NULL to count them
+ * @return number of frames of the clip
+ */
+static uint32_t __VMDClipBoneTrack(VMDFile* vf, const VMDTrack* track,
+                                   uint32_t first, uint32_t last,
+                                   uint32_t shift, VMDBoneSingleFrame* out){
+  const VMDBoneSingleFrame* frames = vf->bone_frames.frames;
+  const VMDClipTrack t = { (const char*)frames, sizeof(VMDBoneSingleFrame),
+                           offsetof(VMDBoneSingleFrame, frame),
+                           track->frames, track->num_frames };
+  VMDBoneSingleFrame key;
+  VMDClipKeys ck;
+  uint32_t num = 0;
+  bool inside;
+
+  __VMDClipFindKeys(&t, first, last, true, &ck);
+  if ( ck.make_first ) {
+    if ( out != NULL ) {
+      __VMDMakeBoneKey(vf, track, first, &out[num]);
+      out[num].frame -= shift;
+    }
+    num++;
+  }
+  for ( uint32_t k = ck.lo; k < ck.hi; k++ ) {
+    key = frames[track->frames[k]];
+    if ( k == ck.lo && ck.make_first && ck.lo > 0 ) {
+      num += __VMDClipBonePart(vf, track, first, &key, ck.u_first, 1.0f,
+                               shift, out == NULL ? NULL : out + num);
+      continue;
+    }
+    if ( out != NULL ) {
+      out[num] = key;
+      out[num].frame -= shift;
+    }
+    num++;
+  }
+  if ( ck.make_last ) {
+    inside = ck.hi - 1 >= ck.lo; // the part starts at a keyframe
+    __VMDMakeBoneKey(vf, track, last, &key);
+    memcpy(key.bezier, frames[track->frames[ck.hi]].bezier,
+           sizeof(key.bezier));
+    num += __VMDClipBonePart(vf, track,
+                             inside ? __VMDClipFrame(&t, ck.hi - 1) : first,
+                             &key, inside ? 0.0f : ck.u_first, ck.u_last,
+                             shift, out == NULL ? NULL : out + num);
+  }
+  return num;
+}
+
+/**
+ * @brief Clip a morph track
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile with track index
+ * @param (track) track
+ * @param (first) first frame of the clip
+ * @param (last) last frame of the clip
+ * @param (shift) subtracted from frame numbers
+ * @param (out) [out] frames of the clip, or NULL to count them
+ * @return number of frames of the clip
+ */
+static uint32_t __VMDClipMorphTrack(VMDFile* vf, const VMDTrack* track,
+                                    uint32_t first, uint32_t last,
+                                    uint32_t shift, VMDMorphSingleFrame* out){
+  const VMDMorphSingleFrame* frames = vf->morph_frames.frames;
+  const VMDClipTrack t = { (const char*)frames, sizeof(VMDMorphSingleFrame),
+                           offsetof(VMDMorphSingleFrame, frame),
+                           track->frames, track->num_frames };
+  VMDClipKeys ck;
+  uint32_t num = 0;
+  float value = 0.0f;
+
+  __VMDClipFindKeys(&t, first, last, true, &ck);
+  if ( out == NULL ) return ck.hi - ck.lo + ck.make_first + ck.make_last;
+  if ( ck.make_first ) {
+    out[num] = frames[track->frames[0]];
+    out[num].frame = first;
+    VMDSampleMorph(vf, track, (float)first, &value);
+    out[num].value = value;
+    out[num++].frame -= shift;
+  }
+  for ( uint32_t k = ck.lo; k < ck.hi; k++ ) {
+    out[num] = frames[track->frames[k]];
+    out[num++].frame -= shift;
+  }
+  if ( ck.make_last ) {
+    out[num] = frames[track->frames[0]];
+    out[num].frame = last;
+    VMDSampleMorph(vf, track, (float)last, &value);
+    out[num].value = value;
+    out[num++].frame -= shift;
+  }
+  return num;
+}
+
+/**
+ * @brief Make camera frame from the camera at a frame
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (frame) frame number
+ * @param (out) [out] camera frame, interpolation parameters are linear
+ * @return void
+ */
+static void __VMDMakeCameraKey(VMDFile* vf, uint32_t frame,
+                               VMDCameraSingleFrame* out){
+  VMDCameraPose pose;
+
+  memset(&pose, 0, sizeof(pose));
+  VMDSampleCamera(vf, (float)frame, &pose);
+  memset(out, 0, sizeof(VMDCameraSingleFrame));
+  out->frame = frame;
+  out->distance = pose.distance;
+  out->x = pose.x;
+  out->y = pose.y;
+  out->z = pose.z;
+  out->rx = pose.rx;
+  out->ry = pose.ry;
+  out->rz = pose.rz;
+  out->viewAngle = (uint32_t)lrintf(pose.view_angle < 0.0f ? 0.0f
+                                                          : pose.view_angle);
+  out->parth = pose.parth;
+  for ( int axis = 0; axis < 6; axis++ ) {
+    out->bezier[axis * 4 + 0] = 20;  // x1
+    out->bezier[axis * 4 + 1] = 107; // x2
+    out->bezier[axis * 4 + 2] = 20;  // y1
+    out->bezier[axis * 4 + 3] = 107; // y2
+  }
+}
+
+/**
+ * @brief Clip camera frames where a part of a curve is in the clip
+ *  Internally called function, see __VMDClipBonePart()
+ * @param (vf) a pointer to VMDFile with sorted camera frames
+ * @param (start) frame where the part starts
+ * @param (end) keyframe where the part ends, with curves of the whole
+ * @param (u0) progress of `start` in the whole
+ * @param (u1) progress of `end` in the whole
+ * @param (shift) subtracted from frame numbers
+ * @param (out) [out] frames after `start` to `end`, or NULL to count them
+ * @return number of frames of the part
+ */
+static uint32_t __VMDClipCameraPart(VMDFile* vf, uint32_t start,
+                                    const VMDCameraSingleFrame* end, float u0,
+                                    float u1, uint32_t shift,
+                                    VMDCameraSingleFrame* out){
+  VMDCameraSingleFrame key = *end;
+  uint32_t num = 0;
+
+  if ( __VMDCutCameraCurves(key.bezier, u0, u1) > VMDLIB_CLIP_TOLERANCE ) {
+    for ( uint32_t f = start + 1; f < key.frame; f++, num++ ) {
+      if ( out == NULL ) continue;
+      __VMDMakeCameraKey(vf, f, &out[num]);
+      out[num].frame -= shift;
+    }
+    __VMDMakeCameraKey(vf, key.frame, &key);
+  }
+  if ( out != NULL ) {
+    out[num] = key;
+    out[num].frame -= shift;
+  }
+  return num + 1;
+}
+
+/**
+ * @brief Clip camera frames
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile with sorted camera frames
+ * @param (first) first frame of the clip
+ * @param (last) last frame of the clip
+ * @param (shift) subtracted from frame numbers
+ * @param (out) [out] frames of the clip, or NULL to count them
+ * @return number of frames of the clip
+ */
+static uint32_t __VMDClipCamera(VMDFile* vf, uint32_t first, uint32_t last,
+                                uint32_t shift, VMDCameraSingleFrame* out){
+  const VMDCameraSingleFrame* frames = vf->camera_frames.frames;
+  const VMDClipTrack t = { (const char*)frames, sizeof(VMDCameraSingleFrame),
+                           offsetof(VMDCameraSingleFrame, frame), NULL,
+                           vf->camera_frames.num_frames };
+  VMDCameraSingleFrame key;
+  VMDClipKeys ck;
+  uint32_t num = 0;
+  bool inside;
+
+  if ( t.num == 0 ) return 0;
+  __VMDClipFindKeys(&t, first, last, true, &ck);
+  if ( ck.make_first ) {
+    if ( out != NULL ) {
+      __VMDMakeCameraKey(vf, first, &out[num]);
+      out[num].frame -= shift;
+    }
+    num++;
+  }
+  for ( uint32_t k = ck.lo; k < ck.hi; k++ ) {
+    if ( k == ck.lo && ck.make_first && ck.lo > 0 ) {
+      num += __VMDClipCameraPart(vf, first, &frames[k], ck.u_first, 1.0f,
+                                 shift, out == NULL ? NULL : out + num);
+      continue;
+    }
+    if ( out != NULL ) {
+      out[num] = frames[k];
+      out[num].frame -= shift;
+    }
+    num++;
+  }
+  if ( ck.make_last ) {
+    inside = ck.hi - 1 >= ck.lo; // the part starts at a keyframe
+    __VMDMakeCameraKey(vf, last, &key);
+    memcpy(key.bezier, frames[ck.hi].bezier, sizeof(key.bezier));
+    num += __VMDClipCameraPart(vf, inside ? frames[ck.hi - 1].frame : first,
+                               &key, inside ? 0.0f : ck.u_first, ck.u_last,
+                               shift, out == NULL ? NULL : out + num);
+  }
+  return num;
+}
+
+/**
+ * @brief Clip light frames
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile with sorted light frames
+ * @param (first) first frame of the clip
+ * @param (last) last frame of the clip
+ * @param (shift) subtracted from frame numbers
+ * @param (out) [out] frames of the clip, or NULL to count them
+ * @return number of frames of the clip
+ */
+static uint32_t __VMDClipLight(VMDFile* vf, uint32_t first, uint32_t last,
+                               uint32_t shift, VMDLightSingleFrame* out){
+  const VMDLightSingleFrame* frames = vf->light_frames.frames;
+  const VMDClipTrack t = { (const char*)frames, sizeof(VMDLightSingleFrame),
+                           offsetof(VMDLightSingleFrame, frame), NULL,
+                           vf->light_frames.num_frames };
+  VMDClipKeys ck;
+  VMDLightPose pose;
+  uint32_t num = 0;
+
+  if ( t.num == 0 ) return 0;
+  __VMDClipFindKeys(&t, first, last, true, &ck);
+  if ( out == NULL ) return ck.hi - ck.lo + ck.make_first + ck.make_last;
+  if ( ck.make_first ) {
+    VMDSampleLight(vf, (float)first, &pose);
+    out[num++] = (VMDLightSingleFrame){ first - shift, pose.r, pose.g, pose.b,
+                                        pose.x, pose.y, pose.z };
+  }
+  for ( uint32_t k = ck.lo; k < ck.hi; k++ ) {
+    out[num] = frames[k];
+    out[num++].frame -= shift;
+  }
+  if ( ck.make_last ) {
+    VMDSampleLight(vf, (float)last, &pose);
+    out[num++] = (VMDLightSingleFrame){ last - shift, pose.r, pose.g, pose.b,
+                                        pose.x, pose.y, pose.z };
+  }
+  return num;
+}
+
+/**
+ * @brief Clip self shadow frames
+ *  Internally called function. Self shadow changes at keyframes, so the
+ *  keyframe before the clip is held at `first`.
+ * @param (vf) a pointer to VMDFile with sorted self shadow frames
+ * @param (first) first frame of the clip
+ * @param (last) last frame of the clip
+ * @param (shift) subtracted from frame numbers
+ * @param (out) [out] frames of the clip, or NULL to count them
+ * @return number of frames of the clip
+ */
+static uint32_t __VMDClipShadow(VMDFile* vf, uint32_t first, uint32_t last,
+                                uint32_t shift, VMDShadowSingleFrame* out){
+  const VMDShadowSingleFrame* frames = vf->shadow_frames.frames;
+  const VMDClipTrack t = { (const char*)frames, sizeof(VMDShadowSingleFrame),
+                           offsetof(VMDShadowSingleFrame, frame), NULL,
+                           vf->shadow_frames.num_frames };
+  VMDClipKeys ck;
+  uint32_t num = 0;
+
+  __VMDClipFindKeys(&t, first, last, false, &ck);
+  if ( out == NULL ) return ck.hi - ck.lo + ck.make_first;
+  if ( ck.make_first ) {
+    out[num] = frames[ck.lo - 1];
+    out[num++].frame = first - shift;
+  }
+  for ( uint32_t k = ck.lo; k < ck.hi; k++ ) {
+    out[num] = frames[k];
+    out[num++].frame -= shift;
+  }
+  return num;
+}
+
+/**
+ * @brief Clip model display and IK frames
+ *  Internally called function. Like self shadow, the keyframe before the
+ *  clip is held at `first`. IK on/off of the frames are copied to `pool`.
+ * @param (vf) a pointer to VMDFile with sorted IK frames
+ * @param (first) first frame of the clip
+ * @param (last) last frame of the clip
+ * @param (shift) subtracted from frame numbers
+ * @param (out) [out] frames of the clip, or NULL to count them
+ * @param (pool) [out] IK on/off of the clip, or NULL to count them
+ * @param (num_ik) [out] number of IK on/off of the clip
+ * @return number of frames of the clip
+ */
+static uint32_t __VMDClipIK(VMDFile* vf, uint32_t first, uint32_t last,
+                            uint32_t shift, VMDIKSingleFrame* out,
+                            VMDInfoIK* pool, uint64_t* num_ik){
+  const VMDIKSingleFrame* frames = vf->ik_frames.frames;
+  const VMDClipTrack t = { (const char*)frames, sizeof(VMDIKSingleFrame),
+                           offsetof(VMDIKSingleFrame, frame), NULL,
+                           vf->ik_frames.num_frames };
+  VMDClipKeys ck;
+  const VMDIKSingleFrame* f;
+  uint32_t num = 0;
+
+  __VMDClipFindKeys(&t, first, last, false, &ck);
+  *num_ik = 0;
+  for ( uint32_t k = ck.lo - ck.make_first; k != ck.hi; k++, num++ ) {
+    f = &frames[k];
+    if ( out != NULL ) {
+      out[num] = *f;
+      out[num].frame = (k < ck.lo ? first : f->frame) - shift;
+      out[num].ik_offset = (uint32_t)*num_ik;
+      memcpy(&pool[*num_ik], &vf->ik_frames.ik[f->ik_offset],
+             sizeof(VMDInfoIK) * f->ik_count);
+    }
+    *num_ik += f->ik_count;
+  }
+  return num;
+}
+
+/**
+ * @brief Get frames of a section in a range of frame numbers
+ *  The frames are found by binary search and not copied, `range` points
+ *  into the section until the file is changed or released.
+ * @note The section must be sorted, see VMDSortAllFrames()
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section
+ * @param (first) first frame number of the range
+ * @param (last) last frame number of the range
+ * @param (range) [out] frames of the range, may be empty
+ * @return bool : false for an invalid call or a section failed to load
+ */
+bool VMDGetSectionRange(VMDFile* vf, VMDStructType type, uint32_t first,
+                        uint32_t last, VMDRange* range){
+  static const size_t sizes[VMDL_IK + 1] = {
+    sizeof(VMDBoneSingleFrame), sizeof(VMDMorphSingleFrame),
+    sizeof(VMDCameraSingleFrame), sizeof(VMDLightSingleFrame),
+    sizeof(VMDShadowSingleFrame), sizeof(VMDIKSingleFrame)
+  };
+  static const size_t keys[VMDL_IK + 1] = {
+    offsetof(VMDBoneSingleFrame, frame), offsetof(VMDMorphSingleFrame, frame),
+    offsetof(VMDCameraSingleFrame, frame), offsetof(VMDLightSingleFrame, frame),
+    offsetof(VMDShadowSingleFrame, frame), offsetof(VMDIKSingleFrame, frame)
+  };
+  VMDClipTrack t;
+  const void* heads[VMDL_IK + 1];
+  uint32_t lo, hi;
+
+  if ( vf == NULL || range == NULL || (int)type < VMDL_BONE || type > VMDL_IK
+       || first > last ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION(type)) == false ) return false;
+  heads[VMDL_BONE] = vf->bone_frames.frames;
+  heads[VMDL_MORPH] = vf->morph_frames.frames;
+  heads[VMDL_CAMERA] = vf->camera_frames.frames;
+  heads[VMDL_LIGHT] = vf->light_frames.frames;
+  heads[VMDL_SHADOW] = vf->shadow_frames.frames;
+  heads[VMDL_IK] = vf->ik_frames.frames;
+  t = (VMDClipTrack){ heads[type], sizes[type], keys[type], NULL,
+                      VMDGetNumFrames(vf, type) };
+  lo = __VMDClipBound(&t, first, true);
+  hi = __VMDClipBound(&t, last, false);
+  range->frames = lo < hi ? t.frames + t.size * lo : NULL;
+  range->begin = lo;
+  range->num_frames = hi - lo;
+  return true;
+}
+
+/**
+ * @brief Get keyframes of a bone or morph track in a range of frame numbers
+ *  `out` is `track` narrowed to the keyframes of the range. It shares the
+ *  positions of `track`, so it is valid while the track index is, and can
+ *  be given to VMDSampleBone() or VMDSampleMorph() as a track.
+ * @param (vf) a pointer to VMDFile, `track` is a track of it
+ * @param (type) VMDL_BONE or VMDL_MORPH, which section `track` is of
+ * @param (track) track
+ * @param (first) first frame number of the range
+ * @param (last) last frame number of the range
+ * @param (out) [out] keyframes of the range, may be empty
+ * @return bool : false for an invalid call
+ */
+bool VMDGetTrackRange(VMDFile* vf, VMDStructType type, const VMDTrack* track,
+                      uint32_t first, uint32_t last, VMDTrack* out){
+  VMDClipTrack t;
+  uint32_t lo, hi;
+
+  if ( vf == NULL || track == NULL || out == NULL || first > last
+       || (type != VMDL_BONE && type != VMDL_MORPH) ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( type == VMDL_BONE ) {
+    t = (VMDClipTrack){ (const char*)vf->bone_frames.frames,
+                        sizeof(VMDBoneSingleFrame),
+                        offsetof(VMDBoneSingleFrame, frame), track->frames,
+                        track->num_frames };
+  } else {
+    t = (VMDClipTrack){ (const char*)vf->morph_frames.frames,
+                        sizeof(VMDMorphSingleFrame),
+                        offsetof(VMDMorphSingleFrame, frame), track->frames,
+                        track->num_frames };
+  }
+  lo = __VMDClipBound(&t, first, true);
+  hi = __VMDClipBound(&t, last, false);
+  *out = *track;
+  out->frames = track->frames + lo;
+  out->num_frames = hi - lo;
+  return true;
+}
+
+/**
+ * @note You must release returned pointer by VMDReleaseVMDFile()
+ *       after you used it
+ * @brief Copy frames of a range of frame numbers to a new file
+ *  Keyframes are made at `first` and `last` where the range starts or ends
+ *  between keyframes, from the poses there, and curves going over the ends
+ *  are cut to the part inside the range, so the clip plays as the range of
+ *  the original does (sampled at integer frames, as MMD plays). A camera
+ *  keyframe made next to another one is a cut in MMD, which holds the
+ *  first one for that frame as the original does. Self shadow and IK
+ *  frames before the range are held at `first`.
+ *  Only frames of the range are read, by binary search over tracks built
+ *  by VMDBuildTrackIndex() (built and released here if there is none).
+ * @note Sections other than bones and morphs must be sorted, see
+ *       VMDSortAllFrames()
+ * @param (vf) a pointer to VMDFile
+ * @param (first) first frame of the clip
+ * @param (last) last frame of the clip
+ * @param (flags) VMDLIB_CLIP_*, by default frames are moved so that
+ *        `first` is frame 0
+ * @return pointer of VMDFile, or NULL with VMD_ERROR set
+ */
+VMDFile* VMDExtractClip(VMDFile* vf, uint32_t first, uint32_t last,
+                        uint32_t flags){
+  const VMDTrackTable* bones;
+  const VMDTrackTable* morphs;
+  VMDFile* out = NULL;
+  void* frames[VMDL_IK + 1] = { NULL };
+  uint64_t num[VMDL_IK + 1] = { 0 }, num_ik = 0;
+  VMDInfoIK* pool = NULL;
+  uint32_t shift, pos;
+  bool own_index = false, ok = false;
+
+  if ( vf == NULL || first > last ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION_ALL) == false ) return NULL;
+  if ( vf->index == NULL ) {
+    if ( VMDBuildTrackIndex(vf) == false ) return NULL;
+    own_index = true;
+  }
+  shift = (flags & VMDLIB_CLIP_KEEP_FRAMES) ? 0 : first;
+  bones = &vf->index->bones;
+  morphs = &vf->index->morphs;
+
+  // count frames of the clip
+  for ( uint32_t i = 0; i < bones->num_tracks; i++ ) {
+    num[VMDL_BONE] += __VMDClipBoneTrack(vf, &bones->tracks[i], first, last,
+                                         shift, NULL);
+  }
+  for ( uint32_t i = 0; i < morphs->num_tracks; i++ ) {
+    num[VMDL_MORPH] += __VMDClipMorphTrack(vf, &morphs->tracks[i], first,
+                                           last, shift, NULL);
+  }
+  num[VMDL_CAMERA] = __VMDClipCamera(vf, first, last, shift, NULL);
+  num[VMDL_LIGHT] = __VMDClipLight(vf, first, last, shift, NULL);
+  num[VMDL_SHADOW] = __VMDClipShadow(vf, first, last, shift, NULL);
+  num[VMDL_IK] = __VMDClipIK(vf, first, last, shift, NULL, NULL, &num_ik);
+  if ( num[VMDL_BONE] > UINT32_MAX || num[VMDL_MORPH] > UINT32_MAX
+       || num_ik > UINT32_MAX ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    goto done;
+  }
+
+  frames[VMDL_BONE] = malloc(sizeof(VMDBoneSingleFrame) * num[VMDL_BONE]);
+  frames[VMDL_MORPH] = malloc(sizeof(VMDMorphSingleFrame) * num[VMDL_MORPH]);
+  frames[VMDL_CAMERA] = malloc(sizeof(VMDCameraSingleFrame)
+                               * num[VMDL_CAMERA]);
+  frames[VMDL_LIGHT] = malloc(sizeof(VMDLightSingleFrame) * num[VMDL_LIGHT]);
+  frames[VMDL_SHADOW] = malloc(sizeof(VMDShadowSingleFrame)
+                               * num[VMDL_SHADOW]);
+  frames[VMDL_IK] = malloc(sizeof(VMDIKSingleFrame) * num[VMDL_IK]);
+  pool = malloc(sizeof(VMDInfoIK) * num_ik);
+  for ( int type = VMDL_BONE; type <= VMDL_IK; type++ ) {
+    if ( num[type] > 0 && frames[type] == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      goto done;
+    }
+  }
+  if ( num_ik > 0 && pool == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    goto done;
+  }
+
+  pos = 0;
+  for ( uint32_t i = 0; i < bones->num_tracks; i++ ) {
+    pos += __VMDClipBoneTrack(vf, &bones->tracks[i], first, last, shift,
+                              (VMDBoneSingleFrame*)frames[VMDL_BONE] + pos);
+  }
+  pos = 0;
+  for ( uint32_t i = 0; i < morphs->num_tracks; i++ ) {
+    pos += __VMDClipMorphTrack(vf, &morphs->tracks[i], first, last, shift,
+                               (VMDMorphSingleFrame*)frames[VMDL_MORPH] + pos);
+  }
+  __VMDClipCamera(vf, first, last, shift, frames[VMDL_CAMERA]);
+  __VMDClipLight(vf, first, last, shift, frames[VMDL_LIGHT]);
+  __VMDClipShadow(vf, first, last, shift, frames[VMDL_SHADOW]);
+  __VMDClipIK(vf, first, last, shift, frames[VMDL_IK], pool, &num_ik);
+  VMDSortBoneFrames(frames[VMDL_BONE], (uint32_t)num[VMDL_BONE]);
+  VMDSortMorphFrames(frames[VMDL_MORPH], (uint32_t)num[VMDL_MORPH]);
+
+  out = VMDCreateVMDFile(NULL);
+  if ( out == NULL ) goto done;
+  out->header = vf->header;
+  out->bone_frames.num_frames = (uint32_t)num[VMDL_BONE];
+  out->bone_frames.frames = frames[VMDL_BONE];
+  out->morph_frames.num_frames = (uint32_t)num[VMDL_MORPH];
+  out->morph_frames.frames = frames[VMDL_MORPH];
+  out->camera_frames.num_frames = (uint32_t)num[VMDL_CAMERA];
+  out->camera_frames.frames = frames[VMDL_CAMERA];
+  out->light_frames.num_frames = (uint32_t)num[VMDL_LIGHT];
+  out->light_frames.frames = frames[VMDL_LIGHT];
+  out->shadow_frames.num_frames = (uint32_t)num[VMDL_SHADOW];
+  out->shadow_frames.frames = frames[VMDL_SHADOW];
+  out->ik_frames.num_frames = (uint32_t)num[VMDL_IK];
+  out->ik_frames.frames = frames[VMDL_IK];
+  out->ik_frames.num_ik = (uint32_t)num_ik;
+  out->ik_frames.ik = pool;
+  ok = true;
+
+ done:
+  if ( ok == false ) {
+    for ( int type = VMDL_BONE; type <= VMDL_IK; type++ ) free(frames[type]);
+    free(pool);
+  }
+  if ( own_index ) VMDReleaseTrackIndex(vf);
+  return out;
+}
@@ -0,0 +1,439 @@
+/**
+ *  @file vmd_columns.c
+ *  @brief Columnar (structure of arrays) view of bone and morph frames
+ *  @author ihm4
+ *  @note
+ *    Frames in file are packed structures with a 15 byte name first, so
+ *    every float is misaligned and a pass over one field pulls the whole
+ *    frame. Columns hold each field in its own array, aligned to
+ *    VMDLIB_COLUMN_ALIGN bytes, with names replaced by ids of the name table
+ *    of the file (VMDGetNameTable()). Row i of columns is frame i of the
+ *    section.
+ *
+ *    Names are compared up to NUL, as VMDFindBoneTrack() does. Bytes after
+ *    NUL are not kept, frames converted back have the name padded by NUL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmd.h"
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+/**
+ * @brief Round column length up to whole alignment units
+ *  Internally called function
+ * @param (num) number of elements
+ * @param (size) size of an element
+ * @return size of the column in bytes
+ */
+static size_t __VMDColumnSize(uint32_t num, size_t size){
+  size_t bytes = (size_t)num * size;
+  return (bytes + VMDLIB_COLUMN_ALIGN - 1) & ~(size_t)(VMDLIB_COLUMN_ALIGN - 1);
+}
+
+/**
+ * @brief Allocate aligned block for columns
+ *  Internally called function, also used for other arrays aligned to
+ *  VMDLIB_COLUMN_ALIGN (see VMDBakeMotion())
+ * @param (size) size in bytes
+ * @return block or NULL
+ */
+void* __VMDAllocColumns(size_t size){
+  void* p = NULL;
+  if ( size == 0 ) size = VMDLIB_COLUMN_ALIGN;
+#ifdef _WIN32
+  p = _aligned_malloc(size, VMDLIB_COLUMN_ALIGN);
+#else
+  if ( posix_memalign(&p, VMDLIB_COLUMN_ALIGN, size) != 0 ) p = NULL;
+#endif
+  return p;
+}
+
+/**
+ * @brief Free block allocated by __VMDAllocColumns()
+ *  Internally called function
+ * @param (p) block or NULL
+ * @return void
+ */
+void __VMDFreeColumns(void* p){
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+/**
+ * @brief Take one column out of the block
+ *  Internally called function
+ * @param (cursor) [in,out] free part of the block
+ * @param (num) number of elements
+ * @param (size) size of an element
+ * @return head of the column
+ */
+static void* __VMDTakeColumn(char** cursor, uint32_t num, size_t size){
+  void* p = *cursor;
+  *cursor += __VMDColumnSize(num, size);
+  return p;
+}
+
+/**
+ * @brief Copy names and name ids of frames into columns
+ *  Internally called function
+ * @param (table) track table of the section
+ * @param (names) name table of the file
+ * @param (name_id) [out] name id of each frame
+ * @param (copy) [out] Shift-JIS form of every name of `names`
+ * @param (num) number of frames
+ * @return void
+ */
+static void __VMDNameIds(const VMDTrackTable* table, const VMDNameTable* names,
+                         uint32_t* name_id, char (*copy)[VMDLIB_NAME_SIZE + 1],
+                         uint32_t num){
+  const char* name;
+  for ( uint32_t i = 0; i < VMDGetNumNames(names); i++ ) {
+    name = VMDGetNameSJIS(names, i);
+    memset(copy[i], 0, VMDLIB_NAME_SIZE + 1);
+    memcpy(copy[i], name, __VMDNameLength(name, VMDLIB_NAME_SIZE));
+  }
+  if ( num > 0 ) memcpy(name_id, table->name_ids, sizeof(uint32_t) * num);
+}
+
+/**
+ * @brief Allocate bone columns
+ *  Internally called function, also used by decoders filling the columns
+ *  directly (see VMDDecompressBoneColumns())
+ * @param (num) number of frames
+ * @param (num_names) number of names
+ * @return columns with every array allocated but not filled, released by
+ *         VMDReleaseBoneColumns(), or NULL with VMD_ERROR set
+ */
+VMDBoneColumns* __VMDAllocBoneColumns(uint32_t num, uint32_t num_names){
+  VMDBoneColumns* cols;
+  size_t size;
+  char* cursor;
+
+  cols = calloc(1, sizeof(VMDBoneColumns));
+  if ( cols == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  size = __VMDColumnSize(num_names, VMDLIB_NAME_SIZE + 1)
+         + __VMDColumnSize(num, sizeof(uint32_t)) * 2
+         + __VMDColumnSize(num, sizeof(float)) * 7
+         + __VMDColumnSize(num, 64);
+  cols->block = __VMDAllocColumns(size);
+  if ( cols->block == NULL ) {
+    free(cols);
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  cursor = cols->block;
+  cols->num_frames = num;
+  cols->num_names = num_names;
+  cols->names = __VMDTakeColumn(&cursor, num_names, VMDLIB_NAME_SIZE + 1);
+  cols->name_id = __VMDTakeColumn(&cursor, num, sizeof(uint32_t));
+  cols->frame = __VMDTakeColumn(&cursor, num, sizeof(uint32_t));
+  cols->x = __VMDTakeColumn(&cursor, num, sizeof(float));
+  cols->y = __VMDTakeColumn(&cursor, num, sizeof(float));
+  cols->z = __VMDTakeColumn(&cursor, num, sizeof(float));
+  cols->qx = __VMDTakeColumn(&cursor, num, sizeof(float));
+  cols->qy = __VMDTakeColumn(&cursor, num, sizeof(float));
+  cols->qz = __VMDTakeColumn(&cursor, num, sizeof(float));
+  cols->qw = __VMDTakeColumn(&cursor, num, sizeof(float));
+  cols->bezier = __VMDTakeColumn(&cursor, num, 64);
+  return cols;
+}
+
+/**
+ * @brief Convert bone frames of VMDFile into columns
+ *  The track index of `vf` is built if it is not built yet. Columns are
+ *  independent of `vf` and stay valid after it is released.
+ * @param (vf) a pointer to VMDFile
+ * @return columns, released by VMDReleaseBoneColumns(), or NULL on failure
+ */
+VMDBoneColumns* VMDCreateBoneColumns(VMDFile* vf){
+  const VMDBoneSingleFrame* f;
+  const VMDTrackTable* table;
+  VMDBoneColumns* cols;
+  uint32_t num;
+
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  if ( vf->index == NULL && VMDBuildTrackIndex(vf) == false ) return NULL;
+  table = &vf->index->bones;
+  num = vf->bone_frames.num_frames;
+
+  cols = __VMDAllocBoneColumns(num, VMDGetNumNames(vf->names));
+  if ( cols == NULL ) return NULL;
+
+  __VMDNameIds(table, vf->names, cols->name_id, cols->names, num);
+  for ( uint32_t i = 0; i < num; i++ ) {
+    f = &vf->bone_frames.frames[i];
+    cols->frame[i] = f->frame;
+    cols->x[i] = f->x;
+    cols->y[i] = f->y;
+    cols->z[i] = f->z;
+    cols->qx[i] = f->qx;
+    cols->qy[i] = f->qy;
+    cols->qz[i] = f->qz;
+    cols->qw[i] = f->qw;
+    memcpy(cols->bezier[i], f->bezier, 64);
+  }
+  return cols;
+}
+
+/**
+ * @brief Convert morph frames of VMDFile into columns
+ *  See VMDCreateBoneColumns()
+ * @param (vf) a pointer to VMDFile
+ * @return columns, released by VMDReleaseMorphColumns(), or NULL on failure
+ */
+VMDMorphColumns* VMDCreateMorphColumns(VMDFile* vf){
+  const VMDMorphSingleFrame* f;
+  const VMDTrackTable* table;
+  VMDMorphColumns* cols;
+  uint32_t num;
+  size_t size;
+  char* cursor;
+
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  if ( vf->index == NULL && VMDBuildTrackIndex(vf) == false ) return NULL;
+  table = &vf->index->morphs;
+  num = vf->morph_frames.num_frames;
+
+  cols = calloc(1, sizeof(VMDMorphColumns));
+  if ( cols == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  size = __VMDColumnSize(VMDGetNumNames(vf->names), VMDLIB_NAME_SIZE + 1)
+         + __VMDColumnSize(num, sizeof(uint32_t)) * 2
+         + __VMDColumnSize(num, sizeof(float));
+  cols->block = __VMDAllocColumns(size);
+  if ( cols->block == NULL ) {
+    free(cols);
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  cursor = cols->block;
+  cols->num_frames = num;
+  cols->num_names = VMDGetNumNames(vf->names);
+  cols->names = __VMDTakeColumn(&cursor, cols->num_names,
+                                VMDLIB_NAME_SIZE + 1);
+  cols->name_id = __VMDTakeColumn(&cursor, num, sizeof(uint32_t));
+  cols->frame = __VMDTakeColumn(&cursor, num, sizeof(uint32_t));
+  cols->value = __VMDTakeColumn(&cursor, num, sizeof(float));
+
+  __VMDNameIds(table, vf->names, cols->name_id, cols->names, num);
+  for ( uint32_t i = 0; i < num; i++ ) {
+    f = &vf->morph_frames.frames[i];
+    cols->frame[i] = f->frame;
+    cols->value[i] = f->value;
+  }
+  return cols;
+}
+
+/**
+ * @brief Convert bone columns back into packed frames
+ * @param (cols) bone columns
+ * @param (frames) [out] `cols->num_frames` frames
+ * @return bool : false for an invalid call
+ */
+bool VMDBoneColumnsToFrames(const VMDBoneColumns* cols,
+                            VMDBoneSingleFrame* frames){
+  VMDBoneSingleFrame* f;
+
+  if ( cols == NULL || (frames == NULL && cols->num_frames > 0) ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  for ( uint32_t i = 0; i < cols->num_frames; i++ ) {
+    if ( cols->name_id[i] >= cols->num_names ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return false;
+    }
+    f = &frames[i];
+    memcpy(f->name, cols->names[cols->name_id[i]], VMDLIB_NAME_SIZE);
+    f->frame = cols->frame[i];
+    f->x = cols->x[i];
+    f->y = cols->y[i];
+    f->z = cols->z[i];
+    f->qx = cols->qx[i];
+    f->qy = cols->qy[i];
+    f->qz = cols->qz[i];
+    f->qw = cols->qw[i];
+    memcpy(f->bezier, cols->bezier[i], 64);
+  }
+  return true;
+}
+
+/**
+ * @brief Convert morph columns back into packed frames
+ * @param (cols) morph columns
+ * @param (frames) [out] `cols->num_frames` frames
+ * @return bool : false for an invalid call
+ */
+bool VMDMorphColumnsToFrames(const VMDMorphColumns* cols,
+                             VMDMorphSingleFrame* frames){
+  VMDMorphSingleFrame* f;
+
+  if ( cols == NULL || (frames == NULL && cols->num_frames > 0) ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  for ( uint32_t i = 0; i < cols->num_frames; i++ ) {
+    if ( cols->name_id[i] >= cols->num_names ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return false;
+    }
+    f = &frames[i];
+    memcpy(f->name, cols->names[cols->name_id[i]], VMDLIB_NAME_SIZE);
+    f->frame = cols->frame[i];
+    f->value = cols->value[i];
+  }
+  return true;
+}
+
+/**
+ * @brief Section buffer of `num` frames to be overwritten by columns
+ *  Internally called function. Frames are reused if the number does not
+ *  change, and reallocated only for sections allocated by malloc().
+ * @param (vf) a pointer to VMDFile
+ * @param (frames) current frames of the section
+ * @param (cur) current number of frames
+ * @param (num) new number of frames
+ * @param (size) size of a frame
+ * @return buffer for `num` frames, or NULL on failure
+ */
+static void* __VMDSectionForColumns(VMDFile* vf, void* frames, uint32_t cur,
+                                    uint32_t num, size_t size){
+  void* p;
+
+  if ( vf->storage == VMDL_STORAGE_MMAP
+       && (vf->map_flags & VMDLIB_MAP_COW) == 0 ) {
+    DEBUG_PRINT("Frames mapped read-only cannot be overwritten\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  if ( num == cur ) return frames;
+  if ( vf->storage != VMDL_STORAGE_HEAP ) {
+    DEBUG_PRINT("Only sections allocated by malloc() can be resized\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  p = realloc(frames, size * (num > 0 ? num : 1));
+  if ( p == NULL ) VMD_ERROR = VMDLIB_E_ME;
+  return p;
+}
+
+/**
+ * @brief Store bone columns as bone frames of VMDFile
+ *  Replaces the bone section with the frames of the columns, ready for
+ *  VMDWriteToFile(). Derived data (track index, curve table) is rebuilt
+ *  if it has been built.
+ * @param (vf) a pointer to VMDFile
+ * @param (cols) bone columns
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDStoreBoneColumns(VMDFile* vf, const VMDBoneColumns* cols){
+  VMDBoneSingleFrame* frames;
+  uint32_t num;
+
+  if ( vf == NULL || cols == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  for ( uint32_t i = 0; i < cols->num_frames; i++ ) {
+    if ( cols->name_id[i] >= cols->num_names ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return false;
+    }
+  }
+  // frames not read yet would overwrite the columns later
+  if ( VMDLoadSections(vf, VMDLIB_SECTION(VMDL_BONE)) == false ) return false;
+  frames = __VMDSectionForColumns(vf, vf->bone_frames.frames,
+                                  vf->bone_frames.num_frames,
+                                  cols->num_frames,
+                                  sizeof(VMDBoneSingleFrame));
+  if ( frames == NULL ) return false;
+  num = vf->bone_frames.num_frames;
+  vf->bone_frames.frames = frames;
+  vf->bone_frames.num_frames = cols->num_frames;
+  VMDBoneColumnsToFrames(cols, frames);
+  __VMDMarkRewritten(vf, VMDL_BONE, num);
+
+  if ( vf->index != NULL ) VMDBuildTrackIndex(vf);
+  if ( vf->curves != NULL ) VMDBuildCurveTable(vf);
+  return true;
+}
+
+/**
+ * @brief Store morph columns as morph frames of VMDFile
+ *  See VMDStoreBoneColumns()
+ * @param (vf) a pointer to VMDFile
+ * @param (cols) morph columns
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDStoreMorphColumns(VMDFile* vf, const VMDMorphColumns* cols){
+  VMDMorphSingleFrame* frames;
+  uint32_t num;
+
+  if ( vf == NULL || cols == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  for ( uint32_t i = 0; i < cols->num_frames; i++ ) {
+    if ( cols->name_id[i] >= cols->num_names ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return false;
+    }
+  }
+  // frames not read yet would overwrite the columns later
+  if ( VMDLoadSections(vf, VMDLIB_SECTION(VMDL_MORPH)) == false ) return false;
+  frames = __VMDSectionForColumns(vf, vf->morph_frames.frames,
+                                  vf->morph_frames.num_frames,
+                                  cols->num_frames,
+                                  sizeof(VMDMorphSingleFrame));
+  if ( frames == NULL ) return false;
+  num = vf->morph_frames.num_frames;
+  vf->morph_frames.frames = frames;
+  vf->morph_frames.num_frames = cols->num_frames;
+  VMDMorphColumnsToFrames(cols, frames);
+  __VMDMarkRewritten(vf, VMDL_MORPH, num);
+
+  if ( vf->index != NULL ) VMDBuildTrackIndex(vf);
+  return true;
+}
+
+/**
+ * @brief Release bone columns
+ * @param (cols) bone columns or NULL
+ * @return void
+ */
+void VMDReleaseBoneColumns(VMDBoneColumns* cols){
+  if ( cols == NULL ) return;
+  __VMDFreeColumns(cols->block);
+  free(cols);
+}
+
+/**
+ * @brief Release morph columns
+ * @param (cols) morph columns or NULL
+ * @return void
+ */
+void VMDReleaseMorphColumns(VMDMorphColumns* cols){
+  if ( cols == NULL ) return;
+  __VMDFreeColumns(cols->block);
+  free(cols);
+}
@@ -0,0 +1,911 @@
+/**
+ *  @file vmd_compress.c
+ *  @brief Compressed container of VMD data ("VMDZ")
+ *  @author ihm4
+ *  @note
+ *    A bone frame takes 111 bytes in VMD, most of them for the name and
+ *    the 64 bytes of interpolation parameters, which are 16 values repeated
+ *    with shifts. The container stores bone frames grouped by track (see
+ *    vmd_index.c) in separate streams:
+ *
+ *      - the name of each track once,
+ *      - frame numbers as varints, the first of each track and then deltas,
+ *      - each distinct set of 16 control points once, where its first key
+ *        is, and the id of the set for later keys,
+ *      - positions only for tracks which have any,
+ *      - rotations quantized as "smallest three": the largest component is
+ *        dropped and the other three are stored in 15 bits each, so a
+ *        rotation takes 6 bytes and each component of the normalized
+ *        rotation is off by about 5e-5 at most (VMDLIB_COMPRESS_EXACT stores
+ *        the four floats instead).
+ *
+ *    Other sections follow as VMD data without bone frames. With
+ *    VMDLIB_COMPRESS_LZ4 or VMDLIB_COMPRESS_ZSTD the whole payload is
+ *    compressed once more, which needs the library built with -DVMDLIB_LZ4
+ *    or -DVMDLIB_ZSTD and linked with liblz4 or libzstd.
+ *
+ *    Decoding fills bone columns (VMDBoneColumns) stream by stream, so a
+ *    loop walks one stream into one column. VMDDecompress() converts the
+ *    columns into frames. Bone frames come back grouped by track, each track
+ *    in frame order, with names padded by NUL as VMDBoneColumnsToFrames()
+ *    writes them, and parameters which are not laid out as MMD writes them
+ *    are kept as they are. A container is specific to the byte order of
+ *    the build which wrote it, as cache files are (vmd_cache.c).
+ *
+ *    The file is laid out as below.
+ *
+ *      char     magic[4];       // "VMDZ"
+ *      uint32_t version;        // 1
+ *      uint32_t byte_order;     // 0x01020304 in the byte order of writer
+ *      uint32_t flags;          // VMDLIB_COMPRESS_* of the writer
+ *      uint64_t raw_size;       // size of the payload
+ *      uint64_t size;           // size of the payload stored in the file
+ *      // payload, compressed by LZ4 or zstd if flags say so
+ *      uint32_t num_tracks;
+ *      uint32_t num_keys;       // number of bone frames
+ *      uint32_t num_curves;     // number of distinct control points
+ *      uint32_t reserved;
+ *      uint64_t stream_size[VMDZ_NUM_STREAMS];
+ *      // the streams, in the order of VMDZStreamType
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "vmd.h"
+#ifdef VMDLIB_LZ4
+#include <lz4.h>
+#endif
+#ifdef VMDLIB_ZSTD
+#include <zstd.h>
+#endif
+
+#define VMDLIB_Z_MAGIC      ("VMDZ")
+#define VMDLIB_Z_VERSION    (1)
+#define VMDLIB_Z_BYTE_ORDER (0x01020304u)
+#define VMDLIB_Z_ZSTD_LEVEL (3)
+// Flag of a track in VMDZ_TRACKS, keys of the track have positions
+#define VMDLIB_Z_TRACK_POSITION (0x01)
+// Bytes of a rotation, quantized or exact
+#define VMDLIB_Z_ROTATION_SIZE(flags) \
+  (((flags) & VMDLIB_COMPRESS_EXACT) ? 4 * sizeof(float) : 6)
+// Largest value of the three smaller components of a unit quaternion
+#define VMDLIB_Z_SQRT1_2    (0.70710678f)
+#define VMDLIB_Z_QUANT_MAX  (32767)
+
+// Streams of the payload, in the order they are stored
+typedef enum {
+  VMDZ_TRACKS,     // name[15], varint number of keys and flag of each track
+  VMDZ_FRAMES,     // varint frame numbers, first of a track and then deltas
+  VMDZ_CURVES,     // distinct first rows of the parameters, 16 bytes each,
+                   // in the order of their first keys
+  VMDZ_CURVE_IDS,  // varint of each key, 0 for VMDZ_BEZIER, 1 for the next
+                   // of VMDZ_CURVES, curve id + 2 for a curve seen before
+  VMDZ_BEZIER,     // 64 bytes of keys whose parameters are not laid out
+                   // as __VMDEncodeBoneBezier() does
+  VMDZ_POSITIONS,  // X, Y and Z floats of keys of tracks with positions
+  VMDZ_ROTATIONS,  // rotation of each key
+  VMDZ_REST,       // VMD data of the file without bone frames
+  VMDZ_NUM_STREAMS
+} VMDZStreamType;
+
+typedef struct {
+  char     magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t flags;
+  uint64_t raw_size;
+  uint64_t size;
+} VMDZHeader;
+
+typedef struct {
+  uint32_t num_tracks;
+  uint32_t num_keys;
+  uint32_t num_curves;
+  uint32_t reserved;
+  uint64_t stream_size[VMDZ_NUM_STREAMS];
+} VMDZPayload;
+
+// Stream being written or read
+typedef struct {
+  uint8_t* data;
+  size_t   size; // written, or left to be read
+} VMDZStream;
+
+// Distinct control points being collected
+typedef struct {
+  uint32_t* slots;  // curve id + 1 of each slot, 0 for empty
+  uint32_t  mask;   // number of slots - 1
+  uint8_t*  curves; // 16 bytes each, VMDZ_CURVES
+  uint32_t  num;
+} VMDZCurveSet;
+
+/**
+ * @brief Append varint
+ *  Internally called function. 7 bits a byte from the lowest, the highest
+ *  bit set on every byte but the last.
+ * @param (s) stream with room for 5 more bytes
+ * @param (v) value
+ * @return void
+ */
+static void __VMDZPutVarint(VMDZStream* s, uint32_t v){
+  while ( v >= 0x80 ) {
+    s->data[s->size++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  s->data[s->size++] = (uint8_t)v;
+}
+
+/**
+ * @brief Append bytes
+ *  Internally called function
+ * @param (s) stream with room for `size` more bytes
+ * @param (p) bytes
+ * @param (size) number of bytes
+ * @return void
+ */
+static void __VMDZPut(VMDZStream* s, const void* p, size_t size){
+  memcpy(s->data + s->size, p, size);
+  s->size += size;
+}
+
+/**
+ * @brief Read varint
+ *  Internally called function
+ * @param (s) [in,out] stream
+ * @param (v) [out] value
+ * @return bool : false if the stream ends or the value exceeds 32 bits
+ */
+static bool __VMDZGetVarint(VMDZStream* s, uint32_t* v){
+  uint32_t value = 0;
+
+  for ( int shift = 0; shift < 35; shift += 7 ) {
+    if ( s->size == 0 ) return false;
+    s->size--;
+    value |= (uint32_t)(*s->data & 0x7f) << shift;
+    if ( (*s->data++ & 0x80) == 0 ) {
+      *v = value;
+      return shift < 28 || (s->data[-1] >> 4) == 0;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Take bytes from stream
+ *  Internally called function
+ * @param (s) [in,out] stream
+ * @param (size) number of bytes
+ * @return head of the bytes, or NULL if the stream ends
+ */
+static const uint8_t* __VMDZGet(VMDZStream* s, size_t size){
+  const uint8_t* p = s->data;
+
+  if ( s->size < size ) return NULL;
+  s->data += size;
+  s->size -= size;
+  return p;
+}
+
+/**
+ * @brief Quantize rotation as smallest three
+ *  Internally called function. 2 bits of the position of the largest
+ *  component, 1 bit of its sign and 15 bits of each other component, from
+ *  the highest bit of 48, stored from the lowest byte.
+ * @param (q) quaternion, X, Y, Z, W
+ * @param (out) [out] 6 bytes
+ * @return void
+ */
+static void __VMDZEncodeRotation(const float* q, uint8_t* out){
+  float len = sqrtf(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+  float v[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+  uint64_t bits;
+  int big = 3, u;
+
+  if ( len > 0.0f && isfinite(len) ) {
+    for ( int i = 0; i < 4; i++ ) v[i] = q[i] / len;
+  }
+  for ( int i = 0; i < 3; i++ ) {
+    if ( fabsf(v[i]) > fabsf(v[big]) ) big = i;
+  }
+  bits = (uint64_t)big << 46 | (uint64_t)(v[big] < 0.0f) << 45;
+  for ( int i = 0, shift = 30; i < 4; i++ ) {
+    if ( i == big ) continue;
+    u = (int)lrintf((v[i] / VMDLIB_Z_SQRT1_2 + 1.0f) * 0.5f
+                    * VMDLIB_Z_QUANT_MAX);
+    u = u < 0 ? 0 : (u > VMDLIB_Z_QUANT_MAX ? VMDLIB_Z_QUANT_MAX : u);
+    bits |= (uint64_t)u << shift;
+    shift -= 15;
+  }
+  for ( int i = 0; i < 6; i++ ) out[i] = (uint8_t)(bits >> (8 * i));
+}
+
+/**
+ * @brief Restore rotation quantized by __VMDZEncodeRotation()
+ *  Internally called function
+ * @param (p) 6 bytes
+ * @param (q) [out] unit quaternion, X, Y, Z, W
+ * @return void
+ */
+static void __VMDZDecodeRotation(const uint8_t* p, float* q){
+  uint64_t bits = 0;
+  float sum = 0.0f, v;
+  int big;
+
+  for ( int i = 0; i < 6; i++ ) bits |= (uint64_t)p[i] << (8 * i);
+  big = (int)(bits >> 46) & 3;
+  for ( int i = 0, shift = 30; i < 4; i++ ) {
+    if ( i == big ) continue;
+    v = ((float)((bits >> shift) & 0x7fff) * (2.0f / VMDLIB_Z_QUANT_MAX)
+         - 1.0f) * VMDLIB_Z_SQRT1_2;
+    q[i] = v;
+    sum += v * v;
+    shift -= 15;
+  }
+  v = sum < 1.0f ? sqrtf(1.0f - sum) : 0.0f;
+  q[big] = (bits >> 45) & 1 ? -v : v;
+}
+
+/**
+ * @brief Find or add control points of a key
+ *  Internally called function
+ * @param (set) [in,out] distinct control points
+ * @param (row) first row of the parameters, 16 bytes
+ * @param (added) [out] true if `row` is seen for the first time
+ * @return curve id
+ */
+static uint32_t __VMDZInternCurve(VMDZCurveSet* set, const char* row,
+                                  bool* added){
+  uint32_t slot = (uint32_t)__VMDXXHash64(row, 16, 0) & set->mask;
+  uint32_t id;
+
+  *added = false;
+  while ( set->slots[slot] != 0 ) {
+    id = set->slots[slot] - 1;
+    if ( memcmp(set->curves + (size_t)id * 16, row, 16) == 0 ) return id;
+    slot = (slot + 1) & set->mask;
+  }
+  id = set->num++;
+  memcpy(set->curves + (size_t)id * 16, row, 16);
+  set->slots[slot] = id + 1;
+  *added = true;
+  return id;
+}
+
+/**
+ * @brief Check if parameters are laid out as MMD writes them
+ *  Internally called function
+ * @param (bezier) 64 bytes of parameters
+ * @return bool : true if the first row is enough to restore them
+ */
+static bool __VMDZIsCanonical(const char* bezier){
+  uint8_t points[4][4];
+  char encoded[64];
+
+  for ( int axis = 0; axis < 4; axis++ ) {
+    for ( int i = 0; i < 4; i++ ) {
+      points[axis][i] = (uint8_t)bezier[i * 4 + axis];
+    }
+  }
+  __VMDEncodeBoneBezier(encoded, (const uint8_t (*)[4])points);
+  return memcmp(encoded, bezier, 64) == 0;
+}
+
+/**
+ * @brief Write payload of bone frames and other sections into streams
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile with the track index built
+ * @param (flags) VMDLIB_COMPRESS_*
+ * @param (s) [out] streams, each with room for the worst case
+ * @param (set) [in,out] distinct control points
+ * @return void
+ */
+static void __VMDZEncode(VMDFile* vf, uint32_t flags, VMDZStream* s,
+                         VMDZCurveSet* set){
+  const VMDTrackTable* table = &vf->index->bones;
+  const VMDBoneSingleFrame* f;
+  const VMDTrack* track;
+  uint32_t prev, id;
+  uint8_t track_flags;
+  bool added;
+  float q[4];
+  uint8_t rotation[6];
+  static const float zero[3];
+
+  for ( uint32_t t = 0; t < table->num_tracks; t++ ) {
+    track = &table->tracks[t];
+    track_flags = 0;
+    for ( uint32_t k = 0; k < track->num_frames; k++ ) {
+      f = &vf->bone_frames.frames[track->frames[k]];
+      if ( memcmp(&f->x, zero, sizeof(zero)) != 0 ) {
+        track_flags |= VMDLIB_Z_TRACK_POSITION;
+        break;
+      }
+    }
+    __VMDZPut(&s[VMDZ_TRACKS], track->name, VMDLIB_NAME_SIZE);
+    __VMDZPutVarint(&s[VMDZ_TRACKS], track->num_frames);
+    __VMDZPut(&s[VMDZ_TRACKS], &track_flags, 1);
+
+    prev = 0;
+    for ( uint32_t k = 0; k < track->num_frames; k++ ) {
+      f = &vf->bone_frames.frames[track->frames[k]];
+      __VMDZPutVarint(&s[VMDZ_FRAMES], f->frame - prev);
+      prev = f->frame;
+      if ( __VMDZIsCanonical(f->bezier) ) {
+        id = __VMDZInternCurve(set, f->bezier, &added);
+        __VMDZPutVarint(&s[VMDZ_CURVE_IDS], added ? 1 : id + 2);
+        if ( added ) __VMDZPut(&s[VMDZ_CURVES], f->bezier, 16);
+      } else {
+        __VMDZPutVarint(&s[VMDZ_CURVE_IDS], 0);
+        __VMDZPut(&s[VMDZ_BEZIER], f->bezier, 64);
+      }
+      if ( track_flags & VMDLIB_Z_TRACK_POSITION ) {
+        __VMDZPut(&s[VMDZ_POSITIONS], &f->x, sizeof(float) * 3);
+      }
+      memcpy(q, &f->qx, sizeof(q));
+      if ( flags & VMDLIB_COMPRESS_EXACT ) {
+        __VMDZPut(&s[VMDZ_ROTATIONS], q, sizeof(q));
+      } else {
+        __VMDZEncodeRotation(q, rotation);
+        __VMDZPut(&s[VMDZ_ROTATIONS], rotation, sizeof(rotation));
+      }
+    }
+  }
+}
+
+/**
+ * @brief Compress payload by LZ4 or zstd
+ *  Internally called function
+ * @param (flags) VMDLIB_COMPRESS_*
+ * @param (raw) payload
+ * @param (raw_size) size of the payload
+ * @param (out) [out] compressed payload, allocated by malloc()
+ * @param (size) [out] size of the compressed payload
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDZPack(uint32_t flags, const void* raw, size_t raw_size,
+                       void** out, size_t* size){
+#ifdef VMDLIB_LZ4
+  if ( flags & VMDLIB_COMPRESS_LZ4 ) {
+    int packed;
+    if ( raw_size > LZ4_MAX_INPUT_SIZE ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return false;
+    }
+    *out = malloc((size_t)LZ4_compressBound((int)raw_size));
+    if ( *out == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      return false;
+    }
+    packed = LZ4_compress_default(raw, *out, (int)raw_size,
+                                  LZ4_compressBound((int)raw_size));
+    if ( packed <= 0 ) {
+      free(*out);
+      VMD_ERROR = VMDLIB_E_ME;
+      return false;
+    }
+    *size = (size_t)packed;
+    return true;
+  }
+#endif
+#ifdef VMDLIB_ZSTD
+  if ( flags & VMDLIB_COMPRESS_ZSTD ) {
+    size_t packed, bound = ZSTD_compressBound(raw_size);
+    *out = malloc(bound);
+    if ( *out == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      return false;
+    }
+    packed = ZSTD_compress(*out, bound, raw, raw_size, VMDLIB_Z_ZSTD_LEVEL);
+    if ( ZSTD_isError(packed) ) {
+      free(*out);
+      VMD_ERROR = VMDLIB_E_ME;
+      return false;
+    }
+    *size = packed;
+    return true;
+  }
+#endif
+  (void)raw;
+  (void)raw_size;
+  (void)flags;
+  *out = NULL;
+  *size = 0;
+  VMD_ERROR = VMDLIB_E_IV;
+  return false;
+}
+
+/**
+ * @brief Check if flags can be handled by this build
+ *  Internally called function
+ * @param (flags) VMDLIB_COMPRESS_*
+ * @return bool
+ */
+static bool __VMDZFlagsSupported(uint32_t flags){
+  uint32_t known = VMDLIB_COMPRESS_EXACT;
+#ifdef VMDLIB_LZ4
+  known |= VMDLIB_COMPRESS_LZ4;
+#endif
+#ifdef VMDLIB_ZSTD
+  known |= VMDLIB_COMPRESS_ZSTD;
+#endif
+  if ( (flags & VMDLIB_COMPRESS_LZ4) && (flags & VMDLIB_COMPRESS_ZSTD) ) {
+    return false;
+  }
+  return (flags & ~known) == 0;
+}
+
+/**
+ * @brief Write VMDFile as compressed container
+ *  See the note of vmd_compress.c for the layout. The track index of `vf`
+ *  is built if it is not built yet, sections not read yet are read.
+ * @param (vf) a pointer to VMDFile
+ * @param (flags) VMDLIB_COMPRESS_*, VMDLIB_E_IV if the build lacks LZ4 or
+ *        zstd asked for
+ * @param (sink) output
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDCompress(VMDFile* vf, uint32_t flags, const VMDSink* sink){
+  VMDZStream s[VMDZ_NUM_STREAMS];
+  size_t worst[VMDZ_NUM_STREAMS];
+  VMDZCurveSet set = { NULL, 0, NULL, 0 };
+  VMDZPayload payload;
+  VMDZHeader header;
+  VMDFile rest;
+  uint32_t num;
+  uint64_t slots = 1;
+  size_t total = sizeof(VMDZPayload), covered = 0, packed_size;
+  void* packed = NULL;
+  char* block;
+  bool ok;
+
+  if ( vf == NULL || sink == NULL || sink->write == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( __VMDZFlagsSupported(flags) == false ) {
+    DEBUG_PRINT("Compression 0x%x is not built in\n", flags);
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION_ALL) == false ) return false;
+  if ( vf->index == NULL && VMDBuildTrackIndex(vf) == false ) return false;
+  num = vf->bone_frames.num_frames;
+  for ( uint32_t t = 0; t < vf->index->bones.num_tracks; t++ ) {
+    covered += vf->index->bones.tracks[t].num_frames;
+  }
+  if ( covered != num ) {
+    DEBUG_PRINT("Track index does not cover all frames\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+
+  // other sections are written by the VMD writer
+  rest = *vf;
+  rest.bone_frames.num_frames = 0;
+  rest.bone_frames.frames = NULL;
+
+  worst[VMDZ_TRACKS] = (size_t)vf->index->bones.num_tracks
+                       * (VMDLIB_NAME_SIZE + 5 + 1);
+  worst[VMDZ_FRAMES] = (size_t)num * 5;
+  worst[VMDZ_CURVES] = (size_t)num * 16;
+  worst[VMDZ_CURVE_IDS] = (size_t)num * 5;
+  worst[VMDZ_BEZIER] = (size_t)num * 64;
+  worst[VMDZ_POSITIONS] = (size_t)num * sizeof(float) * 3;
+  worst[VMDZ_ROTATIONS] = (size_t)num * VMDLIB_Z_ROTATION_SIZE(flags);
+  worst[VMDZ_REST] = VMDGetWriteSize(&rest);
+  for ( int i = 0; i < VMDZ_NUM_STREAMS; i++ ) total += worst[i];
+  while ( slots < (uint64_t)num * 2 ) slots <<= 1;
+
+  block = malloc(total);
+  set.slots = calloc((size_t)slots, sizeof(uint32_t));
+  set.curves = malloc((size_t)num * 16 + 1);
+  if ( block == NULL || set.slots == NULL || set.curves == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    ok = false;
+    goto end;
+  }
+  set.mask = (uint32_t)(slots - 1);
+
+  // each stream is written at its worst case place, then packed
+  s[0].data = (uint8_t*)block + sizeof(VMDZPayload);
+  for ( int i = 0; i < VMDZ_NUM_STREAMS; i++ ) {
+    if ( i > 0 ) s[i].data = s[i - 1].data + worst[i - 1];
+    s[i].size = 0;
+  }
+  __VMDZEncode(vf, flags, s, &set);
+  s[VMDZ_REST].size = VMDWriteToMemory(&rest, s[VMDZ_REST].data,
+                                       worst[VMDZ_REST]);
+
+  memset(&payload, 0, sizeof(payload));
+  payload.num_tracks = vf->index->bones.num_tracks;
+  payload.num_keys = num;
+  payload.num_curves = set.num;
+  total = sizeof(VMDZPayload);
+  for ( int i = 0; i < VMDZ_NUM_STREAMS; i++ ) {
+    payload.stream_size[i] = s[i].size;
+    memmove(block + total, s[i].data, s[i].size);
+    total += s[i].size;
+  }
+  memcpy(block, &payload, sizeof(payload));
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, VMDLIB_Z_MAGIC, sizeof(header.magic));
+  header.version = VMDLIB_Z_VERSION;
+  header.byte_order = VMDLIB_Z_BYTE_ORDER;
+  header.flags = flags;
+  header.raw_size = total;
+  header.size = total;
+  packed_size = total;
+  if ( flags & (VMDLIB_COMPRESS_LZ4 | VMDLIB_COMPRESS_ZSTD) ) {
+    if ( __VMDZPack(flags, block, total, &packed, &packed_size) == false ) {
+      ok = false;
+      goto end;
+    }
+    header.size = packed_size;
+  }
+  ok = sink->write(sink->user, &header, sizeof(header))
+       && sink->write(sink->user, packed != NULL ? packed : block, packed_size);
+  if ( ok == false ) VMD_ERROR = VMDLIB_E_WR;
+
+end:
+  free(packed);
+  free(block);
+  free(set.slots);
+  free(set.curves);
+  return ok;
+}
+
+/**
+ * @brief Sink writing to FILE*
+ *  Internally called function
+ */
+static bool __VMDZFileSink(void* user, const void* data, size_t size){
+  return fwrite(data, 1, size, (FILE*)user) == size;
+}
+
+/**
+ * @brief Write VMDFile as compressed container to file
+ *  See VMDCompress()
+ * @param (vf) a pointer to VMDFile
+ * @param (flags) VMDLIB_COMPRESS_*
+ * @param (fname) file name
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDCompressToFile(VMDFile* vf, uint32_t flags, const char* fname){
+  VMDSink sink = { __VMDZFileSink, NULL };
+  FILE* fp;
+  bool ok;
+
+  if ( fname == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  fp = fopen(fname, "wb");
+  if ( fp == NULL ) {
+    DEBUG_PRINT("File open error.\n");
+    VMD_ERROR = VMDLIB_E_FH;
+    return false;
+  }
+  sink.user = fp;
+  ok = VMDCompress(vf, flags, &sink);
+  if ( fclose(fp) != 0 && ok ) {
+    VMD_ERROR = VMDLIB_E_WR;
+    ok = false;
+  }
+  return ok;
+}
+
+/**
+ * @brief Locate payload and streams of a container
+ *  Internally called function. Payload compressed by LZ4 or zstd is
+ *  decompressed into `*owned`.
+ * @param (data) container
+ * @param (size) size of the container
+ * @param (payload) [out] head of the payload
+ * @param (s) [out] streams
+ * @param (flags) [out] VMDLIB_COMPRESS_* of the writer
+ * @param (owned) [out] memory to be freed after the streams are read, or NULL
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDZOpen(const void* data, size_t size, VMDZPayload* payload,
+                       VMDZStream* s, uint32_t* flags, void** owned){
+  VMDZHeader header;
+  const uint8_t* raw = (const uint8_t*)data + sizeof(VMDZHeader);
+  uint64_t total = sizeof(VMDZPayload);
+
+  *owned = NULL;
+  if ( data == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( size < sizeof(VMDZHeader) ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  if ( memcmp(header.magic, VMDLIB_Z_MAGIC, sizeof(header.magic)) != 0
+       || header.version != VMDLIB_Z_VERSION
+       || header.byte_order != VMDLIB_Z_BYTE_ORDER
+       || header.size != size - sizeof(VMDZHeader)
+       || header.raw_size < sizeof(VMDZPayload)
+       || header.raw_size > SIZE_MAX ) {
+    DEBUG_PRINT("Not a compressed VMD of this build.\n");
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+  if ( __VMDZFlagsSupported(header.flags) == false ) {
+    DEBUG_PRINT("Compression 0x%x is not built in\n", header.flags);
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+  *flags = header.flags;
+
+  if ( header.flags & (VMDLIB_COMPRESS_LZ4 | VMDLIB_COMPRESS_ZSTD) ) {
+    void* unpacked = malloc((size_t)header.raw_size);
+    bool done = false;
+    if ( unpacked == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      return false;
+    }
+#ifdef VMDLIB_LZ4
+    if ( header.flags & VMDLIB_COMPRESS_LZ4 ) {
+      done = header.raw_size <= LZ4_MAX_INPUT_SIZE
+             && header.size <= LZ4_MAX_INPUT_SIZE
+             && LZ4_decompress_safe((const char*)raw, unpacked,
+                                    (int)header.size, (int)header.raw_size)
+                == (int)header.raw_size;
+    }
+#endif
+#ifdef VMDLIB_ZSTD
+    if ( header.flags & VMDLIB_COMPRESS_ZSTD ) {
+      done = ZSTD_decompress(unpacked, (size_t)header.raw_size, raw,
+                             (size_t)header.size) == header.raw_size;
+    }
+#endif
+    if ( done == false ) {
+      free(unpacked);
+      VMD_ERROR = VMDLIB_E_FT;
+      return false;
+    }
+    *owned = unpacked;
+    raw = unpacked;
+  } else if ( header.raw_size != header.size ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+
+  memcpy(payload, raw, sizeof(VMDZPayload));
+  raw += sizeof(VMDZPayload);
+  for ( int i = 0; i < VMDZ_NUM_STREAMS; i++ ) {
+    if ( payload->stream_size[i] > header.raw_size - total ) {
+      total = 0;
+      break;
+    }
+    s[i].data = (uint8_t*)raw;
+    s[i].size = (size_t)payload->stream_size[i];
+    raw += s[i].size;
+    total += s[i].size;
+  }
+  if ( total != header.raw_size
+       || payload->stream_size[VMDZ_CURVES]
+          != (uint64_t)payload->num_curves * 16
+       || payload->stream_size[VMDZ_ROTATIONS]
+          != (uint64_t)payload->num_keys * VMDLIB_Z_ROTATION_SIZE(*flags) ) {
+    free(*owned);
+    *owned = NULL;
+    VMD_ERROR = VMDLIB_E_FT;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Decode bone frames of streams into columns
+ *  Internally called function, each stream is read in a pass of its own
+ * @param (payload) head of the payload
+ * @param (s) [in,out] streams
+ * @param (flags) VMDLIB_COMPRESS_* of the writer
+ * @return columns, or NULL with VMD_ERROR set
+ */
+static VMDBoneColumns* __VMDZDecodeColumns(const VMDZPayload* payload,
+                                           VMDZStream* s, uint32_t flags){
+  VMDBoneColumns* cols;
+  const uint8_t* p;
+  const uint8_t* curves = s[VMDZ_CURVES].data;
+  uint32_t n, id, k = 0, defined = 0;
+  float q[4];
+
+  if ( payload->num_tracks > s[VMDZ_TRACKS].size / (VMDLIB_NAME_SIZE + 2) ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    return NULL;
+  }
+  cols = __VMDAllocBoneColumns(payload->num_keys, payload->num_tracks);
+  if ( cols == NULL ) return NULL;
+
+  // names, frame numbers and positions, track by track
+  for ( uint32_t t = 0; t < payload->num_tracks; t++ ) {
+    p = __VMDZGet(&s[VMDZ_TRACKS], VMDLIB_NAME_SIZE);
+    if ( p == NULL || __VMDZGetVarint(&s[VMDZ_TRACKS], &n) == false
+         || n > payload->num_keys - k ) {
+      goto broken;
+    }
+    memcpy(cols->names[t], p, VMDLIB_NAME_SIZE);
+    cols->names[t][VMDLIB_NAME_SIZE] = '\0';
+    p = __VMDZGet(&s[VMDZ_TRACKS], 1);
+    if ( p == NULL ) goto broken;
+    for ( uint32_t prev = 0, end = k + n; k < end; k++ ) {
+      if ( __VMDZGetVarint(&s[VMDZ_FRAMES], &id) == false ) goto broken;
+      cols->name_id[k] = t;
+      cols->frame[k] = prev += id;
+    }
+    if ( *p & VMDLIB_Z_TRACK_POSITION ) {
+      p = __VMDZGet(&s[VMDZ_POSITIONS], (size_t)n * sizeof(float) * 3);
+      if ( p == NULL ) goto broken;
+      for ( uint32_t i = 0; i < n; i++, p += sizeof(float) * 3 ) {
+        memcpy(&cols->x[k - n + i], p, sizeof(float));
+        memcpy(&cols->y[k - n + i], p + sizeof(float), sizeof(float));
+        memcpy(&cols->z[k - n + i], p + sizeof(float) * 2, sizeof(float));
+      }
+    } else {
+      for ( uint32_t i = k - n; i < k; i++ ) {
+        cols->x[i] = cols->y[i] = cols->z[i] = 0.0f;
+      }
+    }
+  }
+  if ( k != payload->num_keys ) goto broken;
+
+  // interpolation parameters
+  for ( k = 0; k < payload->num_keys; k++ ) {
+    if ( __VMDZGetVarint(&s[VMDZ_CURVE_IDS], &id) == false
+         || (id == 1 && defined == payload->num_curves)
+         || (id > 1 && id - 2 >= defined) ) {
+      goto broken;
+    }
+    if ( id == 1 ) id = ++defined + 1;
+    if ( id == 0 ) {
+      p = __VMDZGet(&s[VMDZ_BEZIER], 64);
+      if ( p == NULL ) goto broken;
+      memcpy(cols->bezier[k], p, 64);
+    } else {
+      uint8_t points[4][4];
+      p = curves + (size_t)(id - 2) * 16;
+      for ( int axis = 0; axis < 4; axis++ ) {
+        for ( int i = 0; i < 4; i++ ) points[axis][i] = p[i * 4 + axis];
+      }
+      __VMDEncodeBoneBezier(cols->bezier[k], (const uint8_t (*)[4])points);
+    }
+  }
+
+  // rotations, fixed size
+  p = s[VMDZ_ROTATIONS].data;
+  for ( k = 0; k < payload->num_keys; k++ ) {
+    if ( flags & VMDLIB_COMPRESS_EXACT ) {
+      memcpy(q, p, sizeof(q));
+      p += sizeof(q);
+    } else {
+      __VMDZDecodeRotation(p, q);
+      p += 6;
+    }
+    cols->qx[k] = q[0];
+    cols->qy[k] = q[1];
+    cols->qz[k] = q[2];
+    cols->qw[k] = q[3];
+  }
+
+  if ( defined != payload->num_curves
+       || s[VMDZ_TRACKS].size != 0 || s[VMDZ_FRAMES].size != 0
+       || s[VMDZ_CURVE_IDS].size != 0 || s[VMDZ_BEZIER].size != 0
+       || s[VMDZ_POSITIONS].size != 0 ) {
+    goto broken;
+  }
+  return cols;
+
+broken:
+  DEBUG_PRINT("Broken stream of compressed VMD\n");
+  VMD_ERROR = VMDLIB_E_FT;
+  VMDReleaseBoneColumns(cols);
+  return NULL;
+}
+
+/**
+ * @brief Decode bone frames of compressed container into columns
+ *  Other sections are not decoded. Row i of the columns is frame i of the
+ *  VMDFile VMDDecompress() gives, and names are the tracks in order.
+ * @param (data) container written by VMDCompress()
+ * @param (size) size of the container
+ * @return columns, released by VMDReleaseBoneColumns(), or NULL with
+ *         VMD_ERROR set
+ */
+VMDBoneColumns* VMDDecompressBoneColumns(const void* data, size_t size){
+  VMDZStream s[VMDZ_NUM_STREAMS];
+  VMDZPayload payload;
+  VMDBoneColumns* cols;
+  uint32_t flags;
+  void* owned;
+
+  if ( __VMDZOpen(data, size, &payload, s, &flags, &owned) == false ) {
+    return NULL;
+  }
+  cols = __VMDZDecodeColumns(&payload, s, flags);
+  free(owned);
+  return cols;
+}
+
+/**
+ * @note You must release returned pointer by VMDReleaseVMDFile()
+ *       after you used it
+ * @brief Decode compressed container into VMDFile
+ *  See the note of vmd_compress.c for the order of bone frames.
+ * @param (data) container written by VMDCompress()
+ * @param (size) size of the container
+ * @return a pointer to VMDFile, or NULL with VMD_ERROR set
+ */
+VMDFile* VMDDecompress(const void* data, size_t size){
+  VMDZStream s[VMDZ_NUM_STREAMS];
+  VMDZPayload payload;
+  VMDBoneColumns* cols = NULL;
+  VMDBoneSingleFrame* frames = NULL;
+  VMDFile* vf = NULL;
+  uint32_t flags;
+  void* owned;
+
+  if ( __VMDZOpen(data, size, &payload, s, &flags, &owned) == false ) {
+    return NULL;
+  }
+  vf = VMDLoadFromMemory(s[VMDZ_REST].data, s[VMDZ_REST].size);
+  if ( vf == NULL ) goto error;
+  if ( vf->bone_frames.num_frames != 0 ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    goto error;
+  }
+  cols = __VMDZDecodeColumns(&payload, s, flags);
+  if ( cols == NULL ) goto error;
+  if ( payload.num_keys != 0 ) {
+    frames = malloc(sizeof(VMDBoneSingleFrame) * payload.num_keys);
+    if ( frames == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      goto error;
+    }
+    VMDBoneColumnsToFrames(cols, frames);
+    free(vf->bone_frames.frames);
+    vf->bone_frames.frames = frames;
+    vf->bone_frames.num_frames = payload.num_keys;
+  }
+  VMDReleaseBoneColumns(cols);
+  free(owned);
+  return vf;
+
+error:
+  VMDReleaseBoneColumns(cols);
+  if ( vf != NULL ) VMDReleaseVMDFile(vf);
+  free(owned);
+  return NULL;
+}
+
+/**
+ * @note You must release returned pointer by VMDReleaseVMDFile()
+ *       after you used it
+ * @brief Load compressed container from file
+ *  See VMDDecompress()
+ * @param (fname) file name
+ * @return a pointer to VMDFile, or NULL with VMD_ERROR set
+ */
+VMDFile* VMDLoadCompressed(const char* fname){
+  VMDFile* vf;
+  size_t size;
+  void* base;
+
+  if ( fname == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  base = __VMDMapWholeFile(fname, false, &size);
+  if ( base == NULL ) return NULL;
+  vf = VMDDecompress(base, size);
+  __VMDUnmap(base, size);
+  return vf;
+}
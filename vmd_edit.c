@@ -0,0 +1,359 @@
+/**
+ *  @file vmd_edit.c
+ *  @brief Editing keyframes of VMD file
+ *  @author ihm4
+ *  @note
+ *    Keyframes are inserted, deleted and updated one by one. An inserted
+ *    keyframe goes after the last keyframe of its frame number found by
+ *    binary search, so a section sorted by VMDSortAllFrames() stays sorted
+ *    without sorting it again. Derived data (track index, curve table) is
+ *    rebuilt if it has been built, so VMDTrack pointers taken before an
+ *    edit must be found again.
+ *
+ *    Each edit records what it changed in the VMDFile: the sections edited,
+ *    those whose number of frames changed, and the frames edited in each
+ *    section. VMDSaveFile() uses them to write only what has changed into
+ *    the file the motion was loaded from. Frames written directly are
+ *    recorded by VMDMarkEdited().
+ *
+ *    ShowIK records are of variable length and cannot be edited here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "vmd.h"
+
+// Sizes of frames of sections other than ShowIK and offsets of their frame
+// numbers, indexed by VMDStructType
+static const size_t __VMD_EDIT_SIZE[VMDL_SHADOW + 1] = {
+  sizeof(VMDBoneSingleFrame), sizeof(VMDMorphSingleFrame),
+  sizeof(VMDCameraSingleFrame), sizeof(VMDLightSingleFrame),
+  sizeof(VMDShadowSingleFrame)
+};
+static const size_t __VMD_EDIT_KEY[VMDL_SHADOW + 1] = {
+  offsetof(VMDBoneSingleFrame, frame), offsetof(VMDMorphSingleFrame, frame),
+  offsetof(VMDCameraSingleFrame, frame), offsetof(VMDLightSingleFrame, frame),
+  offsetof(VMDShadowSingleFrame, frame)
+};
+
+/**
+ * @brief Record that frames of a section have been edited in place
+ *  Internally called function. The edited frames of the section grow to
+ *  cover `first` to `last` - 1. Edits of ShowIK records are recorded as a
+ *  resize since records differ in size.
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section edited
+ * @param (first) first frame edited
+ * @param (last) end of the frames edited
+ * @return void
+ */
+void __VMDMarkEdited(VMDFile* vf, VMDStructType type, uint32_t first,
+                     uint32_t last){
+  VMDDirtyRange r;
+
+  if ( first >= last ) return;
+  vf->dirty |= VMDLIB_SECTION(type);
+  if ( type == VMDL_IK ) vf->resized |= VMDLIB_SECTION(type);
+  r = vf->edited[type];
+  if ( r.last == 0 ) {
+    r.first = first;
+    r.last = last;
+  } else {
+    if ( first < r.first ) r.first = first;
+    if ( last > r.last ) r.last = last;
+  }
+  vf->edited[type] = r;
+}
+
+/**
+ * @brief Record that a section has been rewritten as a whole
+ *  Internally called function, such as by sorts and column stores
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section rewritten
+ * @param (old_num) number of frames of the section before the rewrite
+ * @return void
+ */
+void __VMDMarkRewritten(VMDFile* vf, VMDStructType type, uint32_t old_num){
+  uint32_t num = VMDGetNumFrames(vf, type);
+
+  if ( num != old_num ) {
+    vf->dirty |= VMDLIB_SECTION(type);
+    vf->resized |= VMDLIB_SECTION(type);
+    return;
+  }
+  __VMDMarkEdited(vf, type, 0, num);
+}
+
+/**
+ * @brief Record that frames of a section have been written directly
+ *  Frames changed through `frames[]` of VMDFile instead of the functions of
+ *  the library are not known to VMDSaveFile() until they are recorded by
+ *  this function.
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section written
+ * @param (first) first frame written
+ * @param (last) end of the frames written
+ * @return bool : false with VMD_ERROR set if the frames are out of range
+ */
+bool VMDMarkEdited(VMDFile* vf, VMDStructType type, uint32_t first,
+                   uint32_t last){
+  if ( vf == NULL || (int)type < VMDL_BONE || type > VMDL_IK
+       || first > last || last > VMDGetNumFrames(vf, type) ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  __VMDMarkEdited(vf, type, first, last);
+  return true;
+}
+
+/**
+ * @brief Frames of a section
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section other than VMDL_IK
+ * @return head of the frames, may be NULL
+ */
+static char* __VMDEditFrames(VMDFile* vf, VMDStructType type){
+  switch ( type ) {
+    case VMDL_BONE: return (char*)vf->bone_frames.frames;
+    case VMDL_MORPH: return (char*)vf->morph_frames.frames;
+    case VMDL_CAMERA: return (char*)vf->camera_frames.frames;
+    case VMDL_LIGHT: return (char*)vf->light_frames.frames;
+    case VMDL_SHADOW: return (char*)vf->shadow_frames.frames;
+    default: return NULL;
+  }
+}
+
+/**
+ * @brief Set frames of a section
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section other than VMDL_IK
+ * @param (frames) head of the frames
+ * @param (num) number of frames
+ * @return void
+ */
+static void __VMDEditSetFrames(VMDFile* vf, VMDStructType type, char* frames,
+                               uint32_t num){
+  switch ( type ) {
+#define VMDLIB_SET(member, type_name)                                        \
+      vf->member.frames = (type_name*)frames;                                \
+      vf->member.num_frames = num;                                           \
+      break
+    case VMDL_BONE: VMDLIB_SET(bone_frames, VMDBoneSingleFrame);
+    case VMDL_MORPH: VMDLIB_SET(morph_frames, VMDMorphSingleFrame);
+    case VMDL_CAMERA: VMDLIB_SET(camera_frames, VMDCameraSingleFrame);
+    case VMDL_LIGHT: VMDLIB_SET(light_frames, VMDLightSingleFrame);
+    case VMDL_SHADOW: VMDLIB_SET(shadow_frames, VMDShadowSingleFrame);
+#undef VMDLIB_SET
+    default:
+      break;
+  }
+}
+
+/**
+ * @brief Position after the last frame at or before a frame number
+ *  Internally called function, for a section sorted by frame numbers
+ * @param (frames) frames of the section
+ * @param (num) number of frames
+ * @param (type) section other than VMDL_IK
+ * @param (frame) frame number
+ * @return position
+ */
+static uint32_t __VMDEditBound(const char* frames, uint32_t num,
+                               VMDStructType type, uint32_t frame){
+  uint32_t lo = 0, hi = num, mid, f;
+
+  while ( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    memcpy(&f, frames + __VMD_EDIT_SIZE[type] * mid + __VMD_EDIT_KEY[type],
+           sizeof(uint32_t));
+    if ( f <= frame ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+ * @brief Check an edit and prepare the section for it
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section to be edited
+ * @param (resize) the edit changes the number of frames
+ * @return bool : false with VMD_ERROR set if it cannot be edited
+ */
+static bool __VMDEditBegin(VMDFile* vf, VMDStructType type, bool resize){
+  if ( vf == NULL || (int)type < VMDL_BONE || type >= VMDL_IK ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( vf->storage == VMDL_STORAGE_MMAP
+       && (vf->map_flags & VMDLIB_MAP_COW) == 0 ) {
+    DEBUG_PRINT("Frames mapped read-only cannot be edited\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( resize && vf->storage != VMDL_STORAGE_HEAP ) {
+    DEBUG_PRINT("Only sections allocated by malloc() can be resized\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  return VMDLoadSections(vf, VMDLIB_SECTION(type));
+}
+
+/**
+ * @brief Rebuild data derived from frames after an edit
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section edited
+ * @return void
+ */
+static void __VMDEditEnd(VMDFile* vf, VMDStructType type){
+  if ( vf->index != NULL && (type == VMDL_BONE || type == VMDL_MORPH) ) {
+    VMDBuildTrackIndex(vf);
+  }
+  if ( vf->curves != NULL && (type == VMDL_BONE || type == VMDL_CAMERA) ) {
+    VMDBuildCurveTable(vf);
+  }
+}
+
+/**
+ * @brief Insert a keyframe into a section
+ *  The keyframe goes after the frames at or before its frame number, by
+ *  binary search, so a sorted section stays sorted. Only sections
+ *  allocated by malloc() can grow.
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section other than VMDL_IK
+ * @param (frame) keyframe of the type of the section (VMDBoneSingleFrame
+ *        for VMDL_BONE, ...)
+ * @param (pos) [out] position the keyframe was inserted at, or NULL
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDInsertFrame(VMDFile* vf, VMDStructType type, const void* frame,
+                    uint32_t* pos){
+  size_t size;
+  uint32_t num, at, key;
+  char* frames;
+
+  if ( frame == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( __VMDEditBegin(vf, type, true) == false ) return false;
+  size = __VMD_EDIT_SIZE[type];
+  num = VMDGetNumFrames(vf, type);
+  if ( num == UINT32_MAX ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  frames = realloc(__VMDEditFrames(vf, type), size * ((size_t)num + 1));
+  if ( frames == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  memcpy(&key, (const char*)frame + __VMD_EDIT_KEY[type], sizeof(uint32_t));
+  at = __VMDEditBound(frames, num, type, key);
+  memmove(frames + size * ((size_t)at + 1), frames + size * at,
+          size * (num - at));
+  memcpy(frames + size * at, frame, size);
+  __VMDEditSetFrames(vf, type, frames, num + 1);
+
+  vf->dirty |= VMDLIB_SECTION(type);
+  vf->resized |= VMDLIB_SECTION(type);
+  __VMDEditEnd(vf, type);
+  if ( pos != NULL ) *pos = at;
+  return true;
+}
+
+/**
+ * @brief Delete a keyframe from a section
+ *  Only sections allocated by malloc() can shrink.
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section other than VMDL_IK
+ * @param (pos) position of the keyframe in the section
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDDeleteFrame(VMDFile* vf, VMDStructType type, uint32_t pos){
+  size_t size;
+  uint32_t num;
+  char* frames;
+
+  if ( __VMDEditBegin(vf, type, true) == false ) return false;
+  num = VMDGetNumFrames(vf, type);
+  if ( pos >= num ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  size = __VMD_EDIT_SIZE[type];
+  frames = __VMDEditFrames(vf, type);
+  memmove(frames + size * pos, frames + size * ((size_t)pos + 1),
+          size * (num - pos - 1));
+  __VMDEditSetFrames(vf, type, frames, num - 1);
+
+  vf->dirty |= VMDLIB_SECTION(type);
+  vf->resized |= VMDLIB_SECTION(type);
+  __VMDEditEnd(vf, type);
+  return true;
+}
+
+/**
+ * @brief Overwrite a keyframe of a section
+ *  The number of frames does not change, so frames mapped copy-on-write
+ *  or loaded into an arena can be updated too. If the frame number
+ *  changes, the keyframe moves to keep a sorted section sorted, and the
+ *  frames in between shift by one.
+ * @param (vf) a pointer to VMDFile
+ * @param (type) section other than VMDL_IK
+ * @param (pos) position of the keyframe in the section
+ * @param (frame) new keyframe of the type of the section
+ * @param (new_pos) [out] position of the keyframe after the update, or NULL
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDUpdateFrame(VMDFile* vf, VMDStructType type, uint32_t pos,
+                    const void* frame, uint32_t* new_pos){
+  size_t size;
+  uint32_t num, at, key, old_key;
+  char* frames;
+
+  if ( frame == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( __VMDEditBegin(vf, type, false) == false ) return false;
+  num = VMDGetNumFrames(vf, type);
+  if ( pos >= num ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  size = __VMD_EDIT_SIZE[type];
+  frames = __VMDEditFrames(vf, type);
+  memcpy(&key, (const char*)frame + __VMD_EDIT_KEY[type], sizeof(uint32_t));
+  memcpy(&old_key, frames + size * pos + __VMD_EDIT_KEY[type],
+         sizeof(uint32_t));
+
+  at = pos;
+  if ( key > old_key ) {
+    // after the frames at or before `key`, not counting itself
+    at = pos + __VMDEditBound(frames + size * ((size_t)pos + 1),
+                              num - pos - 1, type, key);
+    memmove(frames + size * pos, frames + size * ((size_t)pos + 1),
+            size * (at - pos));
+  } else if ( key < old_key ) {
+    at = __VMDEditBound(frames, pos, type, key);
+    memmove(frames + size * ((size_t)at + 1), frames + size * at,
+            size * (pos - at));
+  }
+  memcpy(frames + size * at, frame, size);
+
+  __VMDMarkEdited(vf, type, at < pos ? at : pos, (at > pos ? at : pos) + 1);
+  __VMDEditEnd(vf, type);
+  if ( new_pos != NULL ) *new_pos = at;
+  return true;
+}
@@ -0,0 +1,660 @@
+/**
+ *  @file vmd_export.c
+ *  @brief Export of sections of VMD file as CSV, NDJSON or binary columns
+ *  @author ihm4
+ *  @note
+ *    Rows are formatted into one large buffer which is handed to a sink
+ *    (VMDSink) when it fills up, so the output can go to a FILE*, a file
+ *    descriptor or anything else. Floats are formatted like printf("%f")
+ *    without going through printf.
+ *
+ *    ShowIK records have a variable number of IK entries, they are
+ *    exported as one row per entry. A record without entries has one row
+ *    with no name.
+ *
+ *    Binary columns (VMDL_EXPORT_COLUMNS) are laid out as below, all
+ *    integers are little endian.
+ *
+ *      char     magic[8];       // "VMDCOLS\0"
+ *      uint32_t version;        // 1
+ *      uint32_t section;        // VMDStructType
+ *      uint32_t num_rows;
+ *      uint32_t num_columns;
+ *      struct {                 // num_columns descriptors, 32 bytes each
+ *        char     key[16];      // column name, NUL padded
+ *        uint32_t type;         // VMDLIB_COLUMN_*
+ *        uint32_t width;        // bytes per row
+ *        uint64_t offset;       // from the head of the output, 8 aligned
+ *      } columns[num_columns];
+ *      uint32_t num_strings;    // dictionary of NAME columns
+ *      uint32_t ends[num_strings]; // end of each string in `bytes`
+ *      char     bytes[];        // strings without NUL
+ *      // padding to 8, then num_rows * width bytes for each column
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <math.h>
+#include "vmd.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Output buffer, rows are flushed when less than a row of space is left
+#define VMDLIB_EXPORT_BUFFER (256 * 1024)
+#define VMDLIB_EXPORT_ROW    (4096)
+#define VMDLIB_EXPORT_MAX_COLUMNS (12)
+
+typedef struct {
+  char*          buf;
+  size_t         len;
+  const VMDSink* sink;
+  bool           ok;   // false once the sink failed
+} VMDOut;
+
+// A column of export, values are `width` bytes at base + stride * row
+typedef struct {
+  const char* key;
+  uint32_t    type;  // VMDLIB_COLUMN_*
+  uint32_t    width;
+  const char* base;
+  size_t      stride;
+} VMDColumnDef;
+
+// A row of ShowIK for export
+typedef struct {
+  uint32_t frame;
+  char     show;
+  uint32_t name_id; // VMDLIB_NO_NAME for a record without entries
+  char     on_off;  // -1 for a record without entries
+} __attribute__((packed)) VMDIKRow;
+
+/**
+ * @brief Hand buffered output to sink
+ *  Internally called function
+ * @param (out) output buffer
+ * @return void
+ */
+static void __VMDFlush(VMDOut* out){
+  if ( out->ok && out->len > 0 ) {
+    out->ok = out->sink->write(out->sink->user, out->buf, out->len);
+  }
+  out->len = 0;
+}
+
+/**
+ * @brief Space for a row in output buffer
+ *  Internally called function
+ * @param (out) output buffer
+ * @return where the row is to be written, advance `out->len` after
+ */
+static char* __VMDReserve(VMDOut* out){
+  if ( VMDLIB_EXPORT_BUFFER - out->len < VMDLIB_EXPORT_ROW ) __VMDFlush(out);
+  return out->buf + out->len;
+}
+
+/**
+ * @brief Write bytes through output buffer
+ *  Internally called function
+ * @param (out) output buffer
+ * @param (data) bytes
+ * @param (size) number of bytes
+ * @return void
+ */
+static void __VMDPut(VMDOut* out, const void* data, size_t size){
+  size_t n;
+  while ( size > 0 ) {
+    if ( out->len == VMDLIB_EXPORT_BUFFER ) __VMDFlush(out);
+    n = VMDLIB_EXPORT_BUFFER - out->len;
+    if ( n > size ) n = size;
+    memcpy(out->buf + out->len, data, n);
+    out->len += n;
+    data = (const char*)data + n;
+    size -= n;
+  }
+}
+
+/**
+ * @brief Format unsigned integer
+ *  Internally called function
+ * @param (p) where to write
+ * @param (v) value
+ * @return end of the text
+ */
+static char* __VMDFormatU64(char* p, uint64_t v){
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while ( v != 0 );
+  while ( n > 0 ) *p++ = tmp[--n];
+  return p;
+}
+
+/**
+ * @brief Format float as printf("%f") does
+ *  Internally called function. A float times 10^6 is exact in double, so
+ *  rounding it to integer rounds the same way as printf("%f"). Values out
+ *  of range of the fast path are given to snprintf().
+ * @param (p) where to write, at least 64 bytes
+ * @param (f) value
+ * @param (json) write null for NaN and infinity
+ * @return end of the text
+ */
+static char* __VMDFormatFloat(char* p, float f, bool json){
+  double a = fabs((double)f);
+  uint64_t s, frac;
+
+  if ( isnan(f) || isinf(f) ) {
+    if ( json ) {
+      memcpy(p, "null", 4);
+      return p + 4;
+    }
+    return p + snprintf(p, 64, "%f", (double)f);
+  }
+  if ( a >= 1e12 ) return p + snprintf(p, 64, "%f", (double)f);
+
+  s = (uint64_t)llrint(a * 1e6);
+  if ( signbit(f) ) *p++ = '-';
+  p = __VMDFormatU64(p, s / 1000000);
+  *p++ = '.';
+  frac = s % 1000000;
+  for ( int i = 5; i >= 0; i-- ) {
+    p[i] = (char)('0' + frac % 10);
+    frac /= 10;
+  }
+  return p + 6;
+}
+
+/**
+ * @brief Format name as CSV field or JSON string
+ *  Internally called function. CSV fields are quoted only if needed.
+ * @param (p) where to write
+ * @param (name) name terminated by NUL, at most VMDLIB_IK_NAME_SIZE * 3
+ * @param (json) write JSON string
+ * @return end of the text
+ */
+static char* __VMDFormatName(char* p, const char* name, bool json){
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char* s = (const unsigned char*)name;
+
+  if ( json ) {
+    *p++ = '"';
+    for ( ; *s != '\0'; s++ ) {
+      if ( *s == '"' || *s == '\\' ) {
+        *p++ = '\\';
+        *p++ = (char)*s;
+      } else if ( *s < 0x20 ) {
+        memcpy(p, "\\u00", 4);
+        p[4] = hex[*s >> 4];
+        p[5] = hex[*s & 15];
+        p += 6;
+      } else {
+        *p++ = (char)*s;
+      }
+    }
+    *p++ = '"';
+    return p;
+  }
+  if ( strpbrk(name, ",\"\r\n") == NULL ) {
+    size_t len = strlen(name);
+    memcpy(p, name, len);
+    return p + len;
+  }
+  *p++ = '"';
+  for ( ; *s != '\0'; s++ ) {
+    if ( *s == '"' ) *p++ = '"';
+    *p++ = (char)*s;
+  }
+  *p++ = '"';
+  return p;
+}
+
+/**
+ * @brief Columns of a section
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @param (section) section to be exported
+ * @param (flags) VMDLIB_EXPORT_*
+ * @param (ik_rows) [out] rows of ShowIK allocated for VMDL_IK
+ * @param (cols) [out] columns
+ * @param (num_rows) [out] number of rows
+ * @return number of columns, 0 on failure
+ */
+static int __VMDSectionColumns(VMDFile* vf, VMDStructType section,
+                               uint32_t flags, VMDIKRow** ik_rows,
+                               VMDColumnDef* cols, uint32_t* num_rows){
+  const VMDTrackIndex* index;
+  VMDIKRow* rows;
+  const VMDIKSingleFrame* rec;
+  uint32_t n = 0;
+  int c = 0;
+
+#define VMDLIB_COLUMN(k, t, w, b, s)                                         \
+  do {                                                                       \
+    cols[c].key = (k); cols[c].type = (t); cols[c].width = (w);              \
+    cols[c].base = (const char*)(b); cols[c].stride = (s); c++;              \
+  } while ( 0 )
+#define VMDLIB_FIELD(k, t, type, field, frames)                              \
+  VMDLIB_COLUMN(k, t, sizeof(((type*)0)->field),                             \
+                (const char*)(frames) + offsetof(type, field), sizeof(type))
+
+  if ( vf->index == NULL && VMDBuildTrackIndex(vf) == false ) return 0;
+  index = vf->index;
+
+  switch ( section ) {
+    case VMDL_BONE: {
+      const VMDBoneSingleFrame* f = vf->bone_frames.frames;
+      *num_rows = vf->bone_frames.num_frames;
+      VMDLIB_COLUMN("name", VMDLIB_COLUMN_NAME, 4, index->bones.name_ids, 4);
+      VMDLIB_FIELD("frame", VMDLIB_COLUMN_U32, VMDBoneSingleFrame, frame, f);
+      VMDLIB_FIELD("x", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, x, f);
+      VMDLIB_FIELD("y", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, y, f);
+      VMDLIB_FIELD("z", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, z, f);
+      VMDLIB_FIELD("qx", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, qx, f);
+      VMDLIB_FIELD("qy", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, qy, f);
+      VMDLIB_FIELD("qz", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, qz, f);
+      VMDLIB_FIELD("qw", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, qw, f);
+      if ( flags & VMDLIB_EXPORT_BEZIER ) {
+        VMDLIB_FIELD("bezier", VMDLIB_COLUMN_BYTES, VMDBoneSingleFrame,
+                     bezier, f);
+      }
+      break;
+    }
+    case VMDL_MORPH: {
+      const VMDMorphSingleFrame* f = vf->morph_frames.frames;
+      *num_rows = vf->morph_frames.num_frames;
+      VMDLIB_COLUMN("name", VMDLIB_COLUMN_NAME, 4, index->morphs.name_ids, 4);
+      VMDLIB_FIELD("frame", VMDLIB_COLUMN_U32, VMDMorphSingleFrame, frame, f);
+      VMDLIB_FIELD("value", VMDLIB_COLUMN_F32, VMDMorphSingleFrame, value, f);
+      break;
+    }
+    case VMDL_CAMERA: {
+      const VMDCameraSingleFrame* f = vf->camera_frames.frames;
+      *num_rows = vf->camera_frames.num_frames;
+      VMDLIB_FIELD("frame", VMDLIB_COLUMN_U32, VMDCameraSingleFrame, frame, f);
+      VMDLIB_FIELD("distance", VMDLIB_COLUMN_F32, VMDCameraSingleFrame,
+                   distance, f);
+      VMDLIB_FIELD("x", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, x, f);
+      VMDLIB_FIELD("y", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, y, f);
+      VMDLIB_FIELD("z", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, z, f);
+      VMDLIB_FIELD("rx", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, rx, f);
+      VMDLIB_FIELD("ry", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, ry, f);
+      VMDLIB_FIELD("rz", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, rz, f);
+      VMDLIB_FIELD("view_angle", VMDLIB_COLUMN_U32, VMDCameraSingleFrame,
+                   viewAngle, f);
+      VMDLIB_FIELD("parth", VMDLIB_COLUMN_I8, VMDCameraSingleFrame, parth, f);
+      if ( flags & VMDLIB_EXPORT_BEZIER ) {
+        VMDLIB_FIELD("bezier", VMDLIB_COLUMN_BYTES, VMDCameraSingleFrame,
+                     bezier, f);
+      }
+      break;
+    }
+    case VMDL_LIGHT: {
+      const VMDLightSingleFrame* f = vf->light_frames.frames;
+      *num_rows = vf->light_frames.num_frames;
+      VMDLIB_FIELD("frame", VMDLIB_COLUMN_U32, VMDLightSingleFrame, frame, f);
+      VMDLIB_FIELD("r", VMDLIB_COLUMN_F32, VMDLightSingleFrame, r, f);
+      VMDLIB_FIELD("g", VMDLIB_COLUMN_F32, VMDLightSingleFrame, g, f);
+      VMDLIB_FIELD("b", VMDLIB_COLUMN_F32, VMDLightSingleFrame, b, f);
+      VMDLIB_FIELD("x", VMDLIB_COLUMN_F32, VMDLightSingleFrame, x, f);
+      VMDLIB_FIELD("y", VMDLIB_COLUMN_F32, VMDLightSingleFrame, y, f);
+      VMDLIB_FIELD("z", VMDLIB_COLUMN_F32, VMDLightSingleFrame, z, f);
+      break;
+    }
+    case VMDL_SHADOW: {
+      const VMDShadowSingleFrame* f = vf->shadow_frames.frames;
+      *num_rows = vf->shadow_frames.num_frames;
+      VMDLIB_FIELD("frame", VMDLIB_COLUMN_U32, VMDShadowSingleFrame, frame, f);
+      VMDLIB_FIELD("type", VMDLIB_COLUMN_I8, VMDShadowSingleFrame, type, f);
+      VMDLIB_FIELD("distance", VMDLIB_COLUMN_F32, VMDShadowSingleFrame,
+                   distance, f);
+      break;
+    }
+    case VMDL_IK: {
+      for ( uint32_t i = 0; i < vf->ik_frames.num_frames; i++ ) {
+        rec = &vf->ik_frames.frames[i];
+        n += rec->ik_count > 0 ? rec->ik_count : 1;
+      }
+      rows = malloc(sizeof(VMDIKRow) * (n > 0 ? n : 1));
+      if ( rows == NULL ) {
+        VMD_ERROR = VMDLIB_E_ME;
+        return 0;
+      }
+      n = 0;
+      for ( uint32_t i = 0; i < vf->ik_frames.num_frames; i++ ) {
+        rec = &vf->ik_frames.frames[i];
+        for ( uint32_t k = 0; k == 0 || k < rec->ik_count; k++, n++ ) {
+          rows[n].frame = rec->frame;
+          rows[n].show = rec->show;
+          if ( rec->ik_count == 0 ) {
+            rows[n].name_id = VMDLIB_NO_NAME;
+            rows[n].on_off = -1;
+          } else {
+            rows[n].name_id = index->ik_name_ids[rec->ik_offset + k];
+            rows[n].on_off = vf->ik_frames.ik[rec->ik_offset + k].on_off;
+          }
+        }
+      }
+      *ik_rows = rows;
+      *num_rows = n;
+      VMDLIB_FIELD("frame", VMDLIB_COLUMN_U32, VMDIKRow, frame, rows);
+      VMDLIB_FIELD("show", VMDLIB_COLUMN_I8, VMDIKRow, show, rows);
+      VMDLIB_FIELD("name", VMDLIB_COLUMN_NAME, VMDIKRow, name_id, rows);
+      VMDLIB_FIELD("on_off", VMDLIB_COLUMN_I8, VMDIKRow, on_off, rows);
+      break;
+    }
+    default:
+      VMD_ERROR = VMDLIB_E_IV;
+      return 0;
+  }
+#undef VMDLIB_FIELD
+#undef VMDLIB_COLUMN
+  return c;
+}
+
+/**
+ * @brief Name of an id in the form given by flags
+ *  Internally called function
+ * @param (names) name table
+ * @param (id) name id or VMDLIB_NO_NAME
+ * @param (flags) VMDLIB_EXPORT_*
+ * @return name terminated by NUL, empty for VMDLIB_NO_NAME
+ */
+static const char* __VMDExportName(const VMDNameTable* names, uint32_t id,
+                                   uint32_t flags){
+  const char* s = (flags & VMDLIB_EXPORT_SJIS) ? VMDGetNameSJIS(names, id)
+                                               : VMDGetNameUTF8(names, id);
+  return s == NULL ? "" : s;
+}
+
+/**
+ * @brief Export columns as CSV or NDJSON
+ *  Internally called function
+ * @param (out) output buffer
+ * @param (names) name table of the file
+ * @param (cols) columns
+ * @param (num_cols) number of columns
+ * @param (num_rows) number of rows
+ * @param (json) NDJSON if true, CSV otherwise
+ * @param (flags) VMDLIB_EXPORT_*
+ * @return void
+ */
+static void __VMDExportText(VMDOut* out, const VMDNameTable* names,
+                            const VMDColumnDef* cols, int num_cols,
+                            uint32_t num_rows, bool json, uint32_t flags){
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char* v;
+  uint32_t u;
+  float f;
+  char* p;
+
+  if ( json == false && (flags & VMDLIB_EXPORT_NO_HEADER) == 0 ) {
+    p = __VMDReserve(out);
+    for ( int c = 0; c < num_cols; c++ ) {
+      if ( c > 0 ) *p++ = ',';
+      memcpy(p, cols[c].key, strlen(cols[c].key));
+      p += strlen(cols[c].key);
+    }
+    *p++ = '\n';
+    out->len = p - out->buf;
+  }
+
+  for ( uint32_t r = 0; r < num_rows && out->ok; r++ ) {
+    p = __VMDReserve(out);
+    if ( json ) *p++ = '{';
+    for ( int c = 0; c < num_cols; c++ ) {
+      if ( c > 0 ) *p++ = ',';
+      if ( json ) {
+        *p++ = '"';
+        memcpy(p, cols[c].key, strlen(cols[c].key));
+        p += strlen(cols[c].key);
+        *p++ = '"';
+        *p++ = ':';
+      }
+      v = (const unsigned char*)cols[c].base + cols[c].stride * r;
+      switch ( cols[c].type ) {
+        case VMDLIB_COLUMN_U32:
+          memcpy(&u, v, sizeof(uint32_t));
+          p = __VMDFormatU64(p, u);
+          break;
+        case VMDLIB_COLUMN_F32:
+          memcpy(&f, v, sizeof(float));
+          p = __VMDFormatFloat(p, f, json);
+          break;
+        case VMDLIB_COLUMN_I8:
+          if ( (signed char)*v < 0 ) {
+            *p++ = '-';
+            p = __VMDFormatU64(p, (uint64_t)-(int)(signed char)*v);
+          } else {
+            p = __VMDFormatU64(p, *v);
+          }
+          break;
+        case VMDLIB_COLUMN_BYTES:
+          if ( json ) *p++ = '"';
+          for ( uint32_t i = 0; i < cols[c].width; i++ ) {
+            *p++ = hex[v[i] >> 4];
+            *p++ = hex[v[i] & 15];
+          }
+          if ( json ) *p++ = '"';
+          break;
+        case VMDLIB_COLUMN_NAME:
+          memcpy(&u, v, sizeof(uint32_t));
+          if ( json && u == VMDLIB_NO_NAME ) {
+            memcpy(p, "null", 4);
+            p += 4;
+          } else {
+            p = __VMDFormatName(p, __VMDExportName(names, u, flags), json);
+          }
+          break;
+      }
+    }
+    if ( json ) *p++ = '}';
+    *p++ = '\n';
+    out->len = p - out->buf;
+  }
+}
+
+/**
+ * @brief Export columns in binary layout
+ *  Internally called function, see the note of this file for the layout
+ * @param (out) output buffer
+ * @param (names) name table of the file
+ * @param (section) exported section
+ * @param (cols) columns
+ * @param (num_cols) number of columns
+ * @param (num_rows) number of rows
+ * @param (flags) VMDLIB_EXPORT_*
+ * @return void
+ */
+static void __VMDExportColumns(VMDOut* out, const VMDNameTable* names,
+                               VMDStructType section, const VMDColumnDef* cols,
+                               int num_cols, uint32_t num_rows, uint32_t flags){
+  static const char zero[8] = { 0 };
+  uint32_t num_names = VMDGetNumNames(names);
+  uint32_t head[4] = { 1, (uint32_t)section, num_rows, (uint32_t)num_cols };
+  uint64_t pos, offset;
+  uint32_t end = 0, u32;
+  char key[16];
+  char* p;
+
+  // descriptors need offsets of columns, which follow the dictionary
+  pos = 8 + sizeof(head) + 32 * (uint64_t)num_cols + 4 + 4 * (uint64_t)num_names;
+  for ( uint32_t i = 0; i < num_names; i++ ) {
+    pos += strlen(__VMDExportName(names, i, flags));
+  }
+  offset = (pos + 7) & ~(uint64_t)7;
+
+  __VMDPut(out, "VMDCOLS", 8);
+  __VMDPut(out, head, sizeof(head));
+  for ( int c = 0; c < num_cols; c++ ) {
+    memset(key, 0, sizeof(key));
+    strncpy(key, cols[c].key, sizeof(key) - 1);
+    __VMDPut(out, key, sizeof(key));
+    u32 = cols[c].type;
+    __VMDPut(out, &u32, sizeof(uint32_t));
+    __VMDPut(out, &cols[c].width, sizeof(uint32_t));
+    __VMDPut(out, &offset, sizeof(uint64_t));
+    offset += ((uint64_t)cols[c].width * num_rows + 7) & ~(uint64_t)7;
+  }
+  __VMDPut(out, &num_names, sizeof(uint32_t));
+  for ( uint32_t i = 0; i < num_names; i++ ) {
+    end += (uint32_t)strlen(__VMDExportName(names, i, flags));
+    __VMDPut(out, &end, sizeof(uint32_t));
+  }
+  for ( uint32_t i = 0; i < num_names; i++ ) {
+    const char* s = __VMDExportName(names, i, flags);
+    __VMDPut(out, s, strlen(s));
+  }
+  __VMDPut(out, zero, (size_t)(((pos + 7) & ~(uint64_t)7) - pos));
+
+  for ( int c = 0; c < num_cols && out->ok; c++ ) {
+    for ( uint32_t r = 0; r < num_rows; r++ ) {
+      p = __VMDReserve(out);
+      memcpy(p, cols[c].base + cols[c].stride * r, cols[c].width);
+      out->len += cols[c].width;
+    }
+    __VMDPut(out, zero, (8 - ((uint64_t)cols[c].width * num_rows) % 8) % 8);
+  }
+}
+
+/**
+ * @brief Export a section of VMDFile
+ *  The track index of `vf` is built if it is not built yet, for the names.
+ * @param (vf) a pointer to VMDFile
+ * @param (section) section to be exported
+ * @param (format) output format
+ * @param (flags) VMDLIB_EXPORT_*
+ * @param (sink) where the output goes
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDExport(VMDFile* vf, VMDStructType section, VMDExportFormat format,
+               uint32_t flags, const VMDSink* sink){
+  VMDColumnDef cols[VMDLIB_EXPORT_MAX_COLUMNS];
+  VMDIKRow* ik_rows = NULL;
+  uint32_t num_rows = 0;
+  VMDOut out;
+  int num_cols;
+
+  if ( vf == NULL || sink == NULL || sink->write == NULL
+       || format > VMDL_EXPORT_COLUMNS ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( section <= VMDL_IK
+       && VMDLoadSections(vf, VMDLIB_SECTION(section)) == false ) {
+    return false;
+  }
+  num_cols = __VMDSectionColumns(vf, section, flags, &ik_rows, cols, &num_rows);
+  if ( num_cols == 0 ) return false;
+
+  out.buf = malloc(VMDLIB_EXPORT_BUFFER);
+  if ( out.buf == NULL ) {
+    free(ik_rows);
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  out.len = 0;
+  out.sink = sink;
+  out.ok = true;
+
+  if ( format == VMDL_EXPORT_COLUMNS ) {
+    __VMDExportColumns(&out, vf->names, section, cols, num_cols, num_rows,
+                       flags);
+  } else {
+    __VMDExportText(&out, vf->names, cols, num_cols, num_rows,
+                    format == VMDL_EXPORT_NDJSON, flags);
+  }
+  __VMDFlush(&out);
+
+  free(out.buf);
+  free(ik_rows);
+  if ( out.ok == false ) {
+    VMD_ERROR = VMDLIB_E_WR;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Sink writing to FILE*
+ *  Internally called function
+ */
+static bool __VMDFileSink(void* user, const void* data, size_t size){
+  return fwrite(data, 1, size, (FILE*)user) == size;
+}
+
+/**
+ * @brief Sink writing to file descriptor
+ *  Internally called function
+ */
+static bool __VMDFdSink(void* user, const void* data, size_t size){
+  int fd = (int)(intptr_t)user;
+  const char* p = data;
+#ifdef _WIN32
+  int done;
+#else
+  ssize_t done;
+#endif
+
+  while ( size > 0 ) {
+#ifdef _WIN32
+    done = _write(fd, p, size > 0x40000000 ? 0x40000000 : (unsigned)size);
+#else
+    done = write(fd, p, size);
+#endif
+    if ( done < 0 && errno == EINTR ) continue;
+    if ( done <= 0 ) return false;
+    p += done;
+    size -= (size_t)done;
+  }
+  return true;
+}
+
+/**
+ * @brief Export a section of VMDFile to FILE*
+ *  See VMDExport()
+ * @param (vf) a pointer to VMDFile
+ * @param (section) section to be exported
+ * @param (format) output format
+ * @param (flags) VMDLIB_EXPORT_*
+ * @param (fp) output stream, e.g. stdout
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDExportToFile(VMDFile* vf, VMDStructType section,
+                     VMDExportFormat format, uint32_t flags, FILE* fp){
+  VMDSink sink = { __VMDFileSink, fp };
+  if ( fp == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  return VMDExport(vf, section, format, flags, &sink);
+}
+
+/**
+ * @brief Export a section of VMDFile to file descriptor
+ *  See VMDExport()
+ * @param (vf) a pointer to VMDFile
+ * @param (section) section to be exported
+ * @param (format) output format
+ * @param (flags) VMDLIB_EXPORT_*
+ * @param (fd) output file descriptor
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDExportToFd(VMDFile* vf, VMDStructType section, VMDExportFormat format,
+                   uint32_t flags, int fd){
+  VMDSink sink = { __VMDFdSink, (void*)(intptr_t)fd };
+  if ( fd < 0 ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  return VMDExport(vf, section, format, flags, &sink);
+}
@@ -0,0 +1,338 @@
+/**
+ *  @file vmd_hash.c
+ *  @brief Content hashes of VMD file
+ *  @author ihm4
+ *  @note
+ *    Every record of a section is hashed by xxHash64 (__VMDXXHash64()). In
+ *    the hash of a section, each record is hashed with the hash of the
+ *    records before it as the seed, so the order of records counts. With
+ *    VMDLIB_HASH_NORMALIZE the hashes of records are summed instead, so any
+ *    order of the same records (such as the file before and after
+ *    VMDSortAllFrames()) hashes the same, and bytes of names after NUL,
+ *    which MMD leaves undefined, are ignored.
+ *
+ *    Records are hashed one by one in the order of the file, so a file is
+ *    hashed while it is read (VMDHashFile()) with the same result as a
+ *    loaded file (VMDHash()), without holding it in memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmd.h"
+
+// Bytes VMDHashFile() reads at a time
+#define VMDLIB_HASH_CHUNK (1u << 16)
+
+// Hashes of sections being computed
+typedef struct {
+  uint32_t  flags;                   // VMDLIB_HASH_*
+  uint64_t  header;                  // hash of the header
+  uint64_t  acc[VMDL_IK + 1];        // hash of records so far
+  uint32_t  num_frames[VMDL_IK + 1]; // records so far
+} VMDHashState;
+
+/**
+ * @brief Start hashes of sections
+ *  Internally called function
+ * @param (hs) [out] state
+ * @param (flags) VMDLIB_HASH_*
+ * @return void
+ */
+static void __VMDHashBegin(VMDHashState* hs, uint32_t flags){
+  memset(hs, 0, sizeof(VMDHashState));
+  hs->flags = flags;
+}
+
+/**
+ * @brief Clear bytes of a name after NUL for VMDLIB_HASH_NORMALIZE
+ *  Internally called function
+ * @param (name) name
+ * @param (size) size of the name field
+ * @return void
+ */
+static void __VMDHashClearName(char* name, size_t size){
+  size_t len = __VMDNameLength(name, size);
+  memset(name + len, 0, size - len);
+}
+
+/**
+ * @brief Add the hash of a record to its section
+ *  Internally called function
+ * @param (hs) [in,out] state
+ * @param (type) section of the record
+ * @param (record) bytes of the record
+ * @param (size) size of the record
+ * @return void
+ */
+static void __VMDHashRecord(VMDHashState* hs, VMDStructType type,
+                            const void* record, size_t size){
+  char copy[sizeof(VMDBoneSingleFrame)];
+
+  if ( (hs->flags & VMDLIB_HASH_NORMALIZE) == 0 ) {
+    hs->acc[type] = __VMDXXHash64(record, size, hs->acc[type]);
+  } else {
+    if ( type == VMDL_BONE || type == VMDL_MORPH ) {
+      memcpy(copy, record, size);
+      __VMDHashClearName(copy, VMDLIB_NAME_SIZE);
+      record = copy;
+    }
+    hs->acc[type] += __VMDXXHash64(record, size, type);
+  }
+  hs->num_frames[type]++;
+}
+
+/**
+ * @brief Hash records of a section with fixed size records
+ *  Internally called function
+ * @param (hs) [in,out] state
+ * @param (type) section other than VMDL_IK
+ * @param (frames) records
+ * @param (num) number of records
+ * @param (size) size of a record
+ * @return void
+ */
+static void __VMDHashFrames(VMDHashState* hs, VMDStructType type,
+                            const void* frames, uint32_t num, size_t size){
+  for ( uint32_t i = 0; i < num; i++ ) {
+    __VMDHashRecord(hs, type, (const char*)frames + size * i, size);
+  }
+}
+
+/**
+ * @brief Hash a ShowIK record
+ *  Internally called function. The record is hashed in its file layout,
+ *  the head followed by its IK entries.
+ * @param (hs) [in,out] state
+ * @param (frame) frame number
+ * @param (show) show flag
+ * @param (ik) IK entries
+ * @param (count) number of IK entries
+ * @return void
+ */
+static void __VMDHashIK(VMDHashState* hs, uint32_t frame, char show,
+                        const VMDInfoIK* ik, uint32_t count){
+  char head[VMDLIB_IK_HEAD_SIZE];
+  VMDInfoIK entry;
+  uint64_t seed, h;
+
+  memcpy(head, &frame, sizeof(uint32_t));
+  head[4] = show;
+  memcpy(head + 5, &count, sizeof(uint32_t));
+  seed = (hs->flags & VMDLIB_HASH_NORMALIZE) ? VMDL_IK : hs->acc[VMDL_IK];
+  h = __VMDXXHash64(head, VMDLIB_IK_HEAD_SIZE, seed);
+  for ( uint32_t i = 0; i < count; i++ ) {
+    entry = ik[i];
+    if ( hs->flags & VMDLIB_HASH_NORMALIZE ) {
+      __VMDHashClearName(entry.name, VMDLIB_IK_NAME_SIZE);
+    }
+    h = __VMDXXHash64(&entry, sizeof(VMDInfoIK), h);
+  }
+  if ( hs->flags & VMDLIB_HASH_NORMALIZE ) {
+    hs->acc[VMDL_IK] += h;
+  } else {
+    hs->acc[VMDL_IK] = h;
+  }
+  hs->num_frames[VMDL_IK]++;
+}
+
+/**
+ * @brief Hash the header
+ *  Internally called function
+ * @param (hs) [in,out] state
+ * @param (header) header
+ * @return void
+ */
+static void __VMDHashHeader(VMDHashState* hs, const VMDHeader* header){
+  VMDHeader copy = *header;
+
+  if ( hs->flags & VMDLIB_HASH_NORMALIZE ) {
+    __VMDHashClearName(copy.header, sizeof(copy.header));
+    __VMDHashClearName(copy.model_name, sizeof(copy.model_name));
+  }
+  hs->header = __VMDXXHash64(&copy, sizeof(VMDHeader), 0);
+}
+
+/**
+ * @brief Put 64 bit value in little endian
+ *  Internally called function
+ * @param (dst) 8 bytes
+ * @param (v) value
+ * @return void
+ */
+static void __VMDHashPut64(unsigned char* dst, uint64_t v){
+  for ( int i = 0; i < 8; i++ ) dst[i] = (unsigned char)(v >> (8 * i));
+}
+
+/**
+ * @brief Finish hashes of sections and the whole file
+ *  Internally called function. The hash of a section covers the number of
+ *  records, so that empty sections and missing ones hash the same.
+ * @param (hs) state
+ * @param (digest) [out] hashes
+ * @return void
+ */
+static void __VMDHashEnd(const VMDHashState* hs, VMDDigest* digest){
+  unsigned char buf[8 * (VMDL_IK + 2)];
+  size_t pos = 0;
+
+  for ( int i = 0; i <= VMDL_IK; i++ ) {
+    __VMDHashPut64(buf, hs->acc[i]);
+    __VMDHashPut64(buf + 8, hs->num_frames[i]);
+    digest->sections[i] = __VMDXXHash64(buf, 16, (uint64_t)i);
+  }
+  digest->header = hs->header;
+  if ( (hs->flags & VMDLIB_HASH_NO_HEADER) == 0 ) {
+    __VMDHashPut64(buf, hs->header);
+    pos += 8;
+  }
+  for ( int i = 0; i <= VMDL_IK; i++, pos += 8 ) {
+    __VMDHashPut64(buf + pos, digest->sections[i]);
+  }
+  digest->file = __VMDXXHash64(buf, pos, hs->flags);
+}
+
+/**
+ * @brief Hash contents of VMDFile
+ *  Hashes each section and the whole file. Equal files have equal hashes
+ *  whether they are loaded, mapped or read by VMDHashFile().
+ * @param (vf) a pointer to VMDFile
+ * @param (flags) VMDLIB_HASH_*
+ * @param (digest) [out] hashes
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDHash(VMDFile* vf, uint32_t flags, VMDDigest* digest){
+  VMDHashState hs;
+  const VMDIKSingleFrame* head;
+
+  if ( vf == NULL || digest == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION_ALL) == false ) return false;
+  for ( uint32_t i = 0; i < vf->ik_frames.num_frames; i++ ) {
+    head = &vf->ik_frames.frames[i];
+    if ( head->ik_offset > vf->ik_frames.num_ik
+         || head->ik_count > vf->ik_frames.num_ik - head->ik_offset ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return false;
+    }
+  }
+
+  __VMDHashBegin(&hs, flags);
+  __VMDHashHeader(&hs, &vf->header);
+  __VMDHashFrames(&hs, VMDL_BONE, vf->bone_frames.frames,
+                  vf->bone_frames.num_frames, sizeof(VMDBoneSingleFrame));
+  __VMDHashFrames(&hs, VMDL_MORPH, vf->morph_frames.frames,
+                  vf->morph_frames.num_frames, sizeof(VMDMorphSingleFrame));
+  __VMDHashFrames(&hs, VMDL_CAMERA, vf->camera_frames.frames,
+                  vf->camera_frames.num_frames, sizeof(VMDCameraSingleFrame));
+  __VMDHashFrames(&hs, VMDL_LIGHT, vf->light_frames.frames,
+                  vf->light_frames.num_frames, sizeof(VMDLightSingleFrame));
+  __VMDHashFrames(&hs, VMDL_SHADOW, vf->shadow_frames.frames,
+                  vf->shadow_frames.num_frames, sizeof(VMDShadowSingleFrame));
+  for ( uint32_t i = 0; i < vf->ik_frames.num_frames; i++ ) {
+    head = &vf->ik_frames.frames[i];
+    __VMDHashIK(&hs, head->frame, head->show,
+                &vf->ik_frames.ik[head->ik_offset], head->ik_count);
+  }
+  __VMDHashEnd(&hs, digest);
+  return true;
+}
+
+// Callbacks of the streaming parser for VMDHashFile()
+static void __VMDHashOnHeader(void* user, const VMDHeader* header){
+  __VMDHashHeader(user, header);
+}
+static void __VMDHashOnBone(void* user, const VMDBoneSingleFrame* frames,
+                            uint32_t num){
+  __VMDHashFrames(user, VMDL_BONE, frames, num, sizeof(VMDBoneSingleFrame));
+}
+static void __VMDHashOnMorph(void* user, const VMDMorphSingleFrame* frames,
+                             uint32_t num){
+  __VMDHashFrames(user, VMDL_MORPH, frames, num, sizeof(VMDMorphSingleFrame));
+}
+static void __VMDHashOnCamera(void* user, const VMDCameraSingleFrame* frames,
+                              uint32_t num){
+  __VMDHashFrames(user, VMDL_CAMERA, frames, num,
+                  sizeof(VMDCameraSingleFrame));
+}
+static void __VMDHashOnLight(void* user, const VMDLightSingleFrame* frames,
+                             uint32_t num){
+  __VMDHashFrames(user, VMDL_LIGHT, frames, num, sizeof(VMDLightSingleFrame));
+}
+static void __VMDHashOnShadow(void* user, const VMDShadowSingleFrame* frames,
+                              uint32_t num){
+  __VMDHashFrames(user, VMDL_SHADOW, frames, num,
+                  sizeof(VMDShadowSingleFrame));
+}
+static void __VMDHashOnIK(void* user, uint32_t frame, char show,
+                          const VMDInfoIK* ik, uint32_t ik_count){
+  __VMDHashIK(user, frame, show, ik, ik_count);
+}
+
+/**
+ * @brief Hash contents of VMD file while reading it
+ *  Gives the same hashes as VMDHash() of the loaded file, reading the file
+ *  once in chunks by the streaming parser, so memory used does not depend
+ *  on the size of the file.
+ * @param (fname) VMD file name to be read
+ * @param (flags) VMDLIB_HASH_*
+ * @param (digest) [out] hashes
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDHashFile(const char* fname, uint32_t flags, VMDDigest* digest){
+  VMDStreamCallbacks cb;
+  VMDHashState hs;
+  VMDStream* st;
+  FILE* fp;
+  char* buf;
+  size_t len;
+  bool ok = true;
+
+  if ( fname == NULL || digest == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  memset(&cb, 0, sizeof(VMDStreamCallbacks));
+  cb.header = __VMDHashOnHeader;
+  cb.bone = __VMDHashOnBone;
+  cb.morph = __VMDHashOnMorph;
+  cb.camera = __VMDHashOnCamera;
+  cb.light = __VMDHashOnLight;
+  cb.shadow = __VMDHashOnShadow;
+  cb.ik = __VMDHashOnIK;
+  cb.user = &hs;
+  __VMDHashBegin(&hs, flags);
+
+  fp = fopen(fname, "rb");
+  if ( fp == NULL ) {
+    VMD_ERROR = VMDLIB_E_FH;
+    return false;
+  }
+  buf = malloc(VMDLIB_HASH_CHUNK);
+  st = VMDStreamCreate(&cb);
+  if ( buf == NULL || st == NULL ) {
+    free(buf);
+    VMDStreamRelease(st);
+    fclose(fp);
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  while ( ok && (len = fread(buf, 1, VMDLIB_HASH_CHUNK, fp)) > 0 ) {
+    ok = VMDStreamFeed(st, buf, len);
+  }
+  if ( ok && ferror(fp) ) {
+    VMD_ERROR = VMDLIB_E_FH;
+    ok = false;
+  }
+  if ( ok ) ok = VMDStreamFinish(st);
+  VMDStreamRelease(st);
+  free(buf);
+  fclose(fp);
+  if ( ok == false ) return false;
+  __VMDHashEnd(&hs, digest);
+  return true;
+}
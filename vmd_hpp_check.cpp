@@ -0,0 +1,54 @@
+/**
+ *  @file vmd_hpp_check.cpp
+ *  @brief Compile check of the C++ wrapper vmd.hpp
+ *  @author ihm4
+ *  @note
+ *    Templates of vmd.hpp are compiled only when they are instantiated, so
+ *    this instantiates them for every frame type of vmd.h, const types
+ *    included. `make hppcheck` compiles it with -fsyntax-only, nothing is
+ *    built or run.
+ */
+
+#include "vmd.hpp"
+
+namespace {
+
+/**
+ * @brief Instantiate templates of vmd.hpp which read frames of a type
+ * @param (file) file
+ * @return void
+ */
+template <class T>
+void checkRead(vmd::File& file){
+  vmd::Section<T> frames = file.section<T>();
+
+  vmd::range(frames, vmd::lowerBound(frames, 0), UINT32_MAX);
+  if constexpr ( vmd::SampledFrame<T> ) {
+    typename vmd::FrameTraits<std::remove_const_t<T>>::Pose pose;
+    vmd::sample(frames, 0.0f, pose);
+  }
+}
+
+/**
+ * @brief Instantiate templates of vmd.hpp for a frame type
+ * @param (file) file
+ * @return void
+ */
+template <class T>
+void check(vmd::File& file){
+  checkRead<T>(file);
+  checkRead<const T>(file);
+  vmd::sort(file.section<T>());
+  file.sort<T>();
+}
+
+}  // namespace
+
+void vmdHppCheck(vmd::File& file){
+  check<VMDBoneSingleFrame>(file);
+  check<VMDMorphSingleFrame>(file);
+  check<VMDCameraSingleFrame>(file);
+  check<VMDLightSingleFrame>(file);
+  check<VMDShadowSingleFrame>(file);
+  check<VMDIKSingleFrame>(file);
+}
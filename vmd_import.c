@@ -0,0 +1,885 @@
+/**
+ *  @file vmd_import.c
+ *  @brief Import of sections of VMD file from CSV or NDJSON
+ *  @author ihm4
+ *  @note
+ *    The input is the output of VMDExport(). Columns (or keys) are matched
+ *    by name, so their order does not matter, unknown ones are skipped and
+ *    missing ones get the default of MMD (straight interpolation curve,
+ *    identity rotation). ShowIK rows with the same frame number and show
+ *    flag in a row make one record.
+ *
+ *    Rows are parsed in place without allocation. Frames are collected in
+ *    a buffer growing by doubling and appended to the section at the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "vmd.h"
+
+// Longest token which is copied, names and numbers given to strtod()
+#define VMDLIB_IMPORT_TOKEN (256)
+#define VMDLIB_IMPORT_MAX_COLUMNS (32)
+// Entries of cache of UTF-8 to Shift-JIS conversion, power of 2
+#define VMDLIB_IMPORT_NAME_CACHE (256)
+
+// Field types of import, in addition to VMDLIB_COLUMN_*
+#define VMDLIB_FIELD_NONE (0)
+
+typedef struct {
+  const char* key;
+  uint32_t    type;   // VMDLIB_COLUMN_*
+  size_t      offset; // in the record
+  uint32_t    width;  // bytes in the record
+} VMDImportField;
+
+// A row of ShowIK while importing
+typedef struct {
+  uint32_t frame;
+  char     show;
+  char     name[VMDLIB_IK_NAME_SIZE];
+  char     on_off; // -1 for a record without entries
+} VMDIKImportRow;
+
+#define VMDLIB_IMPORT_FIELD(key, type, st, field) \
+  { key, type, offsetof(st, field), sizeof(((st*)0)->field) }
+
+static const VMDImportField __VMD_BONE_FIELDS[] = {
+  VMDLIB_IMPORT_FIELD("name", VMDLIB_COLUMN_NAME, VMDBoneSingleFrame, name),
+  VMDLIB_IMPORT_FIELD("frame", VMDLIB_COLUMN_U32, VMDBoneSingleFrame, frame),
+  VMDLIB_IMPORT_FIELD("x", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, x),
+  VMDLIB_IMPORT_FIELD("y", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, y),
+  VMDLIB_IMPORT_FIELD("z", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, z),
+  VMDLIB_IMPORT_FIELD("qx", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, qx),
+  VMDLIB_IMPORT_FIELD("qy", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, qy),
+  VMDLIB_IMPORT_FIELD("qz", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, qz),
+  VMDLIB_IMPORT_FIELD("qw", VMDLIB_COLUMN_F32, VMDBoneSingleFrame, qw),
+  VMDLIB_IMPORT_FIELD("bezier", VMDLIB_COLUMN_BYTES, VMDBoneSingleFrame,
+                      bezier),
+  { NULL, VMDLIB_FIELD_NONE, 0, 0 }
+};
+
+static const VMDImportField __VMD_MORPH_FIELDS[] = {
+  VMDLIB_IMPORT_FIELD("name", VMDLIB_COLUMN_NAME, VMDMorphSingleFrame, name),
+  VMDLIB_IMPORT_FIELD("frame", VMDLIB_COLUMN_U32, VMDMorphSingleFrame, frame),
+  VMDLIB_IMPORT_FIELD("value", VMDLIB_COLUMN_F32, VMDMorphSingleFrame, value),
+  { NULL, VMDLIB_FIELD_NONE, 0, 0 }
+};
+
+static const VMDImportField __VMD_CAMERA_FIELDS[] = {
+  VMDLIB_IMPORT_FIELD("frame", VMDLIB_COLUMN_U32, VMDCameraSingleFrame, frame),
+  VMDLIB_IMPORT_FIELD("distance", VMDLIB_COLUMN_F32, VMDCameraSingleFrame,
+                      distance),
+  VMDLIB_IMPORT_FIELD("x", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, x),
+  VMDLIB_IMPORT_FIELD("y", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, y),
+  VMDLIB_IMPORT_FIELD("z", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, z),
+  VMDLIB_IMPORT_FIELD("rx", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, rx),
+  VMDLIB_IMPORT_FIELD("ry", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, ry),
+  VMDLIB_IMPORT_FIELD("rz", VMDLIB_COLUMN_F32, VMDCameraSingleFrame, rz),
+  VMDLIB_IMPORT_FIELD("view_angle", VMDLIB_COLUMN_U32, VMDCameraSingleFrame,
+                      viewAngle),
+  VMDLIB_IMPORT_FIELD("parth", VMDLIB_COLUMN_I8, VMDCameraSingleFrame, parth),
+  VMDLIB_IMPORT_FIELD("bezier", VMDLIB_COLUMN_BYTES, VMDCameraSingleFrame,
+                      bezier),
+  { NULL, VMDLIB_FIELD_NONE, 0, 0 }
+};
+
+static const VMDImportField __VMD_LIGHT_FIELDS[] = {
+  VMDLIB_IMPORT_FIELD("frame", VMDLIB_COLUMN_U32, VMDLightSingleFrame, frame),
+  VMDLIB_IMPORT_FIELD("r", VMDLIB_COLUMN_F32, VMDLightSingleFrame, r),
+  VMDLIB_IMPORT_FIELD("g", VMDLIB_COLUMN_F32, VMDLightSingleFrame, g),
+  VMDLIB_IMPORT_FIELD("b", VMDLIB_COLUMN_F32, VMDLightSingleFrame, b),
+  VMDLIB_IMPORT_FIELD("x", VMDLIB_COLUMN_F32, VMDLightSingleFrame, x),
+  VMDLIB_IMPORT_FIELD("y", VMDLIB_COLUMN_F32, VMDLightSingleFrame, y),
+  VMDLIB_IMPORT_FIELD("z", VMDLIB_COLUMN_F32, VMDLightSingleFrame, z),
+  { NULL, VMDLIB_FIELD_NONE, 0, 0 }
+};
+
+static const VMDImportField __VMD_SHADOW_FIELDS[] = {
+  VMDLIB_IMPORT_FIELD("frame", VMDLIB_COLUMN_U32, VMDShadowSingleFrame, frame),
+  VMDLIB_IMPORT_FIELD("type", VMDLIB_COLUMN_I8, VMDShadowSingleFrame, type),
+  VMDLIB_IMPORT_FIELD("distance", VMDLIB_COLUMN_F32, VMDShadowSingleFrame,
+                      distance),
+  { NULL, VMDLIB_FIELD_NONE, 0, 0 }
+};
+
+static const VMDImportField __VMD_IK_FIELDS[] = {
+  VMDLIB_IMPORT_FIELD("frame", VMDLIB_COLUMN_U32, VMDIKImportRow, frame),
+  VMDLIB_IMPORT_FIELD("show", VMDLIB_COLUMN_I8, VMDIKImportRow, show),
+  VMDLIB_IMPORT_FIELD("name", VMDLIB_COLUMN_NAME, VMDIKImportRow, name),
+  VMDLIB_IMPORT_FIELD("on_off", VMDLIB_COLUMN_I8, VMDIKImportRow, on_off),
+  { NULL, VMDLIB_FIELD_NONE, 0, 0 }
+};
+
+#undef VMDLIB_IMPORT_FIELD
+
+// Cached conversion of a UTF-8 name
+typedef struct {
+  uint32_t hash;
+  uint32_t len;  // 0 for empty entry
+  char     utf8[VMDLIB_IMPORT_TOKEN];
+  char     sjis[VMDLIB_IK_NAME_SIZE];
+} VMDNameCacheEntry;
+
+// Straight line for every axis of bone frame, x1, y1, x2, y2
+static const uint8_t __VMD_LINEAR_BONE_CURVES[4][4] = {
+  { 20, 20, 107, 107 }, { 20, 20, 107, 107 },
+  { 20, 20, 107, 107 }, { 20, 20, 107, 107 }
+};
+
+// State of an import
+typedef struct {
+  const VMDImportField* fields;
+  size_t     record_size;
+  char*      rows;      // imported records
+  size_t     num_rows;
+  size_t     cap_rows;
+  char*      record;    // record being parsed, initialized by `defaults`
+  const char* defaults;
+  int        map[VMDLIB_IMPORT_MAX_COLUMNS]; // field of each CSV column
+  int        num_columns;
+  uint32_t   flags;
+  int        error;     // VMDLIB_E_FT for malformed input, or VMDLIB_E_ME
+  void*      cd;        // converter of __VMDNameFromUTF8()
+  VMDNameCacheEntry* cache;
+} VMDImportState;
+
+/**
+ * @brief Parse unsigned decimal integer
+ *  Internally called function
+ * @param (s) text
+ * @param (len) length of the text
+ * @param (max) largest value allowed
+ * @param (v) [out] value
+ * @return bool : false for a malformed value
+ */
+static bool __VMDParseUInt(const char* s, size_t len, uint64_t max,
+                           uint64_t* v){
+  uint64_t r = 0;
+  if ( len == 0 ) return false;
+  for ( size_t i = 0; i < len; i++ ) {
+    if ( s[i] < '0' || s[i] > '9' ) return false;
+    r = r * 10 + (uint64_t)(s[i] - '0');
+    if ( r > max ) return false;
+  }
+  *v = r;
+  return true;
+}
+
+/**
+ * @brief Parse float
+ *  Internally called function. Plain decimals of up to 19 digits are
+ *  computed exactly in double, others are given to strtod().
+ * @param (s) text
+ * @param (len) length of the text
+ * @param (v) [out] value
+ * @return bool : false for a malformed value
+ */
+static bool __VMDParseFloat(const char* s, size_t len, float* v){
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  char buf[VMDLIB_IMPORT_TOKEN];
+  const char* end = s + len;
+  const char* p = s;
+  uint64_t m = 0;
+  int digits = 0, scale = 0, seen = 0; // seen: digits including zeros
+  bool neg = false;
+  char* stop;
+  double d;
+
+  if ( p < end && (*p == '-' || *p == '+') ) {
+    neg = *p == '-';
+    p++;
+  }
+  for ( ; p < end && *p >= '0' && *p <= '9'; p++, seen++ ) {
+    if ( m == 0 && *p == '0' ) continue;
+    m = m * 10 + (uint64_t)(*p - '0');
+    if ( ++digits > 19 ) goto slow;
+  }
+  if ( p < end && *p == '.' ) {
+    for ( p++; p < end && *p >= '0' && *p <= '9'; p++, seen++ ) {
+      if ( m == 0 && *p == '0' ) {
+        scale++;
+        continue;
+      }
+      m = m * 10 + (uint64_t)(*p - '0');
+      scale++;
+      if ( ++digits > 19 ) goto slow;
+    }
+  }
+  // tokens without digits such as "-" or "." are left to strtod() to reject
+  if ( p != end || seen == 0 || scale > 22 || m > ((uint64_t)1 << 53) ) {
+    goto slow;
+  }
+  d = (double)m / pow10[scale];
+  *v = (float)(neg ? -d : d);
+  return true;
+
+ slow:
+  if ( len == 0 || len >= sizeof(buf) ) return false;
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  d = strtod(buf, &stop);
+  if ( stop != buf + len ) return false;
+  *v = (float)d;
+  return true;
+}
+
+/**
+ * @brief Parse hex of interpolation parameters
+ *  Internally called function
+ * @param (s) text
+ * @param (len) length of the text
+ * @param (out) [out] bytes
+ * @param (width) number of bytes
+ * @return bool : false for a malformed value
+ */
+static bool __VMDParseHex(const char* s, size_t len, char* out,
+                          uint32_t width){
+  int hi, lo;
+  if ( len != (size_t)width * 2 ) return false;
+  for ( uint32_t i = 0; i < width; i++ ) {
+#define VMDLIB_HEX(c) ((c) >= '0' && (c) <= '9' ? (c) - '0'                   \
+                       : (c) >= 'a' && (c) <= 'f' ? (c) - 'a' + 10             \
+                       : (c) >= 'A' && (c) <= 'F' ? (c) - 'A' + 10 : -1)
+    hi = VMDLIB_HEX(s[i * 2]);
+    lo = VMDLIB_HEX(s[i * 2 + 1]);
+#undef VMDLIB_HEX
+    if ( hi < 0 || lo < 0 ) return false;
+    out[i] = (char)(hi << 4 | lo);
+  }
+  return true;
+}
+
+/**
+ * @brief Store a name into name field
+ *  Internally called function. UTF-8 names are converted once for each
+ *  distinct name.
+ * @param (im) import state
+ * @param (s) name
+ * @param (len) length of the name
+ * @param (out) [out] name field
+ * @param (width) size of the field
+ * @return bool : false for a too long name
+ */
+static bool __VMDStoreName(VMDImportState* im, const char* s, size_t len,
+                           char* out, uint32_t width){
+  VMDNameCacheEntry* e;
+  uint32_t hash;
+
+  if ( im->flags & VMDLIB_EXPORT_SJIS ) {
+    if ( len > width ) return false;
+    memset(out, 0, width);
+    memcpy(out, s, len);
+    return true;
+  }
+  if ( len >= VMDLIB_IMPORT_TOKEN ) return false;
+  hash = __VMDHashName(s, len);
+  e = &im->cache[hash & (VMDLIB_IMPORT_NAME_CACHE - 1)];
+  if ( e->len != len || e->hash != hash || memcmp(e->utf8, s, len) != 0 ) {
+    e->hash = hash;
+    e->len = (uint32_t)len;
+    memcpy(e->utf8, s, len);
+    __VMDNameFromUTF8(&im->cd, s, len, e->sjis, sizeof(e->sjis));
+  }
+  memset(out, 0, width);
+  memcpy(out, e->sjis, __VMDNameLength(e->sjis, width));
+  return true;
+}
+
+/**
+ * @brief Store a value into the record being parsed
+ *  Internally called function
+ * @param (im) import state
+ * @param (field) field of the value
+ * @param (s) text of the value, unquoted
+ * @param (len) length of the text
+ * @return bool : false for a malformed value
+ */
+static bool __VMDStoreValue(VMDImportState* im, const VMDImportField* field,
+                            const char* s, size_t len){
+  char* dst = im->record + field->offset;
+  uint64_t u;
+  float f;
+  char c;
+
+  switch ( field->type ) {
+    case VMDLIB_COLUMN_U32:
+      if ( __VMDParseUInt(s, len, UINT32_MAX, &u) == false ) return false;
+      memcpy(dst, &(uint32_t){ (uint32_t)u }, sizeof(uint32_t));
+      return true;
+    case VMDLIB_COLUMN_F32:
+      if ( __VMDParseFloat(s, len, &f) == false ) return false;
+      memcpy(dst, &f, sizeof(float));
+      return true;
+    case VMDLIB_COLUMN_I8:
+      if ( len > 0 && s[0] == '-' ) {
+        if ( __VMDParseUInt(s + 1, len - 1, 128, &u) == false ) return false;
+        c = (char)-(int)u;
+      } else {
+        if ( __VMDParseUInt(s, len, 127, &u) == false ) return false;
+        c = (char)u;
+      }
+      *dst = c;
+      return true;
+    case VMDLIB_COLUMN_BYTES:
+      return __VMDParseHex(s, len, dst, field->width);
+    case VMDLIB_COLUMN_NAME:
+      return __VMDStoreName(im, s, len, dst, field->width);
+    default:
+      return true;
+  }
+}
+
+/**
+ * @brief Index of field by key
+ *  Internally called function
+ * @param (fields) fields of the section
+ * @param (key) key
+ * @param (len) length of the key
+ * @return index of the field, or -1 for unknown key
+ */
+static int __VMDFindField(const VMDImportField* fields, const char* key,
+                          size_t len){
+  for ( int i = 0; fields[i].key != NULL; i++ ) {
+    if ( strlen(fields[i].key) == len && memcmp(fields[i].key, key, len) == 0 ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Append the parsed record to the imported rows
+ *  Internally called function. The buffer grows by doubling.
+ * @param (im) import state
+ * @return bool : false if memory is insufficient
+ */
+static bool __VMDPushRecord(VMDImportState* im){
+  char* rows;
+  size_t cap;
+
+  if ( im->num_rows == im->cap_rows ) {
+    cap = im->cap_rows == 0 ? 1024 : im->cap_rows * 2;
+    rows = realloc(im->rows, cap * im->record_size);
+    if ( rows == NULL ) {
+      im->error = VMDLIB_E_ME;
+      return false;
+    }
+    im->rows = rows;
+    im->cap_rows = cap;
+  }
+  memcpy(im->rows + im->num_rows * im->record_size, im->record,
+         im->record_size);
+  im->num_rows++;
+  return true;
+}
+
+/**
+ * @brief Read a CSV field
+ *  Internally called function. Quoted fields are unquoted into `buf`,
+ *  others are returned in place.
+ * @param (p) [in,out] position in the input, left at the delimiter
+ * @param (end) end of the input
+ * @param (buf) buffer for quoted fields
+ * @param (s) [out] text of the field
+ * @param (len) [out] length of the field
+ * @return bool : false for a malformed field
+ */
+static bool __VMDCSVField(const char** p, const char* end, char* buf,
+                          const char** s, size_t* len){
+  const char* q = *p;
+  size_t n = 0;
+
+  if ( q < end && *q == '"' ) {
+    for ( q++; ; q++ ) {
+      if ( q >= end ) return false;
+      if ( *q == '"' ) {
+        if ( q + 1 < end && q[1] == '"' ) {
+          q++;
+        } else {
+          q++;
+          break;
+        }
+      }
+      if ( n >= VMDLIB_IMPORT_TOKEN ) return false;
+      buf[n++] = *q;
+    }
+    *s = buf;
+    *len = n;
+    *p = q;
+    return q >= end || *q == ',' || *q == '\n' || *q == '\r';
+  }
+  while ( q < end && *q != ',' && *q != '\n' && *q != '\r' ) q++;
+  *s = *p;
+  *len = (size_t)(q - *p);
+  *p = q;
+  return true;
+}
+
+/**
+ * @brief Import CSV
+ *  Internally called function
+ * @param (im) import state
+ * @param (data) input
+ * @param (size) size of the input
+ * @return bool : false for a malformed input or insufficient memory
+ */
+static bool __VMDImportCSV(VMDImportState* im, const char* data, size_t size){
+  char buf[VMDLIB_IMPORT_TOKEN];
+  const char* end = data + size;
+  const char* p = data;
+  const char* s;
+  size_t len;
+  int col;
+
+  // columns from header, or all fields in order of export
+  im->num_columns = 0;
+  if ( (im->flags & VMDLIB_EXPORT_NO_HEADER) == 0 ) {
+    while ( p < end && *p != '\n' && *p != '\r' ) {
+      if ( im->num_columns == VMDLIB_IMPORT_MAX_COLUMNS ) return false;
+      if ( __VMDCSVField(&p, end, buf, &s, &len) == false ) return false;
+      im->map[im->num_columns++] = __VMDFindField(im->fields, s, len);
+      if ( p < end && *p == ',' ) p++;
+    }
+  } else {
+    for ( ; im->fields[im->num_columns].key != NULL; im->num_columns++ ) {
+      im->map[im->num_columns] = im->num_columns;
+    }
+  }
+
+  while ( p < end ) {
+    while ( p < end && (*p == '\n' || *p == '\r') ) p++;
+    if ( p >= end ) break;
+    memcpy(im->record, im->defaults, im->record_size);
+    for ( col = 0; ; col++ ) {
+      if ( __VMDCSVField(&p, end, buf, &s, &len) == false ) return false;
+      if ( col < im->num_columns && im->map[col] >= 0 && len > 0
+           && __VMDStoreValue(im, &im->fields[im->map[col]], s, len) == false ) {
+        return false;
+      }
+      if ( p < end && *p == ',' ) {
+        p++;
+        continue;
+      }
+      break;
+    }
+    if ( __VMDPushRecord(im) == false ) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Read a JSON string
+ *  Internally called function. Escapes are decoded into `buf`.
+ * @param (p) [in,out] position at '"', left after the closing '"'
+ * @param (end) end of the input
+ * @param (buf) buffer of VMDLIB_IMPORT_TOKEN bytes
+ * @param (len) [out] length of the string
+ * @return bool : false for a malformed string
+ */
+static bool __VMDJSONString(const char** p, const char* end, char* buf,
+                            size_t* len){
+  const char* q = *p + 1;
+  uint32_t cp, lo;
+  size_t n = 0;
+  char h[2];
+  char c;
+
+  while ( q < end && *q != '"' ) {
+    if ( n + 4 > VMDLIB_IMPORT_TOKEN ) return false;
+    c = *q++;
+    if ( c != '\\' ) {
+      buf[n++] = c;
+      continue;
+    }
+    if ( q >= end ) return false;
+    c = *q++;
+    switch ( c ) {
+      case 'b': buf[n++] = '\b'; break;
+      case 'f': buf[n++] = '\f'; break;
+      case 'n': buf[n++] = '\n'; break;
+      case 'r': buf[n++] = '\r'; break;
+      case 't': buf[n++] = '\t'; break;
+      case 'u':
+        if ( end - q < 4 || __VMDParseHex(q, 4, h, 2) == false ) {
+          return false;
+        }
+        cp = (uint32_t)(unsigned char)h[0] << 8 | (unsigned char)h[1];
+        q += 4;
+        if ( cp >= 0xd800 && cp < 0xdc00 ) { // surrogate pair
+          if ( end - q < 6 || q[0] != '\\' || q[1] != 'u'
+               || __VMDParseHex(q + 2, 4, h, 2) == false ) {
+            return false;
+          }
+          lo = (uint32_t)(unsigned char)h[0] << 8 | (unsigned char)h[1];
+          if ( lo < 0xdc00 || lo >= 0xe000 ) return false;
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          q += 6;
+        }
+        if ( cp < 0x80 ) {
+          buf[n++] = (char)cp;
+        } else if ( cp < 0x800 ) {
+          buf[n++] = (char)(0xc0 | cp >> 6);
+          buf[n++] = (char)(0x80 | (cp & 0x3f));
+        } else if ( cp < 0x10000 ) {
+          buf[n++] = (char)(0xe0 | cp >> 12);
+          buf[n++] = (char)(0x80 | (cp >> 6 & 0x3f));
+          buf[n++] = (char)(0x80 | (cp & 0x3f));
+        } else {
+          buf[n++] = (char)(0xf0 | cp >> 18);
+          buf[n++] = (char)(0x80 | (cp >> 12 & 0x3f));
+          buf[n++] = (char)(0x80 | (cp >> 6 & 0x3f));
+          buf[n++] = (char)(0x80 | (cp & 0x3f));
+        }
+        break;
+      default: // '"', '\\' and '/'
+        buf[n++] = c;
+        break;
+    }
+  }
+  if ( q >= end ) return false;
+  *p = q + 1;
+  *len = n;
+  return true;
+}
+
+/**
+ * @brief Import NDJSON
+ *  Internally called function. Each line is a flat object.
+ * @param (im) import state
+ * @param (data) input
+ * @param (size) size of the input
+ * @return bool : false for a malformed input or insufficient memory
+ */
+static bool __VMDImportNDJSON(VMDImportState* im, const char* data,
+                              size_t size){
+  char key[VMDLIB_IMPORT_TOKEN];
+  char buf[VMDLIB_IMPORT_TOKEN];
+  const char* end = data + size;
+  const char* p = data;
+  const char* s;
+  size_t key_len, len;
+  int field;
+
+#define VMDLIB_SKIP_SPACE()                                                  \
+  while ( p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') ) p++
+
+  for ( ;; ) {
+    VMDLIB_SKIP_SPACE();
+    if ( p >= end ) break;
+    if ( *p++ != '{' ) return false;
+    memcpy(im->record, im->defaults, im->record_size);
+    VMDLIB_SKIP_SPACE();
+    if ( p < end && *p == '}' ) {
+      p++;
+    } else {
+      for ( ;; ) {
+        VMDLIB_SKIP_SPACE();
+        if ( p >= end || *p != '"' ) return false;
+        if ( __VMDJSONString(&p, end, key, &key_len) == false ) return false;
+        VMDLIB_SKIP_SPACE();
+        if ( p >= end || *p++ != ':' ) return false;
+        VMDLIB_SKIP_SPACE();
+        if ( p >= end ) return false;
+        field = __VMDFindField(im->fields, key, key_len);
+
+        if ( *p == '"' ) {
+          if ( __VMDJSONString(&p, end, buf, &len) == false ) return false;
+          s = buf;
+        } else {
+          s = p;
+          while ( p < end && *p != ',' && *p != '}' && *p != ' '
+                  && *p != '\t' && *p != '\r' && *p != '\n' ) {
+            p++;
+          }
+          len = (size_t)(p - s);
+          if ( len == 4 && memcmp(s, "null", 4) == 0 ) field = -1;
+          else if ( len == 4 && memcmp(s, "true", 4) == 0 ) s = "1", len = 1;
+          else if ( len == 5 && memcmp(s, "false", 5) == 0 ) s = "0", len = 1;
+        }
+        if ( field >= 0
+             && __VMDStoreValue(im, &im->fields[field], s, len) == false ) {
+          return false;
+        }
+        VMDLIB_SKIP_SPACE();
+        if ( p >= end ) return false;
+        if ( *p == ',' ) {
+          p++;
+          continue;
+        }
+        if ( *p++ != '}' ) return false;
+        break;
+      }
+    }
+    if ( __VMDPushRecord(im) == false ) return false;
+  }
+#undef VMDLIB_SKIP_SPACE
+  return true;
+}
+
+/**
+ * @brief Append imported records to frames
+ *  Internally called function
+ * @param (frames) frames allocated by malloc()
+ * @param (num) [in,out] number of the frames
+ * @param (im) import state
+ * @return new pointer of the frames, or NULL if memory is insufficient
+ */
+static void* __VMDAppendFrames(void* frames, uint32_t* num,
+                               const VMDImportState* im){
+  char* p;
+
+  if ( im->num_rows > UINT32_MAX - *num ) return NULL;
+  p = realloc(frames, im->record_size * (*num + im->num_rows));
+  if ( p == NULL ) return NULL;
+  memcpy(p + im->record_size * *num, im->rows, im->record_size * im->num_rows);
+  *num += (uint32_t)im->num_rows;
+  return p;
+}
+
+/**
+ * @brief Append imported records to a section
+ *  Internally called function. ShowIK rows are grouped into records.
+ * @param (vf) a pointer to VMDFile
+ * @param (section) section
+ * @param (im) import state
+ * @return bool : false if memory is insufficient
+ */
+static bool __VMDAppendRows(VMDFile* vf, VMDStructType section,
+                            const VMDImportState* im){
+  VMDIKSingleFrame* frames;
+  VMDInfoIK* ik;
+  const VMDIKImportRow* row;
+  const VMDIKImportRow* first;
+  uint32_t num_frames, num_ik, num;
+  void* p;
+
+  if ( im->num_rows == 0 ) return true;
+  switch ( section ) {
+#define VMDLIB_APPEND(member)                                                \
+      num = vf->member.num_frames;                                           \
+      p = __VMDAppendFrames(vf->member.frames, &num, im);                    \
+      if ( p == NULL ) return false;                                         \
+      vf->member.frames = p;                                                 \
+      vf->member.num_frames = num;                                           \
+      return true
+    case VMDL_BONE: VMDLIB_APPEND(bone_frames);
+    case VMDL_MORPH: VMDLIB_APPEND(morph_frames);
+    case VMDL_CAMERA: VMDLIB_APPEND(camera_frames);
+    case VMDL_LIGHT: VMDLIB_APPEND(light_frames);
+    case VMDL_SHADOW: VMDLIB_APPEND(shadow_frames);
+#undef VMDLIB_APPEND
+    default:
+      break;
+  }
+
+  // count records and entries of ShowIK
+  num_frames = vf->ik_frames.num_frames;
+  num_ik = vf->ik_frames.num_ik;
+  for ( size_t i = 0; i < im->num_rows; i++ ) {
+    row = (const VMDIKImportRow*)im->rows + i;
+    first = i == 0 ? NULL : row - 1;
+    if ( first == NULL || first->frame != row->frame
+         || first->show != row->show ) {
+      num_frames++;
+    }
+    if ( row->on_off >= 0 ) num_ik++;
+  }
+  frames = realloc(vf->ik_frames.frames,
+                   sizeof(VMDIKSingleFrame) * (num_frames > 0 ? num_frames : 1));
+  if ( frames == NULL ) return false;
+  vf->ik_frames.frames = frames;
+  ik = realloc(vf->ik_frames.ik, sizeof(VMDInfoIK) * (num_ik > 0 ? num_ik : 1));
+  if ( ik == NULL ) return false;
+  vf->ik_frames.ik = ik;
+
+  for ( size_t i = 0; i < im->num_rows; i++ ) {
+    row = (const VMDIKImportRow*)im->rows + i;
+    first = i == 0 ? NULL : row - 1;
+    if ( first == NULL || first->frame != row->frame
+         || first->show != row->show ) {
+      frames[vf->ik_frames.num_frames].frame = row->frame;
+      frames[vf->ik_frames.num_frames].show = row->show;
+      frames[vf->ik_frames.num_frames].ik_count = 0;
+      frames[vf->ik_frames.num_frames].ik_offset = vf->ik_frames.num_ik;
+      vf->ik_frames.num_frames++;
+    }
+    if ( row->on_off >= 0 ) {
+      memcpy(ik[vf->ik_frames.num_ik].name, row->name, VMDLIB_IK_NAME_SIZE);
+      ik[vf->ik_frames.num_ik].on_off = row->on_off;
+      vf->ik_frames.num_ik++;
+      frames[vf->ik_frames.num_frames - 1].ik_count++;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Import frames of a section from CSV or NDJSON
+ *  Frames are appended to the section of `vf`, which must be allocated by
+ *  malloc() (VMDCreateVMDFile() or VMDLoadFromFile()). Derived data
+ *  (track index, curve table) is rebuilt if it has been built. Nothing is
+ *  appended if the input is malformed.
+ * @param (vf) a pointer to VMDFile
+ * @param (section) section to be imported
+ * @param (format) VMDL_EXPORT_CSV or VMDL_EXPORT_NDJSON
+ * @param (flags) VMDLIB_EXPORT_SJIS and VMDLIB_EXPORT_NO_HEADER
+ * @param (data) input
+ * @param (size) size of the input
+ * @return bool : false with VMD_ERROR set on failure, VMDLIB_E_FT for a
+ *         malformed input
+ */
+bool VMDImport(VMDFile* vf, VMDStructType section, VMDExportFormat format,
+               uint32_t flags, const char* data, size_t size){
+  VMDBoneSingleFrame bone_default;
+  VMDCameraSingleFrame camera_default;
+  VMDIKImportRow ik_default;
+  char record[sizeof(VMDBoneSingleFrame)];
+  char zero[sizeof(VMDBoneSingleFrame)];
+  VMDImportState im;
+  uint32_t num;
+  bool ok;
+
+  if ( vf == NULL || (data == NULL && size > 0) || section > VMDL_IK
+       || format == VMDL_EXPORT_COLUMNS || vf->storage != VMDL_STORAGE_HEAP ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION(section)) == false ) return false;
+  memset(&im, 0, sizeof(VMDImportState));
+  memset(zero, 0, sizeof(zero));
+  im.flags = flags;
+  im.error = VMDLIB_E_FT;
+  im.record = record;
+  im.defaults = zero;
+  switch ( section ) {
+    case VMDL_BONE:
+      memset(&bone_default, 0, sizeof(bone_default));
+      bone_default.qw = 1.0f;
+      __VMDEncodeBoneBezier(bone_default.bezier, __VMD_LINEAR_BONE_CURVES);
+      im.fields = __VMD_BONE_FIELDS;
+      im.record_size = sizeof(VMDBoneSingleFrame);
+      im.defaults = (const char*)&bone_default;
+      break;
+    case VMDL_MORPH:
+      im.fields = __VMD_MORPH_FIELDS;
+      im.record_size = sizeof(VMDMorphSingleFrame);
+      break;
+    case VMDL_CAMERA:
+      memset(&camera_default, 0, sizeof(camera_default));
+      for ( int i = 0; i < 24; i++ ) {
+        camera_default.bezier[i] = (i % 4) % 2 == 0 ? 20 : 107;
+      }
+      camera_default.viewAngle = 30;
+      im.fields = __VMD_CAMERA_FIELDS;
+      im.record_size = sizeof(VMDCameraSingleFrame);
+      im.defaults = (const char*)&camera_default;
+      break;
+    case VMDL_LIGHT:
+      im.fields = __VMD_LIGHT_FIELDS;
+      im.record_size = sizeof(VMDLightSingleFrame);
+      break;
+    case VMDL_SHADOW:
+      im.fields = __VMD_SHADOW_FIELDS;
+      im.record_size = sizeof(VMDShadowSingleFrame);
+      break;
+    case VMDL_IK:
+      memset(&ik_default, 0, sizeof(ik_default));
+      ik_default.show = 1;
+      ik_default.on_off = -1;
+      im.fields = __VMD_IK_FIELDS;
+      im.record_size = sizeof(VMDIKImportRow);
+      im.defaults = (const char*)&ik_default;
+      break;
+  }
+  if ( (flags & VMDLIB_EXPORT_SJIS) == 0 ) {
+    im.cache = calloc(VMDLIB_IMPORT_NAME_CACHE, sizeof(VMDNameCacheEntry));
+    if ( im.cache == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      return false;
+    }
+  }
+
+  ok = format == VMDL_EXPORT_NDJSON ? __VMDImportNDJSON(&im, data, size)
+                                    : __VMDImportCSV(&im, data, size);
+  num = VMDGetNumFrames(vf, section);
+  if ( ok == false ) {
+    VMD_ERROR = im.error;
+  } else if ( __VMDAppendRows(vf, section, &im) == false ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    ok = false;
+  }
+  if ( ok && im.num_rows > 0 ) __VMDMarkRewritten(vf, section, num);
+  free(im.rows);
+  free(im.cache);
+  __VMDCloseConverter(im.cd);
+  if ( ok == false ) return false;
+
+  if ( vf->index != NULL ) VMDBuildTrackIndex(vf);
+  if ( vf->curves != NULL ) VMDBuildCurveTable(vf);
+  return true;
+}
+
+/**
+ * @brief Import frames of a section from CSV or NDJSON file
+ *  See VMDImport()
+ * @param (vf) a pointer to VMDFile
+ * @param (section) section to be imported
+ * @param (format) VMDL_EXPORT_CSV or VMDL_EXPORT_NDJSON
+ * @param (flags) VMDLIB_EXPORT_SJIS and VMDLIB_EXPORT_NO_HEADER
+ * @param (fname) a name of a file to be read
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDImportFromFile(VMDFile* vf, VMDStructType section,
+                       VMDExportFormat format, uint32_t flags,
+                       const char* fname){
+  FILE* fp;
+  char* data = NULL;
+  char* p;
+  size_t size = 0, cap = 0, n;
+  bool ok;
+
+  if ( fname == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  fp = fopen(fname, "rb");
+  if ( fp == NULL ) {
+    VMD_ERROR = VMDLIB_E_FH;
+    return false;
+  }
+  // read by doubling, works for pipes as well as files
+  for ( ;; ) {
+    if ( size == cap ) {
+      cap = cap == 0 ? 1 << 20 : cap * 2;
+      p = realloc(data, cap);
+      if ( p == NULL ) {
+        free(data);
+        fclose(fp);
+        VMD_ERROR = VMDLIB_E_ME;
+        return false;
+      }
+      data = p;
+    }
+    n = fread(data + size, 1, cap - size, fp);
+    size += n;
+    if ( n == 0 ) break;
+  }
+  if ( ferror(fp) ) {
+    free(data);
+    fclose(fp);
+    VMD_ERROR = VMDLIB_E_FH;
+    return false;
+  }
+  fclose(fp);
+  ok = VMDImport(vf, section, format, flags, data, size);
+  free(data);
+  return ok;
+}
@@ -0,0 +1,289 @@
+/**
+ *  @file vmd_index.c
+ *  @brief Per-bone and per-morph track index of VMD file
+ *  @author ihm4
+ *  @note
+ *    Bone and morph frames are stored as one flat array for all bones (or
+ *    morphs) in file. The index groups them by name, so the frames of one
+ *    bone can be found in O(1) and walked in frame order without touching
+ *    the frames of other bones. Names are interned in the name table of the
+ *    file (vmd_names.c), and tracks are found by name id.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmd.h"
+
+/**
+ * @brief Release memory held by track table
+ *  Internally called function
+ * @param (table) track table
+ * @param (mapped) only `tracks` is allocated, see VMDOpenCache()
+ * @return void
+ */
+static void __VMDFreeTrackTable(VMDTrackTable* table, bool mapped){
+  free(table->tracks);
+  if ( mapped == false ) {
+    free(table->track_of);
+    free(table->name_ids);
+    free(table->indices);
+  }
+  memset(table, 0, sizeof(VMDTrackTable));
+}
+
+/**
+ * @brief Build track table of bone or morph frames
+ *  Internally called function. Frames are assigned to tracks by name id in
+ *  one pass, then the positions of frames are scattered to one contiguous
+ *  run per track. Runs are in the order of frames, and are sorted by frame
+ *  number only if the section itself is not.
+ * @param (table) [out] track table
+ * @param (names) name table of the file
+ * @param (frames) head of the frames
+ * @param (num) number of frames
+ * @param (stride) size of a frame
+ * @param (frame_offset) offset of frame number in a frame
+ * @return boolean : false if memory is insufficient
+ */
+static bool __VMDBuildTrackTable(VMDTrackTable* table, VMDNameTable* names,
+                                 const char* frames, uint32_t num,
+                                 size_t stride, size_t frame_offset){
+  uint32_t* ids = NULL;
+  uint32_t* cursor = NULL;
+  uint64_t* pairs = NULL;
+  uint32_t cap = 16;
+  uint32_t id, key, prev = 0;
+  bool sorted = true;
+  const char* name;
+  VMDTrack* track;
+
+  memset(table, 0, sizeof(VMDTrackTable));
+  if ( num == 0 ) return true;
+
+  ids = malloc(sizeof(uint32_t) * num);
+  table->name_ids = malloc(sizeof(uint32_t) * num);
+  table->indices = malloc(sizeof(uint32_t) * num);
+  table->tracks = malloc(sizeof(VMDTrack) * cap);
+  if ( ids == NULL || table->name_ids == NULL || table->indices == NULL
+       || table->tracks == NULL ) {
+    goto error;
+  }
+
+  // name id of each frame, then the track of each name id
+  for ( uint32_t i = 0; i < num; i++ ) {
+    table->name_ids[i] = VMDInternName(names, frames + stride * i,
+                                       VMDLIB_NAME_SIZE);
+    if ( table->name_ids[i] == VMDLIB_NO_NAME ) goto error;
+  }
+  table->num_ids = VMDGetNumNames(names);
+  table->track_of = calloc(table->num_ids, sizeof(uint32_t));
+  if ( table->track_of == NULL ) goto error;
+
+  for ( uint32_t i = 0; i < num; i++ ) {
+    name = frames + stride * i;
+    if ( table->track_of[table->name_ids[i]] != 0 ) {
+      id = table->track_of[table->name_ids[i]] - 1;
+    } else {
+      if ( table->num_tracks == cap ) {
+        cap *= 2;
+        track = realloc(table->tracks, sizeof(VMDTrack) * cap);
+        if ( track == NULL ) goto error;
+        table->tracks = track;
+      }
+      track = &table->tracks[table->num_tracks];
+      memset(track->name, 0, sizeof(track->name));
+      memcpy(track->name, name, __VMDNameLength(name, VMDLIB_NAME_SIZE));
+      track->hash = VMDGetNameHash(names, table->name_ids[i]);
+      track->name_id = table->name_ids[i];
+      track->num_frames = 0;
+      id = table->num_tracks++;
+      table->track_of[table->name_ids[i]] = table->num_tracks;
+    }
+    ids[i] = id;
+    table->tracks[id].num_frames++;
+    memcpy(&key, name + frame_offset, sizeof(uint32_t));
+    sorted = sorted && prev <= key;
+    prev = key;
+  }
+
+  // one contiguous run of frame positions per track
+  cursor = malloc(sizeof(uint32_t) * table->num_tracks);
+  if ( cursor == NULL ) goto error;
+  id = 0;
+  for ( uint32_t t = 0; t < table->num_tracks; t++ ) {
+    table->tracks[t].frames = table->indices + id;
+    cursor[t] = id;
+    id += table->tracks[t].num_frames;
+  }
+  for ( uint32_t i = 0; i < num; i++ ) {
+    table->indices[cursor[ids[i]]++] = i;
+  }
+
+  // runs keep the order of the section, sort them only when it is unsorted
+  if ( sorted == false ) {
+    pairs = malloc(sizeof(uint64_t) * num);
+    if ( pairs == NULL ) goto error;
+    for ( uint32_t t = 0; t < table->num_tracks; t++ ) {
+      track = &table->tracks[t];
+      sorted = true;
+      prev = 0;
+      for ( uint32_t i = 0; i < track->num_frames; i++ ) {
+        memcpy(&key, frames + stride * track->frames[i] + frame_offset,
+               sizeof(uint32_t));
+        sorted = sorted && prev <= key;
+        prev = key;
+        pairs[i] = ((uint64_t)key << 32) | track->frames[i];
+      }
+      if ( sorted ) continue;
+      if ( __VMDSortPairs(pairs, track->num_frames) == false ) goto error;
+      for ( uint32_t i = 0; i < track->num_frames; i++ ) {
+        track->frames[i] = (uint32_t)pairs[i];
+      }
+    }
+  }
+
+  free(pairs);
+  free(cursor);
+  free(ids);
+  return true;
+
+error:
+  DEBUG_PRINT("Insufficient memory.\n");
+  free(pairs);
+  free(cursor);
+  free(ids);
+  __VMDFreeTrackTable(table, false);
+  return false;
+}
+
+/**
+ * @brief Build per-bone and per-morph track index of VMDFile
+ *  The index is held by `vf` and released with it. It refers to positions
+ *  of frames, so build it again after frames are added, removed or
+ *  reordered by other than VMDSortAllFrames(), which rebuilds it.
+ * @param (vf) a pointer to VMDFile
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDBuildTrackIndex(VMDFile* vf){
+  VMDTrackIndex* index;
+  VMDNameTable* names;
+
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION(VMDL_BONE)
+                       | VMDLIB_SECTION(VMDL_MORPH)
+                       | VMDLIB_SECTION(VMDL_IK)) == false ) {
+    return false;
+  }
+  names = VMDGetNameTable(vf);
+  if ( names == NULL ) return false;
+  index = calloc(1, sizeof(VMDTrackIndex));
+  if ( index == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  if ( __VMDBuildTrackTable(&index->bones, names,
+                            (const char*)vf->bone_frames.frames,
+                            vf->bone_frames.num_frames,
+                            sizeof(VMDBoneSingleFrame),
+                            offsetof(VMDBoneSingleFrame, frame)) == false
+       || __VMDBuildTrackTable(&index->morphs, names,
+                               (const char*)vf->morph_frames.frames,
+                               vf->morph_frames.num_frames,
+                               sizeof(VMDMorphSingleFrame),
+                               offsetof(VMDMorphSingleFrame, frame)) == false ) {
+    goto error;
+  }
+  if ( vf->ik_frames.num_ik > 0 ) {
+    index->ik_name_ids = malloc(sizeof(uint32_t) * vf->ik_frames.num_ik);
+    if ( index->ik_name_ids == NULL ) goto error;
+    for ( uint32_t i = 0; i < vf->ik_frames.num_ik; i++ ) {
+      index->ik_name_ids[i] = VMDInternName(names, vf->ik_frames.ik[i].name,
+                                            VMDLIB_IK_NAME_SIZE);
+      if ( index->ik_name_ids[i] == VMDLIB_NO_NAME ) goto error;
+    }
+  }
+  VMDReleaseTrackIndex(vf);
+  vf->index = index;
+  return true;
+
+ error:
+  __VMDFreeTrackTable(&index->bones, false);
+  __VMDFreeTrackTable(&index->morphs, false);
+  free(index->ik_name_ids);
+  free(index);
+  VMD_ERROR = VMDLIB_E_ME;
+  return false;
+}
+
+/**
+ * @brief Release track index of VMDFile
+ *  Called by VMDReleaseVMDFile(), needed only to drop the index earlier.
+ * @param (vf) a pointer to VMDFile
+ * @return void
+ */
+void VMDReleaseTrackIndex(VMDFile* vf){
+  if ( vf == NULL || vf->index == NULL ) return;
+  __VMDFreeTrackTable(&vf->index->bones, vf->index->mapped);
+  __VMDFreeTrackTable(&vf->index->morphs, vf->index->mapped);
+  if ( vf->index->mapped == false ) free(vf->index->ik_name_ids);
+  free(vf->index);
+  vf->index = NULL;
+}
+
+/**
+ * @brief Find track by name
+ *  Internally called function
+ * @param (table) track table
+ * @param (names) name table of the file
+ * @param (name) name terminated by NUL
+ * @return track or NULL
+ */
+static const VMDTrack* __VMDFindTrack(const VMDTrackTable* table,
+                                      const VMDNameTable* names,
+                                      const char* name){
+  uint32_t id = VMDFindName(names, name);
+
+  if ( id == VMDLIB_NO_NAME || id >= table->num_ids
+       || table->track_of[id] == 0 ) {
+    return NULL;
+  }
+  return &table->tracks[table->track_of[id] - 1];
+}
+
+/**
+ * @brief Find keyframes of a bone
+ *  The track index is built on the first call if it is not built yet.
+ * @param (vf) a pointer to VMDFile
+ * @param (name) Shift-JIS bone name terminated by NUL, e.g. "センター"
+ * @return track of the bone, or NULL if the bone has no frame
+ */
+const VMDTrack* VMDFindBoneTrack(VMDFile* vf, const char* name){
+  if ( vf == NULL || name == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  if ( vf->index == NULL && VMDBuildTrackIndex(vf) == false ) return NULL;
+  return __VMDFindTrack(&vf->index->bones, vf->names, name);
+}
+
+/**
+ * @brief Find keyframes of a morph
+ *  The track index is built on the first call if it is not built yet.
+ * @param (vf) a pointer to VMDFile
+ * @param (name) Shift-JIS morph name terminated by NUL, e.g. "まばたき"
+ * @return track of the morph, or NULL if the morph has no frame
+ */
+const VMDTrack* VMDFindMorphTrack(VMDFile* vf, const char* name){
+  if ( vf == NULL || name == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  if ( vf->index == NULL && VMDBuildTrackIndex(vf) == false ) return NULL;
+  return __VMDFindTrack(&vf->index->morphs, vf->names, name);
+}
@@ -0,0 +1,364 @@
+/**
+ *  @file vmd_loader.c
+ *  @brief Parallel loading of many VMD files and a simple thread executor
+ *  @author ihm4
+ *  @note
+ *    VMDLoadBatch() runs a bounded pool of worker threads. Each worker
+ *    claims the next file, loads it into its own arena and hands the result
+ *    to the callback, so that a warmed-up worker loads files without
+ *    allocating memory. While a file is parsed, the files next in the list
+ *    are announced to the kernel (posix_fadvise()) so that their reads
+ *    overlap the parsing.
+ *
+ *    VMDThreadExecutor() gives a VMDExecutor which starts threads for each
+ *    parallel loop, for callers which have no thread pool of their own.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+#include "vmd.h"
+
+// Upper limit of worker threads of a batch or a loop
+#define VMDLIB_MAX_THREADS (256)
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION VMDMutex;
+#else
+typedef pthread_mutex_t VMDMutex;
+#endif
+
+// Body of a worker thread started by __VMDRunWorkers()
+typedef void (*VMDWorkerFunc)(void* arg);
+
+// Argument of the entry point of worker threads
+typedef struct {
+  VMDWorkerFunc func;
+  void*         arg;
+} VMDWorker;
+
+// State shared by workers of VMDLoadBatch()
+typedef struct {
+  const char* const*     paths;
+  size_t                 num_paths;
+  size_t                 next;      // next file to be claimed
+  size_t                 prefetched; // files before this one are prefetched
+  uint32_t               num_threads;
+  const VMDBatchOptions* opt;
+  VMDMutex               lock;
+} VMDBatch;
+
+// State of a loop run by VMDThreadExecutor()
+typedef struct {
+  VMDTaskFunc task;
+  void*       arg;
+  uint32_t    num;
+  uint32_t    next; // next index to be claimed
+  VMDMutex    lock;
+} VMDThreadLoop;
+
+static void __VMDMutexInit(VMDMutex* m){
+#ifdef _WIN32
+  InitializeCriticalSection(m);
+#else
+  pthread_mutex_init(m, NULL);
+#endif
+}
+
+static void __VMDMutexDestroy(VMDMutex* m){
+#ifdef _WIN32
+  DeleteCriticalSection(m);
+#else
+  pthread_mutex_destroy(m);
+#endif
+}
+
+static void __VMDMutexLock(VMDMutex* m){
+#ifdef _WIN32
+  EnterCriticalSection(m);
+#else
+  pthread_mutex_lock(m);
+#endif
+}
+
+static void __VMDMutexUnlock(VMDMutex* m){
+#ifdef _WIN32
+  LeaveCriticalSection(m);
+#else
+  pthread_mutex_unlock(m);
+#endif
+}
+
+/**
+ * @brief Entry point of worker threads
+ *  Internally called function
+ * @param (arg) VMDWorker
+ * @return 0
+ */
+#ifdef _WIN32
+static DWORD WINAPI __VMDWorkerMain(LPVOID arg){
+  ((VMDWorker*)arg)->func(((VMDWorker*)arg)->arg);
+  return 0;
+}
+#else
+static void* __VMDWorkerMain(void* arg){
+  ((VMDWorker*)arg)->func(((VMDWorker*)arg)->arg);
+  return NULL;
+}
+#endif
+
+/**
+ * @brief Run a function on several threads
+ *  Internally called function. The calling thread is one of the workers,
+ *  so `func` runs at least once even if no thread can be started, and it
+ *  must share the work with however many workers there are.
+ * @param (threads) number of workers including the calling thread
+ * @param (func) body of the workers
+ * @param (arg) passed to `func`
+ * @return bool : false with VMD_ERROR set if memory is insufficient
+ */
+static bool __VMDRunWorkers(uint32_t threads, VMDWorkerFunc func, void* arg){
+#ifdef _WIN32
+  HANDLE* workers;
+#else
+  pthread_t* workers;
+#endif
+  VMDWorker worker;
+  uint32_t started = 0;
+
+  worker.func = func;
+  worker.arg = arg;
+  workers = malloc(sizeof(*workers) * (threads > 1 ? threads - 1 : 1));
+  if ( workers == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+#ifdef _WIN32
+  for ( ; started + 1 < threads; started++ ) {
+    workers[started] = CreateThread(NULL, 0, __VMDWorkerMain, &worker, 0,
+                                    NULL);
+    if ( workers[started] == NULL ) break;
+  }
+#else
+  for ( ; started + 1 < threads; started++ ) {
+    if ( pthread_create(&workers[started], NULL, __VMDWorkerMain,
+                        &worker) != 0 ) {
+      break;
+    }
+  }
+#endif
+  func(arg);
+
+#ifdef _WIN32
+  for ( uint32_t i = 0; i < started; i++ ) {
+    WaitForSingleObject(workers[i], INFINITE);
+    CloseHandle(workers[i]);
+  }
+#else
+  for ( uint32_t i = 0; i < started; i++ ) pthread_join(workers[i], NULL);
+#endif
+  free(workers);
+  return true;
+}
+
+/**
+ * @brief Start reading a file ahead
+ *  Internally called function. Asks the kernel to read the file into page
+ *  cache in background, does nothing where it is not supported.
+ * @param (path) a name of a file
+ * @return void
+ */
+static void __VMDPrefetch(const char* path){
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+  int fd = open(path, O_RDONLY);
+  if ( fd < 0 ) return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+#else
+  (void)path;
+#endif
+}
+
+/**
+ * @brief Claim the next file
+ *  Internally called function. Files up to `num_threads` ahead of the
+ *  claimed one are prefetched by the claiming worker.
+ * @param (batch) batch
+ * @param (index) [out] index of the claimed file
+ * @return bool : false if all files are claimed
+ */
+static bool __VMDBatchClaim(VMDBatch* batch, size_t* index){
+  size_t from, to;
+
+  __VMDMutexLock(&batch->lock);
+  if ( batch->next >= batch->num_paths ) {
+    __VMDMutexUnlock(&batch->lock);
+    return false;
+  }
+  *index = batch->next++;
+  from = batch->prefetched > batch->next ? batch->prefetched : batch->next;
+  to = batch->next + batch->num_threads;
+  if ( to > batch->num_paths ) to = batch->num_paths;
+  if ( from < to ) batch->prefetched = to;
+  __VMDMutexUnlock(&batch->lock);
+
+  if ( batch->opt->flags & VMDLIB_BATCH_PREFETCH ) {
+    for ( size_t i = from; i < to; i++ ) __VMDPrefetch(batch->paths[i]);
+  }
+  return true;
+}
+
+/**
+ * @brief Worker of VMDLoadBatch()
+ *  Internally called function
+ * @param (arg) batch
+ * @return void
+ */
+static void __VMDBatchWorker(void* arg){
+  VMDBatch* batch = arg;
+  const VMDBatchOptions* opt = batch->opt;
+  VMDLoadOptions load;
+  VMDArena arena;
+  VMDFile* vf;
+  size_t index;
+  VMDStatus status;
+
+  memset(&load, 0, sizeof(VMDLoadOptions));
+  load.flags = opt->load_flags;
+  load.skip_sections = opt->skip_sections;
+  if ( opt->arena_size > 0 ) {
+    VMDArenaInit(&arena, NULL, opt->arena_size);
+    load.arena = &arena;
+  }
+
+  while ( __VMDBatchClaim(batch, &index) ) {
+    status = VMDLoadFromFileEx(batch->paths[index], &vf, &load);
+    if ( opt->callback != NULL ) {
+      opt->callback(opt->user, index, batch->paths[index], vf, status);
+    }
+    if ( load.arena != NULL ) {
+      VMDReleaseVMDFile(vf);
+      VMDArenaReset(&arena);
+    } else if ( opt->callback == NULL ) {
+      VMDReleaseVMDFile(vf);
+    }
+  }
+
+  if ( load.arena != NULL ) VMDArenaRelease(&arena);
+}
+
+/**
+ * @brief Load many VMD files in parallel
+ *  Files are loaded by a pool of `threads` workers. The callback of `opt`
+ *  is called from the worker threads as each file completes, concurrently
+ *  for different files, with the index of the file in `paths`, the loaded
+ *  VMDFile (NULL on failure) and the status of the file (VMDLIB_OK on
+ *  success).
+ *
+ *  When `opt->arena_size` is not 0, each worker loads into its own arena
+ *  and the VMDFile is valid only during the callback. Otherwise the
+ *  callback owns the VMDFile and releases it by VMDReleaseVMDFile().
+ * @param (paths) names of files to be read
+ * @param (num_paths) number of files
+ * @param (threads) number of workers, 0 for one per file up to a limit
+ * @param (opt) options and callback
+ * @return bool : false with VMD_ERROR set if workers cannot be started,
+ *         errors of each file are passed to the callback
+ */
+bool VMDLoadBatch(const char* const* paths, size_t num_paths,
+                  uint32_t threads, const VMDBatchOptions* opt){
+  VMDBatch batch;
+  bool ok;
+
+  if ( (paths == NULL && num_paths > 0) || opt == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( num_paths == 0 ) return true;
+  if ( threads == 0 || threads > VMDLIB_MAX_THREADS ) {
+    threads = VMDLIB_MAX_THREADS;
+  }
+  if ( threads > num_paths ) threads = (uint32_t)num_paths;
+
+  memset(&batch, 0, sizeof(VMDBatch));
+  batch.paths = paths;
+  batch.num_paths = num_paths;
+  batch.num_threads = threads;
+  batch.opt = opt;
+  __VMDMutexInit(&batch.lock);
+  ok = __VMDRunWorkers(threads, __VMDBatchWorker, &batch);
+  __VMDMutexDestroy(&batch.lock);
+  return ok;
+}
+
+/**
+ * @brief Worker of VMDThreadExecutor()
+ *  Internally called function
+ * @param (arg) loop
+ * @return void
+ */
+static void __VMDThreadLoopWorker(void* arg){
+  VMDThreadLoop* loop = arg;
+  uint32_t i;
+
+  for ( ;; ) {
+    __VMDMutexLock(&loop->lock);
+    i = loop->next < loop->num ? loop->next++ : loop->num;
+    __VMDMutexUnlock(&loop->lock);
+    if ( i == loop->num ) return;
+    loop->task(loop->arg, i);
+  }
+}
+
+/**
+ * @brief Parallel loop of VMDThreadExecutor()
+ *  Internally called function. Runs on the calling thread alone when
+ *  threads cannot be started.
+ * @param (ctx) number of threads
+ * @param (num) number of tasks
+ * @param (task) task
+ * @param (arg) passed to `task`
+ * @return void
+ */
+static void __VMDThreadParallelFor(void* ctx, uint32_t num, VMDTaskFunc task,
+                                   void* arg){
+  VMDThreadLoop loop;
+  uint32_t threads = (uint32_t)(uintptr_t)ctx;
+
+  loop.task = task;
+  loop.arg = arg;
+  loop.num = num;
+  loop.next = 0;
+  __VMDMutexInit(&loop.lock);
+  if ( __VMDRunWorkers(threads < num ? threads : num, __VMDThreadLoopWorker,
+                       &loop) == false ) {
+    __VMDThreadLoopWorker(&loop);
+  }
+  __VMDMutexDestroy(&loop.lock);
+}
+
+/**
+ * @brief Executor running loops on threads started for each loop
+ *  A caller with a thread pool should wrap the pool in VMDExecutor
+ *  instead, this one is for callers having none.
+ * @param (threads) number of threads including the calling thread
+ * @return executor, valid without being released
+ */
+VMDExecutor VMDThreadExecutor(uint32_t threads){
+  VMDExecutor exec;
+
+  if ( threads == 0 ) threads = 1;
+  if ( threads > VMDLIB_MAX_THREADS ) threads = VMDLIB_MAX_THREADS;
+  exec.parallel_for = __VMDThreadParallelFor;
+  exec.ctx = (void*)(uintptr_t)threads;
+  exec.concurrency = threads;
+  return exec;
+}
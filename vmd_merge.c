@@ -0,0 +1,484 @@
+/**
+ *  @file vmd_merge.c
+ *  @brief Merge of several VMD files into one
+ *  @author ihm4
+ *  @note
+ *    Each section of the inputs is walked in frame order and merged by a
+ *    k-way merge on a binary heap, so n frames of k files are merged in
+ *    O(n log k) without sorting the whole concatenation. Sections already
+ *    sorted are walked in place, others are ordered by a radix sort of
+ *    their positions first, the inputs themselves are never modified.
+ *
+ *    Frames of the same frame number are ordered by input, then by their
+ *    order in the input. Where the policy drops conflicting keys, bone and
+ *    morph frames conflict when they have the same name, other frames
+ *    conflict with any frame of the same number.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmd.h"
+
+// Marks a pick dropped by the conflict policy
+#define VMDLIB_MERGE_DROPPED (UINT64_MAX)
+
+// Section of an input file
+typedef struct {
+  const char*     frames;   // head of the frames
+  uint32_t        num;      // number of frames
+  uint32_t*       order;    // positions in frame order, NULL if sorted
+  uint32_t*       name_ids; // name id of each frame, or NULL
+  size_t          key;      // offset of the frame number in a frame
+  uint32_t        offset;   // added to frame numbers
+  uint32_t        cursor;   // next frame in frame order
+} VMDMergeInput;
+
+/**
+ * @brief Frame number of the next frame of an input
+ *  Internally called function
+ * @param (in) input
+ * @param (size) size of a frame
+ * @return shifted frame number
+ */
+static uint32_t __VMDMergeKey(const VMDMergeInput* in, size_t size){
+  uint32_t pos = in->order == NULL ? in->cursor : in->order[in->cursor];
+  uint32_t frame;
+
+  memcpy(&frame, in->frames + size * pos + in->key, sizeof(uint32_t));
+  return frame + in->offset;
+}
+
+/**
+ * @brief Restore heap order downward from a node
+ *  Internally called function
+ * @param (heap) keys, frame number in the upper 32 bits and input below
+ * @param (num) number of nodes
+ * @param (i) node
+ * @return void
+ */
+static void __VMDMergeSiftDown(uint64_t* heap, uint32_t num, uint32_t i){
+  uint64_t v = heap[i];
+  uint32_t c;
+
+  while ( (c = i * 2 + 1) < num ) {
+    if ( c + 1 < num && heap[c + 1] < heap[c] ) c++;
+    if ( v <= heap[c] ) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = v;
+}
+
+/**
+ * @brief Drop conflicting picks of one frame number
+ *  Internally called function
+ * @param (inputs) inputs
+ * @param (picks) picks of the frame number, input in upper 32 bits and
+ *        position below
+ * @param (num) number of picks
+ * @param (policy) VMDL_MERGE_FIRST or VMDL_MERGE_LAST
+ * @param (stamps) stamp of the frame number each name was last kept at
+ * @param (stamp) stamp of this frame number, never used before
+ * @return number of picks kept, moved to the head of `picks`
+ */
+static uint32_t __VMDMergeConflicts(const VMDMergeInput* inputs,
+                                    uint64_t* picks, uint32_t num,
+                                    VMDMergePolicy policy, uint32_t* stamps,
+                                    uint32_t stamp){
+  const VMDMergeInput* in;
+  uint32_t k, id, kept = 0;
+
+  for ( uint32_t i = 0; i < num; i++ ) {
+    k = policy == VMDL_MERGE_FIRST ? i : num - 1 - i;
+    in = &inputs[picks[k] >> 32];
+    id = in->name_ids == NULL ? 0 : in->name_ids[(uint32_t)picks[k]];
+    if ( stamps[id] == stamp ) {
+      picks[k] = VMDLIB_MERGE_DROPPED;
+    } else {
+      stamps[id] = stamp;
+    }
+  }
+  for ( uint32_t i = 0; i < num; i++ ) {
+    if ( picks[i] != VMDLIB_MERGE_DROPPED ) picks[kept++] = picks[i];
+  }
+  return kept;
+}
+
+/**
+ * @brief Merge a section of inputs
+ *  Internally called function
+ * @param (inputs) inputs, cursors are moved to the end
+ * @param (n) number of inputs
+ * @param (size) size of a frame
+ * @param (policy) conflict policy
+ * @param (stamps) stamp of each name id, see __VMDMergeConflicts()
+ * @param (stamp) [in,out] last stamp used
+ * @param (heap) work area of `n` elements
+ * @param (picks) [out] input in upper 32 bits and position below of each
+ *        frame of the output, room for all frames of inputs
+ * @return number of picks
+ */
+static uint32_t __VMDMergeSection(VMDMergeInput* inputs, uint32_t n,
+                                  size_t size, VMDMergePolicy policy,
+                                  uint32_t* stamps, uint32_t* stamp,
+                                  uint64_t* heap, uint64_t* picks){
+  uint32_t num_heap = 0, num_picks = 0, block = 0, block_frame = 0;
+  uint32_t frame, pos;
+  VMDMergeInput* in;
+
+  for ( uint32_t i = 0; i < n; i++ ) {
+    inputs[i].cursor = 0;
+    if ( inputs[i].num == 0 ) continue;
+    heap[num_heap++] = (uint64_t)__VMDMergeKey(&inputs[i], size) << 32 | i;
+  }
+  for ( uint32_t i = num_heap / 2; i-- > 0; ) {
+    __VMDMergeSiftDown(heap, num_heap, i);
+  }
+
+  while ( num_heap > 0 ) {
+    in = &inputs[(uint32_t)heap[0]];
+    frame = (uint32_t)(heap[0] >> 32);
+    if ( policy != VMDL_MERGE_KEEP_ALL && frame != block_frame ) {
+      // all picks of the previous frame number are known
+      num_picks = block + __VMDMergeConflicts(inputs, picks + block,
+                                              num_picks - block, policy,
+                                              stamps, ++*stamp);
+      block = num_picks;
+      block_frame = frame;
+    }
+    pos = in->order == NULL ? in->cursor : in->order[in->cursor];
+    picks[num_picks++] = (uint64_t)(uint32_t)heap[0] << 32 | pos;
+    if ( ++in->cursor < in->num ) {
+      heap[0] = (uint64_t)__VMDMergeKey(in, size) << 32 | (uint32_t)heap[0];
+    } else {
+      heap[0] = heap[--num_heap];
+    }
+    if ( num_heap > 0 ) __VMDMergeSiftDown(heap, num_heap, 0);
+  }
+  if ( policy != VMDL_MERGE_KEEP_ALL ) {
+    num_picks = block + __VMDMergeConflicts(inputs, picks + block,
+                                            num_picks - block, policy,
+                                            stamps, ++*stamp);
+  }
+  return num_picks;
+}
+
+/**
+ * @brief Set up a section of an input
+ *  Internally called function. Checks that shifted frame numbers fit, and
+ *  orders positions of frames if the section is not sorted.
+ * @param (in) [out] input
+ * @param (frames) head of the frames
+ * @param (num) number of frames
+ * @param (size) size of a frame
+ * @param (key) offset of the frame number in a frame
+ * @param (offset) added to frame numbers
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDMergeInputInit(VMDMergeInput* in, const void* frames,
+                                uint32_t num, size_t size, size_t key,
+                                uint32_t offset){
+  uint32_t frame, prev = 0;
+  bool sorted = true;
+  uint64_t* pairs;
+
+  in->frames = frames;
+  in->num = num;
+  in->key = key;
+  in->offset = offset;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    memcpy(&frame, in->frames + size * i + key, sizeof(uint32_t));
+    if ( frame > UINT32_MAX - offset ) {
+      DEBUG_PRINT("Shifted frame number overflows\n");
+      VMD_ERROR = VMDLIB_E_IV;
+      return false;
+    }
+    if ( frame < prev ) sorted = false;
+    prev = frame;
+  }
+  if ( sorted ) return true;
+
+  pairs = malloc(sizeof(uint64_t) * num);
+  in->order = malloc(sizeof(uint32_t) * num);
+  if ( pairs == NULL || in->order == NULL ) goto error;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    memcpy(&frame, in->frames + size * i + key, sizeof(uint32_t));
+    pairs[i] = (uint64_t)frame << 32 | i;
+  }
+  if ( __VMDSortPairs(pairs, num) == false ) goto error;
+  for ( uint32_t i = 0; i < num; i++ ) in->order[i] = (uint32_t)pairs[i];
+  free(pairs);
+  return true;
+
+ error:
+  free(pairs);
+  VMD_ERROR = VMDLIB_E_ME;
+  return false;
+}
+
+/**
+ * @brief Name ids of bone or morph frames of an input
+ *  Internally called function
+ * @param (in) [in,out] input
+ * @param (names) name table shared by inputs
+ * @param (size) size of a frame
+ * @param (name_offset) offset of the name field in a frame
+ * @return bool : false with VMD_ERROR set on failure
+ */
+static bool __VMDMergeNameIds(VMDMergeInput* in, VMDNameTable* names,
+                              size_t size, size_t name_offset){
+  in->name_ids = malloc(sizeof(uint32_t) * in->num + 1);
+  if ( in->name_ids == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+  for ( uint32_t i = 0; i < in->num; i++ ) {
+    in->name_ids[i] = VMDInternName(names, in->frames + size * i
+                                    + name_offset, VMDLIB_NAME_SIZE);
+    if ( in->name_ids[i] == VMDLIB_NO_NAME ) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Copy picked frames, shifting their frame numbers
+ *  Internally called function
+ * @param (inputs) inputs
+ * @param (picks) picks of __VMDMergeSection()
+ * @param (num) number of picks
+ * @param (size) size of a frame
+ * @return frames, or NULL if memory is insufficient
+ */
+static void* __VMDMergeGather(const VMDMergeInput* inputs,
+                              const uint64_t* picks, uint32_t num,
+                              size_t size){
+  char* out;
+  const VMDMergeInput* in;
+  uint32_t frame;
+
+  if ( num == 0 ) return NULL;
+  out = malloc(size * num);
+  if ( out == NULL ) return NULL;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    in = &inputs[picks[i] >> 32];
+    memcpy(out + size * i, in->frames + size * (uint32_t)picks[i], size);
+    memcpy(&frame, out + size * i + in->key, sizeof(uint32_t));
+    frame += in->offset;
+    memcpy(out + size * i + in->key, &frame, sizeof(uint32_t));
+  }
+  return out;
+}
+
+/**
+ * @brief Copy IK entries of picked ShowIK frames into one pool
+ *  Internally called function
+ * @param (files) input files
+ * @param (picks) picks of ShowIK frames
+ * @param (frames) [in,out] picked frames, offsets are rewritten
+ * @param (num) number of picks
+ * @param (pool) [out] pool of entries, NULL if there is none
+ * @param (num_ik) [out] number of entries
+ * @return bool : false if memory is insufficient
+ */
+static bool __VMDMergeIKPool(VMDFile* const* files, const uint64_t* picks,
+                             VMDIKSingleFrame* frames, uint32_t num,
+                             VMDInfoIK** pool, uint32_t* num_ik){
+  const VMDIKFrames* ik;
+  uint64_t total = 0;
+  uint32_t n = 0;
+
+  *pool = NULL;
+  *num_ik = 0;
+  for ( uint32_t i = 0; i < num; i++ ) total += frames[i].ik_count;
+  if ( total == 0 ) return true;
+  if ( total > UINT32_MAX ) return false;
+  *pool = malloc(sizeof(VMDInfoIK) * total);
+  if ( *pool == NULL ) return false;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    ik = &files[picks[i] >> 32]->ik_frames;
+    memcpy(*pool + n, ik->ik + frames[i].ik_offset,
+           sizeof(VMDInfoIK) * frames[i].ik_count);
+    frames[i].ik_offset = n;
+    n += frames[i].ik_count;
+  }
+  *num_ik = n;
+  return true;
+}
+
+/**
+ * @note Release returned pointer by VMDReleaseVMDFile()
+ * @brief Merge VMD files into a new one
+ *  Frames of `files[i]` are shifted by `offsets[i]` frames and merged
+ *  section by section in frame order. Each section of the output is
+ *  allocated once with its exact size. Inputs are not modified and can be
+ *  released afterwards. The header is taken from the first file.
+ * @param (files) input files
+ * @param (n) number of input files
+ * @param (offsets) frames added to frame numbers of each file, or NULL
+ * @param (policy) what to do with keys of the same bone (or morph, or
+ *        camera, and so on) at the same frame
+ * @return pointer of VMDFile, or NULL with VMD_ERROR set
+ */
+VMDFile* VMDMerge(VMDFile* const* files, uint32_t n, const uint32_t* offsets,
+                  VMDMergePolicy policy){
+  static const size_t sizes[VMDL_IK + 1] = {
+    sizeof(VMDBoneSingleFrame), sizeof(VMDMorphSingleFrame),
+    sizeof(VMDCameraSingleFrame), sizeof(VMDLightSingleFrame),
+    sizeof(VMDShadowSingleFrame), sizeof(VMDIKSingleFrame)
+  };
+  static const size_t keys[VMDL_IK + 1] = {
+    offsetof(VMDBoneSingleFrame, frame), offsetof(VMDMorphSingleFrame, frame),
+    offsetof(VMDCameraSingleFrame, frame), offsetof(VMDLightSingleFrame, frame),
+    offsetof(VMDShadowSingleFrame, frame), offsetof(VMDIKSingleFrame, frame)
+  };
+  VMDMergeInput* inputs = NULL;
+  VMDNameTable* names = NULL;
+  VMDFile* out = NULL;
+  uint64_t* heap = NULL;
+  uint64_t* picks = NULL;
+  uint32_t* stamps = NULL;
+  uint32_t* grown;
+  uint32_t num_stamps = 0, stamp = 0, num_picks, num_ik = 0;
+  uint64_t total, max_total = 0;
+  void* frames[VMDL_IK + 1] = { NULL };
+  uint32_t num_frames[VMDL_IK + 1] = { 0 };
+  const void* section;
+  VMDInfoIK* pool = NULL;
+  bool ok = false;
+
+  if ( files == NULL || n == 0 || policy < VMDL_MERGE_KEEP_ALL
+       || policy > VMDL_MERGE_LAST ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  for ( uint32_t i = 0; i < n; i++ ) {
+    if ( files[i] == NULL ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return NULL;
+    }
+    if ( VMDLoadSections(files[i], VMDLIB_SECTION_ALL) == false ) return NULL;
+  }
+  for ( int type = VMDL_BONE; type <= VMDL_IK; type++ ) {
+    total = 0;
+    for ( uint32_t i = 0; i < n; i++ ) {
+      total += VMDGetNumFrames(files[i], (VMDStructType)type);
+    }
+    if ( total > UINT32_MAX ) {
+      VMD_ERROR = VMDLIB_E_IV;
+      return NULL;
+    }
+    if ( total > max_total ) max_total = total;
+  }
+
+  inputs = calloc(n, sizeof(VMDMergeInput));
+  heap = malloc(sizeof(uint64_t) * n);
+  picks = malloc(sizeof(uint64_t) * max_total + 1);
+  if ( inputs == NULL || heap == NULL || picks == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    goto done;
+  }
+  if ( policy != VMDL_MERGE_KEEP_ALL ) {
+    names = VMDCreateNameTable();
+    if ( names == NULL ) goto done;
+  }
+
+  for ( int type = VMDL_BONE; type <= VMDL_IK; type++ ) {
+    for ( uint32_t i = 0; i < n; i++ ) {
+      VMDFile* vf = files[i];
+      switch ( type ) {
+        case VMDL_BONE: section = vf->bone_frames.frames; break;
+        case VMDL_MORPH: section = vf->morph_frames.frames; break;
+        case VMDL_CAMERA: section = vf->camera_frames.frames; break;
+        case VMDL_LIGHT: section = vf->light_frames.frames; break;
+        case VMDL_SHADOW: section = vf->shadow_frames.frames; break;
+        default: section = vf->ik_frames.frames; break;
+      }
+      if ( __VMDMergeInputInit(&inputs[i], section,
+                               VMDGetNumFrames(vf, (VMDStructType)type),
+                               sizes[type], keys[type],
+                               offsets == NULL ? 0 : offsets[i])
+           == false ) {
+        goto done;
+      }
+      // name is at the same place of bone and morph frames
+      if ( names != NULL && type <= VMDL_MORPH
+           && __VMDMergeNameIds(&inputs[i], names, sizes[type],
+                                offsetof(VMDBoneSingleFrame, name))
+              == false ) {
+        goto done;
+      }
+    }
+    if ( names != NULL && VMDGetNumNames(names) + 1 > num_stamps ) {
+      // new names of this section get a stamp never used
+      grown = realloc(stamps, sizeof(uint32_t) * (VMDGetNumNames(names) + 1));
+      if ( grown == NULL ) {
+        VMD_ERROR = VMDLIB_E_ME;
+        goto done;
+      }
+      stamps = grown;
+      memset(stamps + num_stamps, 0,
+             sizeof(uint32_t) * (VMDGetNumNames(names) + 1 - num_stamps));
+      num_stamps = VMDGetNumNames(names) + 1;
+    }
+    num_picks = __VMDMergeSection(inputs, n, sizes[type], policy, stamps,
+                                  &stamp, heap, picks);
+    frames[type] = __VMDMergeGather(inputs, picks, num_picks, sizes[type]);
+    num_frames[type] = num_picks;
+    if ( num_picks > 0 && frames[type] == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      goto done;
+    }
+    if ( type == VMDL_IK
+         && __VMDMergeIKPool(files, picks, frames[type], num_picks, &pool,
+                             &num_ik) == false ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      goto done;
+    }
+    for ( uint32_t i = 0; i < n; i++ ) {
+      free(inputs[i].order);
+      free(inputs[i].name_ids);
+      inputs[i].order = NULL;
+      inputs[i].name_ids = NULL;
+    }
+  }
+
+  out = VMDCreateVMDFile(NULL);
+  if ( out == NULL ) goto done;
+  out->header = files[0]->header;
+  out->bone_frames.num_frames = num_frames[VMDL_BONE];
+  out->bone_frames.frames = frames[VMDL_BONE];
+  out->morph_frames.num_frames = num_frames[VMDL_MORPH];
+  out->morph_frames.frames = frames[VMDL_MORPH];
+  out->camera_frames.num_frames = num_frames[VMDL_CAMERA];
+  out->camera_frames.frames = frames[VMDL_CAMERA];
+  out->light_frames.num_frames = num_frames[VMDL_LIGHT];
+  out->light_frames.frames = frames[VMDL_LIGHT];
+  out->shadow_frames.num_frames = num_frames[VMDL_SHADOW];
+  out->shadow_frames.frames = frames[VMDL_SHADOW];
+  out->ik_frames.num_frames = num_frames[VMDL_IK];
+  out->ik_frames.frames = frames[VMDL_IK];
+  out->ik_frames.num_ik = num_ik;
+  out->ik_frames.ik = pool;
+  ok = true;
+
+ done:
+  if ( inputs != NULL ) {
+    for ( uint32_t i = 0; i < n; i++ ) {
+      free(inputs[i].order);
+      free(inputs[i].name_ids);
+    }
+  }
+  if ( ok == false ) {
+    for ( int type = VMDL_BONE; type <= VMDL_IK; type++ ) free(frames[type]);
+    free(pool);
+  }
+  VMDReleaseNameTable(names);
+  free(inputs);
+  free(heap);
+  free(picks);
+  free(stamps);
+  return out;
+}
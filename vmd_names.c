@@ -0,0 +1,567 @@
+/**
+ *  @file vmd_names.c
+ *  @brief Interned names of bones, morphs and IKs
+ *  @author ihm4
+ *  @note
+ *    Each distinct name is stored once with its hash and UTF-8 form, and
+ *    frames refer to it by id. A table can be shared by many files
+ *    (VMDUseNameTable()), then the same name has the same id in all of
+ *    them. Tables are not thread safe, files sharing a table must not be
+ *    indexed concurrently.
+ *
+ *    Names are converted by iconv(3) from CP932 (or SHIFT_JIS where CP932
+ *    is not known), or by MultiByteToWideChar() on Windows. Define
+ *    VMDLIB_NO_ICONV where iconv is not available, then only ASCII is
+ *    converted and other characters become '?'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include "vmd.h"
+#ifdef _WIN32
+#include <windows.h>
+#elif !defined(VMDLIB_NO_ICONV)
+#include <iconv.h>
+#endif
+
+// Largest UTF-8 form of a name, 3 bytes for each byte of half-width kana
+#define VMDLIB_UTF8_NAME_SIZE (VMDLIB_IK_NAME_SIZE * 3 + 1)
+
+typedef struct {
+  char     sjis[VMDLIB_IK_NAME_SIZE + 1];
+  char     utf8[VMDLIB_UTF8_NAME_SIZE];
+  uint32_t len;  // length of `sjis`
+  uint32_t hash; // __VMDHashName() of `sjis`
+} VMDName;
+
+struct VMDNameTable {
+  uint32_t  num_names;
+  uint32_t  cap;       // allocated names
+  VMDName*  names;
+  uint32_t  hash_size; // number of slots in `hash`, power of 2
+  uint32_t* hash;      // name id + 1 for each slot, 0 for empty slot
+  void*     cd;        // iconv descriptor or NULL
+  bool      cd_tried;  // iconv_open() has been called
+  bool      mapped;    // `names` and `hash` point into a cache file
+};
+
+/**
+ * @brief Hash of a name stored in a fixed size field
+ *  Internally called function. FNV-1a over the bytes up to the first NUL,
+ *  bytes after NUL (often garbage in files from MMD) are ignored.
+ * @param (name) name field
+ * @param (len) length of the name up to NUL
+ * @return 32 bit hash
+ */
+uint32_t __VMDHashName(const char* name, size_t len){
+  uint32_t h = 2166136261u;
+  for ( size_t i = 0; i < len; i++ ) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @brief Length of a name stored in a fixed size field
+ *  Internally called function
+ * @param (name) name field
+ * @param (size) size of the field
+ * @return length up to NUL or `size`
+ */
+size_t __VMDNameLength(const char* name, size_t size){
+  const char* end = memchr(name, '\0', size);
+  return end == NULL ? size : (size_t)(end - name);
+}
+
+/**
+ * @brief Create empty name table
+ * @return name table, released by VMDReleaseNameTable(), or NULL
+ */
+VMDNameTable* VMDCreateNameTable(void){
+  VMDNameTable* table = calloc(1, sizeof(VMDNameTable));
+
+  if ( table == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  table->cap = 64;
+  table->hash_size = 128;
+  table->names = malloc(sizeof(VMDName) * table->cap);
+  table->hash = calloc(table->hash_size, sizeof(uint32_t));
+  if ( table->names == NULL || table->hash == NULL ) {
+    free(table->names);
+    free(table->hash);
+    free(table);
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  return table;
+}
+
+/**
+ * @brief Release name table
+ * @param (table) name table or NULL
+ * @return void
+ */
+void VMDReleaseNameTable(VMDNameTable* table){
+  if ( table == NULL ) return;
+#if !defined(_WIN32) && !defined(VMDLIB_NO_ICONV)
+  if ( table->cd != NULL ) iconv_close((iconv_t)table->cd);
+#endif
+  if ( table->mapped == false ) {
+    free(table->names);
+    free(table->hash);
+  }
+  free(table);
+}
+
+/**
+ * @brief Name table on arrays of a cache file
+ *  Internally called function, see VMDOpenCache(). The arrays are copied
+ *  when a new name is added, and must outlive the table otherwise.
+ * @param (names) names of the table
+ * @param (num_names) number of names
+ * @param (size) size of a name in the cache file
+ * @param (hash) hash table of the names
+ * @param (hash_size) number of slots in `hash`
+ * @return name table, or NULL with VMD_ERROR set
+ */
+VMDNameTable* __VMDMapNameTable(const void* names, uint32_t num_names,
+                                size_t size, const uint32_t* hash,
+                                uint32_t hash_size){
+  const VMDName* n = names;
+  VMDNameTable* table;
+
+  // the slots must be a power of 2 larger than the names, so that every
+  // probe ends at an empty slot
+  if ( size != sizeof(VMDName) || hash_size <= num_names
+       || (hash_size & (hash_size - 1)) != 0 ) {
+    VMD_ERROR = VMDLIB_E_FT;
+    return NULL;
+  }
+  // names are used as strings, so both forms must end within their arrays
+  for ( uint32_t i = 0; i < num_names; i++ ) {
+    if ( n[i].len > VMDLIB_IK_NAME_SIZE || n[i].sjis[n[i].len] != '\0'
+         || memchr(n[i].utf8, '\0', VMDLIB_UTF8_NAME_SIZE) == NULL ) {
+      VMD_ERROR = VMDLIB_E_FT;
+      return NULL;
+    }
+  }
+  for ( uint32_t i = 0; i < hash_size; i++ ) {
+    if ( hash[i] > num_names ) {
+      VMD_ERROR = VMDLIB_E_FT;
+      return NULL;
+    }
+  }
+  table = calloc(1, sizeof(VMDNameTable));
+  if ( table == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  table->num_names = num_names;
+  table->cap = num_names;
+  table->names = (VMDName*)n;
+  table->hash_size = hash_size;
+  table->hash = (uint32_t*)hash;
+  table->mapped = true;
+  return table;
+}
+
+/**
+ * @brief Arrays of name table written to a cache file
+ *  Internally called function, see VMDExportCache()
+ * @param (table) name table
+ * @param (size) [out] size of a name
+ * @param (hash) [out] hash table of the names
+ * @param (hash_size) [out] number of slots in `hash`
+ * @return names of the table
+ */
+const void* __VMDNameTableArrays(const VMDNameTable* table, size_t* size,
+                                 const uint32_t** hash, uint32_t* hash_size){
+  *size = sizeof(VMDName);
+  *hash = table->hash;
+  *hash_size = table->hash_size;
+  return table->names;
+}
+
+/**
+ * @brief Copy arrays of a table mapped from a cache file
+ *  Internally called function
+ * @param (table) name table
+ * @return boolean : false if memory is insufficient
+ */
+static bool __VMDCopyMappedNames(VMDNameTable* table){
+  uint32_t cap = table->num_names < 32 ? 64 : table->num_names * 2;
+  VMDName* names = malloc(sizeof(VMDName) * cap);
+  uint32_t* hash = malloc(sizeof(uint32_t) * table->hash_size);
+
+  if ( names == NULL || hash == NULL ) {
+    free(names);
+    free(hash);
+    return false;
+  }
+  memcpy(names, table->names, sizeof(VMDName) * table->num_names);
+  memcpy(hash, table->hash, sizeof(uint32_t) * table->hash_size);
+  table->names = names;
+  table->cap = cap;
+  table->hash = hash;
+  table->mapped = false;
+  return true;
+}
+
+/**
+ * @brief Convert a name to UTF-8
+ *  Internally called function. Characters which cannot be converted are
+ *  replaced by '?'.
+ * @param (table) name table, holding the converter
+ * @param (name) [in,out] name with `sjis` set
+ * @return void
+ */
+static void __VMDNameToUTF8(VMDNameTable* table, VMDName* name){
+  size_t o = 0;
+
+#ifdef _WIN32
+  wchar_t wide[VMDLIB_IK_NAME_SIZE];
+  int len;
+  (void)table;
+  len = MultiByteToWideChar(932, MB_ERR_INVALID_CHARS, name->sjis,
+                            (int)name->len, wide, VMDLIB_IK_NAME_SIZE);
+  if ( len > 0 ) {
+    len = WideCharToMultiByte(CP_UTF8, 0, wide, len, name->utf8,
+                              VMDLIB_UTF8_NAME_SIZE - 1, NULL, NULL);
+    if ( len > 0 ) {
+      name->utf8[len] = '\0';
+      return;
+    }
+  }
+#elif !defined(VMDLIB_NO_ICONV)
+  char* in = name->sjis;
+  char* out = name->utf8;
+  size_t in_left = name->len;
+  size_t out_left = VMDLIB_UTF8_NAME_SIZE - 1;
+  iconv_t cd;
+
+  if ( table->cd_tried == false ) {
+    table->cd_tried = true;
+    cd = iconv_open("UTF-8", "CP932");
+    if ( cd == (iconv_t)-1 ) cd = iconv_open("UTF-8", "SHIFT_JIS");
+    table->cd = cd == (iconv_t)-1 ? NULL : (void*)cd;
+  }
+  if ( table->cd != NULL ) {
+    cd = (iconv_t)table->cd;
+    iconv(cd, NULL, NULL, NULL, NULL);
+    if ( iconv(cd, &in, &in_left, &out, &out_left) != (size_t)-1 ) {
+      *out = '\0';
+      return;
+    }
+  }
+#else
+  (void)table;
+#endif
+
+  // ASCII only, also for broken names
+  for ( uint32_t i = 0; i < name->len; i++ ) {
+    unsigned char c = (unsigned char)name->sjis[i];
+    name->utf8[o++] = c < 0x80 ? (char)c : '?';
+  }
+  name->utf8[o] = '\0';
+}
+
+/**
+ * @brief Convert a UTF-8 name to Shift-JIS
+ *  Internally called function, the reverse of the conversion of names in
+ *  tables. Characters which cannot be converted are replaced by '?'.
+ * @param (cd) [in,out] converter, NULL on the first call, closed by
+ *             __VMDCloseConverter()
+ * @param (in) UTF-8 name
+ * @param (len) length of the name
+ * @param (out) [out] Shift-JIS name padded by NUL
+ * @param (size) size of `out`
+ * @return void
+ */
+void __VMDNameFromUTF8(void** cd, const char* in, size_t len, char* out,
+                       size_t size){
+  size_t o = 0;
+
+  memset(out, 0, size);
+#ifdef _WIN32
+  wchar_t wide[VMDLIB_UTF8_NAME_SIZE];
+  int n;
+  (void)cd;
+  n = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, in, (int)len, wide,
+                          VMDLIB_UTF8_NAME_SIZE);
+  if ( n > 0 && WideCharToMultiByte(932, 0, wide, n, out, (int)size, NULL,
+                                    NULL) > 0 ) {
+    return;
+  }
+#elif !defined(VMDLIB_NO_ICONV)
+  char* src = (char*)in;
+  char* dst = out;
+  size_t in_left = len;
+  size_t out_left = size;
+  iconv_t c;
+
+  if ( *cd == NULL ) {
+    c = iconv_open("CP932", "UTF-8");
+    if ( c == (iconv_t)-1 ) c = iconv_open("SHIFT_JIS", "UTF-8");
+    *cd = c == (iconv_t)-1 ? (void*)-1 : (void*)c;
+  }
+  if ( *cd != (void*)-1 ) {
+    c = (iconv_t)*cd;
+    iconv(c, NULL, NULL, NULL, NULL);
+    // names longer than the field are cut at a character boundary
+    if ( iconv(c, &src, &in_left, &dst, &out_left) != (size_t)-1
+         || errno == E2BIG ) {
+      return;
+    }
+    memset(out, 0, size);
+  }
+#else
+  (void)cd;
+#endif
+
+  for ( size_t i = 0; i < len && o < size; i++ ) {
+    unsigned char ch = (unsigned char)in[i];
+    if ( ch < 0x80 ) {
+      out[o++] = (char)ch;
+    } else if ( (ch & 0xc0) != 0x80 ) {
+      out[o++] = '?'; // one for each character, not for each byte
+    }
+  }
+}
+
+/**
+ * @brief Close converter of __VMDNameFromUTF8()
+ *  Internally called function
+ * @param (cd) converter or NULL
+ * @return void
+ */
+void __VMDCloseConverter(void* cd){
+#if !defined(_WIN32) && !defined(VMDLIB_NO_ICONV)
+  if ( cd != NULL && cd != (void*)-1 ) iconv_close((iconv_t)cd);
+#else
+  (void)cd;
+#endif
+}
+
+/**
+ * @brief Find slot of a name in hash table
+ *  Internally called function
+ * @param (table) name table
+ * @param (name) name
+ * @param (len) length of the name
+ * @param (hash) hash of the name
+ * @return slot holding the name or an empty slot
+ */
+static uint32_t __VMDFindNameSlot(const VMDNameTable* table, const char* name,
+                                  size_t len, uint32_t hash){
+  uint32_t mask = table->hash_size - 1;
+  uint32_t slot = hash & mask;
+  const VMDName* n;
+
+  while ( table->hash[slot] != 0 ) {
+    n = &table->names[table->hash[slot] - 1];
+    if ( n->hash == hash && n->len == len && memcmp(n->sjis, name, len) == 0 ) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/**
+ * @brief Double the hash table of names
+ *  Internally called function
+ * @param (table) name table
+ * @return boolean : false if memory is insufficient
+ */
+static bool __VMDGrowNameHash(VMDNameTable* table){
+  uint32_t size = table->hash_size * 2;
+  uint32_t* hash = calloc(size, sizeof(uint32_t));
+  uint32_t slot;
+
+  if ( hash == NULL ) return false;
+  for ( uint32_t i = 0; i < table->num_names; i++ ) {
+    slot = table->names[i].hash & (size - 1);
+    while ( hash[slot] != 0 ) slot = (slot + 1) & (size - 1);
+    hash[slot] = i + 1;
+  }
+  free(table->hash);
+  table->hash = hash;
+  table->hash_size = size;
+  return true;
+}
+
+/**
+ * @brief Id of a name, adding it to the table if it is new
+ * @param (table) name table
+ * @param (name) Shift-JIS name field, up to NUL
+ * @param (size) size of the field, at most VMDLIB_IK_NAME_SIZE
+ * @return name id, or VMDLIB_NO_NAME on failure
+ */
+uint32_t VMDInternName(VMDNameTable* table, const char* name, size_t size){
+  VMDName* n;
+  uint32_t hash, slot;
+  size_t len;
+
+  if ( table == NULL || name == NULL || size > VMDLIB_IK_NAME_SIZE ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return VMDLIB_NO_NAME;
+  }
+  len = __VMDNameLength(name, size);
+  hash = __VMDHashName(name, len);
+  slot = __VMDFindNameSlot(table, name, len, hash);
+  if ( table->hash[slot] != 0 ) return table->hash[slot] - 1;
+  if ( table->mapped && __VMDCopyMappedNames(table) == false ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return VMDLIB_NO_NAME;
+  }
+
+  if ( table->num_names == table->cap ) {
+    n = realloc(table->names, sizeof(VMDName) * table->cap * 2);
+    if ( n == NULL ) {
+      VMD_ERROR = VMDLIB_E_ME;
+      return VMDLIB_NO_NAME;
+    }
+    table->names = n;
+    table->cap *= 2;
+  }
+  n = &table->names[table->num_names];
+  memset(n->sjis, 0, sizeof(n->sjis));
+  memcpy(n->sjis, name, len);
+  n->len = (uint32_t)len;
+  n->hash = hash;
+  __VMDNameToUTF8(table, n);
+  table->hash[slot] = ++table->num_names;
+
+  // keep load factor under 1/2
+  if ( table->num_names * 2 > table->hash_size
+       && __VMDGrowNameHash(table) == false ) {
+    table->num_names--;
+    table->hash[slot] = 0;
+    VMD_ERROR = VMDLIB_E_ME;
+    return VMDLIB_NO_NAME;
+  }
+  return table->num_names - 1;
+}
+
+/**
+ * @brief Id of a name without adding it
+ * @param (table) name table
+ * @param (name) Shift-JIS name terminated by NUL
+ * @return name id, or VMDLIB_NO_NAME if the table does not have it
+ */
+uint32_t VMDFindName(const VMDNameTable* table, const char* name){
+  size_t len;
+  uint32_t slot;
+
+  if ( table == NULL || name == NULL ) return VMDLIB_NO_NAME;
+  len = __VMDNameLength(name, VMDLIB_IK_NAME_SIZE);
+  slot = __VMDFindNameSlot(table, name, len, __VMDHashName(name, len));
+  return table->hash[slot] == 0 ? VMDLIB_NO_NAME : table->hash[slot] - 1;
+}
+
+/**
+ * @brief Id of a name given in UTF-8
+ *  Compares with every name in the table, look up the id once rather than
+ *  for each frame.
+ * @param (table) name table
+ * @param (name) UTF-8 name terminated by NUL, e.g. "センター"
+ * @return name id, or VMDLIB_NO_NAME if the table does not have it
+ */
+uint32_t VMDFindNameUTF8(const VMDNameTable* table, const char* name){
+  if ( table == NULL || name == NULL ) return VMDLIB_NO_NAME;
+  for ( uint32_t i = 0; i < table->num_names; i++ ) {
+    if ( strcmp(table->names[i].utf8, name) == 0 ) return i;
+  }
+  return VMDLIB_NO_NAME;
+}
+
+/**
+ * @brief Number of names in table
+ * @param (table) name table
+ * @return number of names, ids are 0 to this - 1
+ */
+uint32_t VMDGetNumNames(const VMDNameTable* table){
+  return table == NULL ? 0 : table->num_names;
+}
+
+/**
+ * @brief Shift-JIS form of a name
+ * @param (table) name table
+ * @param (id) name id
+ * @return name terminated by NUL, or NULL for an invalid id
+ */
+const char* VMDGetNameSJIS(const VMDNameTable* table, uint32_t id){
+  if ( table == NULL || id >= table->num_names ) return NULL;
+  return table->names[id].sjis;
+}
+
+/**
+ * @brief UTF-8 form of a name
+ * @param (table) name table
+ * @param (id) name id
+ * @return name terminated by NUL, or NULL for an invalid id
+ */
+const char* VMDGetNameUTF8(const VMDNameTable* table, uint32_t id){
+  if ( table == NULL || id >= table->num_names ) return NULL;
+  return table->names[id].utf8;
+}
+
+/**
+ * @brief Hash of a name
+ * @param (table) name table
+ * @param (id) name id
+ * @return 32 bit hash of the Shift-JIS form, 0 for an invalid id
+ */
+uint32_t VMDGetNameHash(const VMDNameTable* table, uint32_t id){
+  if ( table == NULL || id >= table->num_names ) return 0;
+  return table->names[id].hash;
+}
+
+/**
+ * @brief Name table of VMDFile
+ *  The table is created on the first call if the file does not have one.
+ * @param (vf) a pointer to VMDFile
+ * @return name table, or NULL if memory is insufficient
+ */
+VMDNameTable* VMDGetNameTable(VMDFile* vf){
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return NULL;
+  }
+  if ( vf->names == NULL ) {
+    vf->names = VMDCreateNameTable();
+    vf->owns_names = vf->names != NULL;
+  }
+  return vf->names;
+}
+
+/**
+ * @brief Share a name table with other files
+ *  Names of `vf` get ids of `table`, which must outlive `vf`. The track
+ *  index is rebuilt if it has been built.
+ * @param (vf) a pointer to VMDFile
+ * @param (table) name table
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDUseNameTable(VMDFile* vf, VMDNameTable* table){
+  if ( vf == NULL || table == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( vf->names == table ) return true;
+  if ( vf->owns_names ) VMDReleaseNameTable(vf->names);
+  vf->names = table;
+  vf->owns_names = false;
+  if ( vf->index != NULL && VMDBuildTrackIndex(vf) == false ) {
+    VMDReleaseTrackIndex(vf); // ids of the index are of the old table
+    return false;
+  }
+  return true;
+}
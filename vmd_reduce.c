@@ -0,0 +1,572 @@
+/**
+ *  @file vmd_reduce.c
+ *  @brief Keyframe reduction of bone and morph tracks
+ *  @author ihm4
+ *  @note
+ *    Each track is walked from its first keyframe, and the keyframes
+ *    following the current one are dropped as long as a single curve from
+ *    the current keyframe to the next kept one reproduces the motion within
+ *    the tolerance. The motion is checked at every dropped keyframe and at a
+ *    few points between the original keyframes, evaluated with their own
+ *    curves, so curves of sparse keyframes are kept as well.
+ *
+ *    A curve of bone frame is fitted for each axis and the rotation by
+ *    least squares on the cubic Bezier of MMD, whose ends are fixed at
+ *    (0, 0) and (1, 1), alternating with reparameterization by Newton's
+ *    method. Morph frames are interpolated linearly by MMD, so only linear
+ *    segments are merged. The span of a curve grows by doubling, then is
+ *    narrowed by bisection, so a track of n keyframes needs O(log n) fits
+ *    per kept keyframe.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "vmd.h"
+
+// Points evaluated between two original keyframes at most
+#define VMDLIB_REDUCE_SUBSAMPLES (3)
+// Keyframes a single curve can span at most
+#define VMDLIB_REDUCE_MAX_SPAN (1024)
+// Rounds of least squares and reparameterization of a fit
+#define VMDLIB_REDUCE_FIT_ROUNDS (4)
+// Changes of value regarded as no change
+#define VMDLIB_REDUCE_EPS (1e-6f)
+
+// Reference motion of a bone track, sampled at keyframes and between them
+typedef struct {
+  uint32_t  num;     // number of samples
+  float*    t;       // time of each sample
+  float   (*v)[7];   // x, y, z, qx, qy, qz, qw of each sample
+  uint32_t* at_key;  // sample of each keyframe
+} VMDReduceSamples;
+
+// State of VMDReduceKeyframes() shared by tasks
+typedef struct {
+  VMDFile*                vf;
+  const VMDReduceOptions* opt;
+  uint8_t*                keep_bones;  // keyframes kept, per bone frame
+  uint8_t*                keep_morphs; // keyframes kept, per morph frame
+} VMDReduce;
+
+/**
+ * @brief Fit a curve of MMD to progress samples
+ *  Internally called function. The control points are rounded to those of
+ *  MMD (0 to 127), and the curve is checked by the same evaluation as
+ *  sampling.
+ * @param (u) time of samples, from 0 to 1
+ * @param (p) progress of samples
+ * @param (s) work area of `num` elements
+ * @param (num) number of samples
+ * @param (tol) largest error of progress allowed
+ * @param (points) [out] x1, y1, x2, y2
+ * @return bool : false if no curve is within `tol`
+ */
+static bool __VMDFitCurve(const float* u, const float* p, float* s,
+                          uint32_t num, float tol, uint8_t* points){
+  double a11, a12, a22, bx1, bx2, by1, by2, det;
+  float c[4], b1, b2, b3, x, d, err, worst;
+  int q[4];
+
+  // a straight line needs no fit
+  worst = 0.0f;
+  for ( uint32_t i = 0; i < num && worst <= tol; i++ ) {
+    err = fabsf(u[i] - p[i]);
+    if ( err > worst ) worst = err;
+  }
+  if ( worst <= tol ) {
+    points[0] = points[1] = 20;
+    points[2] = points[3] = 107;
+    return true;
+  }
+
+  for ( uint32_t i = 0; i < num; i++ ) s[i] = u[i];
+  c[0] = c[1] = 1.0f / 3.0f;
+  c[2] = c[3] = 2.0f / 3.0f;
+  for ( int round = 0; round < VMDLIB_REDUCE_FIT_ROUNDS; round++ ) {
+    // B(s) = b1 * P1 + b2 * P2 + s^3 is linear in P1 and P2 for fixed s
+    a11 = a12 = a22 = bx1 = bx2 = by1 = by2 = 0.0;
+    for ( uint32_t i = 0; i < num; i++ ) {
+      b1 = 3.0f * (1.0f - s[i]) * (1.0f - s[i]) * s[i];
+      b2 = 3.0f * (1.0f - s[i]) * s[i] * s[i];
+      b3 = s[i] * s[i] * s[i];
+      a11 += b1 * b1;
+      a12 += b1 * b2;
+      a22 += b2 * b2;
+      bx1 += b1 * (u[i] - b3);
+      bx2 += b2 * (u[i] - b3);
+      by1 += b1 * (p[i] - b3);
+      by2 += b2 * (p[i] - b3);
+    }
+    det = a11 * a22 - a12 * a12;
+    if ( fabs(det) < 1e-12 ) break;
+    c[0] = (float)((bx1 * a22 - bx2 * a12) / det); // x1
+    c[2] = (float)((a11 * bx2 - a12 * bx1) / det); // x2
+    c[1] = (float)((by1 * a22 - by2 * a12) / det); // y1
+    c[3] = (float)((a11 * by2 - a12 * by1) / det); // y2
+    for ( int i = 0; i < 4; i++ ) {
+      c[i] = c[i] < 0.0f ? 0.0f : c[i] > 1.0f ? 1.0f : c[i];
+    }
+    // find s giving the time of each sample on the new curve
+    for ( uint32_t i = 0; i < num; i++ ) {
+      for ( int k = 0; k < 3; k++ ) {
+        b1 = 1.0f - s[i];
+        x = 3.0f * b1 * b1 * s[i] * c[0] + 3.0f * b1 * s[i] * s[i] * c[2]
+            + s[i] * s[i] * s[i];
+        d = 3.0f * b1 * b1 * c[0] + 6.0f * b1 * s[i] * (c[2] - c[0])
+            + 3.0f * s[i] * s[i] * (1.0f - c[2]);
+        if ( fabsf(d) < VMDLIB_REDUCE_EPS ) break;
+        s[i] -= (x - u[i]) / d;
+        s[i] = s[i] < 0.0f ? 0.0f : s[i] > 1.0f ? 1.0f : s[i];
+      }
+    }
+  }
+
+  // x1, y1, x2, y2 as MMD stores them
+  q[0] = (int)lrintf(c[0] * 127.0f);
+  q[1] = (int)lrintf(c[1] * 127.0f);
+  q[2] = (int)lrintf(c[2] * 127.0f);
+  q[3] = (int)lrintf(c[3] * 127.0f);
+  for ( uint32_t i = 0; i < num; i++ ) {
+    if ( fabsf(__VMDEvalBezier(u[i], q[0], q[1], q[2], q[3]) - p[i]) > tol ) {
+      return false;
+    }
+  }
+  for ( int i = 0; i < 4; i++ ) points[i] = (uint8_t)q[i];
+  return true;
+}
+
+/**
+ * @brief Angle between two quaternions
+ *  Internally called function
+ * @param (a) quaternion
+ * @param (b) quaternion
+ * @return angle of rotation from `a` to `b` in radians
+ */
+static float __VMDQuatAngle(const float* a, const float* b){
+  float dot = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+  float la = a[0]*a[0] + a[1]*a[1] + a[2]*a[2] + a[3]*a[3];
+  float lb = b[0]*b[0] + b[1]*b[1] + b[2]*b[2] + b[3]*b[3];
+
+  if ( la <= 0.0f || lb <= 0.0f ) return 0.0f;
+  dot = fabsf(dot) / sqrtf(la * lb);
+  return dot >= 1.0f ? 0.0f : 2.0f * acosf(dot);
+}
+
+/**
+ * @brief Fit curves of a span of bone track
+ *  Internally called function
+ * @param (rs) reference motion
+ * @param (a) first keyframe of the span
+ * @param (e) last keyframe of the span
+ * @param (opt) tolerances
+ * @param (work) work area of 3 * VMDLIB_REDUCE_MAX_SPAN *
+ *         (VMDLIB_REDUCE_SUBSAMPLES + 1) floats
+ * @param (points) [out] x1, y1, x2, y2 of each axis
+ * @return bool : false if the span cannot be a single curve
+ */
+static bool __VMDFitBoneSpan(const VMDReduceSamples* rs, uint32_t a,
+                             uint32_t e, const VMDReduceOptions* opt,
+                             float* work, uint8_t (*points)[4]){
+  const uint32_t first = rs->at_key[a], last = rs->at_key[e];
+  const uint32_t num = last - first - 1;
+  const float* va = rs->v[first];
+  const float* ve = rs->v[last];
+  float* u = work;
+  float* p = work + num;
+  float* s = work + num * 2;
+  float q[4], b0[4], b1[4], ea[4], dot, len, theta, range, w, err;
+
+  if ( rs->t[last] <= rs->t[first] ) return false;
+  for ( uint32_t i = 0; i < num; i++ ) {
+    if ( rs->t[first + 1 + i] <= rs->t[first + i] ) return false;
+    u[i] = (rs->t[first + 1 + i] - rs->t[first]) / (rs->t[last] - rs->t[first]);
+  }
+
+  // positions
+  for ( int axis = 0; axis < 3; axis++ ) {
+    range = ve[axis] - va[axis];
+    if ( fabsf(range) < VMDLIB_REDUCE_EPS ) {
+      for ( uint32_t i = 0; i < num; i++ ) {
+        if ( fabsf(rs->v[first + 1 + i][axis] - va[axis]) > opt->position ) {
+          return false;
+        }
+      }
+      points[axis][0] = points[axis][1] = 20;
+      points[axis][2] = points[axis][3] = 107;
+      continue;
+    }
+    for ( uint32_t i = 0; i < num; i++ ) {
+      p[i] = (rs->v[first + 1 + i][axis] - va[axis]) / range;
+    }
+    if ( __VMDFitCurve(u, p, s, num, opt->position / fabsf(range),
+                       points[axis]) == false ) {
+      return false;
+    }
+  }
+
+  // rotation, progress is the angle along the arc from `va` to `ve`
+  theta = __VMDQuatAngle(va + 3, ve + 3) * 0.5f;
+  points[3][0] = points[3][1] = 20;
+  points[3][2] = points[3][3] = 107;
+  if ( theta >= VMDLIB_REDUCE_EPS ) {
+    dot = 0.0f;
+    len = 0.0f;
+    for ( int i = 0; i < 4; i++ ) len += va[3 + i] * va[3 + i];
+    len = sqrtf(len);
+    for ( int i = 0; i < 4; i++ ) b0[i] = va[3 + i] / len;
+    for ( int i = 0; i < 4; i++ ) dot += b0[i] * ve[3 + i];
+    for ( int i = 0; i < 4; i++ ) ea[i] = dot < 0.0f ? -ve[3 + i] : ve[3 + i];
+    dot = fabsf(dot);
+    len = 0.0f;
+    for ( int i = 0; i < 4; i++ ) {
+      b1[i] = ea[i] - dot * b0[i];
+      len += b1[i] * b1[i];
+    }
+    len = sqrtf(len);
+    if ( len < VMDLIB_REDUCE_EPS ) return false;
+    for ( int i = 0; i < 4; i++ ) b1[i] /= len;
+    for ( uint32_t i = 0; i < num; i++ ) {
+      const float* v = rs->v[first + 1 + i] + 3;
+      float x0 = 0.0f, x1 = 0.0f, sign;
+      for ( int k = 0; k < 4; k++ ) x0 += b0[k] * v[k];
+      sign = x0 < 0.0f ? -1.0f : 1.0f;
+      x0 *= sign;
+      for ( int k = 0; k < 4; k++ ) x1 += b1[k] * v[k] * sign;
+      p[i] = atan2f(x1, x0) / theta;
+    }
+    // progress is checked by angle, rounded curve is checked below
+    if ( __VMDFitCurve(u, p, s, num, opt->rotation / (2.0f * theta),
+                       points[3]) == false ) {
+      return false;
+    }
+  }
+  for ( uint32_t i = 0; i < num; i++ ) {
+    w = __VMDEvalBezier(u[i], points[3][0], points[3][1], points[3][2],
+                        points[3][3]);
+    __VMDSlerp(va + 3, ve + 3, w, q);
+    err = __VMDQuatAngle(q, rs->v[first + 1 + i] + 3);
+    if ( err > opt->rotation ) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Sample reference motion of a bone track
+ *  Internally called function
+ * @param (frames) bone frames of the file
+ * @param (track) track
+ * @param (rs) [out] samples, released by caller
+ * @return bool : false if memory is insufficient
+ */
+static bool __VMDSampleBoneTrack(const VMDBoneSingleFrame* frames,
+                                 const VMDTrack* track, VMDReduceSamples* rs){
+  const VMDBoneSingleFrame* a;
+  const VMDBoneSingleFrame* b;
+  uint32_t cap, gap, n;
+  float u, qa[4], qb[4], *v;
+
+  cap = track->num_frames * (VMDLIB_REDUCE_SUBSAMPLES + 1);
+  rs->num = 0;
+  rs->t = malloc(sizeof(float) * cap);
+  rs->v = malloc(sizeof(float[7]) * cap);
+  rs->at_key = malloc(sizeof(uint32_t) * track->num_frames);
+  if ( rs->t == NULL || rs->v == NULL || rs->at_key == NULL ) return false;
+
+  for ( uint32_t k = 0; k < track->num_frames; k++ ) {
+    b = &frames[track->frames[k]];
+    if ( k > 0 ) {
+      a = &frames[track->frames[k - 1]];
+      gap = b->frame - a->frame;
+      n = gap < 1 ? 0 : gap - 1;
+      if ( n > VMDLIB_REDUCE_SUBSAMPLES ) n = VMDLIB_REDUCE_SUBSAMPLES;
+      qa[0] = a->qx; qa[1] = a->qy; qa[2] = a->qz; qa[3] = a->qw;
+      qb[0] = b->qx; qb[1] = b->qy; qb[2] = b->qz; qb[3] = b->qw;
+      for ( uint32_t j = 1; j <= n; j++ ) {
+        u = (float)j / (float)(n + 1);
+        rs->t[rs->num] = (float)a->frame + u * (float)gap;
+        v = rs->v[rs->num];
+        v[0] = a->x + (b->x - a->x) * __VMDBoneWeight(b->bezier, 0, u);
+        v[1] = a->y + (b->y - a->y) * __VMDBoneWeight(b->bezier, 1, u);
+        v[2] = a->z + (b->z - a->z) * __VMDBoneWeight(b->bezier, 2, u);
+        __VMDSlerp(qa, qb, __VMDBoneWeight(b->bezier, 3, u), v + 3);
+        rs->num++;
+      }
+    }
+    rs->at_key[k] = rs->num;
+    rs->t[rs->num] = (float)b->frame;
+    rs->v[rs->num][0] = b->x;
+    rs->v[rs->num][1] = b->y;
+    rs->v[rs->num][2] = b->z;
+    rs->v[rs->num][3] = b->qx;
+    rs->v[rs->num][4] = b->qy;
+    rs->v[rs->num][5] = b->qz;
+    rs->v[rs->num][6] = b->qw;
+    rs->num++;
+  }
+  return true;
+}
+
+/**
+ * @brief Reduce keyframes of a bone track
+ *  Internally called function. Keyframes of the track are marked in
+ *  `keep`, and the curves of kept keyframes ending a merged span are
+ *  rewritten. Leaves every keyframe if memory is insufficient.
+ * @param (red) state of the reduction
+ * @param (track) track
+ * @return void
+ */
+static void __VMDReduceBoneTrack(VMDReduce* red, const VMDTrack* track){
+  VMDBoneSingleFrame* frames = red->vf->bone_frames.frames;
+  VMDReduceSamples rs;
+  uint8_t points[4][4], best[4][4];
+  uint32_t a = 0, ok, bad, e, last = track->num_frames - 1;
+  float* work;
+
+  for ( uint32_t k = 0; k < track->num_frames; k++ ) {
+    red->keep_bones[track->frames[k]] = 1;
+  }
+  if ( track->num_frames < 3 ) return;
+  memset(&rs, 0, sizeof(VMDReduceSamples));
+  work = malloc(sizeof(float) * 3 * VMDLIB_REDUCE_MAX_SPAN
+                * (VMDLIB_REDUCE_SUBSAMPLES + 1));
+  if ( work == NULL || __VMDSampleBoneTrack(frames, track, &rs) == false ) {
+    goto done;
+  }
+
+  while ( a < last ) {
+    // a span to the next keyframe is always the original curve
+    ok = a + 1;
+    bad = 0;
+    for ( e = a + 2; e <= last && e - a <= VMDLIB_REDUCE_MAX_SPAN;
+          e = a + (e - a) * 2 ) {
+      if ( __VMDFitBoneSpan(&rs, a, e, red->opt, work, points) == false ) {
+        bad = e;
+        break;
+      }
+      ok = e;
+      memcpy(best, points, sizeof(points));
+    }
+    if ( bad == 0 ) {
+      bad = a + VMDLIB_REDUCE_MAX_SPAN + 1 < last + 1
+            ? a + VMDLIB_REDUCE_MAX_SPAN + 1 : last + 1;
+    }
+    while ( bad - ok > 1 ) {
+      e = ok + (bad - ok) / 2;
+      if ( __VMDFitBoneSpan(&rs, a, e, red->opt, work, points) ) {
+        ok = e;
+        memcpy(best, points, sizeof(points));
+      } else {
+        bad = e;
+      }
+    }
+    if ( ok > a + 1 ) {
+      for ( uint32_t k = a + 1; k < ok; k++ ) {
+        red->keep_bones[track->frames[k]] = 0;
+      }
+      __VMDEncodeBoneBezier(frames[track->frames[ok]].bezier,
+                            (const uint8_t (*)[4])best);
+    }
+    a = ok;
+  }
+
+ done:
+  free(work);
+  free(rs.t);
+  free(rs.v);
+  free(rs.at_key);
+}
+
+/**
+ * @brief Check a span of morph track
+ *  Internally called function
+ * @param (frames) morph frames of the file
+ * @param (track) track
+ * @param (a) first keyframe of the span
+ * @param (e) last keyframe of the span
+ * @param (tol) largest error allowed
+ * @return bool : false if the span cannot be a straight line
+ */
+static bool __VMDFitMorphSpan(const VMDMorphSingleFrame* frames,
+                              const VMDTrack* track, uint32_t a, uint32_t e,
+                              float tol){
+  const VMDMorphSingleFrame* fa = &frames[track->frames[a]];
+  const VMDMorphSingleFrame* fe = &frames[track->frames[e]];
+  const VMDMorphSingleFrame* f;
+  float u;
+
+  if ( fe->frame <= fa->frame ) return false;
+  for ( uint32_t k = a + 1; k < e; k++ ) {
+    f = &frames[track->frames[k]];
+    if ( f->frame <= frames[track->frames[k - 1]].frame ) return false;
+    u = (float)(f->frame - fa->frame) / (float)(fe->frame - fa->frame);
+    if ( fabsf(fa->value + (fe->value - fa->value) * u - f->value) > tol ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Reduce keyframes of a morph track
+ *  Internally called function
+ * @param (red) state of the reduction
+ * @param (track) track
+ * @return void
+ */
+static void __VMDReduceMorphTrack(VMDReduce* red, const VMDTrack* track){
+  const VMDMorphSingleFrame* frames = red->vf->morph_frames.frames;
+  uint32_t a = 0, ok, bad, e, last = track->num_frames - 1;
+
+  for ( uint32_t k = 0; k < track->num_frames; k++ ) {
+    red->keep_morphs[track->frames[k]] = 1;
+  }
+  while ( track->num_frames >= 3 && a < last ) {
+    ok = a + 1;
+    bad = 0;
+    for ( e = a + 2; e <= last && e - a <= VMDLIB_REDUCE_MAX_SPAN;
+          e = a + (e - a) * 2 ) {
+      if ( __VMDFitMorphSpan(frames, track, a, e, red->opt->morph) == false ) {
+        bad = e;
+        break;
+      }
+      ok = e;
+    }
+    if ( bad == 0 ) {
+      bad = a + VMDLIB_REDUCE_MAX_SPAN + 1 < last + 1
+            ? a + VMDLIB_REDUCE_MAX_SPAN + 1 : last + 1;
+    }
+    while ( bad - ok > 1 ) {
+      e = ok + (bad - ok) / 2;
+      if ( __VMDFitMorphSpan(frames, track, a, e, red->opt->morph) ) {
+        ok = e;
+      } else {
+        bad = e;
+      }
+    }
+    for ( uint32_t k = a + 1; k < ok; k++ ) {
+      red->keep_morphs[track->frames[k]] = 0;
+    }
+    a = ok;
+  }
+}
+
+/**
+ * @brief Reduce keyframes of a track, a task of VMDExecutor
+ *  Internally called function. Bone tracks come first, then morph tracks.
+ * @param (arg) state of the reduction
+ * @param (index) index of the track
+ * @return void
+ */
+static void __VMDReduceTask(void* arg, uint32_t index){
+  VMDReduce* red = arg;
+  const VMDTrackIndex* ti = red->vf->index;
+
+  if ( index < ti->bones.num_tracks ) {
+    __VMDReduceBoneTrack(red, &ti->bones.tracks[index]);
+  } else {
+    __VMDReduceMorphTrack(red, &ti->morphs.tracks[index
+                                                  - ti->bones.num_tracks]);
+  }
+}
+
+/**
+ * @brief Drop frames not kept, keeping the order of the others
+ *  Internally called function
+ * @param (frames) frames
+ * @param (num) number of frames
+ * @param (size) size of a frame
+ * @param (keep) flag of each frame
+ * @return number of frames kept
+ */
+static uint32_t __VMDCompactFrames(char* frames, uint32_t num, size_t size,
+                                   const uint8_t* keep){
+  uint32_t n = 0;
+
+  for ( uint32_t i = 0; i < num; i++ ) {
+    if ( keep[i] == 0 ) continue;
+    if ( n != i ) memcpy(frames + size * n, frames + size * i, size);
+    n++;
+  }
+  return n;
+}
+
+/**
+ * @brief Drop keyframes which curves can reproduce
+ *  Bone and morph tracks are reduced independently, in parallel on
+ *  `opt->exec` if given. Kept keyframes keep their order in the sections,
+ *  and interpolation parameters of bone frames ending a merged span are
+ *  replaced by the fitted curves. The positions, rotations and weights
+ *  sampled at the original keyframes and at the points checked between
+ *  them stay within the tolerances of `opt`. The first and the last
+ *  keyframes of each track are always kept.
+ * @param (vf) a pointer to VMDFile, frames must be writable
+ * @param (opt) tolerances and executor
+ * @return bool : false with VMD_ERROR set on failure
+ */
+bool VMDReduceKeyframes(VMDFile* vf, const VMDReduceOptions* opt){
+  VMDReduce red;
+  VMDTrackIndex* index;
+  uint32_t num_tracks, num_bones, num_morphs;
+  bool had_index;
+
+  if ( vf == NULL || opt == NULL || opt->position < 0.0f
+       || opt->rotation < 0.0f || opt->morph < 0.0f ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( vf->storage == VMDL_STORAGE_MMAP
+       && (vf->map_flags & VMDLIB_MAP_COW) == 0 ) {
+    DEBUG_PRINT("Frames mapped read-only cannot be reduced\n");
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  had_index = vf->index != NULL;
+  if ( had_index == false && VMDBuildTrackIndex(vf) == false ) return false;
+  index = vf->index;
+
+  red.vf = vf;
+  red.opt = opt;
+  red.keep_bones = malloc(vf->bone_frames.num_frames + 1);
+  red.keep_morphs = malloc(vf->morph_frames.num_frames + 1);
+  if ( red.keep_bones == NULL || red.keep_morphs == NULL ) {
+    free(red.keep_bones);
+    free(red.keep_morphs);
+    if ( had_index == false ) VMDReleaseTrackIndex(vf);
+    VMD_ERROR = VMDLIB_E_ME;
+    return false;
+  }
+
+  num_tracks = index->bones.num_tracks + index->morphs.num_tracks;
+  if ( opt->exec != NULL && opt->exec->parallel_for != NULL ) {
+    opt->exec->parallel_for(opt->exec->ctx, num_tracks, __VMDReduceTask, &red);
+  } else {
+    for ( uint32_t i = 0; i < num_tracks; i++ ) __VMDReduceTask(&red, i);
+  }
+
+  num_bones = vf->bone_frames.num_frames;
+  num_morphs = vf->morph_frames.num_frames;
+  vf->bone_frames.num_frames =
+    __VMDCompactFrames((char*)vf->bone_frames.frames,
+                       vf->bone_frames.num_frames,
+                       sizeof(VMDBoneSingleFrame), red.keep_bones);
+  vf->morph_frames.num_frames =
+    __VMDCompactFrames((char*)vf->morph_frames.frames,
+                       vf->morph_frames.num_frames,
+                       sizeof(VMDMorphSingleFrame), red.keep_morphs);
+  free(red.keep_bones);
+  free(red.keep_morphs);
+  __VMDMarkRewritten(vf, VMDL_BONE, num_bones);
+  __VMDMarkRewritten(vf, VMDL_MORPH, num_morphs);
+
+  // positions of frames have changed
+  if ( had_index ) {
+    VMDBuildTrackIndex(vf);
+  } else {
+    VMDReleaseTrackIndex(vf);
+  }
+  if ( vf->curves != NULL ) VMDBuildCurveTable(vf);
+  return true;
+}
@@ -0,0 +1,767 @@
+/**
+ *  @file vmd_sample.c
+ *  @brief Keyframe evaluation of VMD file
+ *  @author ihm4
+ *  @note
+ *    Values between keyframes are interpolated in the same way as MMD. The
+ *    interpolation parameters of a keyframe describe the curve from the
+ *    previous keyframe to that keyframe. Before the first keyframe and after
+ *    the last one, the value of the nearest keyframe is held.
+ *
+ *    Solving a curve takes several iterations, so the curves of all
+ *    keyframes are decoded once into lookup tables (VMDBuildCurveTable()).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "vmd.h"
+
+// Newton iterations before falling back to bisection
+#define VMDLIB_BEZIER_NEWTON (8)
+#define VMDLIB_BEZIER_EPS    (1e-6f)
+
+/**
+ * @brief Evaluate interpolation curve of MMD
+ *  Internally called function. The curve is the cubic Bezier curve
+ *  (0,0),(x1,y1),(x2,y2),(127,127). The parameter of the curve at `x` is
+ *  solved by Newton's method, with bisection when it does not converge.
+ * @param (x) progress between the keyframes, 0 to 1
+ * @param (x1) control point, 0 to 127
+ * @param (y1) control point, 0 to 127
+ * @param (x2) control point, 0 to 127
+ * @param (y2) control point, 0 to 127
+ * @return interpolation weight, 0 to 1
+ */
+float __VMDEvalBezier(float x, int x1, int y1, int x2, int y2){
+  float cx, bx, ax, cy, by, ay, s, err, d, lo, hi;
+
+  if ( x <= 0.0f ) return 0.0f;
+  if ( x >= 1.0f ) return 1.0f;
+  if ( x1 == y1 && x2 == y2 ) return x; // straight line
+
+  // polynomial coefficients, B(s) = ((a*s + b)*s + c)*s
+  cx = 3.0f * x1 / 127.0f;
+  bx = 3.0f * (x2 - x1) / 127.0f - cx;
+  ax = 1.0f - cx - bx;
+  cy = 3.0f * y1 / 127.0f;
+  by = 3.0f * (y2 - y1) / 127.0f - cy;
+  ay = 1.0f - cy - by;
+
+  s = x;
+  for ( int i = 0; i < VMDLIB_BEZIER_NEWTON; i++ ) {
+    err = ((ax * s + bx) * s + cx) * s - x;
+    if ( fabsf(err) < VMDLIB_BEZIER_EPS ) {
+      return ((ay * s + by) * s + cy) * s;
+    }
+    d = (3.0f * ax * s + 2.0f * bx) * s + cx;
+    if ( fabsf(d) < VMDLIB_BEZIER_EPS ) break;
+    s -= err / d;
+  }
+
+  // x(s) is monotonic since control points are inside the unit square
+  lo = 0.0f;
+  hi = 1.0f;
+  s = x;
+  for ( int i = 0; i < 32 && hi - lo > VMDLIB_BEZIER_EPS; i++ ) {
+    err = ((ax * s + bx) * s + cx) * s - x;
+    if ( err < 0.0f ) lo = s; else hi = s;
+    s = (lo + hi) * 0.5f;
+  }
+  return ((ay * s + by) * s + cy) * s;
+}
+
+/**
+ * @brief Control point of interpolation parameters
+ *  Internally called function. Values are 0 to 127, but broken files may
+ *  contain others.
+ * @param (c) raw byte
+ * @return value clamped to 0 to 127
+ */
+int __VMDControlPoint(char c){
+  unsigned char v = (unsigned char)c;
+  return v > 127 ? 127 : v;
+}
+
+/**
+ * @brief Interpolation weight of an axis of bone frame
+ *  Internally called function
+ * @param (bezier) interpolation parameters of the bone frame
+ * @param (axis) 0:X, 1:Y, 2:Z, 3:rotation
+ * @param (x) progress between the keyframes
+ * @return interpolation weight
+ */
+float __VMDBoneWeight(const char* bezier, int axis, float x){
+  return __VMDEvalBezier(x, __VMDControlPoint(bezier[axis]),
+                         __VMDControlPoint(bezier[4 + axis]),
+                         __VMDControlPoint(bezier[8 + axis]),
+                         __VMDControlPoint(bezier[12 + axis]));
+}
+
+/**
+ * @brief Encode interpolation parameters of bone frame
+ *  Internally called function. The first row of 16 bytes holds the control
+ *  points, and each following row is the previous one shifted by a byte, as
+ *  MMD writes them.
+ * @param (bezier) [out] 64 bytes of interpolation parameters
+ * @param (points) x1, y1, x2, y2 of each axis, 0:X, 1:Y, 2:Z, 3:rotation
+ * @return void
+ */
+void __VMDEncodeBoneBezier(char* bezier, const uint8_t (*points)[4]){
+  for ( int axis = 0; axis < 4; axis++ ) {
+    for ( int i = 0; i < 4; i++ ) bezier[i * 4 + axis] = (char)points[axis][i];
+  }
+  for ( int row = 1; row < 4; row++ ) {
+    memcpy(bezier + row * 16, bezier + (row - 1) * 16 + 1, 15);
+    bezier[row * 16 + 15] = row == 1 ? 1 : 0;
+  }
+}
+
+/**
+ * @brief Interpolation weight of an axis of camera frame
+ *  Internally called function
+ * @param (bezier) interpolation parameters of the camera frame
+ * @param (axis) 0:X, 1:Y, 2:Z, 3:rotation, 4:distance, 5:view angle
+ * @param (x) progress between the keyframes
+ * @return interpolation weight
+ */
+float __VMDCameraWeight(const char* bezier, int axis, float x){
+  const char* p = bezier + axis * 4; // x1, x2, y1, y2
+  return __VMDEvalBezier(x, __VMDControlPoint(p[0]), __VMDControlPoint(p[2]),
+                         __VMDControlPoint(p[1]), __VMDControlPoint(p[3]));
+}
+
+// Largest error of the table allowed in a segment before it is solved
+#define VMDLIB_CURVE_TOLERANCE (1e-4f)
+
+/**
+ * @brief Decode a curve into table
+ *  Internally called function. Segments where linear interpolation of the
+ *  table is not accurate enough (around vertical tangents) are marked to be
+ *  solved exactly.
+ * @param (curve) [out] decoded curve
+ * @param (key) control points, x1 | y1 << 8 | x2 << 16 | y2 << 24
+ * @return void
+ */
+static void __VMDDecodeCurve(VMDCurve* curve, uint32_t key){
+  const float step = 1.0f / VMDLIB_CURVE_SEGMENTS;
+  float x, lut, err;
+
+  for ( int i = 0; i < 4; i++ ) curve->p[i] = (uint8_t)(key >> (8 * i));
+#define VMDLIB_EVAL_CURVE(x) __VMDEvalBezier((x), curve->p[0], curve->p[1], \
+                                             curve->p[2], curve->p[3])
+  for ( int i = 0; i <= VMDLIB_CURVE_SEGMENTS; i++ ) {
+    curve->y[i] = VMDLIB_EVAL_CURVE(i * step);
+  }
+  curve->exact = 0;
+  for ( int i = 0; i < VMDLIB_CURVE_SEGMENTS; i++ ) {
+    for ( int j = 1; j < 4; j++ ) {
+      x = (i + j * 0.25f) * step;
+      lut = curve->y[i] + (curve->y[i + 1] - curve->y[i]) * j * 0.25f;
+      err = fabsf(lut - VMDLIB_EVAL_CURVE(x));
+      if ( err > VMDLIB_CURVE_TOLERANCE ) {
+        curve->exact |= (uint64_t)1 << i;
+        break;
+      }
+    }
+  }
+#undef VMDLIB_EVAL_CURVE
+}
+
+/**
+ * @brief Interpolation weight by decoded curve
+ *  Internally called function
+ * @param (table) curve table
+ * @param (id) curve id, 0 for the linear curve
+ * @param (x) progress between the keyframes
+ * @return interpolation weight
+ */
+float __VMDCurveWeight(const VMDCurveTable* table, uint32_t id, float x){
+  const VMDCurve* curve;
+  float p, f;
+  int i;
+
+  if ( id == 0 || x <= 0.0f || x >= 1.0f ) {
+    return x <= 0.0f ? 0.0f : (x >= 1.0f ? 1.0f : x);
+  }
+  curve = &table->curves[id];
+  p = x * VMDLIB_CURVE_SEGMENTS;
+  i = (int)p;
+  if ( i >= VMDLIB_CURVE_SEGMENTS ) i = VMDLIB_CURVE_SEGMENTS - 1;
+  if ( curve->exact & ((uint64_t)1 << i) ) {
+    return __VMDEvalBezier(x, curve->p[0], curve->p[1], curve->p[2],
+                           curve->p[3]);
+  }
+  f = p - (float)i;
+  return curve->y[i] + (curve->y[i + 1] - curve->y[i]) * f;
+}
+
+// Hash table of curves used while building VMDCurveTable
+typedef struct {
+  VMDCurveTable* table;
+  uint32_t       cap;  // allocated curves
+  uint32_t       size; // number of slots, power of 2
+  uint32_t*      keys; // control points of each slot
+  uint32_t*      ids;  // curve id for each slot, 0 for empty slot
+} VMDCurveBuilder;
+
+/**
+ * @brief Double the hash table of curve builder
+ *  Internally called function
+ * @param (b) curve builder
+ * @return boolean : false if memory is insufficient
+ */
+static bool __VMDGrowCurveHash(VMDCurveBuilder* b){
+  uint32_t size = b->size * 2;
+  uint32_t* keys = malloc(sizeof(uint32_t) * size);
+  uint32_t* ids = calloc(size, sizeof(uint32_t));
+  uint32_t slot;
+
+  if ( keys == NULL || ids == NULL ) {
+    free(keys);
+    free(ids);
+    return false;
+  }
+  for ( uint32_t i = 0; i < b->size; i++ ) {
+    if ( b->ids[i] == 0 ) continue;
+    slot = (b->keys[i] * 2654435761u) & (size - 1);
+    while ( ids[slot] != 0 ) slot = (slot + 1) & (size - 1);
+    keys[slot] = b->keys[i];
+    ids[slot] = b->ids[i];
+  }
+  free(b->keys);
+  free(b->ids);
+  b->keys = keys;
+  b->ids = ids;
+  b->size = size;
+  return true;
+}
+
+/**
+ * @brief Curve id of interpolation parameters
+ *  Internally called function. The curve is decoded when it is seen first.
+ * @param (b) curve builder
+ * @param (x1) control point
+ * @param (y1) control point
+ * @param (x2) control point
+ * @param (y2) control point
+ * @param (id) [out] curve id
+ * @return boolean : false if memory is insufficient
+ */
+static bool __VMDInternCurve(VMDCurveBuilder* b, int x1, int y1, int x2,
+                             int y2, uint32_t* id){
+  VMDCurveTable* table = b->table;
+  VMDCurve* curves;
+  uint32_t key, slot;
+
+  if ( x1 == y1 && x2 == y2 ) { // straight line
+    *id = 0;
+    return true;
+  }
+  key = (uint32_t)x1 | (uint32_t)y1 << 8 | (uint32_t)x2 << 16
+        | (uint32_t)y2 << 24;
+  slot = (key * 2654435761u) & (b->size - 1);
+  while ( b->ids[slot] != 0 ) {
+    if ( b->keys[slot] == key ) {
+      *id = b->ids[slot];
+      return true;
+    }
+    slot = (slot + 1) & (b->size - 1);
+  }
+
+  if ( table->num_curves == b->cap ) {
+    curves = realloc(table->curves, sizeof(VMDCurve) * b->cap * 2);
+    if ( curves == NULL ) return false;
+    table->curves = curves;
+    b->cap *= 2;
+  }
+  __VMDDecodeCurve(&table->curves[table->num_curves], key);
+  b->keys[slot] = key;
+  b->ids[slot] = table->num_curves;
+  *id = table->num_curves++;
+
+  // keep load factor under 1/2
+  if ( table->num_curves * 2 > b->size ) return __VMDGrowCurveHash(b);
+  return true;
+}
+
+/**
+ * @brief Decode interpolation parameters of all keyframes
+ *  Each distinct curve of bone and camera frames is decoded once into a
+ *  lookup table, then VMDSampleBone() and VMDSampleCamera() interpolate
+ *  without solving the curve. Keyframes with a straight line curve (such
+ *  as the default 20,20,107,107) skip the curve entirely. Called by
+ *  VMDSampleBone() and VMDSampleCamera() if not built yet, and rebuilt by
+ *  VMDSortAllFrames().
+ * @param (vf) a pointer to VMDFile
+ * @return boolean : false if memory is insufficient
+ */
+bool VMDBuildCurveTable(VMDFile* vf){
+  VMDCurveBuilder b;
+  VMDCurveTable* table;
+  const VMDBoneSingleFrame* bone;
+  const VMDCameraSingleFrame* camera;
+  uint32_t num_bones, num_cameras;
+  const char* p;
+  bool ok = true;
+
+  if ( vf == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( VMDLoadSections(vf, VMDLIB_SECTION(VMDL_BONE)
+                       | VMDLIB_SECTION(VMDL_CAMERA)) == false ) {
+    return false;
+  }
+  num_bones = vf->bone_frames.num_frames;
+  num_cameras = vf->camera_frames.num_frames;
+
+  memset(&b, 0, sizeof(VMDCurveBuilder));
+  table = calloc(1, sizeof(VMDCurveTable));
+  if ( table == NULL ) goto error;
+  b.table = table;
+  b.cap = 64;
+  b.size = 128;
+  table->curves = malloc(sizeof(VMDCurve) * b.cap);
+  table->bone_curves = malloc(sizeof(uint32_t) * 4 * ((size_t)num_bones + 1));
+  table->camera_curves = malloc(sizeof(uint32_t) * 6
+                                * ((size_t)num_cameras + 1));
+  b.keys = malloc(sizeof(uint32_t) * b.size);
+  b.ids = calloc(b.size, sizeof(uint32_t));
+  if ( table->curves == NULL || table->bone_curves == NULL
+       || table->camera_curves == NULL || b.keys == NULL || b.ids == NULL ) {
+    goto error;
+  }
+  memset(&table->curves[0], 0, sizeof(VMDCurve)); // linear, never looked up
+  table->num_curves = 1;
+
+  for ( uint32_t i = 0; i < num_bones && ok; i++ ) {
+    bone = &vf->bone_frames.frames[i];
+    for ( int axis = 0; axis < 4 && ok; axis++ ) {
+      ok = __VMDInternCurve(&b, __VMDControlPoint(bone->bezier[axis]),
+                            __VMDControlPoint(bone->bezier[4 + axis]),
+                            __VMDControlPoint(bone->bezier[8 + axis]),
+                            __VMDControlPoint(bone->bezier[12 + axis]),
+                            &table->bone_curves[(size_t)i * 4 + axis]);
+    }
+  }
+  for ( uint32_t i = 0; i < num_cameras && ok; i++ ) {
+    camera = &vf->camera_frames.frames[i];
+    for ( int axis = 0; axis < 6 && ok; axis++ ) {
+      p = camera->bezier + axis * 4; // x1, x2, y1, y2
+      ok = __VMDInternCurve(&b, __VMDControlPoint(p[0]),
+                            __VMDControlPoint(p[2]),
+                            __VMDControlPoint(p[1]),
+                            __VMDControlPoint(p[3]),
+                            &table->camera_curves[(size_t)i * 6 + axis]);
+    }
+  }
+  if ( ok == false ) goto error;
+
+  free(b.keys);
+  free(b.ids);
+  VMDReleaseCurveTable(vf);
+  vf->curves = table;
+  return true;
+
+ error:
+  if ( table != NULL ) {
+    free(table->curves);
+    free(table->bone_curves);
+    free(table->camera_curves);
+    free(table);
+  }
+  free(b.keys);
+  free(b.ids);
+  VMD_ERROR = VMDLIB_E_ME;
+  return false;
+}
+
+/**
+ * @brief Release curve table of VMDFile
+ *  Called by VMDReleaseVMDFile(), do nothing if it is not built.
+ * @param (vf) a pointer to VMDFile
+ * @return void
+ */
+void VMDReleaseCurveTable(VMDFile* vf){
+  if ( vf == NULL || vf->curves == NULL ) return;
+  if ( vf->curves->mapped == false ) {
+    free(vf->curves->curves);
+    free(vf->curves->bone_curves);
+    free(vf->curves->camera_curves);
+  }
+  free(vf->curves);
+  vf->curves = NULL;
+}
+
+/**
+ * @brief Spherical linear interpolation of quaternions
+ *  Internally called function. Goes the shorter way, and falls back to
+ *  normalized linear interpolation for nearly equal quaternions.
+ * @param (a) quaternion x, y, z, w at weight 0
+ * @param (b) quaternion x, y, z, w at weight 1
+ * @param (w) weight
+ * @param (out) [out] interpolated quaternion
+ * @return void
+ */
+void __VMDSlerp(const float* a, const float* b, float w, float* out){
+  float dot = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+  float sign = 1.0f;
+  float wa, wb, theta, st, len;
+
+  if ( dot < 0.0f ) {
+    dot = -dot;
+    sign = -1.0f;
+  }
+  if ( dot > 0.9995f ) {
+    wa = 1.0f - w;
+    wb = w * sign;
+    for ( int i = 0; i < 4; i++ ) out[i] = wa * a[i] + wb * b[i];
+    len = sqrtf(out[0]*out[0] + out[1]*out[1] + out[2]*out[2] + out[3]*out[3]);
+    if ( len > 0.0f ) {
+      for ( int i = 0; i < 4; i++ ) out[i] /= len;
+    }
+    return;
+  }
+  theta = acosf(dot);
+  st = sinf(theta);
+  wa = sinf((1.0f - w) * theta) / st;
+  wb = sinf(w * theta) / st * sign;
+  for ( int i = 0; i < 4; i++ ) out[i] = wa * a[i] + wb * b[i];
+}
+
+// Find the last keyframe whose frame number is not greater than `t`, or 0
+// if `t` is before the first keyframe. `frame_at(i)` gives the frame number
+// of the i-th keyframe, and `num` must be at least 1.
+#define VMDLIB_SEARCH_FRAME(result, num, t, frame_at)                        \
+  do {                                                                       \
+    uint32_t lo_ = 0, hi_ = (num);                                           \
+    while ( hi_ - lo_ > 1 ) {                                                \
+      uint32_t mid_ = lo_ + (hi_ - lo_) / 2;                                 \
+      if ( (float)(frame_at(mid_)) <= (t) ) lo_ = mid_; else hi_ = mid_;     \
+    }                                                                        \
+    (result) = lo_;                                                          \
+  } while ( 0 )
+
+/**
+ * @brief Progress of a time between two keyframes
+ *  Internally called function
+ * @param (f0) frame number of the previous keyframe
+ * @param (f1) frame number of the next keyframe
+ * @param (t) time in frames
+ * @return progress, 0 to 1
+ */
+static float __VMDProgress(uint32_t f0, uint32_t f1, float t){
+  float x;
+  if ( f1 <= f0 ) return 1.0f;
+  x = (t - (float)f0) / (float)(f1 - f0);
+  return x < 0.0f ? 0.0f : (x > 1.0f ? 1.0f : x);
+}
+
+/**
+ * @brief Blend two bone keyframes by weights of each axis
+ *  Internally called function
+ * @param (a) previous keyframe
+ * @param (b) next keyframe
+ * @param (w) weights of X, Y, Z and rotation
+ * @param (pose) [out] interpolated pose
+ * @return void
+ */
+static void __VMDBlendBone(const VMDBoneSingleFrame* a,
+                           const VMDBoneSingleFrame* b, const float* w,
+                           VMDBonePose* pose){
+  float qa[4] = { a->qx, a->qy, a->qz, a->qw };
+  float qb[4] = { b->qx, b->qy, b->qz, b->qw };
+  float q[4];
+
+  pose->x = a->x + (b->x - a->x) * w[0];
+  pose->y = a->y + (b->y - a->y) * w[1];
+  pose->z = a->z + (b->z - a->z) * w[2];
+  __VMDSlerp(qa, qb, w[3], q);
+  pose->qx = q[0];
+  pose->qy = q[1];
+  pose->qz = q[2];
+  pose->qw = q[3];
+}
+
+/**
+ * @brief Interpolate between two bone keyframes
+ *  Internally called function. Solves the curves of `b` directly.
+ * @param (a) previous keyframe
+ * @param (b) next keyframe, holding the interpolation parameters
+ * @param (x) progress between the keyframes
+ * @param (pose) [out] interpolated pose
+ * @return void
+ */
+void __VMDLerpBone(const VMDBoneSingleFrame* a, const VMDBoneSingleFrame* b,
+                   float x, VMDBonePose* pose){
+  float w[4];
+  for ( int axis = 0; axis < 4; axis++ ) {
+    w[axis] = __VMDBoneWeight(b->bezier, axis, x);
+  }
+  __VMDBlendBone(a, b, w, pose);
+}
+
+/**
+ * @brief Curve table of VMDFile, built on first use
+ *  Internally called function
+ * @param (vf) a pointer to VMDFile
+ * @return curve table, or NULL if memory is insufficient
+ */
+static const VMDCurveTable* __VMDGetCurves(VMDFile* vf){
+  if ( vf->curves == NULL ) VMDBuildCurveTable(vf);
+  return vf->curves;
+}
+
+/**
+ * @brief Keyframes and weights of a bone at a time
+ *  Internally called function. Weights are 0 when the pose is held at a
+ *  keyframe, in which case `a` and `b` are the same keyframe.
+ * @param (vf) a pointer to VMDFile
+ * @param (track) track of the bone, at least one keyframe
+ * @param (t) time in frames
+ * @param (a) [out] previous keyframe
+ * @param (b) [out] next keyframe
+ * @param (w) [out] weights of X, Y, Z and rotation
+ * @return void
+ */
+void __VMDBoneKeys(VMDFile* vf, const VMDTrack* track, float t,
+                   const VMDBoneSingleFrame** a, const VMDBoneSingleFrame** b,
+                   float* w){
+  const VMDBoneSingleFrame* frames = vf->bone_frames.frames;
+  const VMDCurveTable* curves;
+  const uint32_t* ids;
+  uint32_t k;
+  float x;
+
+#define VMDLIB_TRACK_FRAME(i) (frames[track->frames[i]].frame)
+  VMDLIB_SEARCH_FRAME(k, track->num_frames, t, VMDLIB_TRACK_FRAME);
+#undef VMDLIB_TRACK_FRAME
+  *a = &frames[track->frames[k]];
+  if ( k + 1 >= track->num_frames || t <= (float)(*a)->frame ) {
+    *b = *a;
+    w[0] = w[1] = w[2] = w[3] = 0.0f;
+    return;
+  }
+  *b = &frames[track->frames[k + 1]];
+  x = __VMDProgress((*a)->frame, (*b)->frame, t);
+
+  curves = __VMDGetCurves(vf);
+  if ( curves == NULL ) {
+    for ( int axis = 0; axis < 4; axis++ ) {
+      w[axis] = __VMDBoneWeight((*b)->bezier, axis, x);
+    }
+    return;
+  }
+  ids = &curves->bone_curves[(size_t)track->frames[k + 1] * 4];
+  for ( int axis = 0; axis < 4; axis++ ) {
+    w[axis] = __VMDCurveWeight(curves, ids[axis], x);
+  }
+}
+
+/**
+ * @brief Sample pose of a bone at a time
+ * @param (vf) a pointer to VMDFile
+ * @param (track) track of the bone, see VMDFindBoneTrack()
+ * @param (t) time in frames, can be fractional
+ * @param (pose) [out] position and rotation of the bone
+ * @return bool : false for an invalid call
+ */
+bool VMDSampleBone(VMDFile* vf, const VMDTrack* track, float t,
+                   VMDBonePose* pose){
+  const VMDBoneSingleFrame* a;
+  const VMDBoneSingleFrame* b;
+  float w[4];
+
+  if ( vf == NULL || track == NULL || pose == NULL || track->num_frames == 0 ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  __VMDBoneKeys(vf, track, t, &a, &b, w);
+  __VMDBlendBone(a, b, w, pose);
+  return true;
+}
+
+/**
+ * @brief Sample weight of a morph at a time
+ *  Morphs are interpolated linearly.
+ * @param (vf) a pointer to VMDFile
+ * @param (track) track of the morph, see VMDFindMorphTrack()
+ * @param (t) time in frames, can be fractional
+ * @param (weight) [out] weight of the morph
+ * @return bool : false for an invalid call
+ */
+bool VMDSampleMorph(VMDFile* vf, const VMDTrack* track, float t,
+                    float* weight){
+  const VMDMorphSingleFrame* frames;
+  const VMDMorphSingleFrame* a;
+  const VMDMorphSingleFrame* b;
+  uint32_t k;
+
+  if ( vf == NULL || track == NULL || weight == NULL
+       || track->num_frames == 0 ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  frames = vf->morph_frames.frames;
+#define VMDLIB_TRACK_FRAME(i) (frames[track->frames[i]].frame)
+  VMDLIB_SEARCH_FRAME(k, track->num_frames, t, VMDLIB_TRACK_FRAME);
+#undef VMDLIB_TRACK_FRAME
+  a = &frames[track->frames[k]];
+  b = k + 1 < track->num_frames ? &frames[track->frames[k + 1]] : a;
+  if ( b == a || t <= (float)a->frame ) {
+    *weight = a->value;
+    return true;
+  }
+  *weight = a->value
+            + (b->value - a->value) * __VMDProgress(a->frame, b->frame, t);
+  return true;
+}
+
+/**
+ * @brief Blend two camera keyframes by weights of each axis
+ *  Internally called function
+ * @param (a) previous keyframe
+ * @param (b) next keyframe
+ * @param (w) weights of X, Y, Z, rotation, distance and view angle
+ * @param (pose) [out] interpolated camera
+ * @return void
+ */
+static void __VMDBlendCamera(const VMDCameraSingleFrame* a,
+                             const VMDCameraSingleFrame* b, const float* w,
+                             VMDCameraPose* pose){
+  pose->x = a->x + (b->x - a->x) * w[0];
+  pose->y = a->y + (b->y - a->y) * w[1];
+  pose->z = a->z + (b->z - a->z) * w[2];
+  pose->rx = a->rx + (b->rx - a->rx) * w[3];
+  pose->ry = a->ry + (b->ry - a->ry) * w[3];
+  pose->rz = a->rz + (b->rz - a->rz) * w[3];
+  pose->distance = a->distance + (b->distance - a->distance) * w[4];
+  pose->view_angle = (float)a->viewAngle
+                     + ((float)b->viewAngle - (float)a->viewAngle) * w[5];
+  pose->parth = a->parth;
+}
+
+/**
+ * @brief Interpolate between two camera keyframes
+ *  Internally called function. Solves the curves of `b` directly.
+ *  Keyframes on adjacent frames are a cut in MMD, so the camera jumps
+ *  instead of moving between them.
+ * @param (a) previous keyframe
+ * @param (b) next keyframe, holding the interpolation parameters
+ * @param (x) progress between the keyframes
+ * @param (pose) [out] interpolated camera
+ * @return void
+ */
+void __VMDLerpCamera(const VMDCameraSingleFrame* a,
+                     const VMDCameraSingleFrame* b, float x,
+                     VMDCameraPose* pose){
+  float w[6];
+
+  if ( b->frame <= a->frame + 1 ) {
+    for ( int axis = 0; axis < 6; axis++ ) w[axis] = 0.0f;
+    __VMDBlendCamera(x >= 1.0f ? b : a, b, w, pose);
+    return;
+  }
+  for ( int axis = 0; axis < 6; axis++ ) {
+    w[axis] = __VMDCameraWeight(b->bezier, axis, x);
+  }
+  __VMDBlendCamera(a, b, w, pose);
+}
+
+/**
+ * @brief Sample camera at a time
+ * @note Camera frames must be sorted, see VMDSortAllFrames()
+ * @param (vf) a pointer to VMDFile
+ * @param (t) time in frames, can be fractional
+ * @param (pose) [out] camera
+ * @return bool : false for an invalid call or no camera frame
+ */
+bool VMDSampleCamera(VMDFile* vf, float t, VMDCameraPose* pose){
+  const VMDCameraSingleFrame* frames;
+  const VMDCameraSingleFrame* a;
+  const VMDCameraSingleFrame* b;
+  const VMDCurveTable* curves;
+  const uint32_t* ids;
+  uint32_t k, num;
+  float x, w[6];
+
+  if ( vf != NULL
+       && VMDLoadSections(vf, VMDLIB_SECTION(VMDL_CAMERA)) == false ) {
+    return false;
+  }
+  if ( vf == NULL || pose == NULL || vf->camera_frames.num_frames == 0 ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  frames = vf->camera_frames.frames;
+  num = vf->camera_frames.num_frames;
+#define VMDLIB_SECTION_FRAME(i) (frames[i].frame)
+  VMDLIB_SEARCH_FRAME(k, num, t, VMDLIB_SECTION_FRAME);
+#undef VMDLIB_SECTION_FRAME
+  a = &frames[k];
+  b = k + 1 < num ? &frames[k + 1] : a;
+  if ( b == a || t <= (float)a->frame || b->frame <= a->frame + 1 ) {
+    for ( int axis = 0; axis < 6; axis++ ) w[axis] = 0.0f;
+    __VMDBlendCamera(a, a, w, pose);
+    return true;
+  }
+  x = __VMDProgress(a->frame, b->frame, t);
+
+  curves = __VMDGetCurves(vf);
+  if ( curves == NULL ) {
+    __VMDLerpCamera(a, b, x, pose);
+    return true;
+  }
+  ids = &curves->camera_curves[(size_t)(k + 1) * 6];
+  for ( int axis = 0; axis < 6; axis++ ) {
+    w[axis] = __VMDCurveWeight(curves, ids[axis], x);
+  }
+  __VMDBlendCamera(a, b, w, pose);
+  return true;
+}
+
+/**
+ * @brief Sample light at a time
+ *  Lights are interpolated linearly.
+ * @note Light frames must be sorted, see VMDSortAllFrames()
+ * @param (vf) a pointer to VMDFile
+ * @param (t) time in frames, can be fractional
+ * @param (pose) [out] light
+ * @return bool : false for an invalid call or no light frame
+ */
+bool VMDSampleLight(VMDFile* vf, float t, VMDLightPose* pose){
+  const VMDLightSingleFrame* frames;
+  const VMDLightSingleFrame* a;
+  const VMDLightSingleFrame* b;
+  uint32_t k, num;
+  float w;
+
+  if ( vf != NULL
+       && VMDLoadSections(vf, VMDLIB_SECTION(VMDL_LIGHT)) == false ) {
+    return false;
+  }
+  if ( vf == NULL || pose == NULL || vf->light_frames.num_frames == 0 ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  frames = vf->light_frames.frames;
+  num = vf->light_frames.num_frames;
+#define VMDLIB_SECTION_FRAME(i) (frames[i].frame)
+  VMDLIB_SEARCH_FRAME(k, num, t, VMDLIB_SECTION_FRAME);
+#undef VMDLIB_SECTION_FRAME
+  a = &frames[k];
+  b = k + 1 < num ? &frames[k + 1] : a;
+  w = (b == a || t <= (float)a->frame) ? 0.0f
+                                       : __VMDProgress(a->frame, b->frame, t);
+  pose->r = a->r + (b->r - a->r) * w;
+  pose->g = a->g + (b->g - a->g) * w;
+  pose->b = a->b + (b->b - a->b) * w;
+  pose->x = a->x + (b->x - a->x) * w;
+  pose->y = a->y + (b->y - a->y) * w;
+  pose->z = a->z + (b->z - a->z) * w;
+  return true;
+}
@@ -0,0 +1,125 @@
+/**
+ *  @file vmd_stats.c
+ *  @brief Counters and timers of hot paths of VMD library
+ *  @author ihm4
+ *  @note
+ *    Built with -DVMDLIB_STATS, loaders, sorts and writers of vmd.c count
+ *    calls, nanoseconds and bytes of each operation (VMDStatOp) through
+ *    VMDLIB_STAT_START() and VMDLIB_STAT_STOP(). Without it the macros are
+ *    empty, nothing is counted and VMDGetStats() gives zeros.
+ *
+ *    Counters are shared by all threads and added atomically. Timers of
+ *    operations nest, e.g. reading a section from a file is counted both
+ *    as VMDL_STAT_READ and as the copy of the section.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "vmd.h"
+
+#if defined(_MSC_VER)
+#define VMDLIB_ATOMIC_ADD(p, v) \
+  InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+#define VMDLIB_ATOMIC_LOAD(p) \
+  ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define VMDLIB_ATOMIC_STORE(p, v) \
+  InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#else
+#define VMDLIB_ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define VMDLIB_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define VMDLIB_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#endif
+
+// Counters of all operations, calls, nsec and bytes of each
+static uint64_t __VMD_STATS[VMDL_STAT_NUM][3];
+
+/**
+ * @brief Time of monotonic clock
+ *  Internally called function
+ * @return nanoseconds
+ */
+uint64_t __VMDStatNow(void){
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if ( freq.QuadPart == 0 ) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Count a call of an operation with its time
+ *  Internally called function, see VMDLIB_STAT_STOP()
+ * @param (op) operation
+ * @param (start) time the operation started, by __VMDStatNow()
+ * @param (bytes) bytes processed
+ * @return void
+ */
+void __VMDStatAdd(VMDStatOp op, uint64_t start, uint64_t bytes){
+  uint64_t now = __VMDStatNow();
+
+  if ( (unsigned)op >= VMDL_STAT_NUM ) return;
+  VMDLIB_ATOMIC_ADD(&__VMD_STATS[op][0], 1);
+  VMDLIB_ATOMIC_ADD(&__VMD_STATS[op][1], now > start ? now - start : 0);
+  VMDLIB_ATOMIC_ADD(&__VMD_STATS[op][2], bytes);
+}
+
+/**
+ * @brief Count a call of an operation without time
+ *  Internally called function, see VMDLIB_STAT_COUNT()
+ * @param (op) operation
+ * @param (bytes) bytes processed
+ * @return void
+ */
+void __VMDStatCount(VMDStatOp op, uint64_t bytes){
+  if ( (unsigned)op >= VMDL_STAT_NUM ) return;
+  VMDLIB_ATOMIC_ADD(&__VMD_STATS[op][0], 1);
+  VMDLIB_ATOMIC_ADD(&__VMD_STATS[op][2], bytes);
+}
+
+/**
+ * @brief Get counters of operations since start or VMDResetStats()
+ *  Each counter is read atomically, but counters updated by other threads
+ *  meanwhile may be a call apart from each other.
+ * @param (stats) [out] counters, all zero and `enabled` false when the
+ *        library is built without VMDLIB_STATS
+ * @return void
+ */
+void VMDGetStats(VMDStats* stats){
+  if ( stats == NULL ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return;
+  }
+  memset(stats, 0, sizeof(VMDStats));
+#ifdef VMDLIB_STATS
+  stats->enabled = true;
+#endif
+  for ( int op = 0; op < VMDL_STAT_NUM; op++ ) {
+    stats->ops[op].calls = VMDLIB_ATOMIC_LOAD(&__VMD_STATS[op][0]);
+    stats->ops[op].nsec = VMDLIB_ATOMIC_LOAD(&__VMD_STATS[op][1]);
+    stats->ops[op].bytes = VMDLIB_ATOMIC_LOAD(&__VMD_STATS[op][2]);
+  }
+}
+
+/**
+ * @brief Reset counters of operations to zero
+ * @return void
+ */
+void VMDResetStats(void){
+  for ( int op = 0; op < VMDL_STAT_NUM; op++ ) {
+    for ( int k = 0; k < 3; k++ ) VMDLIB_ATOMIC_STORE(&__VMD_STATS[op][k], 0);
+  }
+}
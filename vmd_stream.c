@@ -0,0 +1,331 @@
+/**
+ *  @file vmd_stream.c
+ *  @brief Push-style streaming parser for VMD file
+ *  @author ihm4
+ *  @note
+ *    Callers feed byte chunks as they arrive and receive frames section by
+ *    section. Frames are delivered as batches of the packed `VMD*SingleFrame`
+ *    structures pointing into the fed chunk whenever possible, so memory used
+ *    by the parser is bounded by a single record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmd.h"
+
+// Upper limit of IK entries in one ShowIK record accepted by the parser
+#define VMDLIB_STREAM_MAX_IK (0x10000)
+
+typedef enum {
+  VMDL_STREAM_HEADER,    // waiting for VMDHeader
+  VMDL_STREAM_COUNT,     // waiting for count prefix of `section`
+  VMDL_STREAM_FRAMES,    // in frames of `section`
+  VMDL_STREAM_IK_HEAD,   // waiting for the head of a ShowIK record
+  VMDL_STREAM_IK_INFO,   // waiting for IK entries of a ShowIK record
+  VMDL_STREAM_DONE,      // every section has been parsed
+  VMDL_STREAM_ERROR      // broken data or invalid call
+} VMDStreamState;
+
+struct VMDStream {
+  VMDStreamCallbacks cb;
+  VMDStreamState     state;
+  VMDStructType      section;   // current section
+  uint32_t           remaining; // frames left in current section
+  size_t             need;      // bytes the current record consists of
+  size_t             have;      // bytes of current record stored in `carry`
+  char               carry[sizeof(VMDBoneSingleFrame)]; // split record
+  uint32_t           ik_frame;  // head of current ShowIK record
+  char               ik_show;
+  uint32_t           ik_count;
+  VMDInfoIK*         ik_buf;    // IK entries of current ShowIK record
+  uint32_t           ik_cap;
+};
+
+// Size of a single frame of sections with fixed size frames
+static size_t __VMDStreamFrameSize(VMDStructType type){
+  switch(type){
+    case VMDL_BONE:   return sizeof(VMDBoneSingleFrame);
+    case VMDL_MORPH:  return sizeof(VMDMorphSingleFrame);
+    case VMDL_CAMERA: return sizeof(VMDCameraSingleFrame);
+    case VMDL_LIGHT:  return sizeof(VMDLightSingleFrame);
+    case VMDL_SHADOW: return sizeof(VMDShadowSingleFrame);
+    default:          return 0;
+  }
+}
+
+/**
+ * @brief Call the callback of current section with a batch of frames
+ *  Internally called function
+ * @param (st) stream
+ * @param (frames) head of the frames
+ * @param (num) number of frames
+ * @return void
+ */
+static void __VMDStreamDeliver(VMDStream* st, const void* frames, uint32_t num){
+  const VMDStreamCallbacks* cb = &st->cb;
+  switch(st->section){
+    case VMDL_BONE:
+      if ( cb->bone != NULL ) cb->bone(cb->user, frames, num);
+      break;
+    case VMDL_MORPH:
+      if ( cb->morph != NULL ) cb->morph(cb->user, frames, num);
+      break;
+    case VMDL_CAMERA:
+      if ( cb->camera != NULL ) cb->camera(cb->user, frames, num);
+      break;
+    case VMDL_LIGHT:
+      if ( cb->light != NULL ) cb->light(cb->user, frames, num);
+      break;
+    case VMDL_SHADOW:
+      if ( cb->shadow != NULL ) cb->shadow(cb->user, frames, num);
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @brief Move on to the count prefix of the next section
+ *  Internally called function
+ * @param (st) stream
+ * @return void
+ */
+static void __VMDStreamNextSection(VMDStream* st){
+  if ( st->section == VMDL_IK ) {
+    st->state = VMDL_STREAM_DONE;
+    return;
+  }
+  st->section = (VMDStructType)(st->section + 1);
+  st->state = VMDL_STREAM_COUNT;
+  st->need = sizeof(uint32_t);
+  st->have = 0;
+}
+
+/**
+ * @brief Start the next ShowIK record or finish IK section
+ *  Internally called function
+ * @param (st) stream
+ * @return void
+ */
+static void __VMDStreamNextIK(VMDStream* st){
+  if ( st->remaining == 0 ) {
+    __VMDStreamNextSection(st);
+    return;
+  }
+  st->state = VMDL_STREAM_IK_HEAD;
+  st->need = VMDLIB_IK_HEAD_SIZE;
+  st->have = 0;
+}
+
+/**
+ * @brief Act on a completed fixed size record stored in `carry`
+ *  Internally called function
+ * @param (st) stream
+ * @return boolean : false if the data is broken
+ */
+static bool __VMDStreamComplete(VMDStream* st){
+  uint32_t num;
+
+  switch(st->state){
+    case VMDL_STREAM_HEADER:
+      if ( __VMDCheckHeader(st->carry) == false ) {
+        DEBUG_PRINT("The stream is not VMD file!\n");
+        VMD_ERROR = VMDLIB_E_FT;
+        return false;
+      }
+      if ( st->cb.header != NULL ) {
+        st->cb.header(st->cb.user, (const VMDHeader*)st->carry);
+      }
+      st->section = VMDL_BONE;
+      st->state = VMDL_STREAM_COUNT;
+      st->need = sizeof(uint32_t);
+      st->have = 0;
+      return true;
+
+    case VMDL_STREAM_COUNT:
+      memcpy(&num, st->carry, sizeof(num));
+      if ( st->cb.section != NULL ) {
+        st->cb.section(st->cb.user, st->section, num);
+      }
+      st->remaining = num;
+      if ( st->section == VMDL_IK ) {
+        __VMDStreamNextIK(st);
+      } else if ( num == 0 ) {
+        __VMDStreamNextSection(st);
+      } else {
+        st->state = VMDL_STREAM_FRAMES;
+        st->need = __VMDStreamFrameSize(st->section);
+        st->have = 0;
+      }
+      return true;
+
+    case VMDL_STREAM_FRAMES:
+      __VMDStreamDeliver(st, st->carry, 1);
+      st->have = 0;
+      if ( --st->remaining == 0 ) __VMDStreamNextSection(st);
+      return true;
+
+    case VMDL_STREAM_IK_HEAD:
+      memcpy(&st->ik_frame, st->carry, sizeof(uint32_t));
+      st->ik_show = st->carry[sizeof(uint32_t)];
+      memcpy(&st->ik_count, st->carry + sizeof(uint32_t) + sizeof(char),
+             sizeof(uint32_t));
+      if ( st->ik_count > VMDLIB_STREAM_MAX_IK ) {
+        DEBUG_PRINT("Too many IK in a record, %u\n", st->ik_count);
+        VMD_ERROR = VMDLIB_E_FT;
+        return false;
+      }
+      if ( st->ik_count > st->ik_cap ) {
+        VMDInfoIK* buf = realloc(st->ik_buf, sizeof(VMDInfoIK) * st->ik_count);
+        if ( buf == NULL ) {
+          VMD_ERROR = VMDLIB_E_ME;
+          return false;
+        }
+        st->ik_buf = buf;
+        st->ik_cap = st->ik_count;
+      }
+      st->state = VMDL_STREAM_IK_INFO;
+      st->need = sizeof(VMDInfoIK) * st->ik_count;
+      st->have = 0;
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+/**
+ * @note You must release returned pointer by VMDStreamRelease()
+ * @brief Create streaming parser
+ * @param (cb) callbacks to be called, any of them can be NULL
+ * @return pointer to the parser
+ */
+VMDStream* VMDStreamCreate(const VMDStreamCallbacks* cb){
+  VMDStream* st = calloc(1, sizeof(VMDStream));
+  if ( st == NULL ) {
+    VMD_ERROR = VMDLIB_E_ME;
+    return NULL;
+  }
+  if ( cb != NULL ) st->cb = *cb;
+  st->state = VMDL_STREAM_HEADER;
+  st->need = sizeof(VMDHeader);
+  return st;
+}
+
+/**
+ * @brief Feed a chunk of VMD data to the parser
+ *  Callbacks are called from inside this function for every complete part
+ *  in the chunk. Frames passed to callbacks are valid only during the call.
+ * @param (st) parser created by VMDStreamCreate()
+ * @param (data) chunk of data following the previously fed chunk
+ * @param (len) size of the chunk
+ * @return bool : false if data is broken, see VMD_ERROR
+ */
+bool VMDStreamFeed(VMDStream* st, const void* data, size_t len){
+  const char* p = data;
+  size_t take, elem;
+  uint32_t whole;
+
+  if ( st == NULL || (data == NULL && len != 0) ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( st->state == VMDL_STREAM_ERROR ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+
+  while ( len > 0 && st->state != VMDL_STREAM_DONE ) {
+    // batch of whole frames straight out of the chunk
+    if ( st->state == VMDL_STREAM_FRAMES && st->have == 0 ) {
+      elem = st->need;
+      whole = len / elem < st->remaining ? (uint32_t)(len / elem)
+                                         : st->remaining;
+      if ( whole > 0 ) {
+        __VMDStreamDeliver(st, p, whole);
+        p += elem * whole;
+        len -= elem * whole;
+        st->remaining -= whole;
+        if ( st->remaining == 0 ) __VMDStreamNextSection(st);
+        continue;
+      }
+    }
+
+    // IK entries are collected to deliver a record at once
+    if ( st->state == VMDL_STREAM_IK_INFO ) {
+      take = st->need - st->have < len ? st->need - st->have : len;
+      if ( take > 0 ) memcpy((char*)st->ik_buf + st->have, p, take);
+      st->have += take;
+      p += take;
+      len -= take;
+      if ( st->have == st->need ) {
+        if ( st->cb.ik != NULL ) {
+          st->cb.ik(st->cb.user, st->ik_frame, st->ik_show,
+                    st->ik_buf, st->ik_count);
+        }
+        st->remaining--;
+        __VMDStreamNextIK(st);
+      }
+      continue;
+    }
+
+    // records which may be split into chunks go through `carry`
+    take = st->need - st->have < len ? st->need - st->have : len;
+    memcpy(st->carry + st->have, p, take);
+    st->have += take;
+    p += take;
+    len -= take;
+    if ( st->have == st->need && __VMDStreamComplete(st) == false ) {
+      st->state = VMDL_STREAM_ERROR;
+      return false;
+    }
+  }
+
+  // IK record without entries is complete just after its head
+  while ( st->state == VMDL_STREAM_IK_INFO && st->need == 0 ) {
+    if ( st->cb.ik != NULL ) {
+      st->cb.ik(st->cb.user, st->ik_frame, st->ik_show, st->ik_buf, 0);
+    }
+    st->remaining--;
+    __VMDStreamNextIK(st);
+  }
+  return true;
+}
+
+/**
+ * @brief Tell the parser that there is no more data
+ *  Files saved by old MMD end after light or self shadow section, so data
+ *  ending just before the count prefix of these sections is complete.
+ * @param (st) parser created by VMDStreamCreate()
+ * @return bool : false if data ended in the middle, see VMD_ERROR
+ */
+bool VMDStreamFinish(VMDStream* st){
+  if ( st == NULL || st->state == VMDL_STREAM_ERROR ) {
+    VMD_ERROR = VMDLIB_E_IV;
+    return false;
+  }
+  if ( st->state == VMDL_STREAM_DONE ) return true;
+  if ( st->state == VMDL_STREAM_COUNT && st->have == 0
+       && (st->section == VMDL_SHADOW || st->section == VMDL_IK) ) {
+    st->state = VMDL_STREAM_DONE;
+    return true;
+  }
+  DEBUG_PRINT("The stream ended in section %d\n", st->section);
+  VMD_ERROR = VMDLIB_E_FT;
+  st->state = VMDL_STREAM_ERROR;
+  return false;
+}
+
+/**
+ * @brief Release streaming parser
+ * @param (st) parser created by VMDStreamCreate()
+ * @return void
+ */
+void VMDStreamRelease(VMDStream* st){
+  if ( st == NULL ) return;
+  free(st->ik_buf);
+  free(st);
+}